@@ -0,0 +1,18 @@
+// Declarations shared by the compute magnification passes. The transforms
+// are computed on the CPU from the zoom, view centre and crop, so ROI and
+// full-frame views run the same code.
+cbuffer FilterBuffer : register(b0) {
+    uint2 outputSize;       // Size of the target, in pixels
+    uint2 textureSize;      // Size of the bound source texture, in texels
+    float2 texelScale;      // Output pixel index to source texel position
+    float2 texelOffset;
+    float4 viewTransform;   // Output pixel index to source coordinates, for the border check
+    float4 cursorTransform; // Source coordinates to cursor texels: xy scale, zw offset
+    float sharpness;        // 0 to 1, used by the sharpening pass
+    float colorScale;       // SDR white in target units: 1, or the SDR white level for scRGB
+    float colorMin;         // Range the target holds: 0 to 1 for UNORM, unbounded for scRGB
+    float colorMax;
+    row_major float3x4 colorMatrix;  // Enhancement, used by the ENHANCE variants; see MagnifierPS.hlsli
+}
+
+#define TILE 16
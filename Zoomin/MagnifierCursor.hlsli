@@ -0,0 +1,23 @@
+// Pointer composition shared by the magnification shaders. Desktop
+// duplication leaves the pointer out of the image, so the cursor variants
+// (CURSOR 1) draw it from a small texture uploaded once per shape. Texels
+// hold straight alpha, in the encoding of the frame (linear at SDR white
+// for scRGB); alpha 0 with a non-black colour marks an XOR texel of a
+// monochrome or masked-colour shape.
+#if CURSOR
+Texture2D<float4> cursorTexture : register(t1);
+
+// Draw the pointer over a magnified colour; cursorTexel is the position in
+// the cursor texture, outside it the colour is returned unchanged.
+float3 CompositeCursor(float3 color, float2 cursorTexel) {
+    uint width, height;
+    cursorTexture.GetDimensions(width, height);
+    if (any(cursorTexel < 0.0) || any(cursorTexel >= float2(width, height)))
+        return color;
+    float4 cursor = cursorTexture.Load(int3(cursorTexel, 0));
+    if (cursor.a > 0.0)
+        return lerp(color, cursor.rgb, cursor.a);
+    // XOR; exact for the black and white masks cursors use.
+    return abs(color - cursor.rgb);
+}
+#endif
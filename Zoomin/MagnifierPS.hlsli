@@ -0,0 +1,45 @@
+// Magnification pixel shader, compiled once per border mode by the
+// MagnifierPS_*.hlsl wrappers, which define:
+//   BORDER_BLACK  1 to draw black outside the source; 0 when the view is
+//                 known to stay inside it and the sampler clamp suffices
+//   CURSOR        1 to composite the pointer, see MagnifierCursor.hlsli
+//   ENHANCE       1 to apply the colour matrix (colour filter, contrast and
+//                 inversion); 0 when every enhancement is off
+#include "MagnifierCursor.hlsli"
+
+#if ENHANCE
+// MagnificationConstantBuffer in main.cpp; the vertex shader declares only
+// the transforms.
+cbuffer MagnificationBuffer : register(b0) {
+    float4 viewTransform;
+    float4 sourceTransform;
+    float4 cursorTransform;
+    row_major float3x4 colorMatrix;  // Affine, with SDR white folded into the offsets
+}
+#endif
+
+Texture2D frameTexture : register(t0);
+SamplerState frameSampler : register(s0);
+struct PS_INPUT {
+    float4 position : SV_POSITION;
+    float2 texCoord : TEXCOORD0;
+    float2 sourceCoord : TEXCOORD1;
+    float2 cursorCoord : TEXCOORD2;
+};
+float4 main(PS_INPUT input) : SV_TARGET {
+#if BORDER_BLACK
+    if (any(input.sourceCoord < 0.0) || any(input.sourceCoord > 1.0))
+        return float4(0.0, 0.0, 0.0, 1.0);
+#endif
+    // Opaque, so the premultiplied composition swap chain shows no desktop through.
+    float3 color = frameTexture.Sample(frameSampler, input.texCoord).rgb;
+#if ENHANCE
+    // UNORM targets clamp on write; scRGB would keep what inversion takes
+    // below black.
+    color = max(mul(colorMatrix, float4(color, 1.0)), 0.0);
+#endif
+#if CURSOR
+    color = CompositeCursor(color, input.cursorCoord);
+#endif
+    return float4(color, 1.0);
+}
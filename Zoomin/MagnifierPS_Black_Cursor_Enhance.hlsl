@@ -0,0 +1,5 @@
+// Pixel shader permutation; see MagnifierPS.hlsli.
+#define BORDER_BLACK 1
+#define CURSOR 1
+#define ENHANCE 1
+#include "MagnifierPS.hlsli"
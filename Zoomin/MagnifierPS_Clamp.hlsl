@@ -0,0 +1,5 @@
+// Pixel shader permutation; see MagnifierPS.hlsli.
+#define BORDER_BLACK 0
+#define CURSOR 0
+#define ENHANCE 0
+#include "MagnifierPS.hlsli"
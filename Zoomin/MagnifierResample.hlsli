@@ -0,0 +1,141 @@
+// Resampling pass of the compute magnifier, compiled once per filter and
+// border mode by the MagnifierResampleCS_*.hlsl wrappers, which define:
+//   FILTER        FILTER_BILINEAR, FILTER_BICUBIC (Catmull-Rom) or FILTER_LANCZOS (Lanczos-3)
+//   BORDER_BLACK  1 to write black outside the source, 0 when the view stays inside it
+//   CURSOR        1 to composite the pointer, see MagnifierCursor.hlsli
+//   ENHANCE       1 to apply the colour matrix before clamping to the target range
+// Each thread group produces a TILE x TILE block of output pixels. The
+// source texels under the block are loaded into groupshared memory once,
+// filtered horizontally into one row per source line, then vertically into
+// the output.
+#include "MagnifierCompute.hlsli"
+#include "MagnifierCursor.hlsli"
+
+#define FILTER_BILINEAR 0
+#define FILTER_BICUBIC 1
+#define FILTER_LANCZOS 2
+
+#if FILTER == FILTER_LANCZOS
+#define RADIUS 3
+#elif FILTER == FILTER_BICUBIC
+#define RADIUS 2
+#else
+#define RADIUS 1
+#endif
+#define SPAN (TILE + 2 * RADIUS)  // Cached texels per axis, enough at zoom 1 and above
+
+Texture2D<float4> frameTexture : register(t0);
+RWTexture2D<float4> outputTexture : register(u0);
+
+groupshared float4 sourceTile[SPAN][SPAN];
+groupshared float4 rowTile[SPAN][TILE];
+
+// Kernel of the filter at a distance of x texels.
+float Weight(float x) {
+    x = abs(x);
+#if FILTER == FILTER_BICUBIC
+    // Catmull-Rom: interpolating, with a little overshoot at edges.
+    if (x < 1.0)
+        return (1.5 * x - 2.5) * x * x + 1.0;
+    return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+#elif FILTER == FILTER_LANCZOS
+    if (x < 1e-5)
+        return 1.0;
+    float px = 3.14159265 * x;
+    return RADIUS * sin(px) * sin(px / RADIUS) / (px * px);
+#else
+    return 1.0 - x;
+#endif
+}
+
+float2 TexelPosition(float2 pixel) {
+    return pixel * texelScale + texelOffset;
+}
+
+[numthreads(TILE, TILE, 1)]
+void main(uint3 groupId : SV_GroupID, uint3 threadId : SV_GroupThreadID,
+          uint3 pixelId : SV_DispatchThreadID, uint threadIndex : SV_GroupIndex) {
+    // The mapping is axis-aligned and increasing, so the corners of the
+    // block bound the texels it needs.
+    float2 blockFirst = TexelPosition(float2(groupId.xy * TILE));
+    float2 blockLast = TexelPosition(float2(groupId.xy * TILE + (TILE - 1)));
+    int2 origin = int2(floor(blockFirst)) - (RADIUS - 1);
+    int2 span = int2(floor(blockLast)) - origin + RADIUS + 1;
+    int2 maxTexel = int2(textureSize) - 1;
+
+    // The same for the whole group: only an output smaller than the source
+    // makes the footprint too big for the cache.
+    bool cached = span.x <= SPAN && span.y <= SPAN;
+
+    float2 texel = TexelPosition(float2(pixelId.xy));
+    int2 first = int2(floor(texel)) - (RADIUS - 1);
+
+    if (cached) {
+        for (uint i = threadIndex; i < SPAN * SPAN; i += TILE * TILE) {
+            int2 p = int2(i % SPAN, i / SPAN);
+            if (p.x < span.x && p.y < span.y)
+                sourceTile[p.y][p.x] = frameTexture.Load(int3(clamp(origin + p, 0, maxTexel), 0));
+        }
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    // Horizontal pass: every cached line at each of the block's columns.
+    if (cached) {
+        for (uint j = threadIndex; j < SPAN * TILE; j += TILE * TILE) {
+            uint row = j / TILE;
+            uint column = j % TILE;
+            if (row >= (uint)span.y)
+                continue;
+            float x = TexelPosition(float2(groupId.x * TILE + column, 0.0)).x;
+            int firstX = int(floor(x)) - (RADIUS - 1);
+            float4 sum = 0.0;
+            float weightSum = 0.0;
+            [unroll] for (int k = 0; k < 2 * RADIUS; k++) {
+                float w = Weight(x - (firstX + k));
+                sum += w * sourceTile[row][firstX - origin.x + k];
+                weightSum += w;
+            }
+            rowTile[row][column] = sum / weightSum;
+        }
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    float4 color = 0.0;
+    float weightSum = 0.0;
+    if (cached) {
+        [unroll] for (int k = 0; k < 2 * RADIUS; k++) {
+            float w = Weight(texel.y - (first.y + k));
+            color += w * rowTile[first.y - origin.y + k][threadId.x];
+            weightSum += w;
+        }
+    }
+    else {
+        // Filter straight from the texture.
+        [unroll] for (int r = 0; r < 2 * RADIUS; r++) {
+            int y = clamp(first.y + r, 0, maxTexel.y);
+            float wy = Weight(texel.y - (first.y + r));
+            [unroll] for (int k = 0; k < 2 * RADIUS; k++) {
+                float w = wy * Weight(texel.x - (first.x + k));
+                color += w * frameTexture.Load(int3(clamp(first.x + k, 0, maxTexel.x), y, 0));
+                weightSum += w;
+            }
+        }
+    }
+    color.rgb /= weightSum;
+#if ENHANCE
+    color.rgb = mul(colorMatrix, float4(color.rgb, 1.0));
+#endif
+    color = float4(clamp(color.rgb, colorMin, colorMax), 1.0);  // Opaque, see MagnifierPS.hlsli
+
+    if (pixelId.x >= outputSize.x || pixelId.y >= outputSize.y)
+        return;
+    float2 source = float2(pixelId.xy) * viewTransform.xy + viewTransform.zw;
+#if CURSOR
+    color.rgb = CompositeCursor(color.rgb, source * cursorTransform.xy + cursorTransform.zw);
+#endif
+#if BORDER_BLACK
+    if (any(source < 0.0) || any(source > 1.0))
+        color = float4(0.0, 0.0, 0.0, 1.0);
+#endif
+    outputTexture[pixelId.xy] = color;
+}
@@ -0,0 +1,6 @@
+// Resampling shader permutation; see MagnifierResample.hlsli.
+#define FILTER FILTER_BICUBIC
+#define BORDER_BLACK 0
+#define CURSOR 1
+#define ENHANCE 0
+#include "MagnifierResample.hlsli"
@@ -0,0 +1,6 @@
+// Resampling shader permutation; see MagnifierResample.hlsli.
+#define FILTER FILTER_LANCZOS
+#define BORDER_BLACK 1
+#define CURSOR 1
+#define ENHANCE 0
+#include "MagnifierResample.hlsli"
@@ -0,0 +1,32 @@
+// Sharpening pass of the compute magnifier, after AMD's Contrast Adaptive
+// Sharpening. Compiled at build time into MagnifierSharpenCS.h. Reads the
+// resampled image and writes the back buffer. Works on colours relative to
+// SDR white, so an scRGB image is sharpened like an 8-bit one and HDR
+// highlights above white are left alone.
+#include "MagnifierCompute.hlsli"
+
+Texture2D<float4> resampled : register(t0);
+RWTexture2D<float4> outputTexture : register(u0);
+
+[numthreads(TILE, TILE, 1)]
+void main(uint3 pixelId : SV_DispatchThreadID) {
+    if (pixelId.x >= outputSize.x || pixelId.y >= outputSize.y)
+        return;
+    int2 p = int2(pixelId.xy);
+    int2 maxPixel = int2(outputSize) - 1;
+    float4 e = resampled.Load(int3(p, 0));
+    e.rgb /= colorScale;
+    float3 b = resampled.Load(int3(clamp(p + int2(0, -1), 0, maxPixel), 0)).rgb / colorScale;
+    float3 d = resampled.Load(int3(clamp(p + int2(-1, 0), 0, maxPixel), 0)).rgb / colorScale;
+    float3 f = resampled.Load(int3(clamp(p + int2(1, 0), 0, maxPixel), 0)).rgb / colorScale;
+    float3 h = resampled.Load(int3(clamp(p + int2(0, 1), 0, maxPixel), 0)).rgb / colorScale;
+
+    // Sharpen less where the neighbourhood already has strong contrast, so
+    // edges do not ring and flat areas do not pick up noise.
+    float3 minimum = min(e.rgb, min(min(b, d), min(f, h)));
+    float3 maximum = max(e.rgb, max(max(b, d), max(f, h)));
+    float3 amount = sqrt(saturate(min(minimum, 1.0 - maximum) / max(maximum, 1e-5)));
+    float3 w = -amount / lerp(8.0, 5.0, sharpness);
+    float3 color = (w * (b + d + f + h) + e.rgb) / (1.0 + 4.0 * w);
+    outputTexture[p] = float4(clamp(color * colorScale, colorMin, colorMax), e.a);
+}
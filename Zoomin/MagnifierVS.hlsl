@@ -0,0 +1,26 @@
+// Fullscreen triangle vertex shader. Compiled at build time into MagnifierVS.h.
+// The three vertices come from SV_VertexID and the triangle overhangs the
+// target, so no vertex buffer or input layout is bound. The view and crop
+// transforms are affine, so they are applied per vertex and the pixel
+// shader receives coordinates ready to sample.
+cbuffer MagnificationBuffer : register(b0) {
+    float4 viewTransform;    // Window to source coordinates: xy scale, zw offset
+    float4 sourceTransform;  // Source to sampled texture coordinates: xy scale, zw offset
+    float4 cursorTransform;  // Source coordinates to cursor texels: xy scale, zw offset
+}
+struct VS_OUTPUT {
+    float4 position : SV_POSITION;
+    float2 texCoord : TEXCOORD0;     // Sampled texture coordinates
+    float2 sourceCoord : TEXCOORD1;  // Source coordinates, for the border check
+    float2 cursorCoord : TEXCOORD2;  // Cursor texels, for the cursor variants
+};
+VS_OUTPUT main(uint vertexId : SV_VertexID) {
+    // Window coordinates (0, 0), (2, 0) and (0, 2); the target is [0, 1].
+    float2 window = float2((vertexId << 1) & 2, vertexId & 2);
+    VS_OUTPUT output;
+    output.position = float4(window.x * 2.0f - 1.0f, 1.0f - window.y * 2.0f, 0.0f, 1.0f);
+    output.sourceCoord = window * viewTransform.xy + viewTransform.zw;
+    output.texCoord = output.sourceCoord * sourceTransform.xy + sourceTransform.zw;
+    output.cursorCoord = output.sourceCoord * cursorTransform.xy + cursorTransform.zw;
+    return output;
+}
@@ -1,26 +1,102 @@
 ﻿#include <windows.h>
 #include <d3d11.h>
-#include <d3dcompiler.h>
+#include <d3d11_4.h>  // ID3D11Multithread
+#include <d3d12.h>    // The D3D12 renderer
 #include <dxgi1_6.h>  // Using DXGI 1.6 for fullscreen compatibility
+#include <d2d1_1.h>
+#include <dcomp.h>
+#include <dwrite.h>
+#include <avrt.h>     // MMCSS
+#include <timeapi.h>  // timeBeginPeriod
+#include <mfapi.h>    // Media Foundation recording
+#include <mfidl.h>
+#include <mfreadwrite.h>
+#include <mferror.h>
+#include <compressapi.h>  // Capture trace chunks
+#include <TraceLoggingProvider.h>
 #include <wrl/client.h>
 #include <iostream>
+#include <fstream>
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <functional>
 #include <vector>
 #include <string>
+#include <memory>
 #include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <climits>
+#include <immintrin.h>  // SSE4.1 and AVX2 kernels of the CPU magnifier
 #ifdef min
 #undef min
 #endif
+#ifdef max
+#undef max
+#endif
 #include <algorithm>
 
+// Missing from older Windows SDKs.
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+// C++/WinRT for the Windows.Graphics.Capture backend
+#include <unknwn.h>
+#include <winrt/Windows.Foundation.h>
+#include <winrt/Windows.Foundation.Metadata.h>
+#include <winrt/Windows.Graphics.Capture.h>
+#include <winrt/Windows.Graphics.DirectX.Direct3D11.h>
+#include <windows.graphics.capture.interop.h>
+#include <windows.graphics.directx.direct3d11.interop.h>
+
 // GLFW includes
 #define GLFW_EXPOSE_NATIVE_WIN32
 #include <GLFW/glfw3.h>
 #include <GLFW/glfw3native.h>
 
+// Shader bytecode, generated from the .hlsl files by the FxCompile build step
+#include "MagnifierVS.h"
+#include "MagnifierPS_Clamp.h"
+#include "MagnifierPS_Clamp_Enhance.h"
+#include "MagnifierPS_Clamp_Cursor.h"
+#include "MagnifierPS_Clamp_Cursor_Enhance.h"
+#include "MagnifierPS_Black.h"
+#include "MagnifierPS_Black_Enhance.h"
+#include "MagnifierPS_Black_Cursor.h"
+#include "MagnifierPS_Black_Cursor_Enhance.h"
+#include "MagnifierResampleCS_Bilinear_Clamp.h"
+#include "MagnifierResampleCS_Bilinear_Clamp_Enhance.h"
+#include "MagnifierResampleCS_Bilinear_Clamp_Cursor.h"
+#include "MagnifierResampleCS_Bilinear_Clamp_Cursor_Enhance.h"
+#include "MagnifierResampleCS_Bilinear_Black.h"
+#include "MagnifierResampleCS_Bilinear_Black_Enhance.h"
+#include "MagnifierResampleCS_Bilinear_Black_Cursor.h"
+#include "MagnifierResampleCS_Bilinear_Black_Cursor_Enhance.h"
+#include "MagnifierResampleCS_Bicubic_Clamp.h"
+#include "MagnifierResampleCS_Bicubic_Clamp_Enhance.h"
+#include "MagnifierResampleCS_Bicubic_Clamp_Cursor.h"
+#include "MagnifierResampleCS_Bicubic_Clamp_Cursor_Enhance.h"
+#include "MagnifierResampleCS_Bicubic_Black.h"
+#include "MagnifierResampleCS_Bicubic_Black_Enhance.h"
+#include "MagnifierResampleCS_Bicubic_Black_Cursor.h"
+#include "MagnifierResampleCS_Bicubic_Black_Cursor_Enhance.h"
+#include "MagnifierResampleCS_Lanczos_Clamp.h"
+#include "MagnifierResampleCS_Lanczos_Clamp_Enhance.h"
+#include "MagnifierResampleCS_Lanczos_Clamp_Cursor.h"
+#include "MagnifierResampleCS_Lanczos_Clamp_Cursor_Enhance.h"
+#include "MagnifierResampleCS_Lanczos_Black.h"
+#include "MagnifierResampleCS_Lanczos_Black_Enhance.h"
+#include "MagnifierResampleCS_Lanczos_Black_Cursor.h"
+#include "MagnifierResampleCS_Lanczos_Black_Cursor_Enhance.h"
+#include "MagnifierSharpenCS.h"
+
 using Microsoft::WRL::ComPtr;
+namespace wgc = winrt::Windows::Graphics::Capture;
+namespace wgdx = winrt::Windows::Graphics::DirectX;
 
 // Global running flag, window dimensions and swap chain
 std::atomic<bool> g_Running = true;
@@ -28,43 +104,494 @@ GLFWwindow* g_Window = nullptr;
 int g_ScreenWidth = 0;
 int g_ScreenHeight = 0;
 ComPtr<IDXGISwapChain1> g_SwapChain;  // Global swap chain
+UINT g_SwapChainFlags = 0;            // Creation flags, needed again by ResizeBuffers
+constexpr UINT kSwapChainBufferCount = 2;
+uint64_t g_PresentCount = 0;          // Presents issued by RenderCurrentFrame()
+
+// Back buffer format, switched by MatchSourceFormat() to follow the captured
+// desktop so HDR (scRGB FP16) and 10-bit desktops are drawn without a
+// conversion pass. g_SdrWhiteScale is SDR white in back buffer units: the
+// display's SDR white level for scRGB, otherwise 1.
+DXGI_FORMAT g_BackBufferFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
+float g_SdrWhiteScale = 1.0f;
+HMONITOR g_ColorMonitor = nullptr;  // Monitor g_SdrWhiteScale was read from
+
+// Presentation backends. Composition shows the swap chain through a
+// DirectComposition visual with premultiplied alpha, which DWM can hand to a
+// hardware overlay plane instead of composing it into the desktop; Hwnd
+// binds the swap chain to the window and is the fallback.
+enum class PresentBackend { Composition, Hwnd };
+bool g_CompositionSwapChain = false;  // g_SwapChain is the content of g_DCompVisual
+ComPtr<IDCompositionDevice> g_DCompDevice;
+ComPtr<IDCompositionTarget> g_DCompTarget;
+ComPtr<IDCompositionVisual> g_DCompVisual;
+
+// Frame pacing. The swap chain's latency object is signalled when the queue
+// can take another frame; the timer is only used by the capped policy.
+enum class PacingPolicy { LowLatency, VSync, CappedFps };
+HANDLE g_FrameLatencyWaitable = nullptr;
+HANDLE g_PacingTimer = nullptr;
+std::atomic<double> g_RefreshRate{ 60.0 };  // Refresh rate of the active output in Hz
+
+// Renderers draw the view of the current frame into g_SwapChain and present
+// it. D3D11Renderer draws on the immediate context the capture uses;
+// D3D12Renderer replays command lists recorded once per back buffer on its
+// own queue, ordered against the D3D11 desktop copy by shared fences.
+class Renderer {
+public:
+    virtual ~Renderer() = default;
+    virtual const char* Name() const = 0;
+    // What swap chains are created on: the device, or the queue that presents.
+    virtual IUnknown* SwapChainDevice() const = 0;
+    // Take and drop the references to g_SwapChain's buffers; ResizeBuffers
+    // needs them dropped.
+    virtual bool CreateBackBufferViews() = 0;
+    virtual void ReleaseBackBufferViews() = 0;
+    // True when there is a back buffer to draw into.
+    virtual bool Ready() const = 0;
+    virtual void Draw(UINT width, UINT height) = 0;
+    virtual HRESULT Present(UINT syncInterval) = 0;
+    // Called after every write to g_DesktopTexture on the immediate
+    // context, so a renderer on another queue can take the new image.
+    virtual void FrameWritten() {}
+};
+std::unique_ptr<Renderer> g_Renderer;
 
 // DirectX resources
 ComPtr<ID3D11Device>             g_D3DDevice;
 ComPtr<ID3D11DeviceContext>      g_D3DContext;
-ComPtr<IDXGIOutputDuplication>   g_OutputDuplication;
-ComPtr<ID3D11Texture2D>          g_RenderTarget;
-ComPtr<ID3D11RenderTargetView>   g_RenderTargetView;
+ComPtr<ID3D11RenderTargetView>   g_RenderTargetView;  // View of the swap chain back buffer
 ComPtr<ID3D11ShaderResourceView> g_FrameShaderResourceView;
 ComPtr<ID3D11SamplerState>       g_SamplerState;
 ComPtr<ID3D11VertexShader>       g_VertexShader;
-ComPtr<ID3D11PixelShader>        g_PixelShader;
-ComPtr<ID3D11Buffer>             g_VertexBuffer;
-ComPtr<ID3D11InputLayout>        g_InputLayout;
-ComPtr<ID3D11Texture2D>          g_StagingTexture;  // For CPU access
+ComPtr<ID3D11PixelShader>        g_PixelShader;  // Permutation selected by SelectShaderPermutation()
+ComPtr<ID3D11Texture2D>          g_StagingTexture;  // For CPU access, created on first use
+
+// The CPU magnifier, used instead of the device when ChooseRenderPath()
+// picks it. The desktop is copied into system memory as frames arrive, and
+// each frame is resampled on the CPU and uploaded into the back buffer.
+struct CpuImage {
+    std::vector<uint32_t> pixels;  // BGRA texels, width * height
+    UINT width = 0;
+    UINT height = 0;
+    bool valid = false;
+};
+const uint32_t kOpaque = 0xFF000000u;  // Alpha of every texel the magnifier writes
+bool g_CpuRender = false;
+CpuImage g_CpuDesktop;         // The captured region, kept current like g_DesktopTexture
+std::vector<uint32_t> g_CpuOutput;  // The magnified image, window sized
+
+// Shader resource views for the surfaces handed out by AcquireNextFrame.
+// DXGI rotates through a small set of textures, so each one gets its view once.
+struct FrameSurfaceView {
+    ComPtr<ID3D11Texture2D>          texture;
+    ComPtr<ID3D11ShaderResourceView> view;
+};
+const size_t kMaxFrameSurfaceViews = 4;
+FrameSurfaceView g_FrameSurfaceViews[kMaxFrameSurfaceViews];
+size_t g_NextFrameSurfaceView = 0;
+
+// The acquired frame is held until just before the next AcquireNextFrame so
+// the surface stays valid while it is being sampled.
+bool g_FrameAcquired = false;
+
+// Persistent copy of the desktop used by incremental capture. Only the dirty
+// and moved regions of each acquired frame are copied into it.
+ComPtr<ID3D11Texture2D>          g_DesktopTexture;
+ComPtr<ID3D11ShaderResourceView> g_DesktopTextureView;
+bool g_DesktopTextureValid = false;
+
+// Frame metadata storage, grown on demand and reused across frames.
+std::vector<BYTE> g_MetadataBuffer;
+std::vector<RECT> g_ChangedRects;
+
+// Set when the next frame must be drawn even if nothing on the desktop changed.
+bool g_NeedsRedraw = true;
+
+// Triple buffer of desktop copies shared by the capture and render threads.
+// The capture thread writes into its back slot and swaps it with the ready
+// slot; the render thread swaps the ready slot with its front slot whenever a
+// new frame has been published. The only shared state is the packed ready
+// word, so neither side ever waits on the other.
+struct FrameRing {
+    static constexpr int kSlotCount = 3;
+    static constexpr uint32_t kSlotMask = 0x3;
+    static constexpr uint32_t kNewFrameBit = 0x4;      // Ready slot not yet taken by the renderer
+    static constexpr uint32_t kViewChangedBit = 0x8;   // Magnified area changed since the last take
+    static constexpr size_t kMaxPendingRects = 256;
+    static constexpr LONG kGuardBand = 4;              // Texels kept around an ROI crop for filtering
+
+    // Where a slot's texture sits in the captured region. Without ROI mode
+    // every slot holds the whole region; with it a slot holds only a crop.
+    struct SlotLayout {
+        RECT crop;           // Part of the captured region held, in source pixels
+        UINT sourceWidth;    // Size of the whole captured region
+        UINT sourceHeight;
+        UINT textureWidth;   // Size of the slot texture, at least the crop size
+        UINT textureHeight;
+    };
+
+    ComPtr<ID3D11Texture2D>          textures[kSlotCount];
+    ComPtr<ID3D11ShaderResourceView> views[kSlotCount];
+
+    // Capture thread only: regions each slot has missed since it was last written.
+    std::vector<RECT> pendingRects[kSlotCount];
+    bool needsFullCopy[kSlotCount] = { true, true, true };
+    RECT publishedCrop = {};  // ROI mode: crop of the most recently published slot
+    LONGLONG lastCaptureTime = 0;  // QPC present time of the newest captured image
+    int backSlot = 2;
+
+    // Written by the capture thread before the slot is published.
+    SlotLayout layouts[kSlotCount] = {};
+    LONGLONG captureTimes[kSlotCount] = {};
+
+    std::atomic<uint32_t> readyState{ 1 };
+
+    // Render thread only.
+    int frontSlot = 0;
+    bool hasFrame = false;  // A slot has been taken since the ring was created
+};
+// Each output has its own ring (see OutputSession); these point at the ring of
+// the output each thread is currently working on.
+FrameRing* g_CaptureRing = nullptr;  // Capture thread
+FrameRing* g_RenderRing = nullptr;   // Render thread
+HANDLE g_FrameReadyEvent = nullptr;      // Signalled by the capture thread after each publish
+std::atomic<bool> g_CaptureReconfigure{ false };  // Asks the capture thread to exit so the rings can change
+std::atomic<float> g_SharedZoom{ 1.0f };  // Smallest zoom of the current animation, set by the render thread
+
+// Capture backends. Auto uses desktop duplication and falls back to
+// Windows.Graphics.Capture when duplication is unavailable or lost.
+enum class CaptureBackend { Auto, Duplication, GraphicsCapture };
+
+// Resampling filters. Bilinear is drawn by the pixel shader through the
+// sampler; the others need the compute path.
+enum class MagnifyFilter { Bilinear, Bicubic, Lanczos, Count };
+const char* const kFilterNames[] = { "bilinear", "bicubic", "lanczos" };
+
+// Colour filters of the enhancement stage. The colour-blind ones correct
+// rather than simulate: see BuildColorMatrix().
+enum class ColorFilter { None, Grayscale, Protanopia, Deuteranopia, Tritanopia, Count };
+const char* const kColorFilterNames[] = { "none", "grayscale", "protanopia", "deuteranopia", "tritanopia" };
+
+// Curves the zoom animation follows towards its target. Spring is critically
+// damped, so it carries velocity across target changes without overshooting
+// from rest; exponential eases with a fixed time constant.
+enum class ZoomCurve { Spring, Exponential, Instant, Count };
+const char* const kZoomCurveNames[] = { "spring", "exponential", "instant" };
+
+// Renderer backends, see Renderer.
+enum class RendererBackend { D3D11, D3D12, Count };
+const char* const kRendererBackendNames[] = { "d3d11", "d3d12" };
 
-// Global zoom factor (starts at 1.0)
+// Whether to magnify on the CPU: auto picks it on software adapters when it
+// measures faster, on and off force it.
+enum class CpuRenderMode { Auto, On, Off };
+
+// Codecs --record can encode with.
+enum class VideoCodec { H264, Hevc, Count };
+const char* const kVideoCodecNames[] = { "h264", "hevc" };
+
+// Runtime options, set from the command line.
+struct MagnifierOptions {
+    bool incrementalCapture = true;  // Copy only changed regions into g_DesktopTexture
+    bool threadedCapture = true;     // Capture on its own thread into a frame ring
+    PacingPolicy pacing = PacingPolicy::VSync;
+    double cappedFps = 60.0;         // Frame rate for PacingPolicy::CappedFps
+    CaptureBackend captureBackend = CaptureBackend::Auto;
+    PresentBackend presentBackend = PresentBackend::Composition;
+    std::wstring captureWindowTitle; // Capture this window instead of the monitor
+    bool hasCaptureRegion = false;
+    RECT captureRegion = {};         // Monitor sub-region to capture, in monitor pixels
+    bool regionOfInterest = false;   // Ring slots hold only the magnified crop (threaded capture)
+    bool collectStats = false;       // Record frame timing histograms
+    bool statsOverlay = false;       // Draw the timing summary on screen
+    std::string statsCsvPath;        // Append timing summaries to this CSV file
+    MagnifyFilter filter = MagnifyFilter::Bilinear;
+    bool sharpen = false;            // Run the contrast-adaptive sharpening pass after resampling
+    float sharpness = 0.5f;          // Sharpening strength, 0 to 1
+    ColorFilter colorFilter = ColorFilter::None;
+    float contrast = 1.0f;           // Contrast around mid-grey; 1 leaves colours alone
+    bool invert = false;             // Invert colours
+    bool bench = false;              // Run the headless benchmark instead of the magnifier
+    std::string benchOutputPath = "zoomin-bench.csv";
+    UINT lensWidth = 0;              // Lens mode when non-zero: a cursor-following window of this size
+    UINT lensHeight = 0;
+    std::vector<float> zoomLevels = { 1.4f };  // Zooms held right-click selects from, each at least 1
+    ZoomCurve zoomCurve = ZoomCurve::Exponential;
+    float zoomTimeMs = 100.0f;       // Time constant of the zoom animation
+    bool forceSdr = false;           // Capture 8-bit only and let the OS convert HDR desktops
+    bool realtime = true;            // MMCSS, GPU thread priority and fine timer resolution while zoomed
+    int renderCore = -1;             // Core to pin the render thread to, or -1
+    int captureCore = -1;            // Core to pin the capture thread to, or -1
+    std::wstring recordPath;         // Record the presented image to this fragmented MP4
+    VideoCodec recordCodec = VideoCodec::H264;
+    UINT recordBitrateMbps = 0;      // 0 picks one from the size and frame rate
+    UINT vramBudgetMB = 0;           // Cap on the OS video memory budget, or 0
+    CpuRenderMode cpuRender = CpuRenderMode::Auto;
+    RendererBackend renderer = RendererBackend::D3D11;
+    std::string traceRecordPath;     // Record a capture trace to this file
+    std::string traceReplayPath;     // Replay this capture trace through the pipeline, then exit
+    std::string replayReportPath = "zoomin-replay.csv";
+};
+MagnifierOptions g_Options;
+
+// Global zoom factor (starts at 1.0) and the value it is easing towards
 float g_CurrentZoom = 1.0f;
+float g_TargetZoom = 1.0f;
+float g_ZoomVelocity = 0.0f;  // Zoom units per second, carried by the spring curve
+size_t g_ZoomLevel = 0;       // Index into g_Options.zoomLevels used while zooming
 
-// Constant buffer structure for the shader
-struct MagnificationConstantBuffer {
+// What the magnifier shows. The shaders receive it folded into affine
+// transforms, so they do no per-pixel zoom arithmetic.
+struct MagnificationView {
     float magnificationFactor;
-    float padding[3]; // 16-byte alignment
+    float center[2];          // Magnification center, in source coordinates
+    float extent[2];          // Part of the source the window covers at 1.0x; below 1 in lens mode
+    float sourceTransform[4]; // Source to sampled texture coordinates: xy scale, zw offset
+    float sourceSize[2];      // Size of the captured region, in pixels
+    float cursorPosition[2];  // Top-left corner of the pointer shape, in source pixels
+};
+MagnificationView g_View = { 1.0f, {0.5f, 0.5f}, {1.0f, 1.0f}, {1.0f, 1.0f, 0.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 0.0f} };
+// Copy of g_View.center for the capture thread, which crops around it in ROI mode.
+std::atomic<float> g_SharedCenter[2] = { 0.5f, 0.5f };
+bool g_ConstantsDirty = false;  // g_View changed since the constant buffer was uploaded
+
+// Constant buffer structure for the vertex shader
+struct MagnificationConstantBuffer {
+    float viewTransform[4];   // Window to source coordinates: xy scale, zw offset
+    float sourceTransform[4]; // Source to sampled texture coordinates: xy scale, zw offset
+    float cursorTransform[4]; // Source coordinates to cursor texels: xy scale, zw offset
+    float colorMatrix[3][4];  // Enhancement colour transform: rows of an affine matrix
+};
+ComPtr<ID3D11Buffer> g_ConstantBuffer;  // Dynamic; rewritten only when g_View changes
+
+// Magnifier state last bound on the immediate context, so drawing binds only
+// what differs. Reset with InvalidateBoundState() wherever the context may
+// have changed behind it: ClearState, Present, the compute path and Direct2D.
+struct BoundState {
+    bool pipeline = false;  // Topology, vertex shader, constant buffer and sampler
+    ID3D11PixelShader* pixelShader = nullptr;
+    ID3D11ShaderResourceView* frameView = nullptr;
+    ID3D11ShaderResourceView* cursorView = nullptr;
+    ID3D11RenderTargetView* target = nullptr;
+    UINT viewportWidth = 0;
+    UINT viewportHeight = 0;
+};
+BoundState g_Bound;
+
+void InvalidateBoundState()
+{
+    g_Bound = {};
+}
+
+// Compute magnification path for the bicubic and Lanczos filters and the
+// sharpening pass. The resample pass writes straight into the back buffer,
+// or into g_FilterTexture when the sharpening pass follows it.
+struct FilterConstantBuffer {
+    UINT outputSize[2];
+    UINT textureSize[2];     // Size of the bound source texture
+    float texelScale[2];     // Output pixel index to source texel position
+    float texelOffset[2];
+    float viewTransform[4];  // Output pixel index to source coordinates: xy scale, zw offset
+    float cursorTransform[4];
+    float sharpness;
+    float colorScale;        // SDR white in target units
+    float colorMin;          // Range the target holds
+    float colorMax;
+    float colorMatrix[3][4];
+};
+ComPtr<ID3D11ComputeShader>       g_ResampleShader;  // Permutation selected by SelectShaderPermutation()
+ComPtr<ID3D11ComputeShader>       g_SharpenShader;
+ComPtr<ID3D11Buffer>              g_FilterConstantBuffer;
+FilterConstantBuffer              g_FilterConstants = {};  // Last uploaded contents
+ComPtr<ID3D11UnorderedAccessView> g_BackBufferUAV;
+ComPtr<ID3D11Texture2D>           g_FilterTexture;
+ComPtr<ID3D11ShaderResourceView>  g_FilterTextureView;
+ComPtr<ID3D11UnorderedAccessView> g_FilterTextureUAV;
+bool g_ComputeSupported = false;
+
+// Filtering in use, changed at runtime with Numpad 9 (next filter) and
+// Numpad 7 (sharpening on or off) through the request flags.
+MagnifyFilter g_Filter = MagnifyFilter::Bilinear;
+bool g_Sharpen = false;
+bool g_FilterCycleRequest = false;
+bool g_SharpenToggleRequest = false;
+
+// Enhancements in use, changed at runtime with Numpad 6 (inversion on or
+// off) and Numpad 4 (next colour filter) through the request flags.
+// Contrast comes from the options only.
+bool g_Invert = false;
+ColorFilter g_ColorFilter = ColorFilter::None;
+bool g_InvertToggleRequest = false;
+bool g_ColorFilterCycleRequest = false;
+
+// Shader permutations. Every variant is compiled at build time from a small
+// wrapper .hlsl that sets the defines and includes the shared source, and
+// all of them are created with the device. SelectShaderPermutation() picks
+// the ones for the current configuration whenever it changes, so the shader
+// that runs has no branches or taps for features it does not use. ROI and
+// full-frame views need no variants of their own: the crop is part of the
+// transforms in the constants. The cursor variants composite the pointer
+// and are used only while it is inside the view; the enhance variants apply
+// the colour matrix and are used only while an enhancement is on. Tables
+// are indexed [border][cursor][enhance], after the filter for resampling.
+enum class BorderMode { Clamp, Black, Count };  // Clamp: the view cannot leave the source
+constexpr int kBorderModeCount = static_cast<int>(BorderMode::Count);
+constexpr int kFilterCount = static_cast<int>(MagnifyFilter::Count);
+
+struct ShaderBytecode {
+    const BYTE* data;
+    size_t size;
+};
+constexpr ShaderBytecode kPixelShaderPermutations[kBorderModeCount][2][2] = {
+    { { { g_MagnifierPS_Clamp, sizeof(g_MagnifierPS_Clamp) },
+        { g_MagnifierPS_Clamp_Enhance, sizeof(g_MagnifierPS_Clamp_Enhance) } },
+      { { g_MagnifierPS_Clamp_Cursor, sizeof(g_MagnifierPS_Clamp_Cursor) },
+        { g_MagnifierPS_Clamp_Cursor_Enhance, sizeof(g_MagnifierPS_Clamp_Cursor_Enhance) } } },
+    { { { g_MagnifierPS_Black, sizeof(g_MagnifierPS_Black) },
+        { g_MagnifierPS_Black_Enhance, sizeof(g_MagnifierPS_Black_Enhance) } },
+      { { g_MagnifierPS_Black_Cursor, sizeof(g_MagnifierPS_Black_Cursor) },
+        { g_MagnifierPS_Black_Cursor_Enhance, sizeof(g_MagnifierPS_Black_Cursor_Enhance) } } },
+};
+constexpr ShaderBytecode kResamplePermutations[kFilterCount][kBorderModeCount][2][2] = {
+    { { { { g_MagnifierResampleCS_Bilinear_Clamp, sizeof(g_MagnifierResampleCS_Bilinear_Clamp) },
+          { g_MagnifierResampleCS_Bilinear_Clamp_Enhance, sizeof(g_MagnifierResampleCS_Bilinear_Clamp_Enhance) } },
+        { { g_MagnifierResampleCS_Bilinear_Clamp_Cursor, sizeof(g_MagnifierResampleCS_Bilinear_Clamp_Cursor) },
+          { g_MagnifierResampleCS_Bilinear_Clamp_Cursor_Enhance, sizeof(g_MagnifierResampleCS_Bilinear_Clamp_Cursor_Enhance) } } },
+      { { { g_MagnifierResampleCS_Bilinear_Black, sizeof(g_MagnifierResampleCS_Bilinear_Black) },
+          { g_MagnifierResampleCS_Bilinear_Black_Enhance, sizeof(g_MagnifierResampleCS_Bilinear_Black_Enhance) } },
+        { { g_MagnifierResampleCS_Bilinear_Black_Cursor, sizeof(g_MagnifierResampleCS_Bilinear_Black_Cursor) },
+          { g_MagnifierResampleCS_Bilinear_Black_Cursor_Enhance, sizeof(g_MagnifierResampleCS_Bilinear_Black_Cursor_Enhance) } } } },
+    { { { { g_MagnifierResampleCS_Bicubic_Clamp, sizeof(g_MagnifierResampleCS_Bicubic_Clamp) },
+          { g_MagnifierResampleCS_Bicubic_Clamp_Enhance, sizeof(g_MagnifierResampleCS_Bicubic_Clamp_Enhance) } },
+        { { g_MagnifierResampleCS_Bicubic_Clamp_Cursor, sizeof(g_MagnifierResampleCS_Bicubic_Clamp_Cursor) },
+          { g_MagnifierResampleCS_Bicubic_Clamp_Cursor_Enhance, sizeof(g_MagnifierResampleCS_Bicubic_Clamp_Cursor_Enhance) } } },
+      { { { g_MagnifierResampleCS_Bicubic_Black, sizeof(g_MagnifierResampleCS_Bicubic_Black) },
+          { g_MagnifierResampleCS_Bicubic_Black_Enhance, sizeof(g_MagnifierResampleCS_Bicubic_Black_Enhance) } },
+        { { g_MagnifierResampleCS_Bicubic_Black_Cursor, sizeof(g_MagnifierResampleCS_Bicubic_Black_Cursor) },
+          { g_MagnifierResampleCS_Bicubic_Black_Cursor_Enhance, sizeof(g_MagnifierResampleCS_Bicubic_Black_Cursor_Enhance) } } } },
+    { { { { g_MagnifierResampleCS_Lanczos_Clamp, sizeof(g_MagnifierResampleCS_Lanczos_Clamp) },
+          { g_MagnifierResampleCS_Lanczos_Clamp_Enhance, sizeof(g_MagnifierResampleCS_Lanczos_Clamp_Enhance) } },
+        { { g_MagnifierResampleCS_Lanczos_Clamp_Cursor, sizeof(g_MagnifierResampleCS_Lanczos_Clamp_Cursor) },
+          { g_MagnifierResampleCS_Lanczos_Clamp_Cursor_Enhance, sizeof(g_MagnifierResampleCS_Lanczos_Clamp_Cursor_Enhance) } } },
+      { { { g_MagnifierResampleCS_Lanczos_Black, sizeof(g_MagnifierResampleCS_Lanczos_Black) },
+          { g_MagnifierResampleCS_Lanczos_Black_Enhance, sizeof(g_MagnifierResampleCS_Lanczos_Black_Enhance) } },
+        { { g_MagnifierResampleCS_Lanczos_Black_Cursor, sizeof(g_MagnifierResampleCS_Lanczos_Black_Cursor) },
+          { g_MagnifierResampleCS_Lanczos_Black_Cursor_Enhance, sizeof(g_MagnifierResampleCS_Lanczos_Black_Cursor_Enhance) } } } },
+};
+ComPtr<ID3D11PixelShader>   g_PixelShaderPermutations[kBorderModeCount][2][2];
+ComPtr<ID3D11ComputeShader> g_ResampleShaderPermutations[kFilterCount][kBorderModeCount][2][2];
+bool g_CursorInView = false;  // The cursor variants are selected
+
+// Pointer. Desktop duplication reports it beside the image rather than in
+// it: the position with every mouse update, the shape only when it changes.
+// The thread that acquires frames converts each distinct shape into a small
+// texture once and publishes it; the render thread composites it in the
+// magnification pass.
+struct CursorShape {
+    ComPtr<ID3D11ShaderResourceView> view;  // BGRA texels, encoded as in MagnifierCursor.hlsli
+    UINT width;
+    UINT height;
+    float linearScale;                      // Non-zero for linear float texels at this SDR white, for scRGB
+
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO info;   // Shape as reported, to recognise it again
+    std::vector<BYTE> bits;
+    std::vector<uint32_t> pixels;           // The BGRA texels, for the CPU magnifier
+};
+const size_t kMaxCachedCursorShapes = 8;
+std::vector<std::shared_ptr<const CursorShape>> g_CursorShapeCache;  // Acquiring thread only, newest first
+std::vector<BYTE> g_PointerShapeBuffer;
+
+// The pointer shape the last duplication frame carried, as read into
+// g_PointerShapeBuffer; size is 0 if the frame carried none.
+struct PointerShapeRecord {
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO info;
+    UINT size;
+    float linearScale;
 };
-ComPtr<ID3D11Buffer> g_ConstantBuffer;
+PointerShapeRecord g_LastPointerShape = {};
+std::atomic<std::shared_ptr<const CursorShape>> g_CursorShape;
+std::atomic<uint64_t> g_CursorPosition{ 0 };  // Packed top-left corner of the shape, in captured-region pixels
+std::atomic<bool> g_CursorVisible{ false };
 
-// Vertex structure for the fullscreen quad
-#pragma pack(push, 1)
-struct Vertex {
-    float position[3];
-    float texCoord[2];
+// The pointer as the render thread last drew it.
+struct DrawnCursor {
+    std::shared_ptr<const CursorShape> shape;
+    uint64_t position = 0;
+    bool visible = false;
 };
-#pragma pack(pop)
+DrawnCursor g_Cursor;
 
 // Global variables to manage window visibility toggle.
 // The window starts hidden.
 std::atomic<bool> g_WindowVisible(false);
-std::atomic<bool> g_WindowToggleRequest(false);
+bool g_WindowToggleRequest = false;
+
+// Input from the low-level hooks. The hook thread pushes each trigger with
+// its QueryPerformanceCounter time and signals g_WakeEvent; the render
+// thread drains the queue once per iteration and right after every wait,
+// so a press is acted on without polling and the zoom animation starts
+// from the moment of the press rather than from when it was noticed.
+enum class InputEventType { RightButtonDown, RightButtonUp, ToggleWindow, CycleFilter, ToggleSharpen, NextZoomLevel, PreviousZoomLevel,
+    ToggleInvert, CycleColorFilter };
+
+struct InputEvent {
+    InputEventType type;
+    LONGLONG time;  // QueryPerformanceCounter value when the hook saw it
+};
+
+// Single-producer, single-consumer ring of input events. Push() is only
+// called from the hook thread and Pop() only from the render thread. A full
+// queue drops the event, which takes hundreds of presses while the render
+// thread is stalled.
+struct InputQueue {
+    static constexpr uint32_t kCapacity = 256;  // Power of two
+
+    InputEvent events[kCapacity] = {};
+    std::atomic<uint32_t> head{ 0 };  // Next slot to read, owned by the consumer
+    std::atomic<uint32_t> tail{ 0 };  // Next slot to write, owned by the producer
+
+    bool Push(const InputEvent& event)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == kCapacity)
+            return false;
+        events[t % kCapacity] = event;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(InputEvent& event)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        event = events[h % kCapacity];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+};
+InputQueue g_InputQueue;
+std::atomic<uint32_t> g_DroppedInputEvents{ 0 };  // Counted by the hooks, reported by the render thread
+
+// Standby state. While the window is hidden and unzoomed the render loop
+// blocks on g_WakeEvent, which the input hooks signal, and the capture thread
+// blocks on g_ResumeEvent (manual reset) until standby ends.
+HANDLE g_WakeEvent = nullptr;
+HANDLE g_ResumeEvent = nullptr;
+std::atomic<bool> g_Standby(false);
+bool g_RightButtonDown = false;  // From the drained input events
+LONGLONG g_LastZoomUpdate = 0;   // QueryPerformanceCounter time the zoom was last advanced to
+
+// Pending swap chain resize, set from the GLFW framebuffer size callback.
+bool g_ResizeRequest = false;
+int g_PendingWidth = 0;
+int g_PendingHeight = 0;
 
 // Helper function to convert HRESULT to string
 std::string HrToString(HRESULT hr) {
@@ -73,644 +600,7434 @@ std::string HrToString(HRESULT hr) {
     return std::string(buffer);
 }
 
-// Global low-level keyboard hook to detect Shift+Esc (exit) and Numpad 8 (toggle window)
-LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam)
-{
-    if (nCode == HC_ACTION)
+// Frame timing instrumentation, enabled with --stats (on-screen overlay) or
+// --stats-csv <path>. Durations go into log-scale histograms that are
+// summarized and reset once a second; summaries are also written as ETW
+// events through the TraceLogging provider below.
+// {6B0F2C1E-8E4D-4A57-9C3B-2F1D7A5E9B40}
+TRACELOGGING_DEFINE_PROVIDER(g_TraceProvider, "Zoomin",
+    (0x6b0f2c1e, 0x8e4d, 0x4a57, 0x9c, 0x3b, 0x2f, 0x1d, 0x7a, 0x5e, 0x9b, 0x40));
+
+enum class Stat { Acquire, Release, Copy, GpuCopy, GpuDraw, GpuPresent, PresentInterval, Latency, Recovery, CrossAdapter, MissedFrame, HookDelay, Encode, CpuDraw, Count };
+const char* const kStatNames[] = { "acquire", "release", "copy", "gpu-copy", "gpu-draw", "gpu-present", "present-interval", "latency", "recovery", "cross-adapter",
+    "missed-frame", "hook-delay", "encode", "cpu-draw" };
+
+// Histogram of durations in microseconds with eight buckets per octave, from
+// 1 us to about 260 ms. Percentiles are accurate to one bucket (about 9%).
+// Written by any thread and read by the render thread, so the buckets
+// are relaxed atomics.
+struct TimingHistogram {
+    static constexpr int kBucketsPerOctave = 8;
+    static constexpr int kBucketCount = 18 * kBucketsPerOctave;
+
+    std::atomic<uint32_t> buckets[kBucketCount] = {};
+    std::atomic<uint32_t> count{ 0 };
+
+    void Add(double microseconds)
     {
-        KBDLLHOOKSTRUCT* pKeyboard = reinterpret_cast<KBDLLHOOKSTRUCT*>(lParam);
-        if (wParam == WM_KEYDOWN)
-        {
-            // Exit when Shift+Esc is pressed.
-            if (pKeyboard->vkCode == VK_ESCAPE && (GetAsyncKeyState(VK_SHIFT) & 0x8000))
-            {
-                g_Running = false;
-                PostQuitMessage(0);  // Exit hook thread's message loop immediately
-            }
-            // Toggle window visibility when Numpad 8 is pressed (only on non-repeat).
-            else if (pKeyboard->vkCode == VK_NUMPAD8)
-            {
-                if (!(pKeyboard->flags & 0x40000000))
-                {
-                    g_WindowToggleRequest = true;
-                }
-            }
-        }
+        int index = microseconds <= 1.0 ? 0 : static_cast<int>(std::log2(microseconds) * kBucketsPerOctave);
+        index = std::min(index, kBucketCount - 1);
+        buckets[index].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
     }
-    return CallNextHookEx(nullptr, nCode, wParam, lParam);
-}
 
-// Thread function to install the keyboard hook and run a message loop.
-DWORD WINAPI KeyboardHookThread(LPVOID lpParam)
-{
-    HHOOK hook = SetWindowsHookEx(WH_KEYBOARD_LL, LowLevelKeyboardProc, GetModuleHandle(nullptr), 0);
-    if (!hook)
+    // Upper bound of the bucket holding the given percentile.
+    double Percentile(double percent) const
     {
-        std::cerr << "Failed to install keyboard hook." << std::endl;
-        return 1;
+        uint32_t total = count.load(std::memory_order_relaxed);
+        if (total == 0)
+            return 0.0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(total * percent / 100.0));
+        uint64_t seen = 0;
+        for (int i = 0; i < kBucketCount; i++)
+        {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::exp2(static_cast<double>(i + 1) / kBucketsPerOctave);
+        }
+        return std::exp2(static_cast<double>(kBucketCount) / kBucketsPerOctave);
     }
-    MSG msg;
-    while (GetMessage(&msg, nullptr, 0, 0) && g_Running)
+
+    void Reset()
     {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+        for (auto& bucket : buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
     }
-    UnhookWindowsHookEx(hook);
-    return 0;
+};
+TimingHistogram g_Stats[static_cast<int>(Stat::Count)];
+
+// Current QueryPerformanceCounter value.
+LONGLONG QpcNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
 }
 
-// Initialize GLFW window with fullscreen, borderless, and click-through settings.
-// The window is hidden immediately after creation.
-bool InitializeGLFW() {
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        return false;
-    }
-    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
-    const GLFWvidmode* mode = glfwGetVideoMode(monitor);
-    g_ScreenWidth = mode->width;
-    g_ScreenHeight = mode->height;
+// QueryPerformanceCounter ticks per second.
+LONGLONG QpcFrequency()
+{
+    static const LONGLONG frequency = [] { LARGE_INTEGER f; QueryPerformanceFrequency(&f); return f.QuadPart; }();
+    return frequency;
+}
 
-    glfwWindowHint(GLFW_TRANSPARENT_FRAMEBUFFER, GLFW_TRUE);
-    glfwWindowHint(GLFW_DECORATED, GLFW_FALSE);
-    glfwWindowHint(GLFW_FOCUSED, GLFW_FALSE);
-    glfwWindowHint(GLFW_FLOATING, GLFW_TRUE);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+// Convert a QueryPerformanceCounter interval to microseconds.
+double QpcToMicroseconds(LONGLONG ticks)
+{
+    return static_cast<double>(ticks) * 1e6 / static_cast<double>(QpcFrequency());
+}
 
-    g_Window = glfwCreateWindow(g_ScreenWidth, g_ScreenHeight, "Screen Magnifier", nullptr, nullptr);
-    if (!g_Window) {
-        std::cerr << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return false;
-    }
-    // Setup window as click-through.
-    HWND hwnd = glfwGetWin32Window(g_Window);
-    if (!hwnd) {
-        std::cerr << "Failed to get native window handle" << std::endl;
-        return false;
-    }
-    LONG exStyle = GetWindowLong(hwnd, GWL_EXSTYLE);
-    SetWindowLong(hwnd, GWL_EXSTYLE, exStyle | WS_EX_LAYERED | WS_EX_TRANSPARENT | WS_EX_TOPMOST | WS_EX_TOOLWINDOW);
-    SetLayeredWindowAttributes(hwnd, 0, 255, LWA_ALPHA);
-    SetWindowPos(hwnd, HWND_TOPMOST, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
+// Convert microseconds to a QueryPerformanceCounter interval.
+LONGLONG MicrosecondsToQpc(double microseconds)
+{
+    return static_cast<LONGLONG>(microseconds * static_cast<double>(QpcFrequency()) / 1e6);
+}
 
-    // Hide the window initially.
-    glfwHideWindow(g_Window);
-    return true;
+// Add one sample, in microseconds, when stats are enabled.
+void RecordStat(Stat stat, double microseconds)
+{
+    if (g_Options.collectStats)
+        g_Stats[static_cast<int>(stat)].Add(microseconds);
 }
 
-// Create the swap chain.
-bool CreateSwapChain()
+// Report how long capture or the device was out, from the moment the loss
+// was noticed until frames could be acquired again.
+void ReportRecovery(const char* what, LONGLONG lostTime)
 {
-    HWND hwnd = glfwGetWin32Window(g_Window);
-    if (!hwnd)
+    double microseconds = QpcToMicroseconds(QpcNow() - lostTime);
+    RecordStat(Stat::Recovery, microseconds);
+    std::cout << what << " recovered after " << microseconds / 1000.0 << " ms" << std::endl;
+    TraceLoggingWrite(g_TraceProvider, "Recovered",
+        TraceLoggingString(what, "Kind"),
+        TraceLoggingFloat64(microseconds, "Microseconds"));
+}
+
+// Times the enclosing block of CPU work into a histogram.
+class CpuTimer {
+public:
+    explicit CpuTimer(Stat stat) : m_stat(stat), m_start(g_Options.collectStats ? QpcNow() : 0) {}
+    ~CpuTimer()
     {
-        std::cerr << "Could not retrieve HWND for swap chain creation." << std::endl;
-        return false;
-    }
-    if (!SetWindowDisplayAffinity(hwnd, WDA_EXCLUDEFROMCAPTURE)) {
-        std::cerr << "Failed to set window display affinity." << std::endl;
+        if (m_start)
+            RecordStat(m_stat, QpcToMicroseconds(QpcNow() - m_start));
     }
-    DXGI_SWAP_CHAIN_DESC1 swapChainDesc = {};
-    swapChainDesc.Width = g_ScreenWidth;
-    swapChainDesc.Height = g_ScreenHeight;
-    swapChainDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    swapChainDesc.SampleDesc.Count = 1;
-    swapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    swapChainDesc.BufferCount = 2;
-    swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-    swapChainDesc.AlphaMode = DXGI_ALPHA_MODE_IGNORE;
 
-    ComPtr<IDXGIDevice2> dxgiDevice2;
-    HRESULT hr = g_D3DDevice.As(&dxgiDevice2);
-    if (FAILED(hr))
+private:
+    Stat m_stat;
+    LONGLONG m_start;
+};
+
+// GPU memory telemetry. Every texture the magnifier allocates on g_D3DDevice
+// is tagged with its purpose by TrackAllocation(), which attaches a record
+// to the resource as private data; D3D releases the record with the
+// resource, so frees are counted wherever the last reference goes. The swap
+// chain buffers are counted when their views are created. Surfaces owned by
+// the OS, such as the duplication's, only show in the adapter usage.
+enum class GpuMemoryUse { SwapChain, FrameRing, DesktopCopy, Filter, Staging, Cursor, CrossAdapter, Trace, Count };
+const char* const kGpuMemoryUseNames[] = { "swap-chain", "frame-ring", "desktop-copy", "filter", "staging", "cursor", "cross-adapter", "trace" };
+std::atomic<int64_t> g_GpuMemory[static_cast<int>(GpuMemoryUse::Count)] = {};
+
+// {5C3A8E02-7F41-4B6D-9E2A-1B8C4D6F0A93}
+const GUID kAllocationRecordGuid = { 0x5c3a8e02, 0x7f41, 0x4b6d, { 0x9e, 0x2a, 0x1b, 0x8c, 0x4d, 0x6f, 0x0a, 0x93 } };
+
+class AllocationRecord : public IUnknown {
+public:
+    AllocationRecord(GpuMemoryUse use, int64_t bytes) : m_use(use), m_bytes(bytes)
     {
-        std::cerr << "Failed to query IDXGIDevice2: " << HrToString(hr) << std::endl;
-        return false;
+        g_GpuMemory[static_cast<int>(m_use)] += m_bytes;
     }
-    ComPtr<IDXGIAdapter> dxgiAdapter;
-    hr = dxgiDevice2->GetAdapter(&dxgiAdapter);
-    if (FAILED(hr))
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) override
     {
-        std::cerr << "Failed to get adapter from IDXGIDevice2: " << HrToString(hr) << std::endl;
-        return false;
+        if (riid != __uuidof(IUnknown))
+        {
+            *object = nullptr;
+            return E_NOINTERFACE;
+        }
+        *object = static_cast<IUnknown*>(this);
+        AddRef();
+        return S_OK;
     }
-    ComPtr<IDXGIFactory2> dxgiFactory2;
-    hr = dxgiAdapter->GetParent(IID_PPV_ARGS(&dxgiFactory2));
-    if (FAILED(hr))
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++m_references; }
+    ULONG STDMETHODCALLTYPE Release() override
     {
-        std::cerr << "Failed to get factory from adapter: " << HrToString(hr) << std::endl;
-        return false;
+        ULONG references = --m_references;
+        if (references == 0)
+        {
+            g_GpuMemory[static_cast<int>(m_use)] -= m_bytes;
+            delete this;
+        }
+        return references;
     }
-    hr = dxgiFactory2->CreateSwapChainForHwnd(g_D3DDevice.Get(), hwnd, &swapChainDesc, nullptr, nullptr, &g_SwapChain);
-    if (FAILED(hr))
+
+private:
+    std::atomic<ULONG> m_references{ 1 };
+    GpuMemoryUse m_use;
+    int64_t m_bytes;
+};
+
+// Size of a texel of the formats the magnifier allocates; NV12 is not
+// counted here.
+UINT BytesPerPixel(DXGI_FORMAT format)
+{
+    switch (format)
     {
-        std::cerr << "Failed to create swap chain: " << HrToString(hr) << std::endl;
-        return false;
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+        return 16;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+        return 8;
+    default:
+        return 4;
     }
-    return true;
 }
 
-// Initialize DirectX with DXGI 1.6 for improved fullscreen support.
-bool InitializeDirectX() {
+int64_t TextureBytes(const D3D11_TEXTURE2D_DESC& desc)
+{
+    return static_cast<int64_t>(desc.Width) * desc.Height * desc.ArraySize * BytesPerPixel(desc.Format);
+}
 
-    std::cout << "Waiting 5 seconds before initializing capture..." << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+// Count a texture under the given purpose until it is destroyed.
+void TrackAllocation(ID3D11Texture2D* texture, GpuMemoryUse use)
+{
+    if (!texture)
+        return;
+    D3D11_TEXTURE2D_DESC desc = {};
+    texture->GetDesc(&desc);
+    AllocationRecord* record = new AllocationRecord(use, TextureBytes(desc));
+    texture->SetPrivateDataInterface(kAllocationRecordGuid, record);
+    record->Release();
+}
 
-    HRESULT hr = S_OK;
-    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+// Adapter memory budget. The OS budget comes from
+// IDXGIAdapter3::QueryVideoMemoryInfo, checked once a second and whenever
+// the budget-change event fires; --vram-budget can lower it. While usage is
+// over budget the magnifier gives up memory one level at a time, see
+// ApplyMemoryLevel(). Levels are not raised again while running.
+enum class MemoryLevel { Full, Trimmed, CroppedRing, SingleThread, Count };
+const char* const kMemoryLevelNames[] = { "full", "trimmed", "cropped-ring", "single-thread" };
+ComPtr<IDXGIAdapter3> g_MemoryAdapter;
+HANDLE g_BudgetEvent = nullptr;
+DWORD g_BudgetCookie = 0;
+DXGI_QUERY_VIDEO_MEMORY_INFO g_VideoMemory = {};  // Last query, local segment group
+MemoryLevel g_MemoryLevel = MemoryLevel::Full;
 
-    UINT createDeviceFlags = 0;
-#ifdef _DEBUG
-    createDeviceFlags |= D3D11_CREATE_DEVICE_DEBUG;
-#endif
+// Effective budget in bytes: the OS budget, capped by --vram-budget.
+UINT64 MemoryBudget()
+{
+    UINT64 budget = g_VideoMemory.Budget;
+    if (g_Options.vramBudgetMB)
+        budget = std::min<UINT64>(budget, static_cast<UINT64>(g_Options.vramBudgetMB) << 20);
+    return budget;
+}
 
-    D3D_FEATURE_LEVEL featureLevels[] = {
-        D3D_FEATURE_LEVEL_11_1,
-        D3D_FEATURE_LEVEL_11_0,
-        D3D_FEATURE_LEVEL_10_1,
-        D3D_FEATURE_LEVEL_10_0
-    };
-    D3D_FEATURE_LEVEL featureLevel;
+// GPU timestamp queries for one frame. Each segment is bracketed by a pair
+// of timestamps inside a disjoint query; results are read back a few frames
+// later with DONOTFLUSH, so the CPU never waits on the GPU.
+enum class GpuSegment { Copy, Draw, Present, Count };
+struct GpuFrameQueries {
+    static constexpr int kSegmentCount = static_cast<int>(GpuSegment::Count);
+    ComPtr<ID3D11Query> disjoint;
+    ComPtr<ID3D11Query> timestamps[2 * kSegmentCount];
+    bool used[kSegmentCount] = {};
+    bool open = false;     // Disjoint query begun for the frame being recorded
+    bool pending = false;  // Ended, waiting for results
+};
+constexpr int kGpuQueryFrames = 4;
+GpuFrameQueries g_GpuQueries[kGpuQueryFrames];
+int g_GpuQueryFrame = 0;
 
-    hr = D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, createDeviceFlags,
-        featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
-        &g_D3DDevice, &featureLevel, &g_D3DContext);
+// Capture-to-present latency. A present showing a newly captured image is
+// remembered by its present count and resolved once the swap chain's frame
+// statistics report the vblank it was displayed at.
+struct PendingLatency {
+    UINT presentCount;
+    LONGLONG captureTime;  // QPC time the captured image was presented to the desktop
+};
+std::vector<PendingLatency> g_PendingLatency;
+LONGLONG g_ShownCaptureTime = 0;     // Capture time of the image currently bound
+LONGLONG g_MeasuredCaptureTime = 0;  // Last capture time queued for measurement
+LONGLONG g_LastPresentQpc = 0;
 
-    if (FAILED(hr))
+// Stats overlay, drawn with Direct2D onto the back buffer before Present.
+ComPtr<ID2D1Factory1>        g_D2DFactory;
+ComPtr<ID2D1DeviceContext>   g_D2DContext;
+ComPtr<ID2D1Bitmap1>         g_OverlayTarget;
+ComPtr<IDWriteFactory>       g_DWriteFactory;
+ComPtr<IDWriteTextFormat>    g_OverlayTextFormat;
+ComPtr<ID2D1SolidColorBrush> g_OverlayTextBrush;
+ComPtr<ID2D1SolidColorBrush> g_OverlayBackgroundBrush;
+std::wstring g_OverlayText;
+std::ofstream g_StatsCsv;
+
+// Create the timestamp and disjoint queries used for GPU timing.
+bool CreateGpuQueries()
+{
+    D3D11_QUERY_DESC disjointDesc = { D3D11_QUERY_TIMESTAMP_DISJOINT, 0 };
+    D3D11_QUERY_DESC timestampDesc = { D3D11_QUERY_TIMESTAMP, 0 };
+    for (GpuFrameQueries& queries : g_GpuQueries)
     {
-        if (createDeviceFlags & D3D11_CREATE_DEVICE_DEBUG)
-        {
-            createDeviceFlags &= ~D3D11_CREATE_DEVICE_DEBUG;
-            hr = D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, createDeviceFlags,
-                featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
-                &g_D3DDevice, &featureLevel, &g_D3DContext);
-        }
+        HRESULT hr = g_D3DDevice->CreateQuery(&disjointDesc, &queries.disjoint);
+        for (int i = 0; SUCCEEDED(hr) && i < 2 * GpuFrameQueries::kSegmentCount; i++)
+            hr = g_D3DDevice->CreateQuery(&timestampDesc, &queries.timestamps[i]);
         if (FAILED(hr))
         {
-            hr = D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_WARP, nullptr, createDeviceFlags,
-                featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
-                &g_D3DDevice, &featureLevel, &g_D3DContext);
-            if (FAILED(hr))
-            {
-                std::cerr << "D3D11CreateDevice failed with all attempts: " << HrToString(hr) << std::endl;
-                CoUninitialize();
-                return false;
-            }
+            std::cerr << "Create GPU timing queries failed: " << HrToString(hr) << std::endl;
+            return false;
         }
     }
+    return true;
+}
 
-    ComPtr<IDXGIDevice1> dxgiDevice1;
-    hr = g_D3DDevice.As(&dxgiDevice1);
-    if (SUCCEEDED(hr))
+// Read back a finished frame's timestamps if the GPU has produced them.
+// Returns false while the results are still outstanding.
+bool ReadGpuFrame(GpuFrameQueries& queries)
+{
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+    if (g_D3DContext->GetData(queries.disjoint.Get(), &disjoint, sizeof(disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+        return false;
+    queries.pending = false;
+    if (disjoint.Disjoint)
+        return true;
+    for (int i = 0; i < GpuFrameQueries::kSegmentCount; i++)
     {
-        dxgiDevice1->SetMaximumFrameLatency(1);
+        UINT64 begin = 0, end = 0;
+        if (!queries.used[i] ||
+            g_D3DContext->GetData(queries.timestamps[2 * i].Get(), &begin, sizeof(begin), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK ||
+            g_D3DContext->GetData(queries.timestamps[2 * i + 1].Get(), &end, sizeof(end), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+            continue;
+        RecordStat(static_cast<Stat>(static_cast<int>(Stat::GpuCopy) + i),
+            static_cast<double>(end - begin) * 1e6 / static_cast<double>(disjoint.Frequency));
     }
+    return true;
+}
 
-    ComPtr<IDXGIDevice> dxgiDevice;
-    hr = g_D3DDevice.As(&dxgiDevice);
+// Start timing a GPU segment of the current frame. A frame whose queries are
+// still in flight from an earlier round is not timed.
+void BeginGpuSegment(GpuSegment segment)
+{
+    GpuFrameQueries& queries = g_GpuQueries[g_GpuQueryFrame];
+    if (!g_Options.collectStats || !queries.disjoint)
+        return;
+    if (queries.pending && !ReadGpuFrame(queries))
+        return;
+    if (!queries.open)
+    {
+        g_D3DContext->Begin(queries.disjoint.Get());
+        std::fill(std::begin(queries.used), std::end(queries.used), false);
+        queries.open = true;
+    }
+    int index = static_cast<int>(segment);
+    g_D3DContext->End(queries.timestamps[2 * index].Get());
+    queries.used[index] = true;
+}
+
+// Finish timing a GPU segment started with BeginGpuSegment().
+void EndGpuSegment(GpuSegment segment)
+{
+    GpuFrameQueries& queries = g_GpuQueries[g_GpuQueryFrame];
+    int index = static_cast<int>(segment);
+    if (queries.open && queries.used[index])
+        g_D3DContext->End(queries.timestamps[2 * index + 1].Get());
+}
+
+// Close the current frame's disjoint query, if any segment was timed, and
+// collect whatever earlier frames have finished.
+void EndGpuFrame()
+{
+    GpuFrameQueries& queries = g_GpuQueries[g_GpuQueryFrame];
+    if (queries.open)
+    {
+        g_D3DContext->End(queries.disjoint.Get());
+        queries.open = false;
+        queries.pending = true;
+        g_GpuQueryFrame = (g_GpuQueryFrame + 1) % kGpuQueryFrames;
+    }
+    for (GpuFrameQueries& frame : g_GpuQueries)
+    {
+        if (frame.pending)
+            ReadGpuFrame(frame);
+    }
+}
+
+// Called after each Present: record the present interval and missed
+// deadlines, queue a latency sample when a newly captured image went out,
+// and resolve queued samples against the swap chain's frame statistics.
+void TrackPresentLatency()
+{
+    if (!g_Options.collectStats)
+        return;
+    LONGLONG now = QpcNow();
+    if (g_LastPresentQpc)
+    {
+        double interval = QpcToMicroseconds(now - g_LastPresentQpc);
+        RecordStat(Stat::PresentInterval, interval);
+        // While the zoom animates every frame slot is drawn, so a gap of
+        // more than one and a half slots is a missed deadline; the sample is
+        // how late the frame was.
+        double hz = g_Options.pacing == PacingPolicy::CappedFps ? g_Options.cappedFps : g_RefreshRate.load();
+        double period = 1e6 / hz;
+        if (g_CurrentZoom != g_TargetZoom && interval > 1.5 * period)
+            RecordStat(Stat::MissedFrame, interval - period);
+    }
+    g_LastPresentQpc = now;
+
+    UINT presentCount = 0;
+    if (g_ShownCaptureTime && g_ShownCaptureTime != g_MeasuredCaptureTime &&
+        SUCCEEDED(g_SwapChain->GetLastPresentCount(&presentCount)))
+    {
+        if (g_PendingLatency.size() >= 8)
+            g_PendingLatency.erase(g_PendingLatency.begin());
+        g_PendingLatency.push_back({ presentCount, g_ShownCaptureTime });
+        g_MeasuredCaptureTime = g_ShownCaptureTime;
+    }
+
+    DXGI_FRAME_STATISTICS frameStats = {};
+    if (g_PendingLatency.empty() || FAILED(g_SwapChain->GetFrameStatistics(&frameStats)))
+        return;
+    size_t kept = 0;
+    for (const PendingLatency& pending : g_PendingLatency)
+    {
+        // Presents already passed without a matching sample are dropped.
+        if (pending.presentCount == frameStats.PresentCount)
+            RecordStat(Stat::Latency, QpcToMicroseconds(frameStats.SyncQPCTime.QuadPart - pending.captureTime));
+        else if (pending.presentCount > frameStats.PresentCount)
+            g_PendingLatency[kept++] = pending;
+    }
+    g_PendingLatency.resize(kept);
+}
+
+// Create the Direct2D and DirectWrite objects for the stats overlay. The
+// device must have been created with D3D11_CREATE_DEVICE_BGRA_SUPPORT.
+bool CreateStatsOverlay()
+{
+    D2D1_FACTORY_OPTIONS options = {};
+    HRESULT hr = D2D1CreateFactory(D2D1_FACTORY_TYPE_MULTI_THREADED, __uuidof(ID2D1Factory1), &options,
+        reinterpret_cast<void**>(g_D2DFactory.GetAddressOf()));
     if (FAILED(hr))
     {
-        std::cerr << "Query IDXGIDevice failed: " << HrToString(hr) << std::endl;
-        CoUninitialize();
+        std::cerr << "Failed to create Direct2D factory: " << HrToString(hr) << std::endl;
         return false;
     }
-    ComPtr<IDXGIAdapter> tempAdapter;
-    hr = dxgiDevice->GetAdapter(&tempAdapter);
+    ComPtr<IDXGIDevice> dxgiDevice;
+    ComPtr<ID2D1Device> d2dDevice;
+    hr = g_D3DDevice.As(&dxgiDevice);
+    if (SUCCEEDED(hr))
+        hr = g_D2DFactory->CreateDevice(dxgiDevice.Get(), &d2dDevice);
+    if (SUCCEEDED(hr))
+        hr = d2dDevice->CreateDeviceContext(D2D1_DEVICE_CONTEXT_OPTIONS_NONE, &g_D2DContext);
     if (FAILED(hr))
     {
-        std::cerr << "GetAdapter failed: " << HrToString(hr) << std::endl;
-        CoUninitialize();
+        std::cerr << "Failed to create Direct2D device context: " << HrToString(hr) << std::endl;
         return false;
     }
-    ComPtr<IDXGIAdapter1> dxgiAdapter;
-    hr = tempAdapter.As(&dxgiAdapter);
+    hr = DWriteCreateFactory(DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory),
+        reinterpret_cast<IUnknown**>(g_DWriteFactory.GetAddressOf()));
+    if (SUCCEEDED(hr))
+        hr = g_DWriteFactory->CreateTextFormat(L"Consolas", nullptr, DWRITE_FONT_WEIGHT_NORMAL, DWRITE_FONT_STYLE_NORMAL,
+            DWRITE_FONT_STRETCH_NORMAL, 14.0f, L"en-us", &g_OverlayTextFormat);
+    if (SUCCEEDED(hr))
+        hr = g_D2DContext->CreateSolidColorBrush(D2D1::ColorF(D2D1::ColorF::White), &g_OverlayTextBrush);
+    if (SUCCEEDED(hr))
+        hr = g_D2DContext->CreateSolidColorBrush(D2D1::ColorF(0.0f, 0.0f, 0.0f, 0.6f), &g_OverlayBackgroundBrush);
     if (FAILED(hr))
     {
-        std::cerr << "Query IDXGIAdapter1 failed: " << HrToString(hr) << std::endl;
-        CoUninitialize();
+        std::cerr << "Failed to create stats overlay resources: " << HrToString(hr) << std::endl;
+        g_D2DContext.Reset();
         return false;
     }
+    return true;
+}
 
-    ComPtr<IDXGIFactory2> dxgiFactory;
-    hr = dxgiAdapter->GetParent(IID_PPV_ARGS(&dxgiFactory));
-    if (FAILED(hr))
+// Drop the overlay's reference to the back buffer; needed before ResizeBuffers.
+void ReleaseOverlayTarget()
+{
+    if (g_D2DContext)
+        g_D2DContext->SetTarget(nullptr);
+    g_OverlayTarget.Reset();
+}
+
+// Draw the latest stats summary in the top-left corner of the back buffer.
+void DrawStatsOverlay()
+{
+    if (!g_D2DContext || g_OverlayText.empty())
+        return;
+    if (!g_OverlayTarget)
     {
-        std::cerr << "GetParent for IDXGIFactory2 failed: " << HrToString(hr) << std::endl;
-        CoUninitialize();
-        return false;
+        // Buffer 0 of a flip-model swap chain always names the current back
+        // buffer, so the bitmap is only recreated after a resize. Direct2D
+        // cannot draw to a 10-bit back buffer, which ends the overlay.
+        ComPtr<IDXGISurface> surface;
+        HRESULT hr = g_SwapChain->GetBuffer(0, IID_PPV_ARGS(&surface));
+        D2D1_BITMAP_PROPERTIES1 properties = D2D1::BitmapProperties1(
+            D2D1_BITMAP_OPTIONS_TARGET | D2D1_BITMAP_OPTIONS_CANNOT_DRAW,
+            D2D1::PixelFormat(g_BackBufferFormat, D2D1_ALPHA_MODE_PREMULTIPLIED));
+        if (SUCCEEDED(hr))
+            hr = g_D2DContext->CreateBitmapFromDxgiSurface(surface.Get(), &properties, &g_OverlayTarget);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to create stats overlay target: " << HrToString(hr) << std::endl;
+            g_D2DContext.Reset();
+            return;
+        }
+        g_D2DContext->SetTarget(g_OverlayTarget.Get());
+    }
+    float lines = static_cast<float>(std::count(g_OverlayText.begin(), g_OverlayText.end(), L'\n'));
+    D2D1_RECT_F box = D2D1::RectF(8.0f, 8.0f, 440.0f, 8.0f + 18.0f * lines);
+    g_D2DContext->BeginDraw();
+    g_D2DContext->FillRectangle(box, g_OverlayBackgroundBrush.Get());
+    box.left += 8.0f;
+    box.top += 6.0f;
+    g_D2DContext->DrawText(g_OverlayText.c_str(), static_cast<UINT32>(g_OverlayText.size()),
+        g_OverlayTextFormat.Get(), box, g_OverlayTextBrush.Get());
+    g_D2DContext->EndDraw();
+}
+
+// Once a second, summarize the histograms into the overlay text, the CSV
+// file and ETW, then reset them so each summary covers the last second.
+void UpdateStatsReport()
+{
+    if (!g_Options.collectStats)
+        return;
+    static LONGLONG startTime = QpcNow();
+    static LONGLONG lastReport = startTime;
+    LONGLONG now = QpcNow();
+    if (QpcToMicroseconds(now - lastReport) < 1e6)
+        return;
+    lastReport = now;
+    double elapsedSeconds = QpcToMicroseconds(now - startTime) / 1e6;
+
+    std::wstring text = L"metric            count    p50 ms   p99 ms\n";
+    for (int i = 0; i < static_cast<int>(Stat::Count); i++)
+    {
+        TimingHistogram& histogram = g_Stats[i];
+        uint32_t count = histogram.count.load(std::memory_order_relaxed);
+        double p50 = histogram.Percentile(50.0);
+        double p99 = histogram.Percentile(99.0);
+        wchar_t line[96];
+        swprintf_s(line, L"%-16hs %6u %9.3f %8.3f\n", kStatNames[i], count, p50 / 1000.0, p99 / 1000.0);
+        text += line;
+        if (g_StatsCsv.is_open())
+            g_StatsCsv << elapsedSeconds << ',' << kStatNames[i] << ',' << count << ',' << p50 << ',' << p99 << '\n';
+        TraceLoggingWrite(g_TraceProvider, "FrameStats",
+            TraceLoggingString(kStatNames[i], "Metric"),
+            TraceLoggingUInt32(count, "Count"),
+            TraceLoggingFloat64(p50, "P50Microseconds"),
+            TraceLoggingFloat64(p99, "P99Microseconds"));
+        histogram.Reset();
     }
 
-    ComPtr<IDXGIFactory6> dxgiFactory6;
-    hr = dxgiFactory.As(&dxgiFactory6);
-    if (SUCCEEDED(hr))
+    // Video memory: the adapter usage and budget, then the tracked
+    // allocations by purpose. CSV rows carry bytes in the count column.
+    wchar_t line[96];
+    swprintf_s(line, L"vram %llu of %llu MB, %hs\n", static_cast<unsigned long long>(g_VideoMemory.CurrentUsage >> 20),
+        static_cast<unsigned long long>(MemoryBudget() >> 20), kMemoryLevelNames[static_cast<int>(g_MemoryLevel)]);
+    text += line;
+    for (int i = 0; i < static_cast<int>(GpuMemoryUse::Count); i++)
+    {
+        int64_t bytes = g_GpuMemory[i].load(std::memory_order_relaxed);
+        if (bytes == 0)
+            continue;
+        swprintf_s(line, L"  %-14hs %8.1f MB\n", kGpuMemoryUseNames[i], bytes / 1048576.0);
+        text += line;
+        if (g_StatsCsv.is_open())
+            g_StatsCsv << elapsedSeconds << ",vram-" << kGpuMemoryUseNames[i] << ',' << bytes << ",,\n";
+    }
+    if (g_StatsCsv.is_open())
     {
-        std::cout << "Using DXGI 1.6 for better compatibility" << std::endl;
+        g_StatsCsv << elapsedSeconds << ",vram-usage," << g_VideoMemory.CurrentUsage << ",,\n";
+        g_StatsCsv << elapsedSeconds << ",vram-budget," << MemoryBudget() << ",,\n";
     }
+    TraceLoggingWrite(g_TraceProvider, "VideoMemory",
+        TraceLoggingUInt64(g_VideoMemory.CurrentUsage, "UsageBytes"),
+        TraceLoggingUInt64(MemoryBudget(), "BudgetBytes"),
+        TraceLoggingInt64(g_GpuMemory[static_cast<int>(GpuMemoryUse::FrameRing)].load(), "FrameRingBytes"),
+        TraceLoggingString(kMemoryLevelNames[static_cast<int>(g_MemoryLevel)], "Level"));
 
-    std::vector<ComPtr<IDXGIAdapter1>> adapters;
-    ComPtr<IDXGIAdapter1> currentAdapter;
-    for (UINT i = 0; dxgiFactory->EnumAdapters1(i, &currentAdapter) != DXGI_ERROR_NOT_FOUND; i++)
+    if (g_StatsCsv.is_open())
+        g_StatsCsv.flush();
+    if (g_Options.statsOverlay)
     {
-        adapters.push_back(currentAdapter);
-        currentAdapter = nullptr;
+        g_OverlayText = text;
+        g_NeedsRedraw = true;
     }
-    if (adapters.empty())
+}
+
+// Scheduling profile, on unless --no-realtime. The render and capture
+// threads join MMCSS tasks, which keep them scheduled ahead of ordinary
+// work when the machine is loaded; the hook thread runs time-critical so
+// Windows does not time the low-level hooks out.
+HANDLE EnterMmcssTask(const wchar_t* task)
+{
+    if (!g_Options.realtime)
+        return nullptr;
+    DWORD taskIndex = 0;
+    HANDLE handle = AvSetMmThreadCharacteristicsW(task, &taskIndex);
+    if (!handle)
+        std::wcout << L"MMCSS registration as " << task << L" failed: " << GetLastError() << std::endl;
+    return handle;
+}
+
+void LeaveMmcssTask(HANDLE handle)
+{
+    if (handle)
+        AvRevertMmThreadCharacteristics(handle);
+}
+
+// Cores an affinity mask can name: 64 on x64, 32 on Win32.
+constexpr int kMaxAffinityCores = static_cast<int>(sizeof(DWORD_PTR) * 8);
+
+// Pin the calling thread to a core chosen with --cores.
+void PinThreadToCore(int core)
+{
+    if (core < 0 || core >= kMaxAffinityCores)
+        return;
+    if (!SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << core))
+        std::cout << "Failed to pin a thread to core " << core << ": " << GetLastError() << std::endl;
+}
+
+// Hold 1 ms timer resolution while the zoom is in use, for precise sleeps
+// and pacing waits, and give it back when idle so it costs no power.
+void SetFineTimerResolution(bool fine)
+{
+    static bool held = false;
+    if (fine == held || (fine && !g_Options.realtime))
+        return;
+    held = fine;
+    if (fine)
+        timeBeginPeriod(1);
+    else
+        timeEndPeriod(1);
+}
+
+// Queue an input event stamped with the current time and wake the render
+// thread. Called from the hook procedures with the event's own time stamp,
+// in GetTickCount() milliseconds, to record how late the hook ran.
+void PostInputEvent(InputEventType type, DWORD tickTime)
+{
+    RecordStat(Stat::HookDelay, (GetTickCount() - tickTime) * 1000.0);
+    // The hooks run under a system timeout, so a full queue is only
+    // counted here and reported by DrainInputEvents().
+    if (!g_InputQueue.Push({ type, QpcNow() }))
+        g_DroppedInputEvents.fetch_add(1, std::memory_order_relaxed);
+    SetEvent(g_WakeEvent);
+}
+
+// Global low-level keyboard hook to detect Shift+Esc (exit), Numpad 8 (toggle window),
+// Numpad 9/7 (filter selection) and Numpad +/- (zoom level)
+LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam)
+{
+    if (nCode == HC_ACTION)
     {
-        std::cerr << "No adapters found!" << std::endl;
-        CoUninitialize();
+        KBDLLHOOKSTRUCT* pKeyboard = reinterpret_cast<KBDLLHOOKSTRUCT*>(lParam);
+        if (wParam == WM_KEYDOWN)
+        {
+            // Exit when Shift+Esc is pressed.
+            if (pKeyboard->vkCode == VK_ESCAPE && (GetAsyncKeyState(VK_SHIFT) & 0x8000))
+            {
+                g_Running = false;
+                SetEvent(g_WakeEvent);
+                PostQuitMessage(0);  // Exit hook thread's message loop immediately
+            }
+            // Toggle window visibility when Numpad 8 is pressed (only on non-repeat).
+            else if (pKeyboard->vkCode == VK_NUMPAD8)
+            {
+                if (!(pKeyboard->flags & 0x40000000))
+                    PostInputEvent(InputEventType::ToggleWindow, pKeyboard->time);
+            }
+            // Numpad 9 selects the next filter, Numpad 7 toggles sharpening.
+            else if (pKeyboard->vkCode == VK_NUMPAD9 || pKeyboard->vkCode == VK_NUMPAD7)
+            {
+                if (!(pKeyboard->flags & 0x40000000))
+                    PostInputEvent(pKeyboard->vkCode == VK_NUMPAD9 ? InputEventType::CycleFilter : InputEventType::ToggleSharpen,
+                        pKeyboard->time);
+            }
+            // Numpad 6 toggles inversion, Numpad 4 selects the next colour filter.
+            else if (pKeyboard->vkCode == VK_NUMPAD6 || pKeyboard->vkCode == VK_NUMPAD4)
+            {
+                if (!(pKeyboard->flags & 0x40000000))
+                    PostInputEvent(pKeyboard->vkCode == VK_NUMPAD6 ? InputEventType::ToggleInvert : InputEventType::CycleColorFilter,
+                        pKeyboard->time);
+            }
+            // Numpad + and - step through the zoom levels.
+            else if (pKeyboard->vkCode == VK_ADD || pKeyboard->vkCode == VK_SUBTRACT)
+            {
+                if (!(pKeyboard->flags & 0x40000000))
+                    PostInputEvent(pKeyboard->vkCode == VK_ADD ? InputEventType::NextZoomLevel : InputEventType::PreviousZoomLevel,
+                        pKeyboard->time);
+            }
+        }
+    }
+    return CallNextHookEx(nullptr, nCode, wParam, lParam);
+}
+
+// Low-level mouse hook procedure: queues right button presses and releases,
+// which drive the zoom, and wakes the render loop for each of them.
+LRESULT CALLBACK LowLevelMouseProc(int nCode, WPARAM wParam, LPARAM lParam)
+{
+    if (nCode == HC_ACTION)
+    {
+        const MSLLHOOKSTRUCT* pMouse = reinterpret_cast<const MSLLHOOKSTRUCT*>(lParam);
+        if (wParam == WM_RBUTTONDOWN)
+            PostInputEvent(InputEventType::RightButtonDown, pMouse->time);
+        else if (wParam == WM_RBUTTONUP)
+            PostInputEvent(InputEventType::RightButtonUp, pMouse->time);
+    }
+    return CallNextHookEx(nullptr, nCode, wParam, lParam);
+}
+
+// Thread function to install the keyboard and mouse hooks and run a message loop.
+DWORD WINAPI KeyboardHookThread(LPVOID lpParam)
+{
+    if (g_Options.realtime)
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    HHOOK hook = SetWindowsHookEx(WH_KEYBOARD_LL, LowLevelKeyboardProc, GetModuleHandle(nullptr), 0);
+    if (!hook)
+    {
+        std::cerr << "Failed to install keyboard hook." << std::endl;
+        return 1;
+    }
+    // Without the mouse hook standby is only left through the keyboard.
+    HHOOK mouseHook = SetWindowsHookEx(WH_MOUSE_LL, LowLevelMouseProc, GetModuleHandle(nullptr), 0);
+    if (!mouseHook)
+        std::cerr << "Failed to install mouse hook." << std::endl;
+    MSG msg;
+    while (GetMessage(&msg, nullptr, 0, 0) && g_Running)
+    {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+    if (mouseHook)
+        UnhookWindowsHookEx(mouseHook);
+    UnhookWindowsHookEx(hook);
+    return 0;
+}
+
+// Record a framebuffer size change; the swap chain is resized from the frame loop.
+void FramebufferSizeCallback(GLFWwindow* window, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    g_PendingWidth = width;
+    g_PendingHeight = height;
+    g_ResizeRequest = true;
+}
+
+// Initialize GLFW window with fullscreen, borderless, and click-through settings.
+// The window is hidden immediately after creation.
+bool InitializeGLFW() {
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
         return false;
     }
-    ComPtr<IDXGIOutput> dxgiOutput;
-    ComPtr<IDXGIOutput6> dxgiOutput6;
-    for (const auto& adapter : adapters)
+    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+    g_ScreenWidth = mode->width;
+    g_ScreenHeight = mode->height;
+    if (g_Options.lensWidth)
     {
-        DXGI_ADAPTER_DESC1 adapterDesc;
-        adapter->GetDesc1(&adapterDesc);
-        std::wcout << L"Trying adapter: " << adapterDesc.Description << std::endl;
-        for (UINT i = 0; adapter->EnumOutputs(i, &dxgiOutput) != DXGI_ERROR_NOT_FOUND; i++)
+        g_ScreenWidth = g_Options.lensWidth;
+        g_ScreenHeight = g_Options.lensHeight;
+    }
+
+    glfwWindowHint(GLFW_TRANSPARENT_FRAMEBUFFER, GLFW_TRUE);
+    glfwWindowHint(GLFW_DECORATED, GLFW_FALSE);
+    glfwWindowHint(GLFW_FOCUSED, GLFW_FALSE);
+    glfwWindowHint(GLFW_FLOATING, GLFW_TRUE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+
+    g_Window = glfwCreateWindow(g_ScreenWidth, g_ScreenHeight, "Screen Magnifier", nullptr, nullptr);
+    if (!g_Window) {
+        std::cerr << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    // Setup window as click-through. The layered style is what makes hit
+    // testing pass through; with the composition backend nothing is drawn
+    // into the layered surface itself.
+    HWND hwnd = glfwGetWin32Window(g_Window);
+    if (!hwnd) {
+        std::cerr << "Failed to get native window handle" << std::endl;
+        return false;
+    }
+    LONG exStyle = GetWindowLong(hwnd, GWL_EXSTYLE);
+    SetWindowLong(hwnd, GWL_EXSTYLE, exStyle | WS_EX_LAYERED | WS_EX_TRANSPARENT | WS_EX_TOPMOST | WS_EX_TOOLWINDOW);
+    SetLayeredWindowAttributes(hwnd, 0, 255, LWA_ALPHA);
+    SetWindowPos(hwnd, HWND_TOPMOST, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
+    glfwSetFramebufferSizeCallback(g_Window, FramebufferSizeCallback);
+
+    // Hide the window initially.
+    glfwHideWindow(g_Window);
+    return true;
+}
+
+// Records the presented image to a fragmented MP4 with a hardware H.264 or
+// HEVC encoder. The back buffer is converted to NV12 by the D3D11 video
+// processor into textures from a Media Foundation sample pool, and the
+// encoder reads them on the same device through an IMFDXGIDeviceManager, so
+// no pixels come back to the CPU. The render thread never waits on the
+// encoder: when every pooled texture is still queued the frame is dropped.
+class Recorder {
+public:
+    ~Recorder() { Stop(); }
+
+    // Open the file and the encoder at the current window size.
+    bool Start(const std::wstring& path)
+    {
+        HRESULT hr = MFStartup(MF_VERSION, MFSTARTUP_LITE);
+        if (FAILED(hr))
+        {
+            std::cerr << "Media Foundation startup failed: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        m_started = true;
+
+        // Encoders take even dimensions.
+        m_width = static_cast<UINT>(g_ScreenWidth) & ~1u;
+        m_height = static_cast<UINT>(g_ScreenHeight) & ~1u;
+        double fps = g_Options.pacing == PacingPolicy::CappedFps ? g_Options.cappedFps : g_RefreshRate.load();
+        UINT frameRate = std::max(1u, static_cast<UINT>(std::lround(fps)));
+        UINT bitrate = g_Options.recordBitrateMbps > 0 ? g_Options.recordBitrateMbps * 1000000u :
+            static_cast<UINT>(std::min(100e6, 0.1 * m_width * m_height * frameRate));
+
+        hr = MFCreateDXGIDeviceManager(&m_resetToken, &m_deviceManager);
+        if (SUCCEEDED(hr))
+            hr = m_deviceManager->ResetDevice(g_D3DDevice.Get(), m_resetToken);
+        ComPtr<IMFAttributes> attributes;
+        if (SUCCEEDED(hr))
+            hr = MFCreateAttributes(&attributes, 5);
+        if (SUCCEEDED(hr))
+        {
+            attributes->SetUINT32(MF_READWRITE_ENABLE_HARDWARE_TRANSFORMS, TRUE);
+            attributes->SetUnknown(MF_SINK_WRITER_D3D_MANAGER, m_deviceManager.Get());
+            attributes->SetGUID(MF_TRANSCODE_CONTAINERTYPE, MFTranscodeContainerType_FMPEG4);
+            attributes->SetUINT32(MF_SINK_WRITER_DISABLE_THROTTLING, TRUE);
+            attributes->SetUINT32(MF_LOW_LATENCY, TRUE);
+            hr = MFCreateSinkWriterFromURL(path.c_str(), nullptr, attributes.Get(), &m_writer);
+        }
+        ComPtr<IMFMediaType> outputType;
+        if (SUCCEEDED(hr))
+            hr = CreateVideoType(g_Options.recordCodec == VideoCodec::Hevc ? MFVideoFormat_HEVC : MFVideoFormat_H264, frameRate, outputType);
+        if (SUCCEEDED(hr))
+        {
+            outputType->SetUINT32(MF_MT_AVG_BITRATE, bitrate);
+            hr = m_writer->AddStream(outputType.Get(), &m_stream);
+        }
+        ComPtr<IMFMediaType> inputType;
+        if (SUCCEEDED(hr))
+            hr = CreateVideoType(MFVideoFormat_NV12, frameRate, inputType);
+        if (SUCCEEDED(hr))
+            hr = m_writer->SetInputMediaType(m_stream, inputType.Get(), nullptr);
+        if (SUCCEEDED(hr))
+            hr = CreateSamplePool(inputType.Get());
+        if (SUCCEEDED(hr))
+            hr = m_writer->BeginWriting();
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to start recording: " << HrToString(hr) << std::endl;
+            Stop();
+            return false;
+        }
+        m_startTime = QpcNow();
+        std::wcout << L"Recording " << m_width << L"x" << m_height << L" to " << path << L"." << std::endl;
+        return true;
+    }
+
+    // Convert the back buffer, as drawn for this frame, and queue it for the
+    // encoder.
+    void AddFrame(ID3D11RenderTargetView* backBufferView)
+    {
+        if (!m_writer)
+            return;
+        CpuTimer timer(Stat::Encode);
+        if (!m_inputView && !CreateProcessor(backBufferView))
+        {
+            Stop();
+            return;
+        }
+
+        ComPtr<IMFSample> sample;
+        HRESULT hr = m_allocator->AllocateSample(&sample);
+        if (hr == MF_E_SAMPLEALLOCATOR_EMPTY)
+        {
+            m_droppedFrames++;
+            return;
+        }
+        ID3D11VideoProcessorOutputView* outputView = nullptr;
+        if (SUCCEEDED(hr))
+            hr = GetOutputView(sample.Get(), outputView);
+        if (SUCCEEDED(hr))
+        {
+            D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+            stream.Enable = TRUE;
+            stream.pInputSurface = m_inputView.Get();
+            hr = m_videoContext->VideoProcessorBlt(m_processor.Get(), outputView, 0, 1, &stream);
+        }
+        if (SUCCEEDED(hr))
+        {
+            // Media Foundation times are in 100 ns units.
+            LONGLONG time = static_cast<LONGLONG>(QpcToMicroseconds(QpcNow() - m_startTime) * 10.0);
+            sample->SetSampleTime(time);
+            sample->SetSampleDuration(static_cast<LONGLONG>(1e7 / g_RefreshRate.load()));
+            hr = m_writer->WriteSample(m_stream, sample.Get());
+        }
+        if (FAILED(hr))
+        {
+            std::cerr << "Recording stopped: " << HrToString(hr) << std::endl;
+            Stop();
+            return;
+        }
+        m_frames++;
+    }
+
+    // Drop the views of the back buffer so the swap chain can resize it; the
+    // processor is rebuilt for the new buffer on the next frame.
+    void ReleaseSource()
+    {
+        m_inputView.Reset();
+        m_processor.Reset();
+        m_enumerator.Reset();
+    }
+
+    // Finish the file. Safe to call more than once.
+    void Stop()
+    {
+        if (m_writer)
+        {
+            HRESULT hr = m_writer->Finalize();
+            if (FAILED(hr))
+                std::cerr << "Failed to finish the recording: " << HrToString(hr) << std::endl;
+            else
+                std::cout << "Recorded " << m_frames << " frames; " << m_droppedFrames << " dropped while the encoder was busy." << std::endl;
+        }
+        ReleaseSource();
+        m_outputViews.clear();
+        m_writer.Reset();
+        if (m_allocator)
+            m_allocator->UninitializeSampleAllocator();
+        m_allocator.Reset();
+        m_videoContext.Reset();
+        m_videoDevice.Reset();
+        m_deviceManager.Reset();
+        if (m_started)
+            MFShutdown();
+        m_started = false;
+    }
+
+private:
+    HRESULT CreateVideoType(const GUID& subtype, UINT frameRate, ComPtr<IMFMediaType>& type)
+    {
+        HRESULT hr = MFCreateMediaType(&type);
+        if (FAILED(hr))
+            return hr;
+        type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        type->SetGUID(MF_MT_SUBTYPE, subtype);
+        type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+        MFSetAttributeSize(type.Get(), MF_MT_FRAME_SIZE, m_width, m_height);
+        MFSetAttributeRatio(type.Get(), MF_MT_FRAME_RATE, frameRate, 1);
+        MFSetAttributeRatio(type.Get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+        return S_OK;
+    }
+
+    // NV12 textures the video processor can write and the encoder can read.
+    HRESULT CreateSamplePool(IMFMediaType* inputType)
+    {
+        HRESULT hr = g_D3DDevice.As(&m_videoDevice);
+        if (SUCCEEDED(hr))
+            hr = g_D3DContext.As(&m_videoContext);
+        if (FAILED(hr))
+            return hr;
+        hr = MFCreateVideoSampleAllocatorEx(IID_PPV_ARGS(&m_allocator));
+        if (SUCCEEDED(hr))
+            hr = m_allocator->SetDirectXManager(m_deviceManager.Get());
+        ComPtr<IMFAttributes> attributes;
+        if (SUCCEEDED(hr))
+            hr = MFCreateAttributes(&attributes, 2);
+        if (SUCCEEDED(hr))
+        {
+            attributes->SetUINT32(MF_SA_D3D11_BINDFLAGS, D3D11_BIND_RENDER_TARGET | D3D11_BIND_VIDEO_ENCODER);
+            attributes->SetUINT32(MF_SA_D3D11_USAGE, D3D11_USAGE_DEFAULT);
+            hr = m_allocator->InitializeSampleAllocatorEx(kPoolMinimum, kPoolMaximum, attributes.Get(), inputType);
+        }
+        return hr;
+    }
+
+    // Build the processor for the current back buffer: its size and format
+    // in, the recording size in NV12 out, with the colour space conversion
+    // the back buffer needs.
+    bool CreateProcessor(ID3D11RenderTargetView* backBufferView)
+    {
+        ComPtr<ID3D11Resource> resource;
+        backBufferView->GetResource(&resource);
+        ComPtr<ID3D11Texture2D> backBuffer;
+        HRESULT hr = resource.As(&backBuffer);
+        D3D11_TEXTURE2D_DESC desc = {};
+        if (SUCCEEDED(hr))
+        {
+            backBuffer->GetDesc(&desc);
+            D3D11_VIDEO_PROCESSOR_CONTENT_DESC contentDesc = {};
+            contentDesc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+            contentDesc.InputWidth = desc.Width;
+            contentDesc.InputHeight = desc.Height;
+            contentDesc.OutputWidth = m_width;
+            contentDesc.OutputHeight = m_height;
+            contentDesc.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+            hr = m_videoDevice->CreateVideoProcessorEnumerator(&contentDesc, &m_enumerator);
+        }
+        UINT support = 0;
+        if (SUCCEEDED(hr))
+            hr = m_enumerator->CheckVideoProcessorFormat(desc.Format, &support);
+        if (SUCCEEDED(hr) && !(support & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_INPUT))
+            hr = DXGI_ERROR_UNSUPPORTED;
+        if (SUCCEEDED(hr))
+            hr = m_videoDevice->CreateVideoProcessor(m_enumerator.Get(), 0, &m_processor);
+        if (SUCCEEDED(hr))
+        {
+            D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC viewDesc = {};
+            viewDesc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+            hr = m_videoDevice->CreateVideoProcessorInputView(backBuffer.Get(), m_enumerator.Get(), &viewDesc, &m_inputView);
+        }
+        if (FAILED(hr))
+        {
+            std::cerr << "The video processor cannot read the back buffer; recording stopped: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        RECT source = { 0, 0, static_cast<LONG>(desc.Width), static_cast<LONG>(desc.Height) };
+        RECT target = { 0, 0, static_cast<LONG>(m_width), static_cast<LONG>(m_height) };
+        m_videoContext->VideoProcessorSetStreamSourceRect(m_processor.Get(), 0, TRUE, &source);
+        m_videoContext->VideoProcessorSetStreamDestRect(m_processor.Get(), 0, TRUE, &target);
+        m_videoContext->VideoProcessorSetStreamFrameFormat(m_processor.Get(), 0, D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+
+        // An scRGB back buffer is linear; the driver maps it down to the
+        // recording's SDR range.
+        ComPtr<ID3D11VideoContext1> videoContext1;
+        if (SUCCEEDED(m_videoContext.As(&videoContext1)))
+        {
+            videoContext1->VideoProcessorSetStreamColorSpace1(m_processor.Get(), 0,
+                desc.Format == DXGI_FORMAT_R16G16B16A16_FLOAT ? DXGI_COLOR_SPACE_RGB_FULL_G10_NONE_P709 : DXGI_COLOR_SPACE_RGB_FULL_G22_NONE_P709);
+            videoContext1->VideoProcessorSetOutputColorSpace1(m_processor.Get(), DXGI_COLOR_SPACE_YCBCR_STUDIO_G22_LEFT_P709);
+        }
+        else
+        {
+            D3D11_VIDEO_PROCESSOR_COLOR_SPACE input = {};
+            input.RGB_Range = 0;  // Full range
+            D3D11_VIDEO_PROCESSOR_COLOR_SPACE output = {};
+            output.YCbCr_Matrix = 1;  // BT.709
+            output.Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_16_235;
+            m_videoContext->VideoProcessorSetStreamColorSpace(m_processor.Get(), 0, &input);
+            m_videoContext->VideoProcessorSetOutputColorSpace(m_processor.Get(), &output);
+        }
+        return true;
+    }
+
+    // The pool keeps its textures for the life of the recording, so each
+    // one's output view is created once.
+    HRESULT GetOutputView(IMFSample* sample, ID3D11VideoProcessorOutputView*& view)
+    {
+        ComPtr<IMFMediaBuffer> buffer;
+        HRESULT hr = sample->GetBufferByIndex(0, &buffer);
+        ComPtr<IMFDXGIBuffer> dxgiBuffer;
+        if (SUCCEEDED(hr))
+            hr = buffer.As(&dxgiBuffer);
+        ComPtr<ID3D11Texture2D> texture;
+        UINT subresource = 0;
+        if (SUCCEEDED(hr))
+            hr = dxgiBuffer->GetResource(IID_PPV_ARGS(&texture));
+        if (SUCCEEDED(hr))
+            hr = dxgiBuffer->GetSubresourceIndex(&subresource);
+        if (FAILED(hr))
+            return hr;
+        for (const OutputView& cached : m_outputViews)
+        {
+            if (cached.texture.Get() == texture.Get() && cached.subresource == subresource)
+            {
+                view = cached.view.Get();
+                return S_OK;
+            }
+        }
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+        D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC viewDesc = {};
+        if (desc.ArraySize > 1)
+        {
+            viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2DARRAY;
+            viewDesc.Texture2DArray.FirstArraySlice = subresource;
+            viewDesc.Texture2DArray.ArraySize = 1;
+        }
+        else
+        {
+            viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+        }
+        OutputView created = { texture, subresource };
+        hr = m_videoDevice->CreateVideoProcessorOutputView(texture.Get(), m_enumerator.Get(), &viewDesc, &created.view);
+        if (FAILED(hr))
+            return hr;
+        m_outputViews.push_back(created);
+        view = created.view.Get();
+        return S_OK;
+    }
+
+    struct OutputView {
+        ComPtr<ID3D11Texture2D> texture;
+        UINT subresource;
+        ComPtr<ID3D11VideoProcessorOutputView> view;
+    };
+
+    static constexpr DWORD kPoolMinimum = 2;
+    static constexpr DWORD kPoolMaximum = 6;  // Frames the encoder may hold before new ones are dropped
+
+    bool m_started = false;
+    UINT m_width = 0;
+    UINT m_height = 0;
+    UINT m_resetToken = 0;
+    ComPtr<IMFDXGIDeviceManager> m_deviceManager;
+    ComPtr<IMFSinkWriter> m_writer;
+    DWORD m_stream = 0;
+    ComPtr<IMFVideoSampleAllocatorEx> m_allocator;
+    ComPtr<ID3D11VideoDevice> m_videoDevice;
+    ComPtr<ID3D11VideoContext> m_videoContext;
+    ComPtr<ID3D11VideoProcessorEnumerator> m_enumerator;
+    ComPtr<ID3D11VideoProcessor> m_processor;
+    ComPtr<ID3D11VideoProcessorInputView> m_inputView;
+    std::vector<OutputView> m_outputViews;
+    LONGLONG m_startTime = 0;
+    uint64_t m_frames = 0;
+    uint64_t m_droppedFrames = 0;
+};
+std::unique_ptr<Recorder> g_Recorder;
+
+// Create the render target view for the swap chain back buffer.
+// With a flip-model swap chain D3D11 only exposes buffer 0 and rotates the
+// underlying surface on Present, so one view covers every back buffer.
+bool CreateD3D11BackBufferViews()
+{
+    ComPtr<ID3D11Texture2D> backBuffer;
+    HRESULT hr = g_SwapChain->GetBuffer(0, IID_PPV_ARGS(&backBuffer));
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to get back buffer from swap chain: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    hr = g_D3DDevice->CreateRenderTargetView(backBuffer.Get(), nullptr, &g_RenderTargetView);
+    if (FAILED(hr))
+    {
+        std::cerr << "Create back buffer render target view failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    D3D11_TEXTURE2D_DESC desc = {};
+    backBuffer->GetDesc(&desc);
+    g_GpuMemory[static_cast<int>(GpuMemoryUse::SwapChain)] = kSwapChainBufferCount * TextureBytes(desc);
+    if (g_ComputeSupported)
+    {
+        hr = g_D3DDevice->CreateUnorderedAccessView(backBuffer.Get(), nullptr, &g_BackBufferUAV);
+        if (FAILED(hr))
+            std::cout << "Create back buffer UAV failed, compute filters disabled: " << HrToString(hr) << std::endl;
+    }
+    return true;
+}
+
+// Drop every reference to the back buffers, as ResizeBuffers requires.
+void ReleaseD3D11BackBufferViews()
+{
+    g_D3DContext->OMSetRenderTargets(0, nullptr, nullptr);
+    g_Bound.target = nullptr;
+    g_RenderTargetView.Reset();
+    g_BackBufferUAV.Reset();
+    ReleaseOverlayTarget();
+    if (g_Recorder)
+        g_Recorder->ReleaseSource();
+}
+
+// Tell DXGI how to read the back buffer: linear scRGB for FP16, sRGB
+// otherwise.
+void ApplySwapChainColorSpace()
+{
+    DXGI_COLOR_SPACE_TYPE colorSpace = g_BackBufferFormat == DXGI_FORMAT_R16G16B16A16_FLOAT ?
+        DXGI_COLOR_SPACE_RGB_FULL_G10_NONE_P709 : DXGI_COLOR_SPACE_RGB_FULL_G22_NONE_P709;
+    ComPtr<IDXGISwapChain3> swapChain3;
+    UINT support = 0;
+    HRESULT hr = g_SwapChain.As(&swapChain3);
+    if (SUCCEEDED(hr))
+        hr = swapChain3->CheckColorSpaceSupport(colorSpace, &support);
+    if (SUCCEEDED(hr) && !(support & DXGI_SWAP_CHAIN_COLOR_SPACE_SUPPORT_FLAG_PRESENT))
+        hr = DXGI_ERROR_UNSUPPORTED;
+    if (SUCCEEDED(hr))
+        hr = swapChain3->SetColorSpace1(colorSpace);
+    if (FAILED(hr))
+        std::cout << "Failed to set the swap chain colour space: " << HrToString(hr) << std::endl;
+}
+
+// Resize the swap chain buffers and recreate the back buffer view.
+bool ResizeSwapChain(int width, int height)
+{
+    if (width == g_ScreenWidth && height == g_ScreenHeight)
+        return true;
+
+    g_Renderer->ReleaseBackBufferViews();
+    HRESULT hr = g_SwapChain->ResizeBuffers(0, width, height, DXGI_FORMAT_UNKNOWN, g_SwapChainFlags);
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to resize swap chain: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    g_ScreenWidth = width;
+    g_ScreenHeight = height;
+    return g_Renderer->CreateBackBufferViews();
+}
+
+// Make g_SwapChain the content of a visual at the root of the window's
+// composition tree.
+HRESULT CreateCompositionTree(HWND hwnd, IDXGIDevice* dxgiDevice)
+{
+    HRESULT hr = DCompositionCreateDevice(dxgiDevice, IID_PPV_ARGS(&g_DCompDevice));
+    if (SUCCEEDED(hr))
+        hr = g_DCompDevice->CreateTargetForHwnd(hwnd, TRUE, &g_DCompTarget);
+    if (SUCCEEDED(hr))
+        hr = g_DCompDevice->CreateVisual(&g_DCompVisual);
+    if (SUCCEEDED(hr))
+        hr = g_DCompVisual->SetContent(g_SwapChain.Get());
+    if (SUCCEEDED(hr))
+        hr = g_DCompTarget->SetRoot(g_DCompVisual.Get());
+    if (SUCCEEDED(hr))
+        hr = g_DCompDevice->Commit();
+    return hr;
+}
+
+void ReleaseCompositionTree()
+{
+    g_DCompVisual.Reset();
+    g_DCompTarget.Reset();
+    g_DCompDevice.Reset();
+    g_CompositionSwapChain = false;
+}
+
+// Create the swap chain, presented through DirectComposition unless the
+// hwnd backend was chosen or composition is unavailable.
+bool CreateSwapChain()
+{
+    HWND hwnd = glfwGetWin32Window(g_Window);
+    if (!hwnd)
+    {
+        std::cerr << "Could not retrieve HWND for swap chain creation." << std::endl;
+        return false;
+    }
+    if (!SetWindowDisplayAffinity(hwnd, WDA_EXCLUDEFROMCAPTURE)) {
+        std::cerr << "Failed to set window display affinity." << std::endl;
+    }
+    DXGI_SWAP_CHAIN_DESC1 swapChainDesc = {};
+    swapChainDesc.Width = g_ScreenWidth;
+    swapChainDesc.Height = g_ScreenHeight;
+    swapChainDesc.Format = g_BackBufferFormat;
+    swapChainDesc.SampleDesc.Count = 1;
+    swapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    if (g_ComputeSupported && g_Options.renderer == RendererBackend::D3D11)
+        swapChainDesc.BufferUsage |= DXGI_USAGE_UNORDERED_ACCESS;
+    swapChainDesc.BufferCount = kSwapChainBufferCount;
+    swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+    swapChainDesc.Flags = DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT;
+    g_SwapChainFlags = swapChainDesc.Flags;
+
+    ComPtr<IDXGIDevice2> dxgiDevice2;
+    HRESULT hr = g_D3DDevice.As(&dxgiDevice2);
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to query IDXGIDevice2: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    ComPtr<IDXGIAdapter> dxgiAdapter;
+    hr = dxgiDevice2->GetAdapter(&dxgiAdapter);
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to get adapter from IDXGIDevice2: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    ComPtr<IDXGIFactory2> dxgiFactory2;
+    hr = dxgiAdapter->GetParent(IID_PPV_ARGS(&dxgiFactory2));
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to get factory from adapter: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    bool composition = g_Options.presentBackend == PresentBackend::Composition;
+    if (composition)
+    {
+        // The shaders write opaque pixels, so premultiplied alpha costs
+        // nothing and keeps the visual eligible for an overlay plane.
+        swapChainDesc.AlphaMode = DXGI_ALPHA_MODE_PREMULTIPLIED;
+        hr = dxgiFactory2->CreateSwapChainForComposition(g_Renderer->SwapChainDevice(), &swapChainDesc, nullptr, &g_SwapChain);
+        if (SUCCEEDED(hr))
+            hr = CreateCompositionTree(hwnd, dxgiDevice2.Get());
+        if (FAILED(hr))
+        {
+            std::cout << "DirectComposition presentation failed, using a window swap chain: " << HrToString(hr) << std::endl;
+            ReleaseCompositionTree();
+            g_SwapChain.Reset();
+            composition = false;
+        }
+    }
+    if (!composition)
+    {
+        swapChainDesc.AlphaMode = DXGI_ALPHA_MODE_IGNORE;
+        hr = dxgiFactory2->CreateSwapChainForHwnd(g_Renderer->SwapChainDevice(), hwnd, &swapChainDesc, nullptr, nullptr, &g_SwapChain);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to create swap chain: " << HrToString(hr) << std::endl;
+            return false;
+        }
+    }
+    g_CompositionSwapChain = composition;
+
+    // Keep at most one frame queued and let the frame loop wait for it.
+    ComPtr<IDXGISwapChain2> swapChain2;
+    hr = g_SwapChain.As(&swapChain2);
+    if (SUCCEEDED(hr))
+    {
+        swapChain2->SetMaximumFrameLatency(1);
+        g_FrameLatencyWaitable = swapChain2->GetFrameLatencyWaitableObject();
+    }
+    else
+    {
+        std::cout << "Query IDXGISwapChain2 failed, frame latency wait disabled: " << HrToString(hr) << std::endl;
+    }
+
+    if (g_Options.pacing == PacingPolicy::CappedFps && !g_PacingTimer)
+    {
+        g_PacingTimer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (!g_PacingTimer)
+            g_PacingTimer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+    }
+    ApplySwapChainColorSpace();
+    return g_Renderer->CreateBackBufferViews();
+}
+
+// Find the adapter that scans out a monitor. On hybrid laptops the
+// internal panel belongs to the integrated GPU whatever the default adapter
+// is, and a device elsewhere either cannot duplicate it or pays for a copy
+// between adapters every frame. Adapters are searched from the lowest power
+// one up, since some drivers list the panel under both GPUs and the
+// integrated one is the one driving it. Returns null if no adapter owns it.
+ComPtr<IDXGIAdapter1> FindMonitorAdapter(HMONITOR monitor)
+{
+    ComPtr<IDXGIFactory1> factory;
+    if (!monitor || FAILED(CreateDXGIFactory1(IID_PPV_ARGS(&factory))))
+        return nullptr;
+    ComPtr<IDXGIFactory6> factory6;
+    factory.As(&factory6);
+    ComPtr<IDXGIAdapter1> adapter;
+    for (UINT i = 0; ; i++)
+    {
+        HRESULT hr = factory6 ?
+            factory6->EnumAdapterByGpuPreference(i, DXGI_GPU_PREFERENCE_MINIMUM_POWER, IID_PPV_ARGS(&adapter)) :
+            factory->EnumAdapters1(i, &adapter);
+        if (FAILED(hr))
+            return nullptr;
+        ComPtr<IDXGIOutput> output;
+        for (UINT j = 0; adapter->EnumOutputs(j, &output) != DXGI_ERROR_NOT_FOUND; j++)
+        {
+            DXGI_OUTPUT_DESC desc;
+            if (SUCCEEDED(output->GetDesc(&desc)) && desc.Monitor == monitor)
+                return adapter;
+        }
+    }
+}
+
+// Find the adapter g_D3DDevice runs on and register for its budget-change
+// notifications. Without IDXGIAdapter3 the budget is unknown and nothing is
+// ever degraded.
+void RegisterMemoryBudget()
+{
+    ComPtr<IDXGIDevice> dxgiDevice;
+    ComPtr<IDXGIAdapter> adapter;
+    HRESULT hr = g_D3DDevice.As(&dxgiDevice);
+    if (SUCCEEDED(hr))
+        hr = dxgiDevice->GetAdapter(&adapter);
+    if (SUCCEEDED(hr))
+        hr = adapter.As(&g_MemoryAdapter);
+    if (FAILED(hr))
+    {
+        std::cout << "Video memory budget unavailable: " << HrToString(hr) << std::endl;
+        return;
+    }
+    if (!g_BudgetEvent)
+        g_BudgetEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (g_BudgetEvent)
+        g_MemoryAdapter->RegisterVideoMemoryBudgetChangeNotificationEvent(g_BudgetEvent, &g_BudgetCookie);
+}
+
+void UnregisterMemoryBudget()
+{
+    if (g_MemoryAdapter && g_BudgetCookie)
+        g_MemoryAdapter->UnregisterVideoMemoryBudgetChangeNotification(g_BudgetCookie);
+    g_BudgetCookie = 0;
+    g_MemoryAdapter.Reset();
+    g_VideoMemory = {};
+}
+
+// Create the D3D11 device and immediate context on the adapter driving the
+// monitor under the cursor, where the magnifier starts, falling back to the
+// default adapter and then to WARP.
+bool CreateDevice()
+{
+    // BGRA support lets Direct2D draw the stats overlay on the back buffer.
+    UINT createDeviceFlags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
+    // The recorder converts the back buffer with the video processor.
+    if (!g_Options.recordPath.empty())
+        createDeviceFlags |= D3D11_CREATE_DEVICE_VIDEO_SUPPORT;
+#ifdef _DEBUG
+    createDeviceFlags |= D3D11_CREATE_DEVICE_DEBUG;
+#endif
+
+    D3D_FEATURE_LEVEL featureLevels[] = {
+        D3D_FEATURE_LEVEL_11_1,
+        D3D_FEATURE_LEVEL_11_0,
+        D3D_FEATURE_LEVEL_10_1,
+        D3D_FEATURE_LEVEL_10_0
+    };
+    D3D_FEATURE_LEVEL featureLevel;
+
+    POINT cursor = {};
+    GetCursorPos(&cursor);
+    ComPtr<IDXGIAdapter1> adapter = FindMonitorAdapter(MonitorFromPoint(cursor, MONITOR_DEFAULTTOPRIMARY));
+    if (adapter)
+    {
+        DXGI_ADAPTER_DESC1 adapterDesc;
+        adapter->GetDesc1(&adapterDesc);
+        std::wcout << L"Creating the device on " << adapterDesc.Description << L", which drives the monitor under the cursor." << std::endl;
+    }
+    // An explicit adapter needs D3D_DRIVER_TYPE_UNKNOWN.
+    D3D_DRIVER_TYPE driverType = adapter ? D3D_DRIVER_TYPE_UNKNOWN : D3D_DRIVER_TYPE_HARDWARE;
+
+    HRESULT hr = D3D11CreateDevice(adapter.Get(), driverType, nullptr, createDeviceFlags,
+        featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
+        &g_D3DDevice, &featureLevel, &g_D3DContext);
+
+    if (FAILED(hr))
+    {
+        if (createDeviceFlags & D3D11_CREATE_DEVICE_DEBUG)
+        {
+            createDeviceFlags &= ~D3D11_CREATE_DEVICE_DEBUG;
+            hr = D3D11CreateDevice(adapter.Get(), driverType, nullptr, createDeviceFlags,
+                featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
+                &g_D3DDevice, &featureLevel, &g_D3DContext);
+        }
+        if (FAILED(hr) && adapter)
+        {
+            std::cout << "Device creation on the monitor's adapter failed, using the default adapter: " << HrToString(hr) << std::endl;
+            hr = D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, createDeviceFlags,
+                featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
+                &g_D3DDevice, &featureLevel, &g_D3DContext);
+        }
+        if (FAILED(hr))
+        {
+            hr = D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_WARP, nullptr, createDeviceFlags,
+                featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION,
+                &g_D3DDevice, &featureLevel, &g_D3DContext);
+            if (FAILED(hr))
+            {
+                std::cerr << "D3D11CreateDevice failed with all attempts: " << HrToString(hr) << std::endl;
+                return false;
+            }
+        }
+    }
+
+    ComPtr<IDXGIDevice1> dxgiDevice1;
+    hr = g_D3DDevice.As(&dxgiDevice1);
+    if (SUCCEEDED(hr))
+    {
+        dxgiDevice1->SetMaximumFrameLatency(1);
+        // Schedule our GPU work ahead of other processes'; raising it needs
+        // the increase-priority privilege, so failure is only reported.
+        if (g_Options.realtime)
+        {
+            hr = dxgiDevice1->SetGPUThreadPriority(7);
+            if (FAILED(hr))
+                std::cout << "Could not raise the GPU thread priority: " << HrToString(hr) << std::endl;
+        }
+    }
+
+    // The capture thread copies into the frame ring while the render thread
+    // draws, so the immediate context must be safe to use from both.
+    ComPtr<ID3D11Multithread> multithread;
+    hr = g_D3DDevice.As(&multithread);
+    if (SUCCEEDED(hr))
+    {
+        multithread->SetMultithreadProtected(TRUE);
+    }
+    RegisterMemoryBudget();
+    return true;
+}
+
+// Create the bilinear clamp sampler used by the magnification shader.
+bool CreateSamplerState()
+{
+    D3D11_SAMPLER_DESC sampDesc = {};
+    sampDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+    sampDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+    sampDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+    sampDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+    sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+    sampDesc.MinLOD = 0;
+    sampDesc.MaxLOD = D3D11_FLOAT32_MAX;
+    HRESULT hr = g_D3DDevice->CreateSamplerState(&sampDesc, &g_SamplerState);
+    if (FAILED(hr))
+    {
+        std::cerr << "Create sampler state failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Create the compute magnification path. It needs feature level 11_0 and
+// typed UAV stores to the back buffer format; without them only the
+// bilinear pixel shader path is available.
+bool CreateComputeMagnifier()
+{
+    g_ComputeSupported = false;
+    if (g_D3DDevice->GetFeatureLevel() < D3D_FEATURE_LEVEL_11_0)
+    {
+        std::cout << "Compute filters need feature level 11_0; only bilinear is available." << std::endl;
+        return false;
+    }
+    UINT support = 0;
+    D3D11_FEATURE_DATA_FORMAT_SUPPORT2 support2 = { DXGI_FORMAT_B8G8R8A8_UNORM, 0 };
+    if (FAILED(g_D3DDevice->CheckFormatSupport(DXGI_FORMAT_B8G8R8A8_UNORM, &support)) ||
+        !(support & D3D11_FORMAT_SUPPORT_TYPED_UNORDERED_ACCESS_VIEW) ||
+        FAILED(g_D3DDevice->CheckFeatureSupport(D3D11_FEATURE_FORMAT_SUPPORT2, &support2, sizeof(support2))) ||
+        !(support2.OutFormatSupport2 & D3D11_FORMAT_SUPPORT2_UAV_TYPED_STORE))
+    {
+        std::cout << "Back buffer format has no UAV support; only bilinear is available." << std::endl;
+        return false;
+    }
+
+    HRESULT hr = g_D3DDevice->CreateComputeShader(g_MagnifierSharpenCS, sizeof(g_MagnifierSharpenCS), nullptr, &g_SharpenShader);
+    for (int filter = 0; SUCCEEDED(hr) && filter < kFilterCount; filter++)
+    {
+        for (int border = 0; SUCCEEDED(hr) && border < kBorderModeCount; border++)
+        {
+            for (int cursor = 0; SUCCEEDED(hr) && cursor < 2; cursor++)
+            {
+                for (int enhance = 0; SUCCEEDED(hr) && enhance < 2; enhance++)
+                {
+                    const ShaderBytecode& bytecode = kResamplePermutations[filter][border][cursor][enhance];
+                    hr = g_D3DDevice->CreateComputeShader(bytecode.data, bytecode.size, nullptr,
+                        &g_ResampleShaderPermutations[filter][border][cursor][enhance]);
+                }
+            }
+        }
+    }
+    if (FAILED(hr))
+    {
+        std::cerr << "Create compute shaders failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    D3D11_BUFFER_DESC bufferDesc = {};
+    bufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+    bufferDesc.ByteWidth = sizeof(FilterConstantBuffer);
+    bufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    bufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    D3D11_SUBRESOURCE_DATA initData = { &g_FilterConstants, 0, 0 };
+    hr = g_D3DDevice->CreateBuffer(&bufferDesc, &initData, &g_FilterConstantBuffer);
+    if (FAILED(hr))
+    {
+        std::cerr << "Create filter constant buffer failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    g_ComputeSupported = true;
+    return true;
+}
+
+// Return the shader resource view for a duplication surface, creating it the
+// first time the surface is seen.
+ID3D11ShaderResourceView* GetFrameSurfaceView(ID3D11Texture2D* texture)
+{
+    for (const FrameSurfaceView& entry : g_FrameSurfaceViews)
+    {
+        if (entry.texture.Get() == texture)
+            return entry.view.Get();
+    }
+
+    D3D11_TEXTURE2D_DESC textureDesc = {};
+    texture->GetDesc(&textureDesc);
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+    srvDesc.Format = textureDesc.Format;
+    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    srvDesc.Texture2D.MostDetailedMip = 0;
+    srvDesc.Texture2D.MipLevels = 1;
+    ComPtr<ID3D11ShaderResourceView> view;
+    HRESULT hr = g_D3DDevice->CreateShaderResourceView(texture, &srvDesc, &view);
+    if (FAILED(hr))
+    {
+        std::cout << "Create shader resource view failed: " << HrToString(hr) << std::endl;
+        return nullptr;
+    }
+
+    FrameSurfaceView& slot = g_FrameSurfaceViews[g_NextFrameSurfaceView];
+    g_NextFrameSurfaceView = (g_NextFrameSurfaceView + 1) % kMaxFrameSurfaceViews;
+    slot.texture = texture;
+    slot.view = view;
+    return slot.view.Get();
+}
+
+// Drop all cached surface views, e.g. when the duplication session is recreated.
+void ResetFrameSurfaceViews()
+{
+    for (FrameSurfaceView& entry : g_FrameSurfaceViews)
+    {
+        entry.view.Reset();
+        entry.texture.Reset();
+    }
+    g_NextFrameSurfaceView = 0;
+    g_FrameShaderResourceView.Reset();
+}
+
+// Return a CPU-readable copy target matching the given texture. Only features
+// that need CPU pixels call this, so the GPU-only path never allocates one.
+ID3D11Texture2D* GetStagingTexture(const D3D11_TEXTURE2D_DESC& sourceDesc)
+{
+    if (g_StagingTexture)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        g_StagingTexture->GetDesc(&desc);
+        if (desc.Width == sourceDesc.Width && desc.Height == sourceDesc.Height && desc.Format == sourceDesc.Format)
+            return g_StagingTexture.Get();
+        g_StagingTexture.Reset();
+    }
+
+    D3D11_TEXTURE2D_DESC stagingDesc = {};
+    stagingDesc.Width = sourceDesc.Width;
+    stagingDesc.Height = sourceDesc.Height;
+    stagingDesc.MipLevels = 1;
+    stagingDesc.ArraySize = 1;
+    stagingDesc.Format = sourceDesc.Format;
+    stagingDesc.SampleDesc.Count = 1;
+    stagingDesc.Usage = D3D11_USAGE_STAGING;
+    stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    stagingDesc.BindFlags = 0;
+    HRESULT hr = g_D3DDevice->CreateTexture2D(&stagingDesc, nullptr, &g_StagingTexture);
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to create staging texture: " << HrToString(hr) << std::endl;
+        return nullptr;
+    }
+    TrackAllocation(g_StagingTexture.Get(), GpuMemoryUse::Staging);
+    return g_StagingTexture.Get();
+}
+
+// Collect the destination rectangles of all moved and dirty regions of the
+// acquired frame into g_ChangedRects. Returns false if the metadata could not
+// be read, in which case the whole frame must be treated as changed.
+bool CollectFrameChanges(IDXGIOutputDuplication* duplication, const DXGI_OUTDUPL_FRAME_INFO& frameInfo)
+{
+    g_ChangedRects.clear();
+    if (frameInfo.TotalMetadataBufferSize == 0)
+        return true;
+    if (g_MetadataBuffer.size() < frameInfo.TotalMetadataBufferSize)
+        g_MetadataBuffer.resize(frameInfo.TotalMetadataBufferSize);
+
+    UINT moveBytes = 0;
+    HRESULT hr = duplication->GetFrameMoveRects(static_cast<UINT>(g_MetadataBuffer.size()),
+        reinterpret_cast<DXGI_OUTDUPL_MOVE_RECT*>(g_MetadataBuffer.data()), &moveBytes);
+    if (FAILED(hr))
+    {
+        std::cout << "GetFrameMoveRects failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    const DXGI_OUTDUPL_MOVE_RECT* moveRects = reinterpret_cast<const DXGI_OUTDUPL_MOVE_RECT*>(g_MetadataBuffer.data());
+    for (UINT i = 0; i < moveBytes / sizeof(DXGI_OUTDUPL_MOVE_RECT); i++)
+        g_ChangedRects.push_back(moveRects[i].DestinationRect);
+
+    UINT dirtyBytes = 0;
+    BYTE* dirtyStart = g_MetadataBuffer.data() + moveBytes;
+    hr = duplication->GetFrameDirtyRects(static_cast<UINT>(g_MetadataBuffer.size()) - moveBytes,
+        reinterpret_cast<RECT*>(dirtyStart), &dirtyBytes);
+    if (FAILED(hr))
+    {
+        std::cout << "GetFrameDirtyRects failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    const RECT* dirtyRects = reinterpret_cast<const RECT*>(dirtyStart);
+    for (UINT i = 0; i < dirtyBytes / sizeof(RECT); i++)
+        g_ChangedRects.push_back(dirtyRects[i]);
+    return true;
+}
+
+// A frame handed out by a capture source. The texture stays valid until
+// CaptureSource::ReleaseFrame() is called.
+struct CapturedFrame {
+    ComPtr<ID3D11Texture2D> texture;
+    D3D11_BOX region = {};            // Captured area within the texture
+    bool imageUpdated = false;        // False for frames that only move the pointer
+    bool haveChangedRects = false;    // g_ChangedRects lists the changes, in region coordinates
+    DXGI_OUTDUPL_FRAME_INFO frameInfo = {};
+};
+
+// Convert a duplication pointer shape into BGRA texels. Colour shapes keep
+// their alpha. Monochrome shapes (an AND mask over an XOR mask, one bit per
+// pixel) and masked-colour shapes (XOR where the mask byte is set) become
+// opaque texels and alpha-0 XOR texels, which MagnifierCursor.hlsli tells
+// apart by a non-black colour.
+bool ConvertPointerShape(const DXGI_OUTDUPL_POINTER_SHAPE_INFO& info, const BYTE* bits, UINT size,
+    std::vector<uint32_t>& pixels, UINT& width, UINT& height)
+{
+    bool monochrome = info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME;
+    width = info.Width;
+    height = monochrome ? info.Height / 2 : info.Height;
+    UINT rowBytes = monochrome ? (width + 7) / 8 : width * 4;
+    if (width == 0 || height == 0 || info.Pitch < rowBytes || static_cast<size_t>(info.Pitch) * info.Height > size)
+        return false;
+
+    pixels.resize(static_cast<size_t>(width) * height);
+    for (UINT y = 0; y < height; y++)
+    {
+        const BYTE* row = bits + static_cast<size_t>(y) * info.Pitch;
+        for (UINT x = 0; x < width; x++)
+        {
+            uint32_t pixel = 0;
+            if (monochrome)
+            {
+                BYTE bit = static_cast<BYTE>(0x80 >> (x % 8));
+                bool andBit = (row[x / 8] & bit) != 0;
+                bool xorBit = (row[static_cast<size_t>(height) * info.Pitch + x / 8] & bit) != 0;
+                if (andBit)
+                    pixel = xorBit ? 0x00FFFFFF : 0x00000000;  // Invert, or leave the desktop
+                else
+                    pixel = xorBit ? 0xFFFFFFFF : 0xFF000000;  // White or black
+            }
+            else
+            {
+                uint32_t source;
+                memcpy(&source, row + x * 4, sizeof(source));
+                if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR)
+                    pixel = (source >> 24) ? (source & 0x00FFFFFF) : (source | 0xFF000000);
+                else
+                    pixel = (source >> 24) ? source : 0;  // Transparent texels must be black
+            }
+            pixels[static_cast<size_t>(y) * width + x] = pixel;
+        }
+    }
+    return true;
+}
+
+// Decode an sRGB-encoded channel value to linear light.
+float SrgbToLinear(float value)
+{
+    return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+// Return the texture for a pointer shape, uploading it only the first time
+// the shape is seen. Cursors cycle through a handful of shapes, so the most
+// recent ones are kept. For an scRGB desktop linearScale is its SDR white
+// level and the texels are stored as linear floats at that brightness, so
+// the shaders composite them without knowing the format; otherwise it is 0.
+std::shared_ptr<const CursorShape> GetCursorShape(const DXGI_OUTDUPL_POINTER_SHAPE_INFO& info, const BYTE* bits, UINT size,
+    float linearScale)
+{
+    for (auto it = g_CursorShapeCache.begin(); it != g_CursorShapeCache.end(); ++it)
+    {
+        const CursorShape& cached = **it;
+        if (cached.linearScale == linearScale &&
+            cached.info.Type == info.Type && cached.info.Width == info.Width && cached.info.Height == info.Height &&
+            cached.info.Pitch == info.Pitch && cached.bits.size() == size && memcmp(cached.bits.data(), bits, size) == 0)
+        {
+            std::rotate(g_CursorShapeCache.begin(), it, it + 1);
+            return g_CursorShapeCache.front();
+        }
+    }
+
+    std::vector<uint32_t> pixels;
+    UINT width = 0, height = 0;
+    if (!ConvertPointerShape(info, bits, size, pixels, width, height))
+        return nullptr;
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    D3D11_SUBRESOURCE_DATA initData = { pixels.data(), width * 4, 0 };
+    std::vector<float> linearPixels;
+    if (linearScale > 0.0f)
+    {
+        linearPixels.resize(pixels.size() * 4);
+        for (size_t i = 0; i < pixels.size(); i++)
+        {
+            for (int channel = 0; channel < 3; channel++)
+            {
+                float value = ((pixels[i] >> (16 - 8 * channel)) & 0xFF) / 255.0f;
+                linearPixels[4 * i + channel] = SrgbToLinear(value) * linearScale;
+            }
+            linearPixels[4 * i + 3] = (pixels[i] >> 24) / 255.0f;
+        }
+        desc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+        initData = { linearPixels.data(), width * 16, 0 };
+    }
+    ComPtr<ID3D11Texture2D> texture;
+    auto shape = std::make_shared<CursorShape>();
+    HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, &initData, &texture);
+    if (SUCCEEDED(hr))
+    {
+        TrackAllocation(texture.Get(), GpuMemoryUse::Cursor);
+        hr = g_D3DDevice->CreateShaderResourceView(texture.Get(), nullptr, &shape->view);
+    }
+    if (FAILED(hr))
+    {
+        std::cout << "Failed to create cursor texture: " << HrToString(hr) << std::endl;
+        return nullptr;
+    }
+    shape->width = width;
+    shape->height = height;
+    shape->linearScale = linearScale;
+    shape->info = info;
+    shape->bits.assign(bits, bits + size);
+    shape->pixels = std::move(pixels);
+    g_CursorShapeCache.insert(g_CursorShapeCache.begin(), shape);
+    if (g_CursorShapeCache.size() > kMaxCachedCursorShapes)
+        g_CursorShapeCache.pop_back();
+    return shape;
+}
+
+// Publish a pointer update: the position in frameInfo and, if shapeInfo is
+// not null, a new shape. Wakes the render thread, since a frame that only
+// moves the pointer publishes no image. linearScale is as for
+// GetCursorShape().
+void PublishPointer(const DXGI_OUTDUPL_FRAME_INFO& frameInfo, const D3D11_BOX& region,
+    const DXGI_OUTDUPL_POINTER_SHAPE_INFO* shapeInfo, const BYTE* shapeBits, UINT shapeSize, float linearScale)
+{
+    bool changed = false;
+    if (shapeInfo)
+    {
+        if (std::shared_ptr<const CursorShape> shape = GetCursorShape(*shapeInfo, shapeBits, shapeSize, linearScale))
+        {
+            g_CursorShape.store(std::move(shape), std::memory_order_release);
+            changed = true;
+        }
+    }
+
+    int32_t x = frameInfo.PointerPosition.Position.x - static_cast<int32_t>(region.left);
+    int32_t y = frameInfo.PointerPosition.Position.y - static_cast<int32_t>(region.top);
+    uint64_t position = static_cast<uint32_t>(x) | (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32);
+    bool visible = frameInfo.PointerPosition.Visible != FALSE;
+    changed |= g_CursorPosition.exchange(position, std::memory_order_relaxed) != position;
+    changed |= g_CursorVisible.exchange(visible, std::memory_order_relaxed) != visible;
+    if (changed && g_FrameReadyEvent)
+        SetEvent(g_FrameReadyEvent);
+}
+
+// Publish the pointer changes carried by a duplication frame. A new shape is
+// also left in g_PointerShapeBuffer and g_LastPointerShape for the trace
+// recorder. linearScale is as for GetCursorShape().
+void UpdatePointer(IDXGIOutputDuplication* duplication, const DXGI_OUTDUPL_FRAME_INFO& frameInfo, const D3D11_BOX& region,
+    float linearScale)
+{
+    g_LastPointerShape.size = 0;
+    if (frameInfo.LastMouseUpdateTime.QuadPart == 0)
+        return;
+    if (frameInfo.PointerShapeBufferSize == 0)
+    {
+        PublishPointer(frameInfo, region, nullptr, nullptr, 0, linearScale);
+        return;
+    }
+    if (g_PointerShapeBuffer.size() < frameInfo.PointerShapeBufferSize)
+        g_PointerShapeBuffer.resize(frameInfo.PointerShapeBufferSize);
+    UINT size = 0;
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO info = {};
+    HRESULT hr = duplication->GetFramePointerShape(static_cast<UINT>(g_PointerShapeBuffer.size()),
+        g_PointerShapeBuffer.data(), &size, &info);
+    if (FAILED(hr))
+    {
+        std::cout << "GetFramePointerShape failed: " << HrToString(hr) << std::endl;
+        PublishPointer(frameInfo, region, nullptr, nullptr, 0, linearScale);
+        return;
+    }
+    g_LastPointerShape = { info, size, linearScale };
+    PublishPointer(frameInfo, region, &info, g_PointerShapeBuffer.data(), size, linearScale);
+}
+
+// Common interface of the capture backends.
+class CaptureSource {
+public:
+    virtual ~CaptureSource() = default;
+    virtual const char* Name() const = 0;
+    // Wait up to timeoutMs for a new frame. Returns DXGI_ERROR_WAIT_TIMEOUT if
+    // nothing arrived and DXGI_ERROR_ACCESS_LOST if the source must be recreated.
+    virtual HRESULT AcquireFrame(UINT timeoutMs, CapturedFrame& frame) = 0;
+    virtual void ReleaseFrame() = 0;
+    // Re-create the source in place after DXGI_ERROR_ACCESS_LOST, keeping the
+    // device. Returns S_OK once frames can be acquired again; backends that
+    // cannot reconnect return E_NOTIMPL.
+    virtual HRESULT Reconnect() { return E_NOTIMPL; }
+    // Map the acquired frame for reading, for backends that hold it in
+    // system memory. Others return E_NOTIMPL and the frame is read back
+    // through a staging texture.
+    virtual HRESULT MapFrame(DXGI_MAPPED_RECT& mapped) { return E_NOTIMPL; }
+    virtual void UnmapFrame() {}
+
+    LONGLONG lostTime = 0;  // QPC time access was lost, 0 while capturing
+};
+
+UINT RegionWidth(const D3D11_BOX& region) { return region.right - region.left; }
+UINT RegionHeight(const D3D11_BOX& region) { return region.bottom - region.top; }
+
+// Return the part of a texture to capture: the configured sub-region if there
+// is one, otherwise the given content size.
+D3D11_BOX MakeCaptureRegion(UINT contentWidth, UINT contentHeight)
+{
+    D3D11_BOX region = { 0, 0, 0, contentWidth, contentHeight, 1 };
+    if (g_Options.hasCaptureRegion)
+    {
+        const RECT& rect = g_Options.captureRegion;
+        region.left = std::min(static_cast<UINT>(std::max(0L, rect.left)), contentWidth);
+        region.top = std::min(static_cast<UINT>(std::max(0L, rect.top)), contentHeight);
+        region.right = std::max(region.left, std::min(static_cast<UINT>(std::max(0L, rect.right)), contentWidth));
+        region.bottom = std::max(region.top, std::min(static_cast<UINT>(std::max(0L, rect.bottom)), contentHeight));
+    }
+    return region;
+}
+
+// Return true if the captured region is the whole texture.
+bool RegionCoversTexture(const CapturedFrame& frame)
+{
+    D3D11_TEXTURE2D_DESC desc = {};
+    frame.texture->GetDesc(&desc);
+    return frame.region.left == 0 && frame.region.top == 0 &&
+        frame.region.right == desc.Width && frame.region.bottom == desc.Height;
+}
+
+// Clip g_ChangedRects to the capture region and move them into its coordinates.
+void ClipChangedRectsToRegion(const D3D11_BOX& region)
+{
+    RECT bounds = { static_cast<LONG>(region.left), static_cast<LONG>(region.top),
+        static_cast<LONG>(region.right), static_cast<LONG>(region.bottom) };
+    size_t count = 0;
+    for (const RECT& rect : g_ChangedRects)
+    {
+        RECT clipped;
+        if (IntersectRect(&clipped, &rect, &bounds))
+        {
+            OffsetRect(&clipped, -bounds.left, -bounds.top);
+            g_ChangedRects[count++] = clipped;
+        }
+    }
+    g_ChangedRects.resize(count);
+}
+
+// Copy the whole captured region into the top-left corner of destination.
+void CopyCapturedRegion(ID3D11Texture2D* destination, const CapturedFrame& frame)
+{
+    D3D11_TEXTURE2D_DESC destDesc = {};
+    destination->GetDesc(&destDesc);
+    D3D11_TEXTURE2D_DESC sourceDesc = {};
+    frame.texture->GetDesc(&sourceDesc);
+    if (RegionCoversTexture(frame) && destDesc.Width == sourceDesc.Width && destDesc.Height == sourceDesc.Height)
+    {
+        g_D3DContext->CopyResource(destination, frame.texture.Get());
+        return;
+    }
+    D3D11_BOX box = frame.region;
+    box.right = std::min(box.right, box.left + destDesc.Width);
+    box.bottom = std::min(box.bottom, box.top + destDesc.Height);
+    g_D3DContext->CopySubresourceRegion(destination, 0, 0, 0, 0, frame.texture.Get(), 0, &box);
+}
+
+// Copy rectangles of the captured region (in region coordinates) into the
+// same position of destination.
+void CopyCapturedRects(ID3D11Texture2D* destination, const CapturedFrame& frame, const std::vector<RECT>& rects)
+{
+    D3D11_TEXTURE2D_DESC destDesc = {};
+    destination->GetDesc(&destDesc);
+    LONG maxX = static_cast<LONG>(std::min(destDesc.Width, RegionWidth(frame.region)));
+    LONG maxY = static_cast<LONG>(std::min(destDesc.Height, RegionHeight(frame.region)));
+    for (const RECT& rect : rects)
+    {
+        LONG left = std::max(0L, rect.left);
+        LONG top = std::max(0L, rect.top);
+        LONG right = std::min(maxX, rect.right);
+        LONG bottom = std::min(maxY, rect.bottom);
+        if (left >= right || top >= bottom)
+            continue;
+        D3D11_BOX box = { frame.region.left + left, frame.region.top + top, 0,
+            frame.region.left + right, frame.region.top + bottom, 1 };
+        g_D3DContext->CopySubresourceRegion(destination, 0, left, top, 0, frame.texture.Get(), 0, &box);
+    }
+}
+
+// True for DuplicateOutput failures that clear up on their own, such as the
+// secure desktop being shown during logon or a session switch.
+bool IsTransientDuplicationError(HRESULT hr)
+{
+    return hr == E_ACCESSDENIED || hr == DXGI_ERROR_NOT_CURRENTLY_AVAILABLE || hr == DXGI_ERROR_SESSION_DISCONNECTED;
+}
+
+// True if a failure means the device is gone and has to be rebuilt.
+bool DeviceWasRemoved(HRESULT hr)
+{
+    return hr == DXGI_ERROR_DEVICE_REMOVED || hr == DXGI_ERROR_DEVICE_RESET ||
+        (g_D3DDevice && FAILED(g_D3DDevice->GetDeviceRemovedReason()));
+}
+
+// Colour state of a display.
+struct DisplayColor {
+    bool hdr = false;            // Advanced colour (HDR) is on
+    float sdrWhiteScale = 1.0f;  // SDR white in scRGB units, where 1.0 is 80 nits
+};
+
+// Read the colour state of the display path driving a monitor. Displays the
+// display configuration API cannot match are reported as SDR.
+DisplayColor QueryDisplayColor(HMONITOR monitor)
+{
+    DisplayColor color;
+    MONITORINFOEXW monitorInfo = {};
+    monitorInfo.cbSize = sizeof(monitorInfo);
+    UINT32 pathCount = 0, modeCount = 0;
+    if (!monitor || !GetMonitorInfoW(monitor, &monitorInfo) ||
+        GetDisplayConfigBufferSizes(QDC_ONLY_ACTIVE_PATHS, &pathCount, &modeCount) != ERROR_SUCCESS)
+        return color;
+    std::vector<DISPLAYCONFIG_PATH_INFO> paths(pathCount);
+    std::vector<DISPLAYCONFIG_MODE_INFO> modes(modeCount);
+    if (QueryDisplayConfig(QDC_ONLY_ACTIVE_PATHS, &pathCount, paths.data(), &modeCount, modes.data(), nullptr) != ERROR_SUCCESS)
+        return color;
+    for (UINT32 i = 0; i < pathCount; i++)
+    {
+        DISPLAYCONFIG_SOURCE_DEVICE_NAME source = {};
+        source.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME;
+        source.header.size = sizeof(source);
+        source.header.adapterId = paths[i].sourceInfo.adapterId;
+        source.header.id = paths[i].sourceInfo.id;
+        if (DisplayConfigGetDeviceInfo(&source.header) != ERROR_SUCCESS || wcscmp(source.viewGdiDeviceName, monitorInfo.szDevice) != 0)
+            continue;
+
+        DISPLAYCONFIG_GET_ADVANCED_COLOR_INFO advancedColor = {};
+        advancedColor.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_ADVANCED_COLOR_INFO;
+        advancedColor.header.size = sizeof(advancedColor);
+        advancedColor.header.adapterId = paths[i].targetInfo.adapterId;
+        advancedColor.header.id = paths[i].targetInfo.id;
+        if (DisplayConfigGetDeviceInfo(&advancedColor.header) == ERROR_SUCCESS)
+            color.hdr = advancedColor.advancedColorEnabled != 0;
+
+        // The level is reported in thousandths of 80 nits.
+        DISPLAYCONFIG_SDR_WHITE_LEVEL whiteLevel = {};
+        whiteLevel.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SDR_WHITE_LEVEL;
+        whiteLevel.header.size = sizeof(whiteLevel);
+        whiteLevel.header.adapterId = paths[i].targetInfo.adapterId;
+        whiteLevel.header.id = paths[i].targetInfo.id;
+        if (DisplayConfigGetDeviceInfo(&whiteLevel.header) == ERROR_SUCCESS && whiteLevel.SDRWhiteLevel > 0)
+            color.sdrWhiteScale = whiteLevel.SDRWhiteLevel / 1000.0f;
+        break;
+    }
+    return color;
+}
+
+// Start duplicating an output on a device. DuplicateOutput1 is offered
+// every format the pipeline runs in, so an HDR desktop arrives as scRGB
+// FP16 and a 10-bit one as R10G10B10A2 instead of being converted by the OS;
+// the back buffer then follows (MatchSourceFormat). With --sdr, or if
+// DuplicateOutput1 is refused, plain DuplicateOutput gives 8-bit BGRA.
+HRESULT CreateOutputDuplication(IDXGIOutput6* output, ID3D11Device* device, ComPtr<IDXGIOutputDuplication>& duplication)
+{
+    HRESULT hr = DXGI_ERROR_UNSUPPORTED;
+    if (!g_Options.forceSdr)
+    {
+        const DXGI_FORMAT formats[] = { DXGI_FORMAT_R16G16B16A16_FLOAT, DXGI_FORMAT_R10G10B10A2_UNORM,
+            DXGI_FORMAT_B8G8R8A8_UNORM, DXGI_FORMAT_R8G8B8A8_UNORM };
+        hr = output->DuplicateOutput1(device, 0, ARRAYSIZE(formats), formats, &duplication);
+    }
+    if (FAILED(hr))
+        hr = output->DuplicateOutput(device, &duplication);
+    return hr;
+}
+
+// Desktop duplication backend, the default capture path.
+class DuplicationCapture : public CaptureSource {
+public:
+    DuplicationCapture(ComPtr<IDXGIOutput6> output, ComPtr<IDXGIOutputDuplication> duplication)
+        : m_output(std::move(output)), m_duplication(std::move(duplication))
+    {
+        ReadSdrWhiteScale();
+        ReadSystemMemory();
+    }
+    ~DuplicationCapture() override { ReleaseFrame(); }
+
+    const char* Name() const override { return "desktop duplication"; }
+
+    HRESULT AcquireFrame(UINT timeoutMs, CapturedFrame& frame) override
+    {
+        if (!m_duplication)
+            return DXGI_ERROR_ACCESS_LOST;
+        ComPtr<IDXGIResource> resource;
+        HRESULT hr = m_duplication->AcquireNextFrame(timeoutMs, &frame.frameInfo, &resource);
+        if (FAILED(hr))
+        {
+            // A lost session cannot be used again; Reconnect() replaces it.
+            if (hr == DXGI_ERROR_ACCESS_LOST)
+                m_duplication.Reset();
+            return hr;
+        }
+        m_frameHeld = true;
+
+        hr = resource.As(&frame.texture);
+        if (FAILED(hr))
+        {
+            std::cout << "Failed to QI for ID3D11Texture2D: " << HrToString(hr) << std::endl;
+            ReleaseFrame();
+            return hr;
+        }
+        D3D11_TEXTURE2D_DESC desc = {};
+        frame.texture->GetDesc(&desc);
+        frame.region = MakeCaptureRegion(desc.Width, desc.Height);
+        UpdatePointer(m_duplication.Get(), frame.frameInfo, frame.region,
+            desc.Format == DXGI_FORMAT_R16G16B16A16_FLOAT ? m_sdrWhiteScale : 0.0f);
+
+        // A frame without a new present only carries a pointer update.
+        frame.imageUpdated = frame.frameInfo.LastPresentTime.QuadPart != 0;
+        frame.haveChangedRects = true;
+        g_ChangedRects.clear();
+        if (frame.imageUpdated)
+        {
+            frame.haveChangedRects = CollectFrameChanges(m_duplication.Get(), frame.frameInfo);
+            if (frame.haveChangedRects && g_Options.hasCaptureRegion)
+                ClipChangedRectsToRegion(frame.region);
+        }
+        return S_OK;
+    }
+
+    void ReleaseFrame() override
+    {
+        if (!m_frameHeld)
+            return;
+        HRESULT hr = m_duplication->ReleaseFrame();
+        if (hr == DXGI_ERROR_ACCESS_LOST)
+            m_duplication.Reset();
+        else if (FAILED(hr))
+            std::cout << "ReleaseFrame failed: " << HrToString(hr) << std::endl;
+        m_frameHeld = false;
+    }
+
+    HRESULT Reconnect() override
+    {
+        m_duplication.Reset();
+        m_frameHeld = false;
+        HRESULT hr = CreateOutputDuplication(m_output.Get(), g_D3DDevice.Get(), m_duplication);
+        if (SUCCEEDED(hr))
+        {
+            // Access is lost on mode and HDR switches, which can change the
+            // white level. Read once per new session, not per retry.
+            ReadSdrWhiteScale();
+            ReadSystemMemory();
+        }
+        return hr;
+    }
+
+    HRESULT MapFrame(DXGI_MAPPED_RECT& mapped) override
+    {
+        if (!m_frameHeld || !m_systemMemory)
+            return E_NOTIMPL;
+        return m_duplication->MapDesktopSurface(&mapped);
+    }
+
+    void UnmapFrame() override { m_duplication->UnMapDesktopSurface(); }
+
+private:
+    void ReadSdrWhiteScale()
+    {
+        DXGI_OUTPUT_DESC desc = {};
+        m_output->GetDesc(&desc);
+        m_sdrWhiteScale = QueryDisplayColor(desc.Monitor).sdrWhiteScale;
+    }
+
+    // Without a GPU the duplication can keep the desktop in system memory,
+    // where MapFrame() reads it without a copy.
+    void ReadSystemMemory()
+    {
+        DXGI_OUTDUPL_DESC desc = {};
+        m_duplication->GetDesc(&desc);
+        m_systemMemory = desc.DesktopImageInSystemMemory != FALSE;
+    }
+
+    ComPtr<IDXGIOutput6> m_output;
+    ComPtr<IDXGIOutputDuplication> m_duplication;
+    bool m_frameHeld = false;
+    bool m_systemMemory = false;   // DesktopImageInSystemMemory
+    float m_sdrWhiteScale = 1.0f;  // Brightness of pointer shapes over an scRGB desktop
+};
+
+// Desktop duplication of an output on another adapter than g_D3DDevice's,
+// for when DuplicateOutput refuses our device there. A device of its own on
+// the output's adapter duplicates it, and the changed regions travel
+// through a staging texture and system memory into a texture on
+// g_D3DDevice. This is the slowest path and only used when nothing else
+// works; each transfer is timed as the cross-adapter stat.
+class CrossAdapterCapture : public CaptureSource {
+public:
+    CrossAdapterCapture(ComPtr<IDXGIAdapter1> adapter, ComPtr<IDXGIOutput6> output)
+        : m_adapter(std::move(adapter)), m_output(std::move(output)) {}
+
+    const char* Name() const override { return "cross-adapter duplication"; }
+
+    // Create the device on the output's adapter and start duplicating.
+    HRESULT Reconnect() override
+    {
+        m_duplication.Reset();
+        if (!m_device || FAILED(m_device->GetDeviceRemovedReason()))
+        {
+            m_staging.Reset();
+            m_context.Reset();
+            m_device.Reset();
+            D3D_FEATURE_LEVEL featureLevels[] = { D3D_FEATURE_LEVEL_11_0, D3D_FEATURE_LEVEL_10_1, D3D_FEATURE_LEVEL_10_0 };
+            HRESULT hr = D3D11CreateDevice(m_adapter.Get(), D3D_DRIVER_TYPE_UNKNOWN, nullptr, 0,
+                featureLevels, ARRAYSIZE(featureLevels), D3D11_SDK_VERSION, &m_device, nullptr, &m_context);
+            if (FAILED(hr))
+                return hr;
+        }
+        DXGI_OUTPUT_DESC desc = {};
+        m_output->GetDesc(&desc);
+        m_sdrWhiteScale = QueryDisplayColor(desc.Monitor).sdrWhiteScale;
+        m_fullTransfer = true;
+        return CreateOutputDuplication(m_output.Get(), m_device.Get(), m_duplication);
+    }
+
+    HRESULT AcquireFrame(UINT timeoutMs, CapturedFrame& frame) override
+    {
+        if (!m_duplication)
+            return DXGI_ERROR_ACCESS_LOST;
+        ComPtr<IDXGIResource> resource;
+        HRESULT hr = m_duplication->AcquireNextFrame(timeoutMs, &frame.frameInfo, &resource);
+        if (FAILED(hr))
+        {
+            if (hr == DXGI_ERROR_ACCESS_LOST)
+                m_duplication.Reset();
+            return hr;
+        }
+        ComPtr<ID3D11Texture2D> texture;
+        hr = resource.As(&texture);
+        if (FAILED(hr))
+        {
+            std::cout << "Failed to QI for ID3D11Texture2D: " << HrToString(hr) << std::endl;
+            if (m_duplication->ReleaseFrame() == DXGI_ERROR_ACCESS_LOST)
+                m_duplication.Reset();
+            return hr;
+        }
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+        frame.region = MakeCaptureRegion(desc.Width, desc.Height);
+        UpdatePointer(m_duplication.Get(), frame.frameInfo, frame.region,
+            desc.Format == DXGI_FORMAT_R16G16B16A16_FLOAT ? m_sdrWhiteScale : 0.0f);
+
+        frame.imageUpdated = frame.frameInfo.LastPresentTime.QuadPart != 0;
+        frame.haveChangedRects = true;
+        g_ChangedRects.clear();
+        if (frame.imageUpdated)
+        {
+            frame.haveChangedRects = CollectFrameChanges(m_duplication.Get(), frame.frameInfo);
+            hr = TransferFrame(texture.Get(), desc, frame.haveChangedRects);
+            if (frame.haveChangedRects && g_Options.hasCaptureRegion)
+                ClipChangedRectsToRegion(frame.region);
+        }
+        // The frame has been copied out, so the duplication gets it back at once.
+        HRESULT releaseHr = m_duplication->ReleaseFrame();
+        if (releaseHr == DXGI_ERROR_ACCESS_LOST)
+            m_duplication.Reset();
+        if (FAILED(hr))
+        {
+            std::cout << "Cross-adapter transfer failed: " << HrToString(hr) << std::endl;
+            return hr;
+        }
+        if (!m_texture)
+            return DXGI_ERROR_WAIT_TIMEOUT;  // Only pointer updates so far
+        frame.texture = m_texture;
+        return S_OK;
+    }
+
+    void ReleaseFrame() override {}
+
+private:
+    // Bring the changed regions of a duplicated frame into m_texture. The
+    // whole frame is copied when the changes are unknown or the textures
+    // were just created.
+    HRESULT TransferFrame(ID3D11Texture2D* source, const D3D11_TEXTURE2D_DESC& sourceDesc, bool haveChangedRects)
+    {
+        CpuTimer timer(Stat::CrossAdapter);
+        D3D11_TEXTURE2D_DESC desc = {};
+        if (m_texture)
+            m_texture->GetDesc(&desc);
+        if (!m_staging || !m_texture || desc.Width != sourceDesc.Width || desc.Height != sourceDesc.Height || desc.Format != sourceDesc.Format)
+        {
+            m_staging.Reset();
+            m_texture.Reset();
+            desc = sourceDesc;
+            desc.MipLevels = 1;
+            desc.ArraySize = 1;
+            desc.SampleDesc = { 1, 0 };
+            desc.MiscFlags = 0;
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.BindFlags = 0;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            HRESULT hr = m_device->CreateTexture2D(&desc, nullptr, &m_staging);
+            if (FAILED(hr))
+                return hr;
+            desc.Usage = D3D11_USAGE_DEFAULT;
+            desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+            desc.CPUAccessFlags = 0;
+            hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &m_texture);
+            if (FAILED(hr))
+                return hr;
+            TrackAllocation(m_texture.Get(), GpuMemoryUse::CrossAdapter);
+            m_fullTransfer = true;
+        }
+
+        RECT fullFrame = { 0, 0, static_cast<LONG>(desc.Width), static_cast<LONG>(desc.Height) };
+        bool wholeFrame = m_fullTransfer || !haveChangedRects;
+        const RECT* rects = wholeFrame ? &fullFrame : g_ChangedRects.data();
+        size_t rectCount = wholeFrame ? 1 : g_ChangedRects.size();
+        if (rectCount == 0)
+            return S_OK;
+        for (size_t i = 0; i < rectCount; i++)
+        {
+            const RECT& rect = rects[i];
+            D3D11_BOX box = { static_cast<UINT>(rect.left), static_cast<UINT>(rect.top), 0,
+                static_cast<UINT>(rect.right), static_cast<UINT>(rect.bottom), 1 };
+            m_context->CopySubresourceRegion(m_staging.Get(), 0, box.left, box.top, 0, source, 0, &box);
+        }
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        HRESULT hr = m_context->Map(m_staging.Get(), 0, D3D11_MAP_READ, 0, &mapped);
+        if (FAILED(hr))
+            return hr;
+        UINT texelSize = BytesPerPixel(desc.Format);
+        for (size_t i = 0; i < rectCount; i++)
+        {
+            const RECT& rect = rects[i];
+            D3D11_BOX box = { static_cast<UINT>(rect.left), static_cast<UINT>(rect.top), 0,
+                static_cast<UINT>(rect.right), static_cast<UINT>(rect.bottom), 1 };
+            const BYTE* data = static_cast<const BYTE*>(mapped.pData) +
+                static_cast<size_t>(box.top) * mapped.RowPitch + static_cast<size_t>(box.left) * texelSize;
+            g_D3DContext->UpdateSubresource(m_texture.Get(), 0, &box, data, mapped.RowPitch, 0);
+        }
+        m_context->Unmap(m_staging.Get(), 0);
+        m_fullTransfer = false;
+        return S_OK;
+    }
+
+    ComPtr<IDXGIAdapter1> m_adapter;
+    ComPtr<IDXGIOutput6> m_output;
+    ComPtr<ID3D11Device> m_device;           // On m_adapter, used only by the acquiring thread
+    ComPtr<ID3D11DeviceContext> m_context;
+    ComPtr<IDXGIOutputDuplication> m_duplication;
+    ComPtr<ID3D11Texture2D> m_staging;       // On m_device
+    ComPtr<ID3D11Texture2D> m_texture;       // On g_D3DDevice, handed out as the frame
+    bool m_fullTransfer = true;
+    float m_sdrWhiteScale = 1.0f;
+};
+
+// Windows.Graphics.Capture backend for a monitor or a single window. Frames
+// arrive on a free-threaded frame pool whose handler only signals an event,
+// so AcquireFrame sleeps until the compositor delivers something new instead
+// of polling.
+class GraphicsCaptureSource : public CaptureSource {
+public:
+    ~GraphicsCaptureSource() override
+    {
+        ReleaseFrame();
+        try
+        {
+            if (m_framePool)
+            {
+                m_framePool.FrameArrived(m_frameArrivedToken);
+                m_framePool.Close();
+            }
+            if (m_session)
+                m_session.Close();
+        }
+        catch (winrt::hresult_error const&)
+        {
+        }
+        if (m_frameArrived)
+            CloseHandle(m_frameArrived);
+    }
+
+    const char* Name() const override { return "Windows.Graphics.Capture"; }
+
+    bool Initialize(wgc::GraphicsCaptureItem const& item, wgdx::DirectXPixelFormat pixelFormat)
+    {
+        try
+        {
+            m_frameArrived = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+            ComPtr<IDXGIDevice> dxgiDevice;
+            HRESULT hr = g_D3DDevice.As(&dxgiDevice);
+            winrt::check_hresult(hr);
+            winrt::com_ptr<::IInspectable> inspectable;
+            winrt::check_hresult(CreateDirect3D11DeviceFromDXGIDevice(dxgiDevice.Get(), inspectable.put()));
+            m_device = inspectable.as<wgdx::Direct3D11::IDirect3DDevice>();
+
+            m_item = item;
+            m_poolSize = m_item.Size();
+            m_pixelFormat = pixelFormat;
+            m_framePool = wgc::Direct3D11CaptureFramePool::CreateFreeThreaded(m_device, m_pixelFormat, 2, m_poolSize);
+            m_frameArrivedToken = m_framePool.FrameArrived([this](auto const&, auto const&) { SetEvent(m_frameArrived); });
+            m_item.Closed([this](auto const&, auto const&) { m_closed = true; SetEvent(m_frameArrived); });
+
+            m_session = m_framePool.CreateCaptureSession(m_item);
+            // Unlike duplication, this backend reports no pointer shapes, so
+            // the compositor draws the cursor into the frames. The yellow
+            // capture border would end up inside the magnified image.
+            using winrt::Windows::Foundation::Metadata::ApiInformation;
+            if (ApiInformation::IsPropertyPresent(L"Windows.Graphics.Capture.GraphicsCaptureSession", L"IsCursorCaptureEnabled"))
+                m_session.IsCursorCaptureEnabled(true);
+            if (ApiInformation::IsPropertyPresent(L"Windows.Graphics.Capture.GraphicsCaptureSession", L"IsBorderRequired"))
+                m_session.IsBorderRequired(false);
+            m_session.StartCapture();
+        }
+        catch (winrt::hresult_error const& e)
+        {
+            std::cerr << "Failed to start Windows.Graphics.Capture session: " << HrToString(e.code()) << std::endl;
+            return false;
+        }
+        std::cout << "Capturing with Windows.Graphics.Capture at " << m_poolSize.Width << "x" << m_poolSize.Height << std::endl;
+        return true;
+    }
+
+    HRESULT AcquireFrame(UINT timeoutMs, CapturedFrame& frame) override
+    {
+        if (WaitForSingleObject(m_frameArrived, timeoutMs) != WAIT_OBJECT_0)
+            return DXGI_ERROR_WAIT_TIMEOUT;
+        if (m_closed)
+            return DXGI_ERROR_ACCESS_LOST;
+
+        try
+        {
+            // Keep only the newest frame; older ones go straight back to the pool.
+            wgc::Direct3D11CaptureFrame latest{ nullptr };
+            for (auto next = m_framePool.TryGetNextFrame(); next; next = m_framePool.TryGetNextFrame())
+            {
+                if (latest)
+                    latest.Close();
+                latest = next;
+            }
+            if (!latest)
+                return DXGI_ERROR_WAIT_TIMEOUT;
+
+            auto access = latest.Surface().as<::Windows::Graphics::DirectX::Direct3D11::IDirect3DDxgiInterfaceAccess>();
+            winrt::check_hresult(access->GetInterface(IID_PPV_ARGS(&frame.texture)));
+
+            // A resized window needs a pool of the new size; it is recreated
+            // once this frame has been returned.
+            winrt::Windows::Graphics::SizeInt32 contentSize = latest.ContentSize();
+            if (contentSize.Width != m_poolSize.Width || contentSize.Height != m_poolSize.Height)
+            {
+                m_poolSize = contentSize;
+                m_recreatePool = true;
+            }
+
+            D3D11_TEXTURE2D_DESC desc = {};
+            frame.texture->GetDesc(&desc);
+            frame.region = MakeCaptureRegion(std::min(desc.Width, static_cast<UINT>(std::max(0, contentSize.Width))),
+                std::min(desc.Height, static_cast<UINT>(std::max(0, contentSize.Height))));
+            frame.imageUpdated = true;
+            frame.haveChangedRects = false;  // No dirty regions; every frame is a full update
+            frame.frameInfo = {};
+            // SystemRelativeTime is QPC time in 100 ns units; store it in QPC
+            // ticks to match desktop duplication.
+            LARGE_INTEGER frequency;
+            QueryPerformanceFrequency(&frequency);
+            frame.frameInfo.LastPresentTime.QuadPart = latest.SystemRelativeTime().count() * frequency.QuadPart / 10000000;
+            frame.frameInfo.AccumulatedFrames = 1;
+            g_ChangedRects.clear();
+            m_frame = latest;
+        }
+        catch (winrt::hresult_error const& e)
+        {
+            std::cout << "Windows.Graphics.Capture frame failed: " << HrToString(e.code()) << std::endl;
+            return DXGI_ERROR_ACCESS_LOST;
+        }
+        return S_OK;
+    }
+
+    void ReleaseFrame() override
+    {
+        if (!m_frame)
+            return;
+        try
+        {
+            m_frame.Close();
+            m_frame = nullptr;
+            if (m_recreatePool)
+            {
+                m_framePool.Recreate(m_device, m_pixelFormat, 2, m_poolSize);
+                m_recreatePool = false;
+            }
+        }
+        catch (winrt::hresult_error const& e)
+        {
+            std::cout << "Failed to return Windows.Graphics.Capture frame: " << HrToString(e.code()) << std::endl;
+            m_frame = nullptr;
+        }
+    }
+
+private:
+    wgdx::Direct3D11::IDirect3DDevice m_device{ nullptr };
+    wgc::GraphicsCaptureItem m_item{ nullptr };
+    wgc::Direct3D11CaptureFramePool m_framePool{ nullptr };
+    wgc::GraphicsCaptureSession m_session{ nullptr };
+    wgc::Direct3D11CaptureFrame m_frame{ nullptr };
+    winrt::event_token m_frameArrivedToken{};
+    winrt::Windows::Graphics::SizeInt32 m_poolSize{};
+    wgdx::DirectXPixelFormat m_pixelFormat = wgdx::DirectXPixelFormat::B8G8R8A8UIntNormalized;
+    HANDLE m_frameArrived = nullptr;
+    std::atomic<bool> m_closed{ false };
+    bool m_recreatePool = false;
+};
+
+// Capture traces. --trace-record writes what the capture source delivers to
+// a file: every frame's DXGI_OUTDUPL_FRAME_INFO, changed rectangles, pointer
+// shape and the pixels of the changed rectangles, plus the input events the
+// render thread applied. --trace-replay feeds the file back through the
+// single-thread pipeline as fast as it runs and reports per-frame timings,
+// skipped renders and the copy and render traffic, so a pipeline change can
+// be measured against the same desktop activity every time.
+//
+// A trace is a TraceFileHeader followed by chunks until the end of the file.
+// A chunk is a TraceChunkHeader and whole records, compressed with XPRESS
+// Huffman through the Windows compression API. Replay maps the file and
+// expands one chunk at a time, so a trace need not fit in memory.
+const char kTraceMagic[8] = { 'Z', 'M', 'T', 'R', 'A', 'C', 'E', '1' };
+const uint32_t kTraceVersion = 1;
+const size_t kTraceChunkBytes = 8 << 20;  // Records are gathered into chunks of about this size
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;         // DXGI_FORMAT of the captured region
+    uint32_t width;          // Size of the captured region
+    uint32_t height;
+    int32_t originX;         // Top-left corner of the region in the captured texture
+    int32_t originY;
+    int64_t qpcFrequency;    // Of the record times
+    uint64_t frameCount;     // Only known once the recording was closed
+};
+
+struct TraceChunkHeader {
+    uint32_t storedBytes;    // Bytes that follow this header
+    uint32_t rawBytes;       // Bytes of records they expand to
+    uint32_t compressed;     // 0 if the records are stored as they are
+    uint32_t recordCount;
+};
+
+enum class TraceRecordType : uint32_t { Frame, Input };
+
+struct TraceRecordHeader {
+    uint32_t type;           // TraceRecordType
+    uint32_t size;           // Bytes of payload after this header
+    int64_t time;            // QPC ticks since the recording started
+};
+
+// Payload of a frame record. It is followed by changedRectCount RECTs (the
+// frame's g_ChangedRects), shapeBytes of pointer shape, and pixelRectCount
+// RECTs each followed by its rows of texels, tightly packed.
+struct TraceFrameRecord {
+    DXGI_OUTDUPL_FRAME_INFO frameInfo;
+    uint32_t imageUpdated;
+    uint32_t haveChangedRects;
+    uint32_t changedRectCount;
+    uint32_t pixelRectCount;
+    uint32_t shapeBytes;     // 0 unless the frame carried a new pointer shape
+    float shapeScale;        // linearScale the shape was converted with
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo;
+};
+
+// Append raw bytes to a record being built.
+void AppendBytes(std::vector<BYTE>& buffer, const void* data, size_t size)
+{
+    const BYTE* bytes = static_cast<const BYTE*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+// Area of a rectangle in pixels.
+long long RectArea(const RECT& rect)
+{
+    return static_cast<long long>(rect.right - rect.left) * (rect.bottom - rect.top);
+}
+
+// Writes a capture trace. Frames come from the thread that acquires them and
+// input events from the render thread, so records are appended under a lock.
+class TraceWriter {
+public:
+    ~TraceWriter() { Close(); }
+
+    bool Open(const std::string& path)
+    {
+        if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &m_compressor))
+        {
+            std::cerr << "CreateCompressor failed: " << GetLastError() << std::endl;
+            return false;
+        }
+        m_file.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_file)
+        {
+            std::cerr << "Failed to open trace file " << path << std::endl;
+            return false;
+        }
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        memcpy(m_header.magic, kTraceMagic, sizeof(kTraceMagic));
+        m_header.version = kTraceVersion;
+        m_header.qpcFrequency = frequency.QuadPart;
+        WriteHeader();
+        m_startTime = QpcNow();
+        std::cout << "Recording a capture trace to " << path << std::endl;
+        return true;
+    }
+
+    // Fix the captured region on the first frame. Returns false, and ends
+    // the trace, once a frame no longer matches it.
+    bool SetRegion(DXGI_FORMAT format, const D3D11_BOX& region)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_file)
+            return false;
+        UINT width = RegionWidth(region), height = RegionHeight(region);
+        if (m_header.width == 0)
+        {
+            m_header.format = format;
+            m_header.width = width;
+            m_header.height = height;
+            m_header.originX = static_cast<int32_t>(region.left);
+            m_header.originY = static_cast<int32_t>(region.top);
+            WriteHeader();
+            return true;
+        }
+        if (m_header.format == static_cast<uint32_t>(format) && m_header.width == width && m_header.height == height)
+            return true;
+        std::cout << "The captured region changed; the trace ends here." << std::endl;
+        CloseLocked();
+        return false;
+    }
+
+    void Add(TraceRecordType type, const std::vector<BYTE>& payload)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_file || m_header.width == 0)
+            return;  // Nothing is recorded before the first frame
+        TraceRecordHeader header = { static_cast<uint32_t>(type), static_cast<uint32_t>(payload.size()), QpcNow() - m_startTime };
+        AppendBytes(m_chunk, &header, sizeof(header));
+        AppendBytes(m_chunk, payload.data(), payload.size());
+        m_chunkRecords++;
+        if (type == TraceRecordType::Frame)
+            m_header.frameCount++;
+        if (m_chunk.size() >= kTraceChunkBytes)
+            FlushChunk();
+    }
+
+    void AddInput(const InputEvent& event)
+    {
+        uint32_t type = static_cast<uint32_t>(event.type);
+        std::vector<BYTE> payload;
+        AppendBytes(payload, &type, sizeof(type));
+        Add(TraceRecordType::Input, payload);
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        CloseLocked();
+        if (m_compressor)
+        {
+            CloseCompressor(m_compressor);
+            m_compressor = nullptr;
+        }
+    }
+
+private:
+    void WriteHeader()
+    {
+        std::streampos end = m_file.tellp();
+        m_file.seekp(0);
+        m_file.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+        if (end > 0)
+            m_file.seekp(end);
+    }
+
+    // Compress the gathered records into a chunk. Chunks that do not shrink
+    // are stored as they are.
+    void FlushChunk()
+    {
+        if (m_chunk.empty())
+            return;
+        TraceChunkHeader header = { 0, static_cast<uint32_t>(m_chunk.size()), 1, m_chunkRecords };
+        SIZE_T compressedSize = 0;
+        if (!Compress(m_compressor, m_chunk.data(), m_chunk.size(), nullptr, 0, &compressedSize) &&
+            GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+        {
+            m_compressed.resize(compressedSize);
+            if (!Compress(m_compressor, m_chunk.data(), m_chunk.size(), m_compressed.data(), m_compressed.size(), &compressedSize))
+                compressedSize = 0;
+        }
+        const std::vector<BYTE>* stored = &m_compressed;
+        if (compressedSize == 0 || compressedSize >= m_chunk.size())
+        {
+            header.compressed = 0;
+            compressedSize = m_chunk.size();
+            stored = &m_chunk;
+        }
+        header.storedBytes = static_cast<uint32_t>(compressedSize);
+        m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        m_file.write(reinterpret_cast<const char*>(stored->data()), static_cast<std::streamsize>(compressedSize));
+        m_chunk.clear();
+        m_chunkRecords = 0;
+        if (!m_file)
+        {
+            std::cerr << "Failed to write the capture trace; recording stopped." << std::endl;
+            m_file.close();
+        }
+    }
+
+    void CloseLocked()
+    {
+        if (!m_file.is_open())
+            return;
+        FlushChunk();
+        if (m_file.is_open())
+        {
+            WriteHeader();
+            std::cout << "Capture trace closed: " << m_header.frameCount << " frames." << std::endl;
+            m_file.close();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::ofstream m_file;
+    COMPRESSOR_HANDLE m_compressor = nullptr;
+    TraceFileHeader m_header = {};
+    LONGLONG m_startTime = 0;
+    std::vector<BYTE> m_chunk;       // Records of the chunk being gathered
+    uint32_t m_chunkRecords = 0;
+    std::vector<BYTE> m_compressed;
+};
+std::unique_ptr<TraceWriter> g_TraceWriter;
+
+// Capture source that records the frames of another one into g_TraceWriter.
+// The changed pixels are read back through a staging texture, which stalls
+// the acquiring thread for a moment on every image update; a recording run
+// measures the desktop, not the magnifier.
+class TraceRecordingSource : public CaptureSource {
+public:
+    explicit TraceRecordingSource(std::unique_ptr<CaptureSource> inner) : m_inner(std::move(inner)) {}
+
+    const char* Name() const override { return m_inner->Name(); }
+
+    HRESULT AcquireFrame(UINT timeoutMs, CapturedFrame& frame) override
+    {
+        HRESULT hr = m_inner->AcquireFrame(timeoutMs, frame);
+        if (SUCCEEDED(hr))
+            Record(frame);
+        return hr;
+    }
+
+    void ReleaseFrame() override { m_inner->ReleaseFrame(); }
+
+    HRESULT Reconnect() override
+    {
+        m_fullImage = true;
+        return m_inner->Reconnect();
+    }
+
+    HRESULT MapFrame(DXGI_MAPPED_RECT& mapped) override { return m_inner->MapFrame(mapped); }
+    void UnmapFrame() override { m_inner->UnmapFrame(); }
+
+private:
+    // Write one frame. The first one carries the whole region, so the replay
+    // starts from the same image.
+    void Record(const CapturedFrame& frame)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        frame.texture->GetDesc(&desc);
+        if (!g_TraceWriter->SetRegion(desc.Format, frame.region))
+            return;
+        LONG width = static_cast<LONG>(RegionWidth(frame.region));
+        LONG height = static_cast<LONG>(RegionHeight(frame.region));
+        RECT bounds = { 0, 0, width, height };
+        m_pixelRects.clear();
+        if (m_fullImage || (frame.imageUpdated && !frame.haveChangedRects))
+        {
+            m_pixelRects.push_back(bounds);
+        }
+        else if (frame.imageUpdated)
+        {
+            for (const RECT& rect : g_ChangedRects)
+            {
+                RECT clipped;
+                if (IntersectRect(&clipped, &rect, &bounds))
+                    m_pixelRects.push_back(clipped);
+            }
+        }
+
+        TraceFrameRecord record = {};
+        record.frameInfo = frame.frameInfo;
+        record.imageUpdated = frame.imageUpdated;
+        record.haveChangedRects = frame.haveChangedRects;
+        record.changedRectCount = frame.haveChangedRects ? static_cast<uint32_t>(g_ChangedRects.size()) : 0;
+        record.pixelRectCount = static_cast<uint32_t>(m_pixelRects.size());
+        if (frame.frameInfo.PointerShapeBufferSize > 0 && g_LastPointerShape.size > 0)
+        {
+            record.shapeBytes = g_LastPointerShape.size;
+            record.shapeScale = g_LastPointerShape.linearScale;
+            record.shapeInfo = g_LastPointerShape.info;
+        }
+        m_payload.clear();
+        AppendBytes(m_payload, &record, sizeof(record));
+        if (frame.haveChangedRects)
+            AppendBytes(m_payload, g_ChangedRects.data(), g_ChangedRects.size() * sizeof(RECT));
+        AppendBytes(m_payload, g_PointerShapeBuffer.data(), record.shapeBytes);
+        if (!m_pixelRects.empty() && !AppendPixels(frame, desc.Format))
+            return;
+        g_TraceWriter->Add(TraceRecordType::Frame, m_payload);
+        m_fullImage = false;
+    }
+
+    // Read back m_pixelRects of the frame and append them to m_payload.
+    bool AppendPixels(const CapturedFrame& frame, DXGI_FORMAT format)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        if (m_staging)
+            m_staging->GetDesc(&desc);
+        if (!m_staging || desc.Width != RegionWidth(frame.region) || desc.Height != RegionHeight(frame.region) || desc.Format != format)
+        {
+            m_staging.Reset();
+            desc = {};
+            desc.Width = RegionWidth(frame.region);
+            desc.Height = RegionHeight(frame.region);
+            desc.MipLevels = 1;
+            desc.ArraySize = 1;
+            desc.Format = format;
+            desc.SampleDesc.Count = 1;
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &m_staging);
+            if (FAILED(hr))
+            {
+                std::cout << "Failed to create the trace staging texture: " << HrToString(hr) << std::endl;
+                return false;
+            }
+            TrackAllocation(m_staging.Get(), GpuMemoryUse::Staging);
+        }
+        for (const RECT& rect : m_pixelRects)
+        {
+            D3D11_BOX box = { frame.region.left + rect.left, frame.region.top + rect.top, 0,
+                frame.region.left + rect.right, frame.region.top + rect.bottom, 1 };
+            g_D3DContext->CopySubresourceRegion(m_staging.Get(), 0, rect.left, rect.top, 0, frame.texture.Get(), 0, &box);
+        }
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        HRESULT hr = g_D3DContext->Map(m_staging.Get(), 0, D3D11_MAP_READ, 0, &mapped);
+        if (FAILED(hr))
+        {
+            std::cout << "Failed to read back the traced frame: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        size_t texelSize = BytesPerPixel(format);
+        for (const RECT& rect : m_pixelRects)
+        {
+            AppendBytes(m_payload, &rect, sizeof(rect));
+            size_t rowBytes = static_cast<size_t>(rect.right - rect.left) * texelSize;
+            for (LONG y = rect.top; y < rect.bottom; y++)
+            {
+                const BYTE* row = static_cast<const BYTE*>(mapped.pData) +
+                    static_cast<size_t>(y) * mapped.RowPitch + static_cast<size_t>(rect.left) * texelSize;
+                AppendBytes(m_payload, row, rowBytes);
+            }
+        }
+        g_D3DContext->Unmap(m_staging.Get(), 0);
+        return true;
+    }
+
+    std::unique_ptr<CaptureSource> m_inner;
+    ComPtr<ID3D11Texture2D> m_staging;   // Region-sized readback target
+    std::vector<RECT> m_pixelRects;      // Rectangles whose pixels the current frame records
+    std::vector<BYTE> m_payload;
+    bool m_fullImage = true;
+};
+
+// Reads a capture trace for --trace-replay and gathers the replay report.
+// Owned by the render thread.
+class TraceReplay {
+public:
+    ~TraceReplay()
+    {
+        if (m_view)
+            UnmapViewOfFile(m_view);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        if (m_decompressor)
+            CloseDecompressor(m_decompressor);
+    }
+
+    bool Open(const std::string& path)
+    {
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER fileSize = {};
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &fileSize))
+        {
+            std::cerr << "Failed to open trace file " << path << std::endl;
+            return false;
+        }
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping)
+            m_view = static_cast<const BYTE*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!m_view)
+        {
+            std::cerr << "Failed to map trace file " << path << ": " << GetLastError() << std::endl;
+            return false;
+        }
+        m_size = static_cast<size_t>(fileSize.QuadPart);
+        if (m_size >= sizeof(m_header))
+            memcpy(&m_header, m_view, sizeof(m_header));
+        // Only the formats duplication and Windows.Graphics.Capture deliver.
+        DXGI_FORMAT format = static_cast<DXGI_FORMAT>(m_header.format);
+        bool knownFormat = format == DXGI_FORMAT_B8G8R8A8_UNORM || format == DXGI_FORMAT_R8G8B8A8_UNORM ||
+            format == DXGI_FORMAT_R16G16B16A16_FLOAT || format == DXGI_FORMAT_R10G10B10A2_UNORM;
+        if (m_size < sizeof(m_header) || memcmp(m_header.magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+            m_header.version != kTraceVersion || m_header.width == 0 || m_header.height == 0 || !knownFormat)
+        {
+            std::cerr << path << " is not a capture trace." << std::endl;
+            return false;
+        }
+        if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &m_decompressor))
+        {
+            std::cerr << "CreateDecompressor failed: " << GetLastError() << std::endl;
+            return false;
+        }
+        m_offset = sizeof(m_header);
+        std::cout << "Replaying " << path << ": " << m_header.width << "x" << m_header.height << ", "
+            << m_header.frameCount << " frames." << std::endl;
+        return true;
+    }
+
+    const TraceFileHeader& Header() const { return m_header; }
+    bool Started() const { return !m_frames.empty(); }
+
+    // Return the next record; data stays valid until the next call. Returns
+    // false at the end of the trace or on a damaged chunk.
+    bool Next(TraceRecordType& type, const BYTE*& data, uint32_t& size)
+    {
+        while (m_recordOffset + sizeof(TraceRecordHeader) > m_records.size())
+        {
+            if (!ReadChunk())
+                return false;
+        }
+        TraceRecordHeader header;
+        memcpy(&header, m_records.data() + m_recordOffset, sizeof(header));
+        m_recordOffset += sizeof(header);
+        if (header.size > m_records.size() - m_recordOffset)
+        {
+            std::cout << "The capture trace is damaged; stopping the replay." << std::endl;
+            return false;
+        }
+        type = static_cast<TraceRecordType>(header.type);
+        data = m_records.data() + m_recordOffset;
+        size = header.size;
+        m_recordOffset += header.size;
+        m_lastTime = header.time;
+        return true;
+    }
+
+    // Queue an input event of the trace for DrainInputEvents().
+    void QueueInput(InputEventType type) { m_input.push_back({ type, QpcNow() }); }
+
+    bool PopInput(InputEvent& event)
+    {
+        if (m_inputRead == m_input.size())
+        {
+            m_input.clear();
+            m_inputRead = 0;
+            return false;
+        }
+        event = m_input[m_inputRead++];
+        return true;
+    }
+
+    // Account the frame just handed to the pipeline. The previous frame ends
+    // here: its time covers the loop iteration that processed it, and it was
+    // rendered if anything was presented since.
+    void BeginFrame(bool imageUpdated, size_t changedRects, uint64_t changedPixels)
+    {
+        EndFrame();
+        m_start = QpcNow();
+        m_presentCount = g_PresentCount;
+        m_frames.push_back({ m_lastTime, imageUpdated, static_cast<uint32_t>(changedRects), changedPixels, false, 0.0 });
+    }
+
+    // Close the last frame, print the summary and write the per-frame report.
+    void Finish(const std::string& reportPath)
+    {
+        EndFrame();
+        if (m_frames.empty())
+            return;
+        double texelBytes = BytesPerPixel(static_cast<DXGI_FORMAT>(m_header.format));
+        std::ofstream report(reportPath, std::ios::trunc);
+        if (report)
+            report << "frame,trace_ms,image_updated,changed_rects,changed_pixels,rendered,frame_us,copy_bytes\n";
+        std::vector<double> durations;
+        size_t rendered = 0;
+        double copyBytes = 0.0;
+        double totalUs = 0.0;
+        for (size_t i = 0; i < m_frames.size(); i++)
+        {
+            const ReplayFrame& frame = m_frames[i];
+            // A copy reads and writes every changed texel.
+            double bytes = 2.0 * static_cast<double>(frame.changedPixels) * texelBytes;
+            copyBytes += bytes;
+            totalUs += frame.durationUs;
+            rendered += frame.rendered;
+            durations.push_back(frame.durationUs);
+            if (report)
+                report << i << ',' << QpcToTraceMs(frame.time) << ',' << frame.imageUpdated << ',' << frame.changedRects << ','
+                    << frame.changedPixels << ',' << frame.rendered << ',' << frame.durationUs << ',' << bytes << '\n';
+        }
+        std::sort(durations.begin(), durations.end());
+        double seconds = std::max(totalUs / 1e6, 1e-6);
+        // Each render writes the back buffer and, at most, reads as much source.
+        double renderBytes = 2.0 * rendered * g_ScreenWidth * g_ScreenHeight * BytesPerPixel(g_BackBufferFormat);
+        std::cout << "Replayed " << m_frames.size() << " frames (" << QpcToTraceMs(m_lastTime) / 1000.0 << " s of trace) in "
+            << seconds << " s, " << m_frames.size() / seconds << " frames/s." << std::endl;
+        std::cout << "  rendered " << rendered << ", skipped " << (m_frames.size() - rendered) << std::endl;
+        std::cout << "  frame p50 " << durations[durations.size() / 2] << " us, p99 "
+            << durations[std::min(durations.size() - 1, durations.size() * 99 / 100)] << " us" << std::endl;
+        std::cout << "  copy traffic " << copyBytes / 1048576.0 << " MB (" << copyBytes / seconds / 1e9 << " GB/s), render traffic about "
+            << renderBytes / 1048576.0 << " MB (" << renderBytes / seconds / 1e9 << " GB/s)" << std::endl;
+        if (report)
+            std::cout << "Per-frame replay report written to " << reportPath << std::endl;
+        m_frames.clear();
+    }
+
+private:
+    struct ReplayFrame {
+        int64_t time;            // Trace time of the frame record
+        bool imageUpdated;
+        uint32_t changedRects;
+        uint64_t changedPixels;
+        bool rendered;
+        double durationUs;
+    };
+
+    void EndFrame()
+    {
+        if (m_frames.empty() || m_start == 0)
+            return;
+        ReplayFrame& frame = m_frames.back();
+        frame.durationUs = QpcToMicroseconds(QpcNow() - m_start);
+        frame.rendered = g_PresentCount != m_presentCount;
+        m_start = 0;
+    }
+
+    double QpcToTraceMs(int64_t ticks) const
+    {
+        return m_header.qpcFrequency > 0 ? ticks * 1000.0 / m_header.qpcFrequency : 0.0;
+    }
+
+    // Expand the next chunk into m_records.
+    bool ReadChunk()
+    {
+        TraceChunkHeader header;
+        if (m_offset + sizeof(header) > m_size)
+            return false;
+        memcpy(&header, m_view + m_offset, sizeof(header));
+        m_offset += sizeof(header);
+        if (header.storedBytes > m_size - m_offset)
+        {
+            std::cout << "The capture trace ends in the middle of a chunk." << std::endl;
+            return false;
+        }
+        const BYTE* stored = m_view + m_offset;
+        m_offset += header.storedBytes;
+        m_records.resize(header.rawBytes);
+        m_recordOffset = 0;
+        if (!header.compressed)
+        {
+            if (header.storedBytes != header.rawBytes)
+                return false;
+            memcpy(m_records.data(), stored, header.rawBytes);
+            return true;
+        }
+        SIZE_T expanded = 0;
+        if (!Decompress(m_decompressor, stored, header.storedBytes, m_records.data(), m_records.size(), &expanded) ||
+            expanded != header.rawBytes)
+        {
+            std::cout << "Failed to decompress a trace chunk: " << GetLastError() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+    const BYTE* m_view = nullptr;     // The whole file, paged in as chunks are read
+    size_t m_size = 0;
+    size_t m_offset = 0;              // Next chunk
+    DECOMPRESSOR_HANDLE m_decompressor = nullptr;
+    TraceFileHeader m_header = {};
+    std::vector<BYTE> m_records;      // Expanded records of the current chunk
+    size_t m_recordOffset = 0;
+    int64_t m_lastTime = 0;           // Time of the last record read
+    std::vector<InputEvent> m_input;  // Events waiting for DrainInputEvents()
+    size_t m_inputRead = 0;
+    std::vector<ReplayFrame> m_frames;
+    LONGLONG m_start = 0;             // QPC time the current frame was handed out
+    uint64_t m_presentCount = 0;      // g_PresentCount at that time
+};
+std::unique_ptr<TraceReplay> g_TraceReplay;
+
+// Capture source that plays g_TraceReplay back. Each frame record becomes one
+// frame, without waiting: its pixels are uploaded into a texture that stands
+// in for the duplication surface and its changed rectangles and pointer are
+// published as DuplicationCapture would. Input records are queued for
+// DrainInputEvents(). At the end of the trace the magnifier exits.
+class TraceReplaySource : public CaptureSource {
+public:
+    const char* Name() const override { return "trace replay"; }
+
+    HRESULT AcquireFrame(UINT timeoutMs, CapturedFrame& frame) override
+    {
+        TraceRecordType type;
+        const BYTE* data = nullptr;
+        uint32_t size = 0;
+        while (g_TraceReplay->Next(type, data, size))
+        {
+            if (type == TraceRecordType::Input && size >= sizeof(uint32_t))
+            {
+                uint32_t eventType;
+                memcpy(&eventType, data, sizeof(eventType));
+                g_TraceReplay->QueueInput(static_cast<InputEventType>(eventType));
+            }
+            else if (type == TraceRecordType::Frame)
+            {
+                HRESULT hr = ApplyFrame(data, size, frame);
+                if (hr != S_FALSE)
+                    return hr;
+            }
+        }
+        g_Running = false;
+        return DXGI_ERROR_WAIT_TIMEOUT;
+    }
+
+    void ReleaseFrame() override {}
+
+private:
+    // Bring one frame record into m_texture and the capture globals. Returns
+    // S_FALSE if the record is damaged, in which case it is skipped.
+    HRESULT ApplyFrame(const BYTE* data, uint32_t size, CapturedFrame& frame)
+    {
+        const TraceFileHeader& header = g_TraceReplay->Header();
+        TraceFrameRecord record;
+        if (size < sizeof(record))
+            return S_FALSE;
+        memcpy(&record, data, sizeof(record));
+        const BYTE* end = data + size;
+        const BYTE* cursor = data + sizeof(record);
+        if (static_cast<size_t>(end - cursor) < static_cast<size_t>(record.changedRectCount) * sizeof(RECT) + record.shapeBytes)
+            return S_FALSE;
+
+        if (!m_texture)
+        {
+            D3D11_TEXTURE2D_DESC desc = {};
+            desc.Width = header.width;
+            desc.Height = header.height;
+            desc.MipLevels = 1;
+            desc.ArraySize = 1;
+            desc.Format = static_cast<DXGI_FORMAT>(header.format);
+            desc.SampleDesc.Count = 1;
+            desc.Usage = D3D11_USAGE_DEFAULT;
+            desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+            HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &m_texture);
+            if (FAILED(hr))
+            {
+                std::cerr << "Failed to create the replay texture: " << HrToString(hr) << std::endl;
+                return hr;
+            }
+            TrackAllocation(m_texture.Get(), GpuMemoryUse::Trace);
+        }
+
+        g_ChangedRects.resize(record.changedRectCount);
+        memcpy(g_ChangedRects.data(), cursor, g_ChangedRects.size() * sizeof(RECT));
+        cursor += g_ChangedRects.size() * sizeof(RECT);
+        const BYTE* shapeBits = cursor;
+        cursor += record.shapeBytes;
+
+        RECT bounds = { 0, 0, static_cast<LONG>(header.width), static_cast<LONG>(header.height) };
+        size_t texelSize = BytesPerPixel(static_cast<DXGI_FORMAT>(header.format));
+        for (uint32_t i = 0; i < record.pixelRectCount; i++)
+        {
+            RECT rect;
+            if (static_cast<size_t>(end - cursor) < sizeof(rect))
+                return S_FALSE;
+            memcpy(&rect, cursor, sizeof(rect));
+            cursor += sizeof(rect);
+            RECT clipped;
+            if (!IntersectRect(&clipped, &rect, &bounds) || !EqualRect(&clipped, &rect))
+                return S_FALSE;
+            size_t rowBytes = static_cast<size_t>(rect.right - rect.left) * texelSize;
+            size_t bytes = rowBytes * static_cast<size_t>(rect.bottom - rect.top);
+            if (static_cast<size_t>(end - cursor) < bytes)
+                return S_FALSE;
+            D3D11_BOX box = { static_cast<UINT>(rect.left), static_cast<UINT>(rect.top), 0,
+                static_cast<UINT>(rect.right), static_cast<UINT>(rect.bottom), 1 };
+            g_D3DContext->UpdateSubresource(m_texture.Get(), 0, &box, cursor, static_cast<UINT>(rowBytes), 0);
+            cursor += bytes;
+        }
+
+        // The pointer is placed as on the recorded texture, whose region may
+        // not have started at its corner.
+        D3D11_BOX pointerRegion = { static_cast<UINT>(header.originX), static_cast<UINT>(header.originY), 0,
+            static_cast<UINT>(header.originX) + header.width, static_cast<UINT>(header.originY) + header.height, 1 };
+        if (record.frameInfo.LastMouseUpdateTime.QuadPart != 0)
+            PublishPointer(record.frameInfo, pointerRegion, record.shapeBytes ? &record.shapeInfo : nullptr,
+                shapeBits, record.shapeBytes, record.shapeScale);
+
+        frame.texture = m_texture;
+        frame.region = { 0, 0, 0, header.width, header.height, 1 };
+        frame.imageUpdated = record.imageUpdated != 0;
+        frame.haveChangedRects = record.haveChangedRects != 0;
+        frame.frameInfo = record.frameInfo;
+
+        // What the pipeline copies out of this frame.
+        uint64_t changedPixels = 0;
+        if (frame.imageUpdated)
+        {
+            if (!frame.haveChangedRects)
+                changedPixels = static_cast<uint64_t>(RectArea(bounds));
+            for (const RECT& rect : g_ChangedRects)
+                changedPixels += static_cast<uint64_t>(RectArea(rect));
+        }
+        g_TraceReplay->BeginFrame(frame.imageUpdated, g_ChangedRects.size(), changedPixels);
+        return S_OK;
+    }
+
+    ComPtr<ID3D11Texture2D> m_texture;  // The replayed desktop image
+};
+
+std::unique_ptr<CaptureSource> g_CaptureSource;
+HMONITOR g_CaptureMonitor = nullptr;  // Monitor being captured
+std::atomic<bool> g_DeviceLost{ false };  // Set by either thread; the render thread rebuilds the device
+const DWORD kReconnectIntervalMs = 10;    // Retry period while a capture source is lost
+
+// Capture state of one monitor. Every output is duplicated up front so the
+// magnifier can follow the cursor without calling DuplicateOutput on each
+// crossing, but only the active output is acquired from. Its state lives in
+// the capture globals above; the other outputs keep theirs parked here.
+struct OutputSession {
+    HMONITOR monitor = nullptr;
+    double refreshRate = 0.0;
+    std::unique_ptr<CaptureSource> source;  // Null while the output is active
+    ComPtr<ID3D11Texture2D>          desktopTexture;
+    ComPtr<ID3D11ShaderResourceView> desktopTextureView;
+    bool desktopTextureValid = false;
+    FrameRing ring;
+};
+std::vector<std::unique_ptr<OutputSession>> g_Outputs;
+std::atomic<int> g_ActiveOutput{ 0 };  // Output under the cursor, chosen by the render thread
+int g_CaptureOutput = 0;               // Output loaded into the capture globals, owned by the capturing thread
+
+// Load the parked state of an output into the capture globals.
+void LoadCaptureOutput(int index)
+{
+    OutputSession& session = *g_Outputs[index];
+    g_CaptureSource = std::move(session.source);
+    g_DesktopTexture = std::move(session.desktopTexture);
+    g_DesktopTextureView = std::move(session.desktopTextureView);
+    g_DesktopTextureValid = session.desktopTextureValid;
+    g_CaptureMonitor = session.monitor;
+    g_CaptureRing = &session.ring;
+    g_CaptureOutput = index;
+}
+
+// Park the active output and load another one. Called only by the thread
+// that acquires frames, with no frame held. The parked duplication keeps
+// accumulating changes, which arrive with its first frame once it is
+// active again.
+void SwitchCaptureOutput(int index)
+{
+    OutputSession& session = *g_Outputs[g_CaptureOutput];
+    session.source = std::move(g_CaptureSource);
+    session.desktopTexture = std::move(g_DesktopTexture);
+    session.desktopTextureView = std::move(g_DesktopTextureView);
+    session.desktopTextureValid = g_DesktopTextureValid;
+    g_CpuDesktop.valid = false;  // Only the active output has a CPU copy
+    ResetFrameSurfaceViews();
+    LoadCaptureOutput(index);
+}
+
+// Create a Windows.Graphics.Capture source for the configured window, or for
+// the captured monitor if no window was given. On an HDR display frames are
+// requested as scRGB FP16, which the compositor produces without tone
+// mapping.
+std::unique_ptr<CaptureSource> CreateGraphicsCaptureSource()
+{
+    wgc::GraphicsCaptureItem item{ nullptr };
+    HMONITOR monitor = nullptr;
+    try
+    {
+        if (!wgc::GraphicsCaptureSession::IsSupported())
+        {
+            std::cerr << "Windows.Graphics.Capture is not supported on this system." << std::endl;
+            return nullptr;
+        }
+        auto interop = winrt::get_activation_factory<wgc::GraphicsCaptureItem, IGraphicsCaptureItemInterop>();
+        if (!g_Options.captureWindowTitle.empty())
+        {
+            HWND window = FindWindowW(nullptr, g_Options.captureWindowTitle.c_str());
+            if (!window)
+            {
+                std::wcerr << L"No window titled \"" << g_Options.captureWindowTitle << L"\" to capture." << std::endl;
+                return nullptr;
+            }
+            winrt::check_hresult(interop->CreateForWindow(window, winrt::guid_of<wgc::IGraphicsCaptureItem>(), winrt::put_abi(item)));
+            monitor = MonitorFromWindow(window, MONITOR_DEFAULTTOPRIMARY);
+        }
+        else
+        {
+            monitor = g_CaptureMonitor ? g_CaptureMonitor : MonitorFromPoint(POINT{ 0, 0 }, MONITOR_DEFAULTTOPRIMARY);
+            winrt::check_hresult(interop->CreateForMonitor(monitor, winrt::guid_of<wgc::IGraphicsCaptureItem>(), winrt::put_abi(item)));
+        }
+    }
+    catch (winrt::hresult_error const& e)
+    {
+        std::cerr << "Failed to create capture item: " << HrToString(e.code()) << std::endl;
+        return nullptr;
+    }
+
+    bool hdr = !g_Options.forceSdr && QueryDisplayColor(monitor).hdr;
+    auto source = std::make_unique<GraphicsCaptureSource>();
+    if (!source->Initialize(item, hdr ? wgdx::DirectXPixelFormat::R16G16B16A16Float : wgdx::DirectXPixelFormat::B8G8R8A8UIntNormalized))
+        return nullptr;
+    return source;
+}
+
+// Note that the capture source lost access (DXGI_ERROR_ACCESS_LOST), as happens
+// for UAC prompts, the lock screen, mode changes and fullscreen games. Nothing
+// is torn down: the desktop copies are marked stale and RecoverCapture()
+// reconnects the source.
+void HandleCaptureLost()
+{
+    std::cout << "Access lost to " << g_CaptureSource->Name() << ", reconnecting..." << std::endl;
+    g_CaptureSource->lostTime = QpcNow();
+    g_DesktopTextureValid = false;
+    g_CpuDesktop.valid = false;
+    for (int i = 0; i < FrameRing::kSlotCount; i++)
+        g_CaptureRing->needsFullCopy[i] = true;
+}
+
+// Try to bring a lost capture source back. Called every kReconnectIntervalMs
+// while it is lost. Only the capture session is re-created; the device,
+// rings and swap chain stay, so the picture returns within one interval of
+// the desktop becoming available again. A source that cannot reconnect is
+// dropped, and in auto mode a lost duplication session falls back to
+// Windows.Graphics.Capture.
+bool RecoverCapture()
+{
+    HRESULT hr = g_CaptureSource->Reconnect();
+    if (SUCCEEDED(hr))
+    {
+        ReportRecovery("Capture", g_CaptureSource->lostTime);
+        g_CaptureSource->lostTime = 0;
+        return true;
+    }
+    if (DeviceWasRemoved(hr))
+    {
+        g_DeviceLost = true;
+        return false;
+    }
+    if (IsTransientDuplicationError(hr))
+        return false;
+
+    if (hr != E_NOTIMPL)
+        std::cout << "Reconnecting " << g_CaptureSource->Name() << " failed: " << HrToString(hr) << std::endl;
+    bool wasDuplication = dynamic_cast<DuplicationCapture*>(g_CaptureSource.get()) != nullptr;
+    LONGLONG lostTime = g_CaptureSource->lostTime;
+    g_CaptureSource.reset();
+    if (g_Options.captureBackend == CaptureBackend::Auto && wasDuplication)
+        g_CaptureSource = CreateGraphicsCaptureSource();
+    if (!g_CaptureSource)
+        return false;
+    ReportRecovery("Capture", lostTime);
+    return true;
+}
+
+// Return the refresh rate of a monitor in Hz, or 0 if it cannot be read.
+double GetMonitorRefreshRate(HMONITOR monitor)
+{
+    MONITORINFOEXW monitorInfo = {};
+    monitorInfo.cbSize = sizeof(monitorInfo);
+    if (!GetMonitorInfoW(monitor, &monitorInfo))
+        return 0.0;
+    DEVMODEW mode = {};
+    mode.dmSize = sizeof(mode);
+    if (!EnumDisplaySettingsW(monitorInfo.szDevice, ENUM_CURRENT_SETTINGS, &mode) || mode.dmDisplayFrequency <= 1)
+        return 0.0;
+    return static_cast<double>(mode.dmDisplayFrequency);
+}
+
+// Return the part of the desktop magnified at the given zoom, in source pixels.
+// A one pixel border is included for the bilinear filter footprint.
+RECT GetMagnifiedSourceRect(UINT sourceWidth, UINT sourceHeight, float zoom)
+{
+    // A lens covers its own size in source pixels at 1.0x.
+    float viewWidth = g_Options.lensWidth ? std::min<float>(g_Options.lensWidth, sourceWidth) : sourceWidth;
+    float viewHeight = g_Options.lensHeight ? std::min<float>(g_Options.lensHeight, sourceHeight) : sourceHeight;
+    float halfWidth = 0.5f * viewWidth / zoom;
+    float halfHeight = 0.5f * viewHeight / zoom;
+    float centerX = g_SharedCenter[0].load(std::memory_order_relaxed) * sourceWidth;
+    float centerY = g_SharedCenter[1].load(std::memory_order_relaxed) * sourceHeight;
+    RECT rect;
+    rect.left = std::max(0L, static_cast<LONG>(std::floor(centerX - halfWidth)) - 1);
+    rect.top = std::max(0L, static_cast<LONG>(std::floor(centerY - halfHeight)) - 1);
+    rect.right = std::min(static_cast<LONG>(sourceWidth), static_cast<LONG>(std::ceil(centerX + halfWidth)) + 1);
+    rect.bottom = std::min(static_cast<LONG>(sourceHeight), static_cast<LONG>(std::ceil(centerY + halfHeight)) + 1);
+    return rect;
+}
+
+// Return true if any rectangle in g_ChangedRects overlaps the given region.
+bool ChangedRectsIntersect(const RECT& region)
+{
+    RECT overlap;
+    for (const RECT& rect : g_ChangedRects)
+    {
+        if (IntersectRect(&overlap, &rect, &region))
+            return true;
+    }
+    return false;
+}
+
+// Return true if inner lies entirely within outer.
+bool RectContains(const RECT& outer, const RECT& inner)
+{
+    return inner.left >= outer.left && inner.top >= outer.top &&
+        inner.right <= outer.right && inner.bottom <= outer.bottom;
+}
+
+// Return the crop a ring slot needs in ROI mode: the magnified area at the
+// given zoom plus a guard band for the filter footprint.
+RECT GetRegionOfInterest(UINT sourceWidth, UINT sourceHeight, float zoom)
+{
+    RECT rect = GetMagnifiedSourceRect(sourceWidth, sourceHeight, zoom);
+    rect.left = std::max(0L, rect.left - FrameRing::kGuardBand);
+    rect.top = std::max(0L, rect.top - FrameRing::kGuardBand);
+    rect.right = std::min(static_cast<LONG>(sourceWidth), rect.right + FrameRing::kGuardBand);
+    rect.bottom = std::min(static_cast<LONG>(sourceHeight), rect.bottom + FrameRing::kGuardBand);
+    return rect;
+}
+
+// Bring g_DesktopTexture up to date with the captured frame. The first frame
+// (or one without usable metadata) is copied whole; after that only the
+// changed regions are copied, since the captured surface always holds the
+// complete current image.
+bool UpdateDesktopTexture(const CapturedFrame& frame)
+{
+    D3D11_TEXTURE2D_DESC surfaceDesc = {};
+    frame.texture->GetDesc(&surfaceDesc);
+    UINT width = RegionWidth(frame.region);
+    UINT height = RegionHeight(frame.region);
+
+    if (g_DesktopTexture)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        g_DesktopTexture->GetDesc(&desc);
+        if (desc.Width != width || desc.Height != height || desc.Format != surfaceDesc.Format)
+        {
+            g_DesktopTextureView.Reset();
+            g_DesktopTexture.Reset();
+        }
+    }
+    if (!g_DesktopTexture)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = width;
+        desc.Height = height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = surfaceDesc.Format;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &g_DesktopTexture);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to create desktop texture: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        TrackAllocation(g_DesktopTexture.Get(), GpuMemoryUse::DesktopCopy);
+        hr = g_D3DDevice->CreateShaderResourceView(g_DesktopTexture.Get(), nullptr, &g_DesktopTextureView);
+        if (FAILED(hr))
+        {
+            std::cerr << "Create desktop texture view failed: " << HrToString(hr) << std::endl;
+            g_DesktopTexture.Reset();
+            return false;
+        }
+        g_DesktopTextureValid = false;
+    }
+
+    if (!g_DesktopTextureValid || !frame.haveChangedRects)
+    {
+        CopyCapturedRegion(g_DesktopTexture.Get(), frame);
+        g_DesktopTextureValid = true;
+    }
+    else
+    {
+        CopyCapturedRects(g_DesktopTexture.Get(), frame, g_ChangedRects);
+    }
+    g_Renderer->FrameWritten();
+    return true;
+}
+
+// Bring g_CpuDesktop up to date with the captured frame, as
+// UpdateDesktopTexture() does for the device copy: the whole region the
+// first time, then only the changed regions. A frame the source holds in
+// system memory is read in place, any other through the staging texture.
+bool UpdateCpuDesktop(CaptureSource& source, const CapturedFrame& frame)
+{
+    D3D11_TEXTURE2D_DESC surfaceDesc = {};
+    frame.texture->GetDesc(&surfaceDesc);
+    if (surfaceDesc.Format != DXGI_FORMAT_B8G8R8A8_UNORM)
+    {
+        std::cerr << "The CPU magnifier cannot read a desktop in format " << surfaceDesc.Format << "." << std::endl;
+        return false;
+    }
+    UINT width = RegionWidth(frame.region);
+    UINT height = RegionHeight(frame.region);
+    if (g_CpuDesktop.width != width || g_CpuDesktop.height != height)
+    {
+        g_CpuDesktop.pixels.assign(static_cast<size_t>(width) * height, kOpaque);
+        g_CpuDesktop.width = width;
+        g_CpuDesktop.height = height;
+        g_CpuDesktop.valid = false;
+    }
+    RECT whole = { 0, 0, static_cast<LONG>(width), static_cast<LONG>(height) };
+    bool copyAll = !g_CpuDesktop.valid || !frame.haveChangedRects;
+    const RECT* rects = copyAll ? &whole : g_ChangedRects.data();
+    size_t rectCount = copyAll ? 1 : g_ChangedRects.size();
+
+    // Where the region starts in the mapped image.
+    const BYTE* bits = nullptr;
+    UINT pitch = 0;
+    LONG originX = 0, originY = 0;
+    ID3D11Texture2D* staging = nullptr;
+    DXGI_MAPPED_RECT mapped = {};
+    if (SUCCEEDED(source.MapFrame(mapped)))
+    {
+        bits = mapped.pBits;
+        pitch = static_cast<UINT>(mapped.Pitch);
+        originX = static_cast<LONG>(frame.region.left);
+        originY = static_cast<LONG>(frame.region.top);
+    }
+    else
+    {
+        // The copies put the region at the top left of the staging texture.
+        staging = GetStagingTexture(surfaceDesc);
+        if (!staging)
+            return false;
+        if (copyAll)
+            CopyCapturedRegion(staging, frame);
+        else
+            CopyCapturedRects(staging, frame, g_ChangedRects);
+        D3D11_MAPPED_SUBRESOURCE subresource = {};
+        HRESULT hr = g_D3DContext->Map(staging, 0, D3D11_MAP_READ, 0, &subresource);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to map the staging texture: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        bits = static_cast<const BYTE*>(subresource.pData);
+        pitch = subresource.RowPitch;
+    }
+
+    for (size_t i = 0; i < rectCount; i++)
+    {
+        LONG left = std::max(0L, rects[i].left);
+        LONG top = std::max(0L, rects[i].top);
+        LONG right = std::min(static_cast<LONG>(width), rects[i].right);
+        LONG bottom = std::min(static_cast<LONG>(height), rects[i].bottom);
+        if (left >= right || top >= bottom)
+            continue;
+        for (LONG y = top; y < bottom; y++)
+            memcpy(&g_CpuDesktop.pixels[static_cast<size_t>(y) * width + left],
+                bits + static_cast<size_t>(originY + y) * pitch + static_cast<size_t>(originX + left) * 4,
+                static_cast<size_t>(right - left) * 4);
+    }
+    if (staging)
+        g_D3DContext->Unmap(staging, 0);
+    else
+        source.UnmapFrame();
+    g_CpuDesktop.valid = true;
+    return true;
+}
+
+// Create the ring textures to match the captured region. Called by the
+// capture thread before its first publish, so the renderer never sees a
+// partially created ring.
+bool CreateFrameRing(FrameRing& ring, const CapturedFrame& frame)
+{
+    D3D11_TEXTURE2D_DESC surfaceDesc = {};
+    frame.texture->GetDesc(&surfaceDesc);
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = RegionWidth(frame.region);
+    desc.Height = RegionHeight(frame.region);
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = surfaceDesc.Format;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    for (int i = 0; i < FrameRing::kSlotCount; i++)
+    {
+        HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &ring.textures[i]);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to create frame ring texture: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        TrackAllocation(ring.textures[i].Get(), GpuMemoryUse::FrameRing);
+        hr = g_D3DDevice->CreateShaderResourceView(ring.textures[i].Get(), nullptr, &ring.views[i]);
+        if (FAILED(hr))
+        {
+            std::cerr << "Create frame ring view failed: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        ring.pendingRects[i].reserve(FrameRing::kMaxPendingRects);
+        ring.needsFullCopy[i] = true;
+        ring.layouts[i] = { { 0, 0, static_cast<LONG>(desc.Width), static_cast<LONG>(desc.Height) },
+            desc.Width, desc.Height, desc.Width, desc.Height };
+    }
+    return true;
+}
+
+// Queue the changed regions of the current frame for every slot. A slot falls
+// back to a full copy when the frame has no usable metadata or too many
+// regions have piled up.
+void QueueFrameRingChanges(FrameRing& ring, bool haveChangedRects)
+{
+    for (int i = 0; i < FrameRing::kSlotCount; i++)
+    {
+        if (ring.needsFullCopy[i])
+            continue;
+        if (!haveChangedRects || ring.pendingRects[i].size() + g_ChangedRects.size() > FrameRing::kMaxPendingRects)
+        {
+            ring.needsFullCopy[i] = true;
+            ring.pendingRects[i].clear();
+            continue;
+        }
+        ring.pendingRects[i].insert(ring.pendingRects[i].end(), g_ChangedRects.begin(), g_ChangedRects.end());
+    }
+}
+
+// Bring the ring's back slot up to date with the captured frame. The back
+// slot copies everything it has missed since it was last written.
+void WriteFrameRingSlot(FrameRing& ring, const CapturedFrame& frame)
+{
+    QueueFrameRingChanges(ring, frame.haveChangedRects);
+
+    int slot = ring.backSlot;
+    if (ring.needsFullCopy[slot])
+        CopyCapturedRegion(ring.textures[slot].Get(), frame);
+    else
+        CopyCapturedRects(ring.textures[slot].Get(), frame, ring.pendingRects[slot]);
+    ring.pendingRects[slot].clear();
+    ring.needsFullCopy[slot] = false;
+}
+
+// ROI mode: copy a crop of g_DesktopTexture into the ring's back slot. The
+// slot texture only grows, in 256 pixel steps, so a widening crop does not
+// reallocate every frame. A slot that already holds this crop copies just
+// the changed regions that fall inside it.
+bool WriteFrameRingCrop(FrameRing& ring, const RECT& crop)
+{
+    D3D11_TEXTURE2D_DESC sourceDesc = {};
+    g_DesktopTexture->GetDesc(&sourceDesc);
+    UINT cropWidth = static_cast<UINT>(crop.right - crop.left);
+    UINT cropHeight = static_cast<UINT>(crop.bottom - crop.top);
+
+    int slot = ring.backSlot;
+    FrameRing::SlotLayout& layout = ring.layouts[slot];
+    D3D11_TEXTURE2D_DESC slotDesc = {};
+    if (ring.textures[slot])
+        ring.textures[slot]->GetDesc(&slotDesc);
+    if (!ring.textures[slot] || slotDesc.Width < cropWidth || slotDesc.Height < cropHeight || slotDesc.Format != sourceDesc.Format)
+    {
+        ring.views[slot].Reset();
+        ring.textures[slot].Reset();
+        slotDesc = sourceDesc;
+        slotDesc.Width = std::min(sourceDesc.Width, (cropWidth + 255) & ~255u);
+        slotDesc.Height = std::min(sourceDesc.Height, (cropHeight + 255) & ~255u);
+        HRESULT hr = g_D3DDevice->CreateTexture2D(&slotDesc, nullptr, &ring.textures[slot]);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to create frame ring texture: " << HrToString(hr) << std::endl;
+            return false;
+        }
+        TrackAllocation(ring.textures[slot].Get(), GpuMemoryUse::FrameRing);
+        hr = g_D3DDevice->CreateShaderResourceView(ring.textures[slot].Get(), nullptr, &ring.views[slot]);
+        if (FAILED(hr))
+        {
+            std::cerr << "Create frame ring view failed: " << HrToString(hr) << std::endl;
+            ring.textures[slot].Reset();
+            return false;
+        }
+        ring.needsFullCopy[slot] = true;
+    }
+
+    if (ring.needsFullCopy[slot] || !EqualRect(&layout.crop, &crop))
+    {
+        D3D11_BOX box = { static_cast<UINT>(crop.left), static_cast<UINT>(crop.top), 0,
+            static_cast<UINT>(crop.right), static_cast<UINT>(crop.bottom), 1 };
+        g_D3DContext->CopySubresourceRegion(ring.textures[slot].Get(), 0, 0, 0, 0, g_DesktopTexture.Get(), 0, &box);
+    }
+    else
+    {
+        RECT clipped;
+        for (const RECT& rect : ring.pendingRects[slot])
+        {
+            if (!IntersectRect(&clipped, &rect, &crop))
+                continue;
+            D3D11_BOX box = { static_cast<UINT>(clipped.left), static_cast<UINT>(clipped.top), 0,
+                static_cast<UINT>(clipped.right), static_cast<UINT>(clipped.bottom), 1 };
+            g_D3DContext->CopySubresourceRegion(ring.textures[slot].Get(), 0,
+                clipped.left - crop.left, clipped.top - crop.top, 0, g_DesktopTexture.Get(), 0, &box);
+        }
+    }
+    layout = { crop, sourceDesc.Width, sourceDesc.Height, slotDesc.Width, slotDesc.Height };
+    ring.pendingRects[slot].clear();
+    ring.needsFullCopy[slot] = false;
+    return true;
+}
+
+// Publish the back slot as the newest frame. A view change that the renderer
+// has not picked up yet is carried over to the new frame.
+void PublishFrameRingSlot(FrameRing& ring, bool viewChanged)
+{
+    ring.captureTimes[ring.backSlot] = ring.lastCaptureTime;
+    uint32_t previous = ring.readyState.load(std::memory_order_relaxed);
+    uint32_t next;
+    do
+    {
+        bool pendingChange = (previous & FrameRing::kNewFrameBit) && (previous & FrameRing::kViewChangedBit);
+        next = static_cast<uint32_t>(ring.backSlot) | FrameRing::kNewFrameBit |
+            ((viewChanged || pendingChange) ? FrameRing::kViewChangedBit : 0);
+    } while (!ring.readyState.compare_exchange_weak(previous, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+    ring.backSlot = static_cast<int>(previous & FrameRing::kSlotMask);
+}
+
+// Take the newest published frame, if there is one, as the render thread's
+// front slot. Returns false when nothing new was published.
+bool TakeFrameRingSlot(FrameRing& ring, bool* viewChanged)
+{
+    if (!(ring.readyState.load(std::memory_order_acquire) & FrameRing::kNewFrameBit))
+        return false;
+    uint32_t previous = ring.readyState.exchange(static_cast<uint32_t>(ring.frontSlot), std::memory_order_acq_rel);
+    ring.frontSlot = static_cast<int>(previous & FrameRing::kSlotMask);
+    *viewChanged = (previous & FrameRing::kViewChangedBit) != 0;
+    return true;
+}
+
+// ROI mode: publish the back slot cut to the crop the renderer needs. A new
+// slot goes out when the frame changed something inside the published crop,
+// or when the zoom has moved the needed crop outside it (or made it much
+// smaller). Returns true if a slot was published.
+bool PublishFrameRingCrop(FrameRing& ring, bool imageChanged, bool viewChanged)
+{
+    if (!g_DesktopTextureValid)
+        return false;
+    D3D11_TEXTURE2D_DESC desc = {};
+    g_DesktopTexture->GetDesc(&desc);
+    RECT bounds = { 0, 0, static_cast<LONG>(desc.Width), static_cast<LONG>(desc.Height) };
+    RECT needed = GetRegionOfInterest(desc.Width, desc.Height, g_SharedZoom.load(std::memory_order_relaxed));
+    bool cropStale = !RectContains(ring.publishedCrop, needed) || !RectContains(bounds, ring.publishedCrop) ||
+        RectArea(ring.publishedCrop) > 2 * RectArea(needed);
+    if (!cropStale && !(imageChanged && ChangedRectsIntersect(ring.publishedCrop)))
+        return false;
+
+    RECT crop = cropStale ? needed : ring.publishedCrop;
+    if (!WriteFrameRingCrop(ring, crop))
+        return false;
+    ring.publishedCrop = crop;
+    PublishFrameRingSlot(ring, viewChanged || cropStale);
+    return true;
+}
+
+// True when any enhancement changes colours, so the enhance shader variants
+// are needed.
+bool EnhancementActive()
+{
+    return g_Invert || g_ColorFilter != ColorFilter::None || g_Options.contrast != 1.0f;
+}
+
+// Compose the enhancements into one affine colour transform, applied in the
+// order colour filter, contrast, inversion. The colour-blind filters are
+// daltonization corrections, M = I + E (I - S): S simulates the deficiency
+// (Machado et al. 2009, full severity), so I - S is the detail the viewer
+// loses, and E moves it into channels they can still tell apart. Offsets are
+// in SDR white units, so inversion maps white to black on scRGB too.
+void BuildColorMatrix(float matrix[3][4])
+{
+    static const float kSimulation[][3][3] = {
+        { { 0.152286f, 1.052583f, -0.204868f }, { 0.114503f, 0.786281f, 0.099216f }, { -0.003882f, -0.048116f, 1.051998f } },
+        { { 0.367322f, 0.860646f, -0.227968f }, { 0.280085f, 0.672501f, 0.047413f }, { -0.011820f, 0.042940f, 0.968881f } },
+        { { 1.255528f, -0.076749f, -0.178779f }, { -0.078411f, 0.930809f, 0.147602f }, { 0.004733f, 0.691367f, 0.303900f } },
+    };
+    // Red-green losses are shown as green and blue, blue-yellow ones as red
+    // and green.
+    static const float kRedGreenShift[3][3] = { { 0.0f, 0.0f, 0.0f }, { 0.7f, 1.0f, 0.0f }, { 0.7f, 0.0f, 1.0f } };
+    static const float kBlueYellowShift[3][3] = { { 1.0f, 0.0f, 0.7f }, { 0.0f, 1.0f, 0.7f }, { 0.0f, 0.0f, 0.0f } };
+
+    float m[3][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } };
+    if (g_ColorFilter == ColorFilter::Grayscale)
+    {
+        for (auto& row : m)
+        {
+            row[0] = 0.2126f;
+            row[1] = 0.7152f;
+            row[2] = 0.0722f;
+        }
+    }
+    else if (g_ColorFilter != ColorFilter::None)
+    {
+        int deficiency = static_cast<int>(g_ColorFilter) - static_cast<int>(ColorFilter::Protanopia);
+        const float (&s)[3][3] = kSimulation[deficiency];
+        const float (&e)[3][3] = g_ColorFilter == ColorFilter::Tritanopia ? kBlueYellowShift : kRedGreenShift;
+        for (int row = 0; row < 3; row++)
+            for (int column = 0; column < 3; column++)
+                for (int k = 0; k < 3; k++)
+                    m[row][column] += e[row][k] * ((k == column ? 1.0f : 0.0f) - s[k][column]);
+    }
+    float contrast = g_Options.contrast;
+    float sign = g_Invert ? -1.0f : 1.0f;
+    float offset = (g_Invert ? 1.0f : 0.0f) + sign * 0.5f * (1.0f - contrast);
+    for (int row = 0; row < 3; row++)
+    {
+        for (int column = 0; column < 3; column++)
+            matrix[row][column] = sign * contrast * m[row][column];
+        matrix[row][3] = offset * g_SdrWhiteScale;
+    }
+}
+
+// Fold g_View into the vertex shader's transforms.
+MagnificationConstantBuffer BuildConstants()
+{
+    float scaleX = g_View.extent[0] / g_View.magnificationFactor;
+    float scaleY = g_View.extent[1] / g_View.magnificationFactor;
+    MagnificationConstantBuffer constants = {
+        { scaleX, scaleY, g_View.center[0] - 0.5f * scaleX, g_View.center[1] - 0.5f * scaleY },
+        {},
+        { g_View.sourceSize[0], g_View.sourceSize[1], -g_View.cursorPosition[0], -g_View.cursorPosition[1] } };
+    memcpy(constants.sourceTransform, g_View.sourceTransform, sizeof(constants.sourceTransform));
+    BuildColorMatrix(constants.colorMatrix);
+    return constants;
+}
+
+// Create shaders from the bytecode compiled into the binary and initialize
+// the constant buffer from g_View.
+bool CreateShaders() {
+    HRESULT hr = g_D3DDevice->CreateVertexShader(g_MagnifierVS, sizeof(g_MagnifierVS), nullptr, &g_VertexShader);
+    if (FAILED(hr))
+    {
+        std::cerr << "Create vertex shader failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+
+    for (int border = 0; border < kBorderModeCount; border++)
+    {
+        for (int cursor = 0; cursor < 2; cursor++)
+        {
+            for (int enhance = 0; enhance < 2; enhance++)
+            {
+                const ShaderBytecode& bytecode = kPixelShaderPermutations[border][cursor][enhance];
+                hr = g_D3DDevice->CreatePixelShader(bytecode.data, bytecode.size, nullptr,
+                    &g_PixelShaderPermutations[border][cursor][enhance]);
+                if (FAILED(hr))
+                {
+                    std::cerr << "Create pixel shader failed: " << HrToString(hr) << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    g_PixelShader = g_PixelShaderPermutations[static_cast<int>(BorderMode::Clamp)][0][0];
+
+    // The quad is a single triangle generated from SV_VertexID, so there is
+    // no vertex buffer or input layout.
+    D3D11_BUFFER_DESC constantBufferDesc = {};
+    constantBufferDesc.ByteWidth = sizeof(MagnificationConstantBuffer);
+    constantBufferDesc.Usage = D3D11_USAGE_DYNAMIC;
+    constantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    constantBufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    MagnificationConstantBuffer constants = BuildConstants();
+    D3D11_SUBRESOURCE_DATA constantBufferData = {};
+    constantBufferData.pSysMem = &constants;
+    hr = g_D3DDevice->CreateBuffer(&constantBufferDesc, &constantBufferData, &g_ConstantBuffer);
+    if (FAILED(hr))
+    {
+        std::cerr << "Create constant buffer failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Index of the session capturing a monitor, or -1 if there is none.
+int FindOutputSession(HMONITOR monitor)
+{
+    for (size_t i = 0; i < g_Outputs.size(); i++)
+    {
+        if (g_Outputs[i]->monitor == monitor)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+// Try once to duplicate every output of the adapters, adding a session for
+// each one that succeeds. The device's own adapter comes first in the list.
+// An output on another adapter that refuses g_D3DDevice falls back to a
+// CrossAdapterCapture. Sets transient if some output failed in a way worth
+// retrying.
+void TryDuplicateOutputs(const std::vector<ComPtr<IDXGIAdapter1>>& adapters, const LUID& deviceLuid, bool verbose, bool& transient)
+{
+    transient = false;
+    for (const auto& adapter : adapters)
+    {
+        DXGI_ADAPTER_DESC1 adapterDesc;
+        adapter->GetDesc1(&adapterDesc);
+        bool deviceAdapter = adapterDesc.AdapterLuid.LowPart == deviceLuid.LowPart &&
+            adapterDesc.AdapterLuid.HighPart == deviceLuid.HighPart;
+        if (verbose)
+            std::wcout << L"Trying adapter: " << adapterDesc.Description << std::endl;
+        ComPtr<IDXGIOutput> dxgiOutput;
+        for (UINT i = 0; adapter->EnumOutputs(i, &dxgiOutput) != DXGI_ERROR_NOT_FOUND; i++)
+        {
+            DXGI_OUTPUT_DESC outputDesc;
+            dxgiOutput->GetDesc(&outputDesc);
+            if (verbose)
+                std::wcout << L"  Trying output: " << outputDesc.DeviceName << std::endl;
+            // Hybrid systems can list a monitor under both adapters.
+            if (FindOutputSession(outputDesc.Monitor) >= 0)
+                continue;
+            ComPtr<IDXGIOutput6> dxgiOutput6;
+            HRESULT hr = dxgiOutput.As(&dxgiOutput6);
+            if (FAILED(hr))
+            {
+                if (verbose)
+                    std::cout << "    Query IDXGIOutput6 failed: " << HrToString(hr) << std::endl;
+                continue;
+            }
+            ComPtr<IDXGIOutputDuplication> duplication;
+            hr = CreateOutputDuplication(dxgiOutput6.Get(), g_D3DDevice.Get(), duplication);
+            if (hr == DXGI_ERROR_UNSUPPORTED && !deviceAdapter)
+            {
+                auto source = std::make_unique<CrossAdapterCapture>(adapter, dxgiOutput6);
+                hr = source->Reconnect();
+                if (SUCCEEDED(hr))
+                {
+                    auto session = std::make_unique<OutputSession>();
+                    session->monitor = outputDesc.Monitor;
+                    session->refreshRate = GetMonitorRefreshRate(outputDesc.Monitor);
+                    session->source = std::move(source);
+                    std::cout << "    Capturing through system memory from another adapter; expect a slower frame." << std::endl;
+                    g_Outputs.push_back(std::move(session));
+                    continue;
+                }
+            }
+            if (SUCCEEDED(hr))
+            {
+                DXGI_OUTDUPL_DESC outputDuplDesc;
+                duplication->GetDesc(&outputDuplDesc);
+                const DXGI_RATIONAL& rate = outputDuplDesc.ModeDesc.RefreshRate;
+                auto session = std::make_unique<OutputSession>();
+                session->monitor = outputDesc.Monitor;
+                if (rate.Numerator != 0 && rate.Denominator != 0)
+                    session->refreshRate = static_cast<double>(rate.Numerator) / rate.Denominator;
+                session->source = std::make_unique<DuplicationCapture>(dxgiOutput6, duplication);
+                std::cout << "    Capturing at: " << outputDuplDesc.ModeDesc.Width << "x"
+                    << outputDuplDesc.ModeDesc.Height << " @ " << session->refreshRate << " Hz" << std::endl;
+                if (!deviceAdapter)
+                    std::cout << "    This output is on another adapter; DXGI copies its frames across." << std::endl;
+                g_Outputs.push_back(std::move(session));
+                continue;
+            }
+            if (verbose)
+                std::cout << "    DuplicateOutput failed: " << HrToString(hr) << std::endl;
+            if (IsTransientDuplicationError(hr))
+                transient = true;
+        }
+    }
+}
+
+// Create a capture session for every output, or the Windows.Graphics.Capture
+// fallback. Desktop duplication is retried with exponential backoff while
+// the desktop is not yet available, instead of waiting a fixed time before
+// the first attempt.
+bool CreateOutputSessions()
+{
+    ComPtr<IDXGIDevice> dxgiDevice;
+    HRESULT hr = g_D3DDevice.As(&dxgiDevice);
+    if (FAILED(hr))
+    {
+        std::cerr << "Query IDXGIDevice failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    ComPtr<IDXGIAdapter> tempAdapter;
+    hr = dxgiDevice->GetAdapter(&tempAdapter);
+    if (FAILED(hr))
+    {
+        std::cerr << "GetAdapter failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    ComPtr<IDXGIAdapter1> dxgiAdapter;
+    hr = tempAdapter.As(&dxgiAdapter);
+    if (FAILED(hr))
+    {
+        std::cerr << "Query IDXGIAdapter1 failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+
+    ComPtr<IDXGIFactory2> dxgiFactory;
+    hr = dxgiAdapter->GetParent(IID_PPV_ARGS(&dxgiFactory));
+    if (FAILED(hr))
+    {
+        std::cerr << "GetParent for IDXGIFactory2 failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+
+    std::vector<ComPtr<IDXGIAdapter1>> adapters;
+    ComPtr<IDXGIAdapter1> currentAdapter;
+    for (UINT i = 0; dxgiFactory->EnumAdapters1(i, &currentAdapter) != DXGI_ERROR_NOT_FOUND; i++)
+    {
+        adapters.push_back(currentAdapter);
+        currentAdapter = nullptr;
+    }
+    if (adapters.empty())
+    {
+        std::cerr << "No adapters found!" << std::endl;
+        return false;
+    }
+    // Outputs of the device's adapter are duplicated directly, so they are
+    // claimed before other adapters that may list the same monitors.
+    DXGI_ADAPTER_DESC1 deviceDesc;
+    dxgiAdapter->GetDesc1(&deviceDesc);
+    std::stable_partition(adapters.begin(), adapters.end(), [&](const ComPtr<IDXGIAdapter1>& adapter) {
+        DXGI_ADAPTER_DESC1 desc;
+        adapter->GetDesc1(&desc);
+        return desc.AdapterLuid.LowPart == deviceDesc.AdapterLuid.LowPart && desc.AdapterLuid.HighPart == deviceDesc.AdapterLuid.HighPart;
+    });
+
+    if (g_TraceReplay)
+    {
+        auto session = std::make_unique<OutputSession>();
+        session->monitor = MonitorFromPoint(POINT{ 0, 0 }, MONITOR_DEFAULTTOPRIMARY);
+        session->refreshRate = GetMonitorRefreshRate(session->monitor);
+        session->source = std::make_unique<TraceReplaySource>();
+        g_Outputs.push_back(std::move(session));
+    }
+    if (g_Outputs.empty() && g_Options.captureBackend != CaptureBackend::GraphicsCapture)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        auto backoff = std::chrono::milliseconds(10);
+        bool transient = false;
+        for (int attempt = 0; g_Running; attempt++)
+        {
+            TryDuplicateOutputs(adapters, deviceDesc.AdapterLuid, attempt == 0, transient);
+            if (!g_Outputs.empty() || !transient || std::chrono::steady_clock::now() + backoff > deadline)
+                break;
+            if (attempt == 0)
+                std::cout << "Desktop not available yet, retrying..." << std::endl;
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min(backoff * 2, std::chrono::milliseconds(500));
+        }
+    }
+    if (g_Outputs.empty() && g_Options.captureBackend != CaptureBackend::Duplication)
+    {
+        // Windows.Graphics.Capture is kept to a single output.
+        if (g_Options.captureBackend == CaptureBackend::Auto)
+            std::cout << "Desktop duplication unavailable, falling back to Windows.Graphics.Capture." << std::endl;
+        auto session = std::make_unique<OutputSession>();
+        session->monitor = MonitorFromPoint(POINT{ 0, 0 }, MONITOR_DEFAULTTOPRIMARY);
+        session->refreshRate = GetMonitorRefreshRate(session->monitor);
+        g_CaptureMonitor = session->monitor;
+        session->source = CreateGraphicsCaptureSource();
+        if (session->source)
+            g_Outputs.push_back(std::move(session));
+    }
+    if (g_Outputs.empty())
+    {
+        std::cerr << "Failed to create output duplication on any adapter/output combination." << std::endl;
+        std::cerr << "This could be due to UAC elevation requirements or protected content." << std::endl;
+        return false;
+    }
+
+    // Start on the output under the cursor.
+    int active = 0;
+    POINT cursor;
+    if (GetCursorPos(&cursor))
+        active = std::max(0, FindOutputSession(MonitorFromPoint(cursor, MONITOR_DEFAULTTONULL)));
+    // A trace follows the output the magnifier starts on.
+    if (g_TraceWriter)
+        g_Outputs[active]->source = std::make_unique<TraceRecordingSource>(std::move(g_Outputs[active]->source));
+    LoadCaptureOutput(active);
+    g_RenderRing = g_CaptureRing;
+    g_ActiveOutput = active;
+    if (g_Outputs[active]->refreshRate > 0.0)
+        g_RefreshRate = g_Outputs[active]->refreshRate;
+    if (g_Outputs.size() > 1)
+        std::cout << "Duplicating " << g_Outputs.size() << " outputs; following the cursor." << std::endl;
+    return true;
+}
+
+// Length of one frame under the active pacing policy.
+std::chrono::nanoseconds GetFramePeriod()
+{
+    double hz = g_Options.pacing == PacingPolicy::CappedFps ? g_Options.cappedFps : g_RefreshRate.load();
+    return std::chrono::nanoseconds(static_cast<long long>(1e9 / hz));
+}
+
+// Block until the swap chain can accept another frame and, for the capped
+// policy, until the next frame slot is due.
+void WaitForNextFrame()
+{
+    if (g_FrameLatencyWaitable)
+        WaitForSingleObjectEx(g_FrameLatencyWaitable, 1000, TRUE);
+
+    if (g_Options.pacing == PacingPolicy::CappedFps && g_PacingTimer)
+    {
+        static auto nextFrameTime = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        if (now < nextFrameTime)
+        {
+            // Negative due times are relative, in 100 ns units.
+            LARGE_INTEGER dueTime;
+            dueTime.QuadPart = -std::chrono::duration_cast<std::chrono::nanoseconds>(nextFrameTime - now).count() / 100;
+            if (SetWaitableTimer(g_PacingTimer, &dueTime, 0, nullptr, nullptr, FALSE))
+                WaitForSingleObject(g_PacingTimer, INFINITE);
+            nextFrameTime += GetFramePeriod();
+        }
+        else
+        {
+            nextFrameTime = now + GetFramePeriod();
+        }
+    }
+}
+
+// Replace the contents of a dynamic constant buffer.
+void WriteConstantBuffer(ID3D11Buffer* buffer, const void* data, size_t size)
+{
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if (SUCCEEDED(g_D3DContext->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+    {
+        memcpy(mapped.pData, data, size);
+        g_D3DContext->Unmap(buffer, 0);
+    }
+}
+
+// Upload the constant buffer if g_View changed since the last draw.
+void UploadConstants()
+{
+    if (g_ConstantsDirty)
+    {
+        MagnificationConstantBuffer constants = BuildConstants();
+        WriteConstantBuffer(g_ConstantBuffer.Get(), &constants, sizeof(constants));
+        g_ConstantsDirty = false;
+    }
+}
+
+// Bind the texture the pixel shader samples, unless it already is.
+void BindFrameView(ID3D11ShaderResourceView* view)
+{
+    if (g_Bound.frameView != view)
+    {
+        g_D3DContext->PSSetShaderResources(0, 1, &view);
+        g_Bound.frameView = view;
+    }
+}
+
+// Take the pointer state published by the capture side. Returns true if it
+// changed since it was last drawn.
+bool UpdateCursor()
+{
+    std::shared_ptr<const CursorShape> shape = g_CursorShape.load(std::memory_order_acquire);
+    uint64_t position = g_CursorPosition.load(std::memory_order_relaxed);
+    bool visible = shape && g_CursorVisible.load(std::memory_order_relaxed);
+    if (shape == g_Cursor.shape && position == g_Cursor.position && visible == g_Cursor.visible)
+        return false;
+    g_Cursor.shape = std::move(shape);
+    g_Cursor.position = position;
+    g_Cursor.visible = visible;
+    g_View.cursorPosition[0] = static_cast<float>(static_cast<int32_t>(position & 0xFFFFFFFF));
+    g_View.cursorPosition[1] = static_cast<float>(static_cast<int32_t>(position >> 32));
+    g_ConstantsDirty = true;
+    return true;
+}
+
+// Whether the pointer overlaps the part of the source the view shows.
+bool CursorInView()
+{
+    if (!g_Cursor.visible)
+        return false;
+    UINT size[2] = { g_Cursor.shape->width, g_Cursor.shape->height };
+    for (int axis = 0; axis < 2; axis++)
+    {
+        float half = 0.5f * g_View.extent[axis] / g_View.magnificationFactor;
+        float first = (g_View.center[axis] - half) * g_View.sourceSize[axis];
+        float last = (g_View.center[axis] + half) * g_View.sourceSize[axis];
+        if (g_View.cursorPosition[axis] + size[axis] <= first || g_View.cursorPosition[axis] >= last)
+            return false;
+    }
+    return true;
+}
+
+// Draw the magnifier triangle over the whole target. It covers every pixel,
+// so no clear is needed. Only state that differs from g_Bound is set.
+// Shared by the window and the benchmark.
+void DrawMagnifier(ID3D11RenderTargetView* target, UINT width, UINT height)
+{
+    if (!g_Bound.pipeline)
+    {
+        g_D3DContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        g_D3DContext->VSSetShader(g_VertexShader.Get(), nullptr, 0);
+        g_D3DContext->VSSetConstantBuffers(0, 1, g_ConstantBuffer.GetAddressOf());
+        g_D3DContext->PSSetConstantBuffers(0, 1, g_ConstantBuffer.GetAddressOf());
+        g_D3DContext->PSSetSamplers(0, 1, g_SamplerState.GetAddressOf());
+        g_Bound.pipeline = true;
+    }
+    if (g_Bound.pixelShader != g_PixelShader.Get())
+    {
+        g_D3DContext->PSSetShader(g_PixelShader.Get(), nullptr, 0);
+        g_Bound.pixelShader = g_PixelShader.Get();
+    }
+    if (g_CursorInView && g_Bound.cursorView != g_Cursor.shape->view.Get())
+    {
+        g_Bound.cursorView = g_Cursor.shape->view.Get();
+        g_D3DContext->PSSetShaderResources(1, 1, &g_Bound.cursorView);
+    }
+    if (g_Bound.target != target)
+    {
+        g_D3DContext->OMSetRenderTargets(1, &target, nullptr);
+        g_Bound.target = target;
+    }
+    if (g_Bound.viewportWidth != width || g_Bound.viewportHeight != height)
+    {
+        D3D11_VIEWPORT viewport = { 0.0f, 0.0f, static_cast<float>(width), static_cast<float>(height), 0.0f, 1.0f };
+        g_D3DContext->RSSetViewports(1, &viewport);
+        g_Bound.viewportWidth = width;
+        g_Bound.viewportHeight = height;
+    }
+    UploadConstants();
+    g_D3DContext->Draw(3, 0);
+}
+
+// Whether the view can show anything outside the source. If it lies inside
+// at 1.0x, it stays inside at every larger zoom.
+BorderMode RequiredBorderMode()
+{
+    for (int axis = 0; axis < 2; axis++)
+    {
+        if (g_View.center[axis] - 0.5f * g_View.extent[axis] < 0.0f ||
+            g_View.center[axis] + 0.5f * g_View.extent[axis] > 1.0f)
+            return BorderMode::Black;
+    }
+    return BorderMode::Clamp;
+}
+
+// Bind the shader variants for the current filter, the given border mode,
+// g_CursorInView and the enhancements. Called when one of them changes, not
+// per frame.
+void SelectShaderPermutation(BorderMode border)
+{
+    int cursor = g_CursorInView ? 1 : 0;
+    int enhance = EnhancementActive() ? 1 : 0;
+    g_PixelShader = g_PixelShaderPermutations[static_cast<int>(border)][cursor][enhance];
+    g_ResampleShader = g_ResampleShaderPermutations[static_cast<int>(g_Filter)][static_cast<int>(border)][cursor][enhance];
+}
+
+void SelectShaderPermutation()
+{
+    SelectShaderPermutation(RequiredBorderMode());
+}
+
+void ResetShaderPermutations()
+{
+    for (auto& cursors : g_PixelShaderPermutations)
+        for (auto& variants : cursors)
+            for (ComPtr<ID3D11PixelShader>& shader : variants)
+                shader.Reset();
+    for (auto& borders : g_ResampleShaderPermutations)
+        for (auto& cursors : borders)
+            for (auto& variants : cursors)
+                for (ComPtr<ID3D11ComputeShader>& shader : variants)
+                    shader.Reset();
+}
+
+// True when the selected filtering needs the compute path.
+bool ComputeFilterSelected()
+{
+    return g_Filter != MagnifyFilter::Bilinear || g_Sharpen;
+}
+
+// Make g_FilterTexture, the sharpening pass input, match the target size
+// and hold the range of the back buffer. 8-bit BGRA has no guaranteed UAV
+// support, so its counterpart is RGBA.
+bool EnsureFilterTexture(UINT width, UINT height)
+{
+    DXGI_FORMAT format = g_BackBufferFormat == DXGI_FORMAT_B8G8R8A8_UNORM ? DXGI_FORMAT_R8G8B8A8_UNORM : g_BackBufferFormat;
+    if (g_FilterTexture)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        g_FilterTexture->GetDesc(&desc);
+        if (desc.Width == width && desc.Height == height && desc.Format == format)
+            return true;
+        g_FilterTextureUAV.Reset();
+        g_FilterTextureView.Reset();
+        g_FilterTexture.Reset();
+    }
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = format;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_UNORDERED_ACCESS;
+    HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &g_FilterTexture);
+    if (SUCCEEDED(hr))
+    {
+        TrackAllocation(g_FilterTexture.Get(), GpuMemoryUse::Filter);
+        hr = g_D3DDevice->CreateShaderResourceView(g_FilterTexture.Get(), nullptr, &g_FilterTextureView);
+    }
+    if (SUCCEEDED(hr))
+        hr = g_D3DDevice->CreateUnorderedAccessView(g_FilterTexture.Get(), nullptr, &g_FilterTextureUAV);
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to create filter texture: " << HrToString(hr) << std::endl;
+        g_FilterTextureUAV.Reset();
+        g_FilterTextureView.Reset();
+        g_FilterTexture.Reset();
+        return false;
+    }
+    return true;
+}
+
+// Map the pixel indices of a width x height output onto the source:
+// viewTransform gives source coordinates, 0 to 1 over the whole source, for
+// the border check; texelScale and texelOffset give texel positions in a
+// texture of the given size, which may hold only the crop in
+// g_View.sourceTransform. Shared by the compute and the CPU magnifiers.
+void GetOutputMapping(UINT width, UINT height, UINT textureWidth, UINT textureHeight,
+    float viewTransform[4], float texelScale[2], float texelOffset[2])
+{
+    const float* crop = g_View.sourceTransform;
+    UINT outputSize[2] = { width, height };
+    UINT textureSize[2] = { textureWidth, textureHeight };
+    for (int axis = 0; axis < 2; axis++)
+    {
+        float scale = g_View.extent[axis] / g_View.magnificationFactor;
+        viewTransform[axis] = scale / outputSize[axis];
+        viewTransform[2 + axis] = 0.5f * viewTransform[axis] + g_View.center[axis] - 0.5f * scale;
+    }
+    for (int axis = 0; axis < 2; axis++)
+    {
+        float texels = static_cast<float>(textureSize[axis]);
+        texelScale[axis] = viewTransform[axis] * crop[axis] * texels;
+        texelOffset[axis] = (viewTransform[2 + axis] * crop[axis] + crop[2 + axis]) * texels - 0.5f;
+    }
+}
+
+// Magnify source into target, a UAV of the given size, with the compute
+// filters: the resample pass, then the sharpening pass if it is on. Shared
+// by the window and the benchmark.
+void DispatchMagnifier(ID3D11UnorderedAccessView* target, ID3D11ShaderResourceView* source, UINT width, UINT height)
+{
+    ComPtr<ID3D11Resource> resource;
+    source->GetResource(&resource);
+    ComPtr<ID3D11Texture2D> texture;
+    D3D11_TEXTURE2D_DESC desc = {};
+    if (SUCCEEDED(resource.As(&texture)))
+        texture->GetDesc(&desc);
+
+    FilterConstantBuffer constants = {};
+    constants.outputSize[0] = width;
+    constants.outputSize[1] = height;
+    constants.textureSize[0] = desc.Width;
+    constants.textureSize[1] = desc.Height;
+    GetOutputMapping(width, height, desc.Width, desc.Height,
+        constants.viewTransform, constants.texelScale, constants.texelOffset);
+    for (int axis = 0; axis < 2; axis++)
+    {
+        constants.cursorTransform[axis] = g_View.sourceSize[axis];
+        constants.cursorTransform[2 + axis] = -g_View.cursorPosition[axis];
+    }
+    constants.sharpness = std::min(std::max(g_Options.sharpness, 0.0f), 1.0f);
+    bool scRgb = g_BackBufferFormat == DXGI_FORMAT_R16G16B16A16_FLOAT;
+    constants.colorScale = g_SdrWhiteScale;
+    constants.colorMin = scRgb ? -65504.0f : 0.0f;
+    constants.colorMax = scRgb ? 65504.0f : 1.0f;
+    BuildColorMatrix(constants.colorMatrix);
+    if (memcmp(&constants, &g_FilterConstants, sizeof(constants)) != 0)
+    {
+        g_FilterConstants = constants;
+        WriteConstantBuffer(g_FilterConstantBuffer.Get(), &g_FilterConstants, sizeof(g_FilterConstants));
+    }
+    g_D3DContext->CSSetConstantBuffers(0, 1, g_FilterConstantBuffer.GetAddressOf());
+    // Binding the back buffer as a UAV unbinds it as a render target.
+    g_Bound.target = nullptr;
+
+    bool sharpen = g_Sharpen && EnsureFilterTexture(width, height);
+    UINT groupsX = (width + 15) / 16;
+    UINT groupsY = (height + 15) / 16;
+    ID3D11UnorderedAccessView* resampleTarget = sharpen ? g_FilterTextureUAV.Get() : target;
+    ID3D11ShaderResourceView* sources[] = { source, g_CursorInView ? g_Cursor.shape->view.Get() : nullptr };
+    g_D3DContext->CSSetShader(g_ResampleShader.Get(), nullptr, 0);
+    g_D3DContext->CSSetShaderResources(0, 2, sources);
+    g_D3DContext->CSSetUnorderedAccessViews(0, 1, &resampleTarget, nullptr);
+    g_D3DContext->Dispatch(groupsX, groupsY, 1);
+
+    // The textures must be unbound before they change roles, and before the
+    // back buffer is drawn on or presented.
+    ID3D11UnorderedAccessView* nullUAV = nullptr;
+    ID3D11ShaderResourceView* nullViews[2] = {};
+    g_D3DContext->CSSetUnorderedAccessViews(0, 1, &nullUAV, nullptr);
+    if (sharpen)
+    {
+        g_D3DContext->CSSetShader(g_SharpenShader.Get(), nullptr, 0);
+        g_D3DContext->CSSetShaderResources(0, 1, g_FilterTextureView.GetAddressOf());
+        g_D3DContext->CSSetUnorderedAccessViews(0, 1, &target, nullptr);
+        g_D3DContext->Dispatch(groupsX, groupsY, 1);
+        g_D3DContext->CSSetUnorderedAccessViews(0, 1, &nullUAV, nullptr);
+    }
+    g_D3DContext->CSSetShaderResources(0, 2, nullViews);
+}
+
+// CPU magnifier, for when ChooseRenderPath() finds the device slower than the
+// processor, as with WARP in a virtual machine without a GPU. The same view
+// is resampled from g_CpuDesktop into g_CpuOutput, rows split across
+// g_RowPool, and uploaded into the back buffer.
+
+// Runs a function over the rows of an image on a fixed set of threads, the
+// caller included. Each worker starts on an equal share and takes bands of
+// kBandRows from its front; one that runs out steals the back half of the
+// largest share left, so a preempted or slower core does not hold up the
+// frame. A share is packed into one atomic (first row << 32 | end row) so
+// the owner and a thief can both claim rows with a compare-exchange.
+class RowPool {
+public:
+    static constexpr uint32_t kBandRows = 8;
+    static constexpr UINT kMaxWorkers = 8;
+
+    ~RowPool() { Stop(); }
+
+    // Start a helper thread for every worker but the caller. If threads run
+    // out, the pool works with those it has.
+    void Start()
+    {
+        SYSTEM_INFO info = {};
+        GetSystemInfo(&info);
+        m_workerCount = std::min(std::max<UINT>(info.dwNumberOfProcessors, 1), kMaxWorkers);
+        m_done = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!m_done)
+            m_workerCount = 1;
+        for (UINT i = 1; i < m_workerCount; i++)
+        {
+            Worker& worker = m_workers[i];
+            worker.pool = this;
+            worker.wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+            worker.thread = worker.wake ? CreateThread(nullptr, 0, WorkerThread, &worker, 0, nullptr) : nullptr;
+            if (!worker.thread)
+            {
+                if (worker.wake)
+                    CloseHandle(worker.wake);
+                worker.wake = nullptr;
+                m_workerCount = i;
+                break;
+            }
+        }
+    }
+
+    void Stop()
+    {
+        m_stopping = true;
+        for (UINT i = 1; i < m_workerCount; i++)
+        {
+            SetEvent(m_workers[i].wake);
+            WaitForSingleObject(m_workers[i].thread, INFINITE);
+            CloseHandle(m_workers[i].thread);
+            CloseHandle(m_workers[i].wake);
+        }
+        m_workerCount = 1;
+        if (m_done)
+            CloseHandle(m_done);
+        m_done = nullptr;
+    }
+
+    UINT WorkerCount() const { return m_workerCount; }
+
+    // Call rows(begin, end) until every row in [0, rowCount) is done, then
+    // return. rows must be safe to call from several threads at once.
+    void Run(uint32_t rowCount, const std::function<void(uint32_t, uint32_t)>& rows)
+    {
+        if (m_workerCount <= 1 || rowCount <= kBandRows)
+        {
+            rows(0, rowCount);
+            return;
+        }
+        m_rows = &rows;
+        for (UINT i = 0; i < m_workerCount; i++)
+            m_workers[i].range.store(Pack(rowCount * i / m_workerCount, rowCount * (i + 1) / m_workerCount),
+                std::memory_order_relaxed);
+        m_pending.store(m_workerCount - 1, std::memory_order_relaxed);
+        for (UINT i = 1; i < m_workerCount; i++)
+            SetEvent(m_workers[i].wake);
+        Work(m_workers[0]);
+        WaitForSingleObject(m_done, INFINITE);
+        m_rows = nullptr;
+    }
+
+private:
+    // On its own cache line, so claiming rows does not slow the neighbours.
+    struct alignas(64) Worker {
+        std::atomic<uint64_t> range = 0;
+        HANDLE wake = nullptr;
+        HANDLE thread = nullptr;
+        RowPool* pool = nullptr;
+    };
+
+    static uint64_t Pack(uint32_t begin, uint32_t end) { return (static_cast<uint64_t>(begin) << 32) | end; }
+    static uint32_t Begin(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+    static uint32_t End(uint64_t range) { return static_cast<uint32_t>(range); }
+    static uint32_t Remaining(uint64_t range) { return End(range) > Begin(range) ? End(range) - Begin(range) : 0; }
+
+    static DWORD WINAPI WorkerThread(LPVOID parameter)
+    {
+        Worker& worker = *static_cast<Worker*>(parameter);
+        RowPool& pool = *worker.pool;
+        for (;;)
+        {
+            WaitForSingleObject(worker.wake, INFINITE);
+            if (pool.m_stopping)
+                return 0;
+            pool.Work(worker);
+            if (pool.m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                SetEvent(pool.m_done);
+        }
+    }
+
+    // Run bands from the worker's share, refilling it by stealing until no
+    // rows are left anywhere.
+    void Work(Worker& self)
+    {
+        for (;;)
+        {
+            uint64_t range = self.range.load(std::memory_order_acquire);
+            if (Remaining(range) == 0)
+            {
+                if (!Steal(self))
+                    return;
+                continue;
+            }
+            uint32_t begin = Begin(range);
+            uint32_t end = std::min(begin + kBandRows, End(range));
+            if (self.range.compare_exchange_weak(range, Pack(end, End(range)), std::memory_order_acq_rel))
+                (*m_rows)(begin, end);
+        }
+    }
+
+    // Move the back half of the largest share, or all of one no bigger
+    // than a band, into the empty share of self. Returns false when every
+    // share is empty. Only the owner refills a share, and only once it is
+    // empty, so no other thread is claiming from it at the time.
+    bool Steal(Worker& self)
+    {
+        for (;;)
+        {
+            Worker* victim = nullptr;
+            uint64_t range = 0;
+            uint32_t most = 0;
+            for (UINT i = 0; i < m_workerCount; i++)
+            {
+                uint64_t candidate = m_workers[i].range.load(std::memory_order_acquire);
+                if (Remaining(candidate) > most)
+                {
+                    victim = &m_workers[i];
+                    range = candidate;
+                    most = Remaining(candidate);
+                }
+            }
+            if (!victim)
+                return false;
+            uint32_t split = most <= kBandRows ? Begin(range) : End(range) - most / 2;
+            if (victim->range.compare_exchange_weak(range, Pack(Begin(range), split), std::memory_order_acq_rel))
+            {
+                self.range.store(Pack(split, End(range)), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    Worker m_workers[kMaxWorkers];
+    UINT m_workerCount = 1;
+    HANDLE m_done = nullptr;
+    std::atomic<UINT> m_pending = 0;
+    std::atomic<bool> m_stopping = false;
+    const std::function<void(uint32_t, uint32_t)>* m_rows = nullptr;
+};
+std::unique_ptr<RowPool> g_RowPool;
+
+// Where one output column or row samples the source: the four texels
+// around it, clamped to the edge, with their Catmull-Rom weights, and the
+// position between index[1] and index[2] in 1/256ths for bilinear.
+struct CpuTap {
+    uint32_t index[4];
+    float weight[4];
+    uint32_t fraction;
+};
+
+// Catmull-Rom kernel at a distance of x texels, as in MagnifierResample.hlsli.
+float CatmullRom(float x)
+{
+    x = std::abs(x);
+    if (x < 1.0f)
+        return (1.5f * x - 2.5f) * x * x + 1.0f;
+    if (x < 2.0f)
+        return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+    return 0.0f;
+}
+
+// Fill taps for count output positions along one axis, where position i
+// samples texel position i * scale + offset of a source size texels long.
+void BuildCpuTaps(std::vector<CpuTap>& taps, UINT count, float scale, float offset, UINT size)
+{
+    taps.resize(count);
+    for (UINT i = 0; i < count; i++)
+    {
+        float position = i * scale + offset;
+        float first = std::floor(position);
+        float fraction = position - first;
+        CpuTap& tap = taps[i];
+        float sum = 0.0f;
+        for (int k = 0; k < 4; k++)
+        {
+            long long texel = static_cast<long long>(first) - 1 + k;
+            tap.index[k] = static_cast<uint32_t>(std::min<long long>(std::max<long long>(texel, 0), size - 1));
+            tap.weight[k] = CatmullRom(fraction - (k - 1));
+            sum += tap.weight[k];
+        }
+        for (float& weight : tap.weight)
+            weight /= sum;
+        tap.fraction = std::min(256u, static_cast<uint32_t>(fraction * 256.0f + 0.5f));
+    }
+}
+
+// Resample one output row from source: row is its vertical tap, columns
+// the horizontal taps of its width pixels. Output alpha is opaque, as the
+// shaders write it.
+using CpuRowKernel = void (*)(uint32_t* output, const CpuTap& row, const CpuTap* columns, UINT width, const CpuImage& source);
+
+// Bilinear in 8.8 fixed point, one channel at a time.
+void BilinearRowScalar(uint32_t* output, const CpuTap& row, const CpuTap* columns, UINT width, const CpuImage& source)
+{
+    const uint32_t* top = &source.pixels[static_cast<size_t>(row.index[1]) * source.width];
+    const uint32_t* bottom = &source.pixels[static_cast<size_t>(row.index[2]) * source.width];
+    uint32_t fy = row.fraction;
+    for (UINT x = 0; x < width; x++)
+    {
+        uint32_t fx = columns[x].fraction;
+        uint32_t topLeft = top[columns[x].index[1]], topRight = top[columns[x].index[2]];
+        uint32_t bottomLeft = bottom[columns[x].index[1]], bottomRight = bottom[columns[x].index[2]];
+        uint32_t pixel = kOpaque;
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            uint32_t upper = ((topLeft >> shift) & 0xFF) * (256 - fx) + ((topRight >> shift) & 0xFF) * fx;
+            uint32_t lower = ((bottomLeft >> shift) & 0xFF) * (256 - fx) + ((bottomRight >> shift) & 0xFF) * fx;
+            pixel |= ((upper * (256 - fy) + lower * fy + 32768) >> 16) << shift;
+        }
+        output[x] = pixel;
+    }
+}
+
+// Blend two source lines into one, weighting the lower by fraction/256.
+// Sums stay below 65536, so the channels fit 16-bit lanes.
+void BlendLinesSse(uint32_t* blended, const uint32_t* top, const uint32_t* bottom, UINT count, uint32_t fraction)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi16(128);
+    __m128i topWeight = _mm_set1_epi16(static_cast<short>(256 - fraction));
+    __m128i bottomWeight = _mm_set1_epi16(static_cast<short>(fraction));
+    UINT i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i upper = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + i));
+        __m128i lower = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + i));
+        __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(upper, zero), topWeight),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(lower, zero), bottomWeight));
+        __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(upper, zero), topWeight),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(lower, zero), bottomWeight));
+        low = _mm_srli_epi16(_mm_add_epi16(low, round), 8);
+        high = _mm_srli_epi16(_mm_add_epi16(high, round), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(blended + i), _mm_packus_epi16(low, high));
+    }
+    for (; i < count; i++)
+    {
+        uint32_t pixel = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+            pixel |= ((((top[i] >> shift) & 0xFF) * (256 - fraction) + ((bottom[i] >> shift) & 0xFF) * fraction + 128) >> 8) << shift;
+        blended[i] = pixel;
+    }
+}
+
+// Weights of one horizontal blend: 256 - fraction for the four channels of
+// the left texel, fraction for the right.
+__m128i PairWeights(uint32_t fraction)
+{
+    short left = static_cast<short>(256 - fraction);
+    short right = static_cast<short>(fraction);
+    return _mm_set_epi16(right, right, right, right, left, left, left, left);
+}
+
+// Bilinear, blending the two source lines once per source column and then
+// each output pixel from its pair of blended texels.
+void BilinearRowSse41(uint32_t* output, const CpuTap& row, const CpuTap* columns, UINT width, const CpuImage& source)
+{
+    thread_local std::vector<uint32_t> blended;
+    UINT first = columns[0].index[1];
+    UINT count = columns[width - 1].index[2] - first + 1;
+    blended.resize(count);
+    BlendLinesSse(blended.data(), &source.pixels[static_cast<size_t>(row.index[1]) * source.width] + first,
+        &source.pixels[static_cast<size_t>(row.index[2]) * source.width] + first, count, row.fraction);
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi16(128);
+    for (UINT x = 0; x < width; x++)
+    {
+        const CpuTap& column = columns[x];
+        __m128i pair = _mm_unpacklo_epi8(_mm_set_epi32(0, 0,
+            static_cast<int>(blended[column.index[2] - first]), static_cast<int>(blended[column.index[1] - first])), zero);
+        pair = _mm_mullo_epi16(pair, PairWeights(column.fraction));
+        pair = _mm_add_epi16(pair, _mm_srli_si128(pair, 8));
+        pair = _mm_srli_epi16(_mm_add_epi16(pair, round), 8);
+        output[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(pair, pair))) | kOpaque;
+    }
+}
+
+// As BilinearRowSse41, with the line blend eight texels and the horizontal
+// pass two pixels at a time.
+void BilinearRowAvx2(uint32_t* output, const CpuTap& row, const CpuTap* columns, UINT width, const CpuImage& source)
+{
+    thread_local std::vector<uint32_t> blended;
+    UINT first = columns[0].index[1];
+    UINT count = columns[width - 1].index[2] - first + 1;
+    blended.resize(count);
+    const uint32_t* top = &source.pixels[static_cast<size_t>(row.index[1]) * source.width] + first;
+    const uint32_t* bottom = &source.pixels[static_cast<size_t>(row.index[2]) * source.width] + first;
+
+    __m256i zero = _mm256_setzero_si256();
+    __m256i round = _mm256_set1_epi16(128);
+    __m256i topWeight = _mm256_set1_epi16(static_cast<short>(256 - row.fraction));
+    __m256i bottomWeight = _mm256_set1_epi16(static_cast<short>(row.fraction));
+    UINT i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        // Unpacking and packing work within each 128-bit lane, so the
+        // texel order comes back unchanged.
+        __m256i upper = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(top + i));
+        __m256i lower = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom + i));
+        __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(upper, zero), topWeight),
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(lower, zero), bottomWeight));
+        __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(upper, zero), topWeight),
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(lower, zero), bottomWeight));
+        low = _mm256_srli_epi16(_mm256_add_epi16(low, round), 8);
+        high = _mm256_srli_epi16(_mm256_add_epi16(high, round), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(blended.data() + i), _mm256_packus_epi16(low, high));
+    }
+    BlendLinesSse(blended.data() + i, top + i, bottom + i, count - i, row.fraction);
+
+    UINT x = 0;
+    for (; x + 2 <= width; x += 2)
+    {
+        const CpuTap& left = columns[x];
+        const CpuTap& right = columns[x + 1];
+        __m128i texels = _mm_set_epi32(
+            static_cast<int>(blended[right.index[2] - first]), static_cast<int>(blended[right.index[1] - first]),
+            static_cast<int>(blended[left.index[2] - first]), static_cast<int>(blended[left.index[1] - first]));
+        __m256i pairs = _mm256_cvtepu8_epi16(texels);
+        pairs = _mm256_mullo_epi16(pairs, _mm256_set_m128i(PairWeights(right.fraction), PairWeights(left.fraction)));
+        pairs = _mm256_add_epi16(pairs, _mm256_srli_si256(pairs, 8));
+        pairs = _mm256_srli_epi16(_mm256_add_epi16(pairs, round), 8);
+        pairs = _mm256_packus_epi16(pairs, pairs);
+        output[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_castsi256_si128(pairs))) | kOpaque;
+        output[x + 1] = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_extracti128_si256(pairs, 1))) | kOpaque;
+    }
+    _mm256_zeroupper();
+    __m128i zero128 = _mm_setzero_si128();
+    for (; x < width; x++)
+    {
+        const CpuTap& column = columns[x];
+        __m128i pair = _mm_unpacklo_epi8(_mm_set_epi32(0, 0,
+            static_cast<int>(blended[column.index[2] - first]), static_cast<int>(blended[column.index[1] - first])), zero128);
+        pair = _mm_mullo_epi16(pair, PairWeights(column.fraction));
+        pair = _mm_add_epi16(pair, _mm_srli_si128(pair, 8));
+        pair = _mm_srli_epi16(_mm_add_epi16(pair, _mm_set1_epi16(128)), 8);
+        output[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(pair, pair))) | kOpaque;
+    }
+}
+
+// One BGRA texel as four floats.
+__m128 TexelToFloats(uint32_t texel)
+{
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(texel))));
+}
+
+// Catmull-Rom in floats: the four source lines are filtered once per source
+// column, then each output pixel from four filtered texels. Overshoot is
+// clamped by the saturating packs.
+void BicubicRowSse41(uint32_t* output, const CpuTap& row, const CpuTap* columns, UINT width, const CpuImage& source)
+{
+    thread_local std::vector<__m128> filtered;
+    UINT first = columns[0].index[0];
+    UINT count = columns[width - 1].index[3] - first + 1;
+    filtered.resize(count);
+    const uint32_t* lines[4];
+    __m128 lineWeights[4];
+    for (int k = 0; k < 4; k++)
+    {
+        lines[k] = &source.pixels[static_cast<size_t>(row.index[k]) * source.width] + first;
+        lineWeights[k] = _mm_set1_ps(row.weight[k]);
+    }
+    for (UINT i = 0; i < count; i++)
+    {
+        __m128 sum = _mm_mul_ps(TexelToFloats(lines[0][i]), lineWeights[0]);
+        for (int k = 1; k < 4; k++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(TexelToFloats(lines[k][i]), lineWeights[k]));
+        filtered[i] = sum;
+    }
+    for (UINT x = 0; x < width; x++)
+    {
+        const CpuTap& column = columns[x];
+        __m128 sum = _mm_mul_ps(filtered[column.index[0] - first], _mm_set1_ps(column.weight[0]));
+        for (int k = 1; k < 4; k++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(filtered[column.index[k] - first], _mm_set1_ps(column.weight[k])));
+        __m128i channels = _mm_cvtps_epi32(sum);
+        channels = _mm_packus_epi32(channels, channels);
+        output[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(channels, channels))) | kOpaque;
+    }
+}
+
+// Kernels for the processor, chosen by ChooseRenderPath(). Lanczos is drawn
+// with the bicubic kernel, and without SSE4.1 bicubic with the bilinear one.
+CpuRowKernel g_CpuBilinearRow = BilinearRowScalar;
+CpuRowKernel g_CpuBicubicRow = BilinearRowScalar;
+
+// Apply the enhancement colour matrix (see BuildColorMatrix()) to a row of
+// 8-bit texels.
+void EnhanceRow(uint32_t* pixels, UINT width, const float matrix[3][4])
+{
+    for (UINT x = 0; x < width; x++)
+    {
+        float color[3] = { ((pixels[x] >> 16) & 0xFF) / 255.0f, ((pixels[x] >> 8) & 0xFF) / 255.0f, (pixels[x] & 0xFF) / 255.0f };
+        uint32_t pixel = kOpaque;
+        for (int row = 0; row < 3; row++)
+        {
+            float value = matrix[row][0] * color[0] + matrix[row][1] * color[1] + matrix[row][2] * color[2] + matrix[row][3];
+            value = std::min(std::max(value, 0.0f), 1.0f);
+            pixel |= static_cast<uint32_t>(value * 255.0f + 0.5f) << (16 - 8 * row);
+        }
+        pixels[x] = pixel;
+    }
+}
+
+// Draw the pointer over output row y as CompositeCursor() in
+// MagnifierCursor.hlsli does, sampling the shape at the nearest texel.
+void CompositeCursorRow(uint32_t* pixels, UINT y, UINT width, const float viewTransform[4])
+{
+    const CursorShape& shape = *g_Cursor.shape;
+    float cursorY = (y * viewTransform[1] + viewTransform[3]) * g_View.sourceSize[1] - g_View.cursorPosition[1];
+    if (cursorY < 0.0f || cursorY >= shape.height)
+        return;
+    const uint32_t* line = &shape.pixels[static_cast<size_t>(cursorY) * shape.width];
+    for (UINT x = 0; x < width; x++)
+    {
+        float cursorX = (x * viewTransform[0] + viewTransform[2]) * g_View.sourceSize[0] - g_View.cursorPosition[0];
+        if (cursorX < 0.0f || cursorX >= shape.width)
+            continue;
+        uint32_t texel = line[static_cast<UINT>(cursorX)];
+        uint32_t alpha = texel >> 24;
+        uint32_t pixel = kOpaque;
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            int color = (pixels[x] >> shift) & 0xFF;
+            int cursor = (texel >> shift) & 0xFF;
+            // Alpha 0 marks an XOR texel.
+            int value = alpha ? (color * static_cast<int>(255 - alpha) + cursor * static_cast<int>(alpha) + 127) / 255 :
+                std::abs(color - cursor);
+            pixel |= static_cast<uint32_t>(value) << shift;
+        }
+        pixels[x] = pixel;
+    }
+}
+
+// Magnify g_CpuDesktop into g_CpuOutput, width x height, with the selected
+// filter, then enhance, draw the pointer and black out the border as the
+// shader variants would.
+void MagnifyOnCpu(UINT width, UINT height)
+{
+    float viewTransform[4], texelScale[2], texelOffset[2];
+    GetOutputMapping(width, height, g_CpuDesktop.width, g_CpuDesktop.height, viewTransform, texelScale, texelOffset);
+    static std::vector<CpuTap> columns, rows;
+    BuildCpuTaps(columns, width, texelScale[0], texelOffset[0], g_CpuDesktop.width);
+    BuildCpuTaps(rows, height, texelScale[1], texelOffset[1], g_CpuDesktop.height);
+    CpuRowKernel kernel = g_Filter == MagnifyFilter::Bilinear ? g_CpuBilinearRow : g_CpuBicubicRow;
+    bool enhance = EnhancementActive();
+    float matrix[3][4] = {};
+    if (enhance)
+        BuildColorMatrix(matrix);
+
+    // Output columns whose source position lies within 0 to 1.
+    bool border = RequiredBorderMode() == BorderMode::Black;
+    UINT insideFirst = 0, insideEnd = width;
+    if (border)
+    {
+        float first = std::ceil(-viewTransform[2] / viewTransform[0]);
+        float last = std::floor((1.0f - viewTransform[2]) / viewTransform[0]);
+        insideFirst = static_cast<UINT>(std::min(std::max(first, 0.0f), static_cast<float>(width)));
+        insideEnd = std::max(insideFirst, static_cast<UINT>(std::min(std::max(last + 1.0f, 0.0f), static_cast<float>(width))));
+    }
+
+    g_CpuOutput.resize(static_cast<size_t>(width) * height);
+    g_RowPool->Run(height, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; y++)
+        {
+            uint32_t* line = &g_CpuOutput[static_cast<size_t>(y) * width];
+            float sourceY = y * viewTransform[1] + viewTransform[3];
+            if (border && (sourceY < 0.0f || sourceY > 1.0f || insideFirst == insideEnd))
+            {
+                std::fill(line, line + width, kOpaque);
+                continue;
+            }
+            kernel(line, rows[y], columns.data(), width, g_CpuDesktop);
+            if (enhance)
+                EnhanceRow(line, width, matrix);
+            if (g_CursorInView)
+                CompositeCursorRow(line, y, width, viewTransform);
+            if (border)
+            {
+                std::fill(line, line + insideFirst, kOpaque);
+                std::fill(line + insideEnd, line + width, kOpaque);
+            }
+        }
+    });
+}
+
+// Magnify on the CPU and upload the result into the back buffer, which
+// ChooseRenderPath() keeps 8-bit by forcing SDR capture.
+void DrawCpuMagnifier(UINT width, UINT height)
+{
+    if (!g_CpuDesktop.valid || width == 0 || height == 0 || g_BackBufferFormat != DXGI_FORMAT_B8G8R8A8_UNORM)
+        return;
+    {
+        CpuTimer timer(Stat::CpuDraw);
+        MagnifyOnCpu(width, height);
+    }
+    ComPtr<ID3D11Resource> resource;
+    g_RenderTargetView->GetResource(&resource);
+    ComPtr<ID3D11Texture2D> backBuffer;
+    if (FAILED(resource.As(&backBuffer)))
+        return;
+    D3D11_TEXTURE2D_DESC desc = {};
+    backBuffer->GetDesc(&desc);
+    D3D11_BOX box = { 0, 0, 0, std::min(width, desc.Width), std::min(height, desc.Height), 1 };
+    g_D3DContext->UpdateSubresource(backBuffer.Get(), 0, &box, g_CpuOutput.data(), width * 4, 0);
+}
+
+// Back buffer format for a captured format: scRGB FP16 and 10-bit desktops
+// are drawn in their own format, anything else to 8-bit BGRA.
+DXGI_FORMAT BackBufferFormatFor(DXGI_FORMAT source)
+{
+    if (source == DXGI_FORMAT_R16G16B16A16_FLOAT || source == DXGI_FORMAT_R10G10B10A2_UNORM)
+        return source;
+    return DXGI_FORMAT_B8G8R8A8_UNORM;
+}
+
+// Switch the back buffer to the format of the frame about to be drawn, and
+// keep g_SdrWhiteScale current for the monitor it comes from. The buffers are
+// only recreated when the desktop format changes, as on HDR switches.
+void MatchSourceFormat(ID3D11ShaderResourceView* source)
+{
+    if (!source)
+        return;
+    D3D11_SHADER_RESOURCE_VIEW_DESC desc;
+    source->GetDesc(&desc);
+    DXGI_FORMAT format = BackBufferFormatFor(desc.Format);
+    HMONITOR monitor = g_Outputs.empty() ? nullptr : g_Outputs[g_ActiveOutput.load()]->monitor;
+    if (format == g_BackBufferFormat && monitor == g_ColorMonitor)
+        return;
+    g_ColorMonitor = monitor;
+    g_SdrWhiteScale = format == DXGI_FORMAT_R16G16B16A16_FLOAT ? QueryDisplayColor(monitor).sdrWhiteScale : 1.0f;
+    g_ConstantsDirty = true;  // The colour matrix offsets are in SDR white units
+    if (format == g_BackBufferFormat)
+        return;
+
+    // Composition swap chains reject a zero size, so pass the current one.
+    g_Renderer->ReleaseBackBufferViews();
+    HRESULT hr = g_SwapChain->ResizeBuffers(0, g_ScreenWidth, g_ScreenHeight, format, g_SwapChainFlags);
+    if (DeviceWasRemoved(hr))
+    {
+        g_DeviceLost = true;
+        return;
+    }
+    if (FAILED(hr))
+        std::cout << "Failed to switch the back buffer format: " << HrToString(hr) << std::endl;
+    else
+        g_BackBufferFormat = format;
+    ApplySwapChainColorSpace();
+    if (!g_Renderer->CreateBackBufferViews())
+        g_DeviceLost = true;
+    std::cout << "Drawing in " << (g_BackBufferFormat == DXGI_FORMAT_R16G16B16A16_FLOAT ? "scRGB FP16" :
+        g_BackBufferFormat == DXGI_FORMAT_R10G10B10A2_UNORM ? "10-bit" : "8-bit") << " to match the desktop." << std::endl;
+}
+
+// Renderer that draws on the immediate context, with the fragment, compute
+// or CPU magnifier.
+class D3D11Renderer : public Renderer {
+public:
+    const char* Name() const override { return "Direct3D 11"; }
+    IUnknown* SwapChainDevice() const override { return g_D3DDevice.Get(); }
+    bool CreateBackBufferViews() override { return CreateD3D11BackBufferViews(); }
+    void ReleaseBackBufferViews() override { ReleaseD3D11BackBufferViews(); }
+    bool Ready() const override { return g_RenderTargetView != nullptr; }
+
+    void Draw(UINT width, UINT height) override
+    {
+        if (g_CpuRender)
+            DrawCpuMagnifier(width, height);
+        else if (g_BackBufferUAV && ComputeFilterSelected())
+            DispatchMagnifier(g_BackBufferUAV.Get(), g_FrameShaderResourceView.Get(), width, height);
+        else
+            DrawMagnifier(g_RenderTargetView.Get(), width, height);
+    }
+
+    HRESULT Present(UINT syncInterval) override
+    {
+        HRESULT hr = g_SwapChain->Present(syncInterval, 0);
+        g_Bound.target = nullptr;  // Flip-model Present unbinds the back buffer
+        return hr;
+    }
+};
+
+// Renderer that draws the fragment magnifier on a Direct3D 12 queue of its
+// own, created on the capture device's adapter at global realtime priority
+// where the process may use it, high priority otherwise or with
+// --no-realtime. Capture stays on Direct3D 11, since desktop duplication
+// needs a D3D11 device. Each updated desktop image is copied into the next
+// of a few frame slots, textures shared with this device through NT
+// handles, and two shared fences order the queues explicitly: the copy into
+// a slot waits on the render fence only for the last frame that read that
+// slot and signals the capture fence, and the queue waits on the capture
+// fence for the slot it draws. Capturing the next image so overlaps drawing
+// the current one.
+//
+// Each frame replays a command list recorded once per back buffer and
+// shader variant when the buffers are created, so drawing records nothing.
+// The lists read their constants and descriptors from slots per back buffer,
+// which are rewritten only once the buffer's last frame has completed.
+class D3D12Renderer : public Renderer {
+public:
+    ~D3D12Renderer() override
+    {
+        WaitForGpu();
+        if (m_fenceEvent)
+            CloseHandle(m_fenceEvent);
+    }
+
+    bool Initialize()
+    {
+        ComPtr<IDXGIDevice> dxgiDevice;
+        ComPtr<IDXGIAdapter> adapter;
+        HRESULT hr = g_D3DDevice.As(&dxgiDevice);
+        if (SUCCEEDED(hr))
+            hr = dxgiDevice->GetAdapter(&adapter);
+        if (SUCCEEDED(hr))
+            hr = D3D12CreateDevice(adapter.Get(), D3D_FEATURE_LEVEL_11_0, IID_PPV_ARGS(&m_device));
+        if (FAILED(hr))
+            return Fail("Create D3D12 device", hr);
+        if (FAILED(hr = g_D3DDevice.As(&m_device11)) || FAILED(hr = g_D3DContext.As(&m_context11)))
+            return Fail("Query the D3D11.4 fence interfaces", hr);
+
+        D3D12_COMMAND_QUEUE_DESC queueDesc = {};
+        queueDesc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+        queueDesc.Priority = g_Options.realtime ? D3D12_COMMAND_QUEUE_PRIORITY_GLOBAL_REALTIME : D3D12_COMMAND_QUEUE_PRIORITY_HIGH;
+        hr = m_device->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&m_queue));
+        if (FAILED(hr) && queueDesc.Priority == D3D12_COMMAND_QUEUE_PRIORITY_GLOBAL_REALTIME)
+        {
+            // Global realtime needs the increase base priority privilege.
+            queueDesc.Priority = D3D12_COMMAND_QUEUE_PRIORITY_HIGH;
+            hr = m_device->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&m_queue));
+        }
+        if (FAILED(hr))
+            return Fail("Create command queue", hr);
+        if (FAILED(hr = m_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&m_allocator))))
+            return Fail("Create command allocator", hr);
+        if (!CreatePipeline() || !CreateHeaps() || !CreateFences())
+            return false;
+        std::cout << "Drawing with Direct3D 12 on a " <<
+            (queueDesc.Priority == D3D12_COMMAND_QUEUE_PRIORITY_GLOBAL_REALTIME ? "global realtime" : "high") <<
+            " priority queue." << std::endl;
+        return true;
+    }
+
+    const char* Name() const override { return "Direct3D 12"; }
+    IUnknown* SwapChainDevice() const override { return m_queue.Get(); }
+    bool Ready() const override { return !m_buffers.empty(); }
+
+    bool CreateBackBufferViews() override
+    {
+        ComPtr<IDXGISwapChain3> swapChain3;
+        HRESULT hr = g_SwapChain.As(&swapChain3);
+        if (FAILED(hr))
+            return Fail("Query IDXGISwapChain3", hr);
+        DXGI_SWAP_CHAIN_DESC1 desc = {};
+        g_SwapChain->GetDesc1(&desc);
+        if (desc.Format != DXGI_FORMAT_B8G8R8A8_UNORM || desc.BufferCount > kSwapChainBufferCount)
+        {
+            std::cerr << "The Direct3D 12 renderer draws into " << kSwapChainBufferCount << " 8-bit BGRA buffers only." << std::endl;
+            return false;
+        }
+        m_swapChain = swapChain3;
+        if (FAILED(hr = m_allocator->Reset()))
+            return Fail("Reset command allocator", hr);
+
+        UINT rtvSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_RTV);
+        UINT srvSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+        m_buffers.resize(desc.BufferCount);
+        for (UINT index = 0; index < desc.BufferCount; index++)
+        {
+            BackBuffer& buffer = m_buffers[index];
+            if (FAILED(hr = g_SwapChain->GetBuffer(index, IID_PPV_ARGS(&buffer.resource))))
+            {
+                m_buffers.clear();
+                return Fail("Get back buffer", hr);
+            }
+            D3D12_CPU_DESCRIPTOR_HANDLE rtv = m_rtvHeap->GetCPUDescriptorHandleForHeapStart();
+            rtv.ptr += static_cast<SIZE_T>(index) * rtvSize;
+            m_device->CreateRenderTargetView(buffer.resource.Get(), nullptr, rtv);
+            D3D12_GPU_DESCRIPTOR_HANDLE table = m_srvHeap->GetGPUDescriptorHandleForHeapStart();
+            table.ptr += static_cast<UINT64>(index) * 2 * srvSize;
+            D3D12_GPU_VIRTUAL_ADDRESS constants = m_constantBuffer->GetGPUVirtualAddress() + index * kConstantSlotSize;
+
+            for (int border = 0; border < kBorderModeCount; border++)
+            {
+                for (int cursor = 0; cursor < 2; cursor++)
+                {
+                    for (int enhance = 0; enhance < 2; enhance++)
+                    {
+                        ComPtr<ID3D12GraphicsCommandList>& list = buffer.lists[border][cursor][enhance];
+                        hr = m_device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, m_allocator.Get(),
+                            m_pipelines[border][cursor][enhance].Get(), IID_PPV_ARGS(&list));
+                        if (FAILED(hr))
+                        {
+                            m_buffers.clear();
+                            return Fail("Create command list", hr);
+                        }
+                        RecordDraw(list.Get(), buffer.resource.Get(), rtv, table, constants, desc.Width, desc.Height);
+                        if (FAILED(hr = list->Close()))
+                        {
+                            m_buffers.clear();
+                            return Fail("Record command list", hr);
+                        }
+                    }
+                }
+            }
+        }
+        g_GpuMemory[static_cast<int>(GpuMemoryUse::SwapChain)] = static_cast<UINT64>(desc.BufferCount) * desc.Width * desc.Height * 4;
+        return true;
+    }
+
+    void ReleaseBackBufferViews() override
+    {
+        WaitForGpu();
+        m_buffers.clear();
+        m_swapChain.Reset();
+    }
+
+    // The recorded viewport already matches the buffers, as the size does.
+    void Draw(UINT, UINT) override
+    {
+        if (m_latestSlot >= kFrameSlotCount || !g_DesktopTextureValid)
+            return;
+        FrameSlot& frameSlot = m_frameSlots[m_latestSlot];
+        UINT index = m_swapChain->GetCurrentBackBufferIndex();
+        if (index >= m_buffers.size())
+            return;
+        BackBuffer& buffer = m_buffers[index];
+        WaitForValue(buffer.fenceValue);
+
+        MagnificationConstantBuffer constants = BuildConstants();
+        memcpy(m_constants + index * kConstantSlotSize, &constants, sizeof(constants));
+        g_ConstantsDirty = false;
+
+        ID3D12Resource* cursor = nullptr;
+        if (g_CursorInView)
+            cursor = GetCursorTexture(g_Cursor.shape);
+        UINT srvSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+        D3D12_CPU_DESCRIPTOR_HANDLE slot = m_srvHeap->GetCPUDescriptorHandleForHeapStart();
+        slot.ptr += static_cast<SIZE_T>(index) * 2 * srvSize;
+        if (buffer.frameTexture != frameSlot.texture.Get())
+        {
+            m_device->CreateShaderResourceView(frameSlot.texture.Get(), nullptr, slot);
+            buffer.frameTexture = frameSlot.texture.Get();
+        }
+        slot.ptr += srvSize;
+        if (cursor && buffer.cursorTexture != cursor)
+        {
+            m_device->CreateShaderResourceView(cursor, nullptr, slot);
+            buffer.cursorTexture = cursor;
+        }
+
+        int border = 0, cursorVariant = 0, enhance = 0;
+        FindPixelShaderVariant(border, cursorVariant, enhance);
+        if (cursorVariant && !cursor)
+            cursorVariant = 0;  // The upload failed; draw without the pointer
+        ID3D12CommandList* list = buffer.lists[border][cursorVariant][enhance].Get();
+        m_queue->Wait(m_captureFence.Get(), frameSlot.captureValue);
+        m_queue->ExecuteCommandLists(1, &list);
+        m_drawnIndex = index;
+        m_drawnSlot = m_latestSlot;
+    }
+
+    HRESULT Present(UINT syncInterval) override
+    {
+        HRESULT hr = g_SwapChain->Present(syncInterval, 0);
+        m_queue->Signal(m_renderFence.Get(), ++m_renderValue);
+        if (m_drawnIndex < m_buffers.size())
+            m_buffers[m_drawnIndex].fenceValue = m_renderValue;
+        if (m_drawnSlot < kFrameSlotCount)
+            m_frameSlots[m_drawnSlot].renderValue = m_renderValue;
+        m_drawnIndex = UINT_MAX;
+        m_drawnSlot = UINT_MAX;
+        return hr;
+    }
+
+    // Copy the new image into the next frame slot once the last frame that
+    // read the slot is done; the frames drawing from the others go on.
+    void FrameWritten() override
+    {
+        if (!EnsureFrameSlots())
+            return;
+        UINT next = (m_latestSlot + 1) % kFrameSlotCount;
+        FrameSlot& frameSlot = m_frameSlots[next];
+        m_context11->Wait(m_renderFence11.Get(), frameSlot.renderValue);
+        g_D3DContext->CopyResource(frameSlot.texture11.Get(), g_DesktopTexture.Get());
+        m_context11->Signal(m_captureFence11.Get(), ++m_captureValue);
+        frameSlot.captureValue = m_captureValue;
+        m_latestSlot = next;
+        g_D3DContext->Flush();  // Submit the signal the queue waits for
+    }
+
+private:
+    static constexpr UINT kConstantSlotSize = D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT;
+    // One slot per frame the queue can have in flight, and one to copy into.
+    static constexpr UINT kFrameSlotCount = kSwapChainBufferCount + 1;
+
+    struct BackBuffer {
+        ComPtr<ID3D12Resource> resource;
+        ComPtr<ID3D12GraphicsCommandList> lists[kBorderModeCount][2][2];
+        UINT64 fenceValue = 0;                   // Render fence value its last frame signals
+        ID3D12Resource* frameTexture = nullptr;  // Textures its descriptor slots hold
+        ID3D12Resource* cursorTexture = nullptr;
+    };
+    struct FrameSlot {
+        ComPtr<ID3D11Texture2D> texture11;   // Shared copy of g_DesktopTexture
+        ComPtr<ID3D12Resource> texture;      // The same texture on this device
+        UINT64 captureValue = 0;             // Capture fence value its last copy signals
+        UINT64 renderValue = 0;              // Render fence value of the last frame that read it
+    };
+    struct CursorTexture {
+        std::shared_ptr<const CursorShape> shape;
+        ComPtr<ID3D12Resource> texture;
+    };
+
+    static bool Fail(const char* what, HRESULT hr)
+    {
+        std::cerr << what << " failed: " << HrToString(hr) << std::endl;
+        return false;
+    }
+
+    // Root signature: the constants at b0 for both stages, the frame and
+    // cursor textures at t0 and t1, and the bilinear clamp sampler at s0,
+    // as the shaders declare them. One pipeline per pixel shader variant.
+    bool CreatePipeline()
+    {
+        D3D12_DESCRIPTOR_RANGE range = {};
+        range.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
+        range.NumDescriptors = 2;
+        range.OffsetInDescriptorsFromTableStart = D3D12_DESCRIPTOR_RANGE_OFFSET_APPEND;
+        D3D12_ROOT_PARAMETER parameters[2] = {};
+        parameters[0].ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV;
+        parameters[0].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+        parameters[1].ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
+        parameters[1].DescriptorTable = { 1, &range };
+        parameters[1].ShaderVisibility = D3D12_SHADER_VISIBILITY_PIXEL;
+        D3D12_STATIC_SAMPLER_DESC sampler = {};
+        sampler.Filter = D3D12_FILTER_MIN_MAG_MIP_LINEAR;
+        sampler.AddressU = D3D12_TEXTURE_ADDRESS_MODE_CLAMP;
+        sampler.AddressV = D3D12_TEXTURE_ADDRESS_MODE_CLAMP;
+        sampler.AddressW = D3D12_TEXTURE_ADDRESS_MODE_CLAMP;
+        sampler.ComparisonFunc = D3D12_COMPARISON_FUNC_NEVER;
+        sampler.MaxLOD = D3D12_FLOAT32_MAX;
+        sampler.ShaderVisibility = D3D12_SHADER_VISIBILITY_PIXEL;
+        D3D12_ROOT_SIGNATURE_DESC rootDesc = { ARRAYSIZE(parameters), parameters, 1, &sampler,
+            D3D12_ROOT_SIGNATURE_FLAG_DENY_HULL_SHADER_ROOT_ACCESS | D3D12_ROOT_SIGNATURE_FLAG_DENY_DOMAIN_SHADER_ROOT_ACCESS |
+            D3D12_ROOT_SIGNATURE_FLAG_DENY_GEOMETRY_SHADER_ROOT_ACCESS };
+        ComPtr<ID3DBlob> blob, errors;
+        HRESULT hr = D3D12SerializeRootSignature(&rootDesc, D3D_ROOT_SIGNATURE_VERSION_1, &blob, &errors);
+        if (SUCCEEDED(hr))
+            hr = m_device->CreateRootSignature(0, blob->GetBufferPointer(), blob->GetBufferSize(), IID_PPV_ARGS(&m_rootSignature));
+        if (FAILED(hr))
+            return Fail("Create root signature", hr);
+
+        // The quad is the same single triangle generated from SV_VertexID.
+        D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {};
+        desc.pRootSignature = m_rootSignature.Get();
+        desc.VS = { g_MagnifierVS, sizeof(g_MagnifierVS) };
+        desc.BlendState.RenderTarget[0].RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_ALL;
+        desc.SampleMask = UINT_MAX;
+        desc.RasterizerState.FillMode = D3D12_FILL_MODE_SOLID;
+        desc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+        desc.RasterizerState.DepthClipEnable = TRUE;
+        desc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+        desc.NumRenderTargets = 1;
+        desc.RTVFormats[0] = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        for (int border = 0; border < kBorderModeCount; border++)
+        {
+            for (int cursor = 0; cursor < 2; cursor++)
+            {
+                for (int enhance = 0; enhance < 2; enhance++)
+                {
+                    const ShaderBytecode& bytecode = kPixelShaderPermutations[border][cursor][enhance];
+                    desc.PS = { bytecode.data, bytecode.size };
+                    hr = m_device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&m_pipelines[border][cursor][enhance]));
+                    if (FAILED(hr))
+                        return Fail("Create pipeline state", hr);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Descriptor heaps for the back buffer views and the texture slots, and
+    // the persistently mapped constant slots.
+    bool CreateHeaps()
+    {
+        D3D12_DESCRIPTOR_HEAP_DESC rtvDesc = { D3D12_DESCRIPTOR_HEAP_TYPE_RTV, kSwapChainBufferCount, D3D12_DESCRIPTOR_HEAP_FLAG_NONE, 0 };
+        D3D12_DESCRIPTOR_HEAP_DESC srvDesc = { D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, 2 * kSwapChainBufferCount,
+            D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE, 0 };
+        HRESULT hr = m_device->CreateDescriptorHeap(&rtvDesc, IID_PPV_ARGS(&m_rtvHeap));
+        if (SUCCEEDED(hr))
+            hr = m_device->CreateDescriptorHeap(&srvDesc, IID_PPV_ARGS(&m_srvHeap));
+        if (FAILED(hr))
+            return Fail("Create descriptor heap", hr);
+        // Null views until the first frame, so every slot is valid.
+        D3D12_SHADER_RESOURCE_VIEW_DESC nullView = {};
+        nullView.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        nullView.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+        nullView.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+        nullView.Texture2D.MipLevels = 1;
+        UINT srvSize = m_device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+        D3D12_CPU_DESCRIPTOR_HANDLE slot = m_srvHeap->GetCPUDescriptorHandleForHeapStart();
+        for (UINT i = 0; i < 2 * kSwapChainBufferCount; i++, slot.ptr += srvSize)
+            m_device->CreateShaderResourceView(nullptr, &nullView, slot);
+
+        D3D12_HEAP_PROPERTIES upload = { D3D12_HEAP_TYPE_UPLOAD };
+        D3D12_RESOURCE_DESC bufferDesc = {};
+        bufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        bufferDesc.Width = kSwapChainBufferCount * kConstantSlotSize;
+        bufferDesc.Height = 1;
+        bufferDesc.DepthOrArraySize = 1;
+        bufferDesc.MipLevels = 1;
+        bufferDesc.SampleDesc.Count = 1;
+        bufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+        hr = m_device->CreateCommittedResource(&upload, D3D12_HEAP_FLAG_NONE, &bufferDesc,
+            D3D12_RESOURCE_STATE_GENERIC_READ, nullptr, IID_PPV_ARGS(&m_constantBuffer));
+        D3D12_RANGE noRead = { 0, 0 };
+        if (SUCCEEDED(hr))
+            hr = m_constantBuffer->Map(0, &noRead, reinterpret_cast<void**>(&m_constants));
+        if (FAILED(hr))
+            return Fail("Create constant buffer", hr);
+        return true;
+    }
+
+    // The capture fence belongs to the D3D11 device and the render fence to
+    // the D3D12 one; each is opened on the other device.
+    bool CreateFences()
+    {
+        HANDLE handle = nullptr;
+        HRESULT hr = m_device11->CreateFence(0, D3D11_FENCE_FLAG_SHARED, IID_PPV_ARGS(&m_captureFence11));
+        if (SUCCEEDED(hr))
+            hr = m_captureFence11->CreateSharedHandle(nullptr, GENERIC_ALL, nullptr, &handle);
+        if (SUCCEEDED(hr))
+            hr = m_device->OpenSharedHandle(handle, IID_PPV_ARGS(&m_captureFence));
+        if (handle)
+            CloseHandle(handle);
+        if (FAILED(hr))
+            return Fail("Share the capture fence", hr);
+
+        handle = nullptr;
+        hr = m_device->CreateFence(0, D3D12_FENCE_FLAG_SHARED, IID_PPV_ARGS(&m_renderFence));
+        if (SUCCEEDED(hr))
+            hr = m_device->CreateSharedHandle(m_renderFence.Get(), nullptr, GENERIC_ALL, nullptr, &handle);
+        if (SUCCEEDED(hr))
+            hr = m_device11->OpenSharedFence(handle, IID_PPV_ARGS(&m_renderFence11));
+        if (handle)
+            CloseHandle(handle);
+        if (FAILED(hr))
+            return Fail("Share the render fence", hr);
+
+        m_fenceEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (!m_fenceEvent)
+            return Fail("Create fence event", HRESULT_FROM_WIN32(GetLastError()));
+        return true;
+    }
+
+    // Record the draw of one back buffer: the only state a command list
+    // starts without is set here, so replaying it needs nothing else.
+    void RecordDraw(ID3D12GraphicsCommandList* list, ID3D12Resource* target, D3D12_CPU_DESCRIPTOR_HANDLE rtv,
+        D3D12_GPU_DESCRIPTOR_HANDLE table, D3D12_GPU_VIRTUAL_ADDRESS constants, UINT width, UINT height)
+    {
+        ID3D12DescriptorHeap* heaps[] = { m_srvHeap.Get() };
+        list->SetGraphicsRootSignature(m_rootSignature.Get());
+        list->SetDescriptorHeaps(1, heaps);
+        list->SetGraphicsRootConstantBufferView(0, constants);
+        list->SetGraphicsRootDescriptorTable(1, table);
+        D3D12_VIEWPORT viewport = { 0.0f, 0.0f, static_cast<float>(width), static_cast<float>(height), 0.0f, 1.0f };
+        D3D12_RECT scissor = { 0, 0, static_cast<LONG>(width), static_cast<LONG>(height) };
+        list->RSSetViewports(1, &viewport);
+        list->RSSetScissorRects(1, &scissor);
+        D3D12_RESOURCE_BARRIER barrier = {};
+        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+        barrier.Transition.pResource = target;
+        barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
+        barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_PRESENT;
+        barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_RENDER_TARGET;
+        list->ResourceBarrier(1, &barrier);
+        // The triangle covers every pixel, so no clear is needed.
+        list->OMSetRenderTargets(1, &rtv, FALSE, nullptr);
+        list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        list->DrawInstanced(3, 1, 0, 0);
+        std::swap(barrier.Transition.StateBefore, barrier.Transition.StateAfter);
+        list->ResourceBarrier(1, &barrier);
+    }
+
+    // (Re)create the frame slots to match g_DesktopTexture. They are
+    // recreated only when its size or format changes, after the queue has
+    // finished reading the old ones.
+    bool EnsureFrameSlots()
+    {
+        if (!g_DesktopTexture)
+            return false;
+        D3D11_TEXTURE2D_DESC desc = {};
+        g_DesktopTexture->GetDesc(&desc);
+        if (m_frameSlots[0].texture11)
+        {
+            D3D11_TEXTURE2D_DESC slotDesc = {};
+            m_frameSlots[0].texture11->GetDesc(&slotDesc);
+            if (slotDesc.Width == desc.Width && slotDesc.Height == desc.Height && slotDesc.Format == desc.Format)
+                return true;
+        }
+        WaitForGpu();
+        for (BackBuffer& buffer : m_buffers)
+            buffer.frameTexture = nullptr;
+        for (FrameSlot& frameSlot : m_frameSlots)
+            frameSlot = {};
+        m_latestSlot = UINT_MAX;
+
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;  // Some drivers only share render targets
+        desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED | D3D11_RESOURCE_MISC_SHARED_NTHANDLE;
+        for (FrameSlot& frameSlot : m_frameSlots)
+        {
+            ComPtr<IDXGIResource1> resource;
+            HANDLE handle = nullptr;
+            HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, nullptr, &frameSlot.texture11);
+            if (SUCCEEDED(hr))
+            {
+                TrackAllocation(frameSlot.texture11.Get(), GpuMemoryUse::DesktopCopy);
+                hr = frameSlot.texture11.As(&resource);
+            }
+            if (SUCCEEDED(hr))
+                hr = resource->CreateSharedHandle(nullptr, DXGI_SHARED_RESOURCE_READ | DXGI_SHARED_RESOURCE_WRITE, nullptr, &handle);
+            if (SUCCEEDED(hr))
+                hr = m_device->OpenSharedHandle(handle, IID_PPV_ARGS(&frameSlot.texture));
+            if (handle)
+                CloseHandle(handle);
+            if (FAILED(hr))
+            {
+                std::cout << "Failed to share a frame slot with the D3D12 device: " << HrToString(hr) << std::endl;
+                for (FrameSlot& created : m_frameSlots)
+                    created = {};
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Texture of a pointer shape on this device, uploaded once per shape
+    // through a CPU-visible heap; the shapes are the 8-bit ones, as capture
+    // runs in SDR. The most recent shapes are kept, as on the capture side.
+    ID3D12Resource* GetCursorTexture(const std::shared_ptr<const CursorShape>& shape)
+    {
+        for (auto it = m_cursorTextures.begin(); it != m_cursorTextures.end(); ++it)
+        {
+            if (it->shape == shape)
+            {
+                std::rotate(m_cursorTextures.begin(), it, it + 1);
+                return m_cursorTextures.front().texture.Get();
+            }
+        }
+        if (shape->pixels.empty())
+            return nullptr;
+        D3D12_HEAP_PROPERTIES heap = {};
+        heap.Type = D3D12_HEAP_TYPE_CUSTOM;
+        heap.CPUPageProperty = D3D12_CPU_PAGE_PROPERTY_WRITE_COMBINE;
+        heap.MemoryPoolPreference = D3D12_MEMORY_POOL_L0;
+        D3D12_RESOURCE_DESC desc = {};
+        desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+        desc.Width = shape->width;
+        desc.Height = shape->height;
+        desc.DepthOrArraySize = 1;
+        desc.MipLevels = 1;
+        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        ComPtr<ID3D12Resource> texture;
+        HRESULT hr = m_device->CreateCommittedResource(&heap, D3D12_HEAP_FLAG_NONE, &desc,
+            D3D12_RESOURCE_STATE_COMMON, nullptr, IID_PPV_ARGS(&texture));
+        if (SUCCEEDED(hr))
+            hr = texture->Map(0, nullptr, nullptr);
+        if (SUCCEEDED(hr))
+        {
+            hr = texture->WriteToSubresource(0, nullptr, shape->pixels.data(), shape->width * 4, 0);
+            texture->Unmap(0, nullptr);
+        }
+        if (FAILED(hr))
+        {
+            std::cout << "Failed to create the D3D12 cursor texture: " << HrToString(hr) << std::endl;
+            return nullptr;
+        }
+        if (m_cursorTextures.size() >= kMaxCachedCursorShapes)
+        {
+            // A frame in flight may still sample the oldest shape.
+            WaitForGpu();
+            ID3D12Resource* evicted = m_cursorTextures.back().texture.Get();
+            for (BackBuffer& buffer : m_buffers)
+            {
+                if (buffer.cursorTexture == evicted)
+                    buffer.cursorTexture = nullptr;
+            }
+            m_cursorTextures.pop_back();
+        }
+        m_cursorTextures.insert(m_cursorTextures.begin(), CursorTexture{ shape, texture });
+        return texture.Get();
+    }
+
+    // Indices of g_PixelShader in the permutation table, which the pipelines
+    // mirror.
+    void FindPixelShaderVariant(int& border, int& cursor, int& enhance) const
+    {
+        for (int b = 0; b < kBorderModeCount; b++)
+            for (int c = 0; c < 2; c++)
+                for (int e = 0; e < 2; e++)
+                    if (g_PixelShaderPermutations[b][c][e] == g_PixelShader)
+                    {
+                        border = b;
+                        cursor = c;
+                        enhance = e;
+                    }
+    }
+
+    void WaitForValue(UINT64 value)
+    {
+        if (m_renderFence->GetCompletedValue() >= value)
+            return;
+        if (SUCCEEDED(m_renderFence->SetEventOnCompletion(value, m_fenceEvent)))
+            WaitForSingleObject(m_fenceEvent, INFINITE);
+    }
+
+    // Wait until the queue has finished every frame submitted to it.
+    void WaitForGpu()
+    {
+        if (!m_queue || !m_renderFence || !m_fenceEvent)
+            return;
+        if (SUCCEEDED(m_queue->Signal(m_renderFence.Get(), ++m_renderValue)))
+            WaitForValue(m_renderValue);
+    }
+
+    ComPtr<ID3D12Device> m_device;
+    ComPtr<ID3D12CommandQueue> m_queue;
+    ComPtr<ID3D12CommandAllocator> m_allocator;  // Backs every recorded list
+    ComPtr<ID3D12RootSignature> m_rootSignature;
+    ComPtr<ID3D12PipelineState> m_pipelines[kBorderModeCount][2][2];
+    ComPtr<ID3D12DescriptorHeap> m_rtvHeap;
+    ComPtr<ID3D12DescriptorHeap> m_srvHeap;      // Frame and cursor views, two per back buffer
+    ComPtr<ID3D12Resource> m_constantBuffer;
+    BYTE* m_constants = nullptr;                 // Mapped slots, one per back buffer
+    ComPtr<IDXGISwapChain3> m_swapChain;
+    std::vector<BackBuffer> m_buffers;
+    UINT m_drawnIndex = UINT_MAX;                // Back buffer Draw() submitted to
+    UINT m_drawnSlot = UINT_MAX;                 // Frame slot it reads
+
+    FrameSlot m_frameSlots[kFrameSlotCount];
+    UINT m_latestSlot = UINT_MAX;                // Slot holding the newest image
+    std::vector<CursorTexture> m_cursorTextures; // Newest first
+
+    ComPtr<ID3D11Device5> m_device11;
+    ComPtr<ID3D11DeviceContext4> m_context11;
+    ComPtr<ID3D11Fence> m_captureFence11;        // Signalled by D3D11 after each frame slot copy
+    ComPtr<ID3D12Fence> m_captureFence;
+    UINT64 m_captureValue = 0;
+    ComPtr<ID3D12Fence> m_renderFence;           // Signalled by the queue after each present
+    ComPtr<ID3D11Fence> m_renderFence11;
+    UINT64 m_renderValue = 0;
+    HANDLE m_fenceEvent = nullptr;
+};
+
+// Render the current frame into the back buffer and present it.
+void RenderCurrentFrame() {
+    WaitForNextFrame();
+    MatchSourceFormat(g_FrameShaderResourceView.Get());
+    if (!g_Renderer->Ready())
+        return;
+
+    bool cursorInView = CursorInView();
+    if (cursorInView != g_CursorInView)
+    {
+        g_CursorInView = cursorInView;
+        SelectShaderPermutation();
+    }
+
+    // The swap chain always matches the client area.
+    BeginGpuSegment(GpuSegment::Draw);
+    UINT width = static_cast<UINT>(g_ScreenWidth);
+    UINT height = static_cast<UINT>(g_ScreenHeight);
+    g_Renderer->Draw(width, height);
+    EndGpuSegment(GpuSegment::Draw);
+    if (g_Options.statsOverlay)
+    {
+        DrawStatsOverlay();
+        InvalidateBoundState();  // Direct2D draws through the same context
+    }
+    if (g_Recorder)
+    {
+        g_Recorder->AddFrame(g_RenderTargetView.Get());
+        InvalidateBoundState();
+    }
+
+    UINT syncInterval = g_Options.pacing == PacingPolicy::VSync ? 1 : 0;
+    BeginGpuSegment(GpuSegment::Present);
+    HRESULT hr = g_Renderer->Present(syncInterval);
+    EndGpuSegment(GpuSegment::Present);
+    g_PresentCount++;
+    if (DeviceWasRemoved(hr))
+        g_DeviceLost = true;
+    else if (FAILED(hr))
+        std::cout << "Present failed: " << HrToString(hr) << std::endl;
+    TrackPresentLatency();
+}
+
+// Predict when the frame about to be presented reaches the screen: the
+// vblank after the presents still queued, counted from the last vblank the
+// swap chain's frame statistics report, and never earlier than the next
+// vblank from now. Falls back to one refresh from now while the swap chain
+// has no statistics yet.
+LONGLONG PredictPresentTime()
+{
+    LONGLONG now = QpcNow();
+    LONGLONG period = std::max<LONGLONG>(1, MicrosecondsToQpc(1e6 / g_RefreshRate.load()));
+    DXGI_FRAME_STATISTICS frameStats = {};
+    UINT presentCount = 0;
+    if (!g_SwapChain || FAILED(g_SwapChain->GetFrameStatistics(&frameStats)) ||
+        FAILED(g_SwapChain->GetLastPresentCount(&presentCount)) || frameStats.SyncQPCTime.QuadPart == 0)
+        return now + period;
+    LONGLONG queued = std::max(0, static_cast<int>(presentCount - frameStats.PresentCount));
+    LONGLONG predicted = frameStats.SyncQPCTime.QuadPart + (queued + 1) * period;
+    if (predicted <= now)
+        predicted += ((now - predicted) / period + 1) * period;
+    return predicted;
+}
+
+// Advance the zoom towards its target up to the given QueryPerformanceCounter
+// time along the configured curve. The curves are evaluated in closed form,
+// so the value depends only on the time reached and not on how often it was
+// sampled. The zoom never crosses its target and snaps to it once it is
+// within 0.0005. Times before the last update are treated as the last update.
+void AdvanceZoom(LONGLONG time)
+{
+    if (time <= g_LastZoomUpdate)
+        return;
+    float dt = static_cast<float>(QpcToMicroseconds(time - g_LastZoomUpdate) / 1e6);
+    g_LastZoomUpdate = time;
+    if (g_CurrentZoom == g_TargetZoom && g_ZoomVelocity == 0.0f)
+        return;
+
+    float tau = g_Options.zoomTimeMs / 1000.0f;
+    float offset = g_CurrentZoom - g_TargetZoom;
+    float next = 0.0f;
+    if (g_Options.zoomCurve == ZoomCurve::Spring && tau > 0.0f)
+    {
+        // x(t) = (x0 + (v0 + w x0) t) e^(-w t), v(t) = (v0 - w (v0 + w x0) t) e^(-w t).
+        // w = 2 / tau settles in about the time the exponential curve takes.
+        float omega = 2.0f / tau;
+        float decay = std::exp(-omega * dt);
+        float c = g_ZoomVelocity + omega * offset;
+        next = (offset + c * dt) * decay;
+        g_ZoomVelocity = (g_ZoomVelocity - omega * c * dt) * decay;
+    }
+    else if (g_Options.zoomCurve == ZoomCurve::Exponential && tau > 0.0f)
+    {
+        next = offset * std::exp(-dt / tau);
+        g_ZoomVelocity = 0.0f;
+    }
+    if (next * offset < 0.0f || (std::fabs(next) < 0.0005f && std::fabs(g_ZoomVelocity) * tau < 0.0005f))
+    {
+        next = 0.0f;
+        g_ZoomVelocity = 0.0f;
+    }
+    g_CurrentZoom = g_TargetZoom + next;
+}
+
+// Zoom held right-click eases to.
+float HeldZoom()
+{
+    return g_Options.zoomLevels[g_ZoomLevel];
+}
+
+// Apply one input event. A right button change first advances the zoom to
+// the time of the event, so the new target is eased towards from the moment
+// of the press or release.
+void ApplyInputEvent(const InputEvent& event)
+{
+    switch (event.type)
+    {
+    case InputEventType::RightButtonDown:
+    case InputEventType::RightButtonUp:
+        AdvanceZoom(event.time);
+        g_RightButtonDown = event.type == InputEventType::RightButtonDown;
+        g_TargetZoom = g_RightButtonDown ? HeldZoom() : 1.0f;
+        break;
+    case InputEventType::NextZoomLevel:
+    case InputEventType::PreviousZoomLevel:
+        if (event.type == InputEventType::NextZoomLevel)
+            g_ZoomLevel = std::min(g_ZoomLevel + 1, g_Options.zoomLevels.size() - 1);
+        else if (g_ZoomLevel > 0)
+            g_ZoomLevel--;
+        std::cout << "Zoom level: " << HeldZoom() << "x" << std::endl;
+        if (g_RightButtonDown)
+        {
+            AdvanceZoom(event.time);
+            g_TargetZoom = HeldZoom();
+        }
+        break;
+    case InputEventType::ToggleWindow:
+        g_WindowToggleRequest = !g_WindowToggleRequest;
+        break;
+    case InputEventType::CycleFilter:
+        g_FilterCycleRequest = true;
+        break;
+    case InputEventType::ToggleSharpen:
+        g_SharpenToggleRequest = !g_SharpenToggleRequest;
+        break;
+    case InputEventType::ToggleInvert:
+        g_InvertToggleRequest = !g_InvertToggleRequest;
+        break;
+    case InputEventType::CycleColorFilter:
+        g_ColorFilterCycleRequest = true;
+        break;
+    }
+}
+
+// Apply the input events queued by the hooks, in order, recording them in
+// the capture trace, then those a replayed trace queued. Replayed window
+// toggles are left out, since they would hide the window being measured.
+void DrainInputEvents()
+{
+    if (uint32_t dropped = g_DroppedInputEvents.exchange(0, std::memory_order_relaxed))
+        std::cerr << "Input queue full; " << dropped << " events dropped." << std::endl;
+    InputEvent event;
+    while (g_InputQueue.Pop(event))
+    {
+        if (g_TraceWriter)
+            g_TraceWriter->AddInput(event);
+        ApplyInputEvent(event);
+    }
+    while (g_TraceReplay && g_TraceReplay->PopInput(event))
+    {
+        if (event.type != InputEventType::ToggleWindow)
+            ApplyInputEvent(event);
+    }
+}
+
+// Evaluate the zoom animation at the predicted present time of the frame
+// being drawn, so frames show where the animation is when they reach the
+// screen however the frame pacing varies, and store it for the constant
+// buffer. Returns true if the zoom changed; once the animation has settled
+// there are no further constant buffer updates or redraws.
+bool UpdateZoom() {
+    if (g_CurrentZoom != g_TargetZoom || g_ZoomVelocity != 0.0f)
+        AdvanceZoom(PredictPresentTime());
+    float targetZoom = g_TargetZoom;
+
+    // The capture thread sizes ROI crops for the widest view of the animation.
+    g_SharedZoom.store(std::min(g_CurrentZoom, targetZoom), std::memory_order_relaxed);
+
+    bool zoomChanged = g_CurrentZoom != g_View.magnificationFactor;
+    if (zoomChanged)
+    {
+        g_View.magnificationFactor = g_CurrentZoom;
+        g_ConstantsDirty = true;
+    }
+    return zoomChanged;
+}
+
+// Whether a desktop image is ready to be drawn, by the device or the CPU.
+bool HaveFrameToDraw()
+{
+    return g_CpuRender ? g_CpuDesktop.valid : g_FrameShaderResourceView != nullptr;
+}
+
+// Process the frame: update the zoom, capture the desktop frame, update the
+// shader resource, and render. Used when capture runs on the render thread.
+// Drawing and presenting are skipped when nothing inside the magnified area
+// changed and the zoom is settled.
+bool ProcessFrame() {
+    bool zoomChanged = UpdateZoom();
+    bool redraw = zoomChanged || g_NeedsRedraw;
+
+    int activeOutput = g_ActiveOutput.load();
+    if (activeOutput != g_CaptureOutput)
+    {
+        if (g_FrameAcquired)
+        {
+            g_CaptureSource->ReleaseFrame();
+            g_FrameAcquired = false;
+        }
+        SwitchCaptureOutput(activeOutput);
+        g_FrameShaderResourceView = g_DesktopTextureValid ? g_DesktopTextureView.Get() : nullptr;
+        BindFrameView(g_FrameShaderResourceView.Get());
+    }
+
+    if (!g_CaptureSource)
+    {
+        if (HaveFrameToDraw() && redraw)
+        {
+            RenderCurrentFrame();
+            g_NeedsRedraw = false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(25));
+        return true;
+    }
+    if (g_CaptureSource->lostTime && !RecoverCapture())
+    {
+        if (HaveFrameToDraw() && redraw)
+        {
+            RenderCurrentFrame();
+            g_NeedsRedraw = false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(kReconnectIntervalMs));
+        return true;
+    }
+
+    // Release the previous frame right before acquiring the next one, as
+    // recommended for desktop duplication.
+    if (g_FrameAcquired)
+    {
+        CpuTimer timer(Stat::Release);
+        g_CaptureSource->ReleaseFrame();
+        g_FrameAcquired = false;
+    }
+
+    CapturedFrame frame;
+    HRESULT hr;
+    {
+        CpuTimer timer(Stat::Acquire);
+        hr = g_CaptureSource->AcquireFrame(25, frame);
+    }
+    if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+    {
+        // Nothing new was presented, so the desktop texture still holds the
+        // current image. A surface sampled directly went back to the
+        // duplication with ReleaseFrame(), so that redraw waits for the next
+        // frame.
+        bool surfaceReleased = !g_CpuRender && g_FrameShaderResourceView.Get() != g_DesktopTextureView.Get();
+        if (HaveFrameToDraw() && redraw && !surfaceReleased)
+        {
+            RenderCurrentFrame();
+            g_NeedsRedraw = false;
+        }
+        else if (redraw)
+        {
+            g_NeedsRedraw = true;
+        }
+        return true;
+    }
+    else if (FAILED(hr))
+    {
+        if (hr == DXGI_ERROR_ACCESS_LOST)
+        {
+            ResetFrameSurfaceViews();
+            HandleCaptureLost();
+        }
+        else if (DeviceWasRemoved(hr))
+        {
+            g_DeviceLost = true;
+        }
+        else
+        {
+            std::cout << "AcquireFrame failed: " << HrToString(hr) << std::endl;
+        }
+        return true;
+    }
+    g_FrameAcquired = true;
+    SetSourceSize(RegionWidth(frame.region), RegionHeight(frame.region));
+    if (UpdateCursor())
+        redraw = true;
+
+    bool viewChanged = false;
+    if (frame.imageUpdated)
+    {
+        g_ShownCaptureTime = frame.frameInfo.LastPresentTime.QuadPart;
+        viewChanged = !frame.haveChangedRects || ChangedRectsIntersect(
+            GetMagnifiedSourceRect(RegionWidth(frame.region), RegionHeight(frame.region), g_CurrentZoom));
+    }
+
+    // The CPU magnifier keeps its own copy of the desktop, so the surface
+    // can be released as soon as the changes are read.
+    if (g_CpuRender)
+    {
+        if (frame.imageUpdated || !g_CpuDesktop.valid)
+        {
+            if (!g_CpuDesktop.valid)
+                viewChanged = true;
+            CpuTimer timer(Stat::Copy);
+            if (!UpdateCpuDesktop(*g_CaptureSource, frame))
+                return true;
+        }
+        {
+            CpuTimer timer(Stat::Release);
+            g_CaptureSource->ReleaseFrame();
+            g_FrameAcquired = false;
+        }
+        if (viewChanged || redraw)
+        {
+            RenderCurrentFrame();
+            g_NeedsRedraw = false;
+        }
+        return true;
+    }
+
+    // A sub-region cannot be sampled in place, so it always goes through the
+    // desktop texture. So does every frame when there are several outputs:
+    // the image has to outlive the frame so an output can be shown again
+    // when the cursor returns to it.
+    bool incremental = g_Options.incrementalCapture || g_Outputs.size() > 1 || !RegionCoversTexture(frame);
+    ID3D11ShaderResourceView* frameView = nullptr;
+    if (incremental)
+    {
+        if (frame.imageUpdated || !g_DesktopTextureValid)
+        {
+            if (!g_DesktopTextureValid)
+                viewChanged = true;
+            CpuTimer timer(Stat::Copy);
+            BeginGpuSegment(GpuSegment::Copy);
+            bool updated = UpdateDesktopTexture(frame);
+            EndGpuSegment(GpuSegment::Copy);
+            if (!updated)
+                return true;
+        }
+        frameView = g_DesktopTextureView.Get();
+
+        // The surface is no longer needed once its changes are copied out.
+        CpuTimer timer(Stat::Release);
+        g_CaptureSource->ReleaseFrame();
+        g_FrameAcquired = false;
+    }
+    else
+    {
+        // Sample the acquired surface directly; no copy is made.
+        frameView = GetFrameSurfaceView(frame.texture.Get());
+        if (!frameView)
+            return true;
+    }
+    if (g_FrameShaderResourceView.Get() != frameView)
+    {
+        g_FrameShaderResourceView = frameView;
+        BindFrameView(g_FrameShaderResourceView.Get());
+        if (incremental)
+            viewChanged = true;
+    }
+
+    if (viewChanged || redraw)
+    {
+        RenderCurrentFrame();
+        g_NeedsRedraw = false;
+    }
+    return true;
+}
+
+// Acquire one desktop frame on the capture thread, copy its changes into the
+// frame ring and publish it. Frames that only move the pointer are dropped.
+bool CaptureFrame() {
+    int activeOutput = g_ActiveOutput.load(std::memory_order_acquire);
+    if (activeOutput != g_CaptureOutput)
+        SwitchCaptureOutput(activeOutput);
+    FrameRing& ring = *g_CaptureRing;
+
+    if (!g_CaptureSource)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return false;
+    }
+    if (g_CaptureSource->lostTime && !RecoverCapture())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kReconnectIntervalMs));
+        return false;
+    }
+
+    // The timeout only bounds how long shutdown waits for this thread. In ROI
+    // mode the crop also has to follow the zoom while the desktop is static,
+    // and with several outputs the cursor can move to another one, so the
+    // wait is kept to about one frame.
+    UINT timeoutMs = 100;
+    if (g_Options.regionOfInterest || g_Outputs.size() > 1)
+        timeoutMs = std::max(1u, static_cast<UINT>(std::chrono::duration_cast<std::chrono::milliseconds>(GetFramePeriod()).count()));
+
+    CapturedFrame frame;
+    HRESULT hr;
+    {
+        CpuTimer timer(Stat::Acquire);
+        hr = g_CaptureSource->AcquireFrame(timeoutMs, frame);
+    }
+    if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+    {
+        if (g_Options.regionOfInterest && PublishFrameRingCrop(ring, false, false))
+            SetEvent(g_FrameReadyEvent);
+        return true;
+    }
+    if (FAILED(hr))
+    {
+        if (hr == DXGI_ERROR_ACCESS_LOST)
+            HandleCaptureLost();
+        else if (DeviceWasRemoved(hr))
+            g_DeviceLost = true;
+        else
+            std::cout << "AcquireFrame failed: " << HrToString(hr) << std::endl;
+        return true;
+    }
+
+    bool published = false;
+    bool firstFrame = !ring.textures[0];
+    if (frame.imageUpdated)
+        ring.lastCaptureTime = frame.frameInfo.LastPresentTime.QuadPart;
+    {
+        CpuTimer timer(Stat::Copy);
+        if (g_Options.regionOfInterest)
+        {
+            // g_DesktopTexture keeps the whole region current; slots are cut from it.
+            bool wasValid = g_DesktopTextureValid;
+            bool imageChanged = frame.imageUpdated || !wasValid;
+            if (imageChanged && !UpdateDesktopTexture(frame))
+                imageChanged = false;
+            bool haveChangedRects = wasValid && frame.haveChangedRects;
+            if (imageChanged)
+                QueueFrameRingChanges(ring, haveChangedRects);
+            if (imageChanged && !haveChangedRects)
+            {
+                // Treat the whole region as changed.
+                D3D11_TEXTURE2D_DESC desc = {};
+                if (g_DesktopTexture)
+                    g_DesktopTexture->GetDesc(&desc);
+                g_ChangedRects.assign(1, { 0, 0, static_cast<LONG>(desc.Width), static_cast<LONG>(desc.Height) });
+            }
+            float zoom = g_SharedZoom.load(std::memory_order_relaxed);
+            bool viewChanged = imageChanged && ChangedRectsIntersect(
+                GetMagnifiedSourceRect(RegionWidth(frame.region), RegionHeight(frame.region), zoom));
+            published = PublishFrameRingCrop(ring, imageChanged, viewChanged);
+        }
+        else if (frame.imageUpdated || firstFrame)
+        {
+            if (!firstFrame || CreateFrameRing(ring, frame))
+            {
+                float zoom = g_SharedZoom.load(std::memory_order_relaxed);
+                bool viewChanged = firstFrame || !frame.haveChangedRects || ChangedRectsIntersect(
+                    GetMagnifiedSourceRect(RegionWidth(frame.region), RegionHeight(frame.region), zoom));
+                WriteFrameRingSlot(ring, frame);
+                PublishFrameRingSlot(ring, viewChanged);
+                published = true;
+            }
+        }
+    }
+
+    {
+        CpuTimer timer(Stat::Release);
+        g_CaptureSource->ReleaseFrame();
+    }
+    if (published)
+        SetEvent(g_FrameReadyEvent);
+    return true;
+}
+
+// Thread function that keeps the frame ring fed with desktop frames.
+DWORD WINAPI CaptureThread(LPVOID lpParam)
+{
+    // Windows.Graphics.Capture objects are used from this thread.
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    HANDLE mmcssTask = EnterMmcssTask(L"Capture");
+    PinThreadToCore(g_Options.captureCore);
+    while (g_Running && !g_DeviceLost && !g_CaptureReconfigure)
+    {
+        // No frames are acquired in standby; changes accumulate in the
+        // duplication metadata until capture resumes.
+        if (g_Standby)
+        {
+            WaitForSingleObject(g_ResumeEvent, INFINITE);
+            continue;
+        }
+        CaptureFrame();
+    }
+    LeaveMmcssTask(mmcssTask);
+    CoUninitialize();
+    return 0;
+}
+
+// Record the size of the captured region, which places the pointer.
+void SetSourceSize(UINT width, UINT height)
+{
+    if (g_View.sourceSize[0] != width || g_View.sourceSize[1] != height)
+    {
+        g_View.sourceSize[0] = static_cast<float>(width);
+        g_View.sourceSize[1] = static_cast<float>(height);
+        g_ConstantsDirty = true;
+    }
+}
+
+// Map source texture coordinates onto the part of the source a ring slot
+// holds, so the shader can sample a crop as if it were the whole frame.
+void SetSourceTransform(const FrameRing::SlotLayout& layout)
+{
+    SetSourceSize(layout.sourceWidth, layout.sourceHeight);
+    float transform[4] = {
+        static_cast<float>(layout.sourceWidth) / layout.textureWidth,
+        static_cast<float>(layout.sourceHeight) / layout.textureHeight,
+        -static_cast<float>(layout.crop.left) / layout.textureWidth,
+        -static_cast<float>(layout.crop.top) / layout.textureHeight };
+    if (memcmp(transform, g_View.sourceTransform, sizeof(transform)) != 0)
+    {
+        memcpy(g_View.sourceTransform, transform, sizeof(transform));
+        g_ConstantsDirty = true;
+    }
+}
+
+// Sample the render thread's front slot of a ring.
+void BindFrontSlot(const FrameRing& ring)
+{
+    g_FrameShaderResourceView = ring.views[ring.frontSlot];
+    BindFrameView(g_FrameShaderResourceView.Get());
+    SetSourceTransform(ring.layouts[ring.frontSlot]);
+    g_ShownCaptureTime = ring.captureTimes[ring.frontSlot];
+}
+
+// Render the newest frame published by the capture thread. Never blocks on
+// capture; the zoom animates at whatever rate this is called.
+bool RenderLatestFrame() {
+    bool zoomChanged = UpdateZoom();
+    bool cursorChanged = UpdateCursor();
+
+    bool viewChanged = false;
+    if (TakeFrameRingSlot(*g_RenderRing, &viewChanged))
+    {
+        g_RenderRing->hasFrame = true;
+        BindFrontSlot(*g_RenderRing);
+    }
+    if (!g_FrameShaderResourceView)
+        return true;
+
+    if (viewChanged || zoomChanged || cursorChanged || g_NeedsRedraw)
+    {
+        RenderCurrentFrame();
+        g_NeedsRedraw = false;
+    }
+    return true;
+}
+
+// Cover a monitor with the magnifier window. The framebuffer size callback
+// then resizes the swap chain. A lens is placed by UpdateLens() instead.
+void MoveWindowToOutput(const OutputSession& session)
+{
+    if (g_Options.lensWidth)
+        return;
+    MONITORINFO info = { sizeof(info) };
+    if (!GetMonitorInfo(session.monitor, &info))
+        return;
+    const RECT& bounds = info.rcMonitor;
+    SetWindowPos(glfwGetWin32Window(g_Window), HWND_TOPMOST, bounds.left, bounds.top,
+        bounds.right - bounds.left, bounds.bottom - bounds.top, SWP_NOACTIVATE);
+}
+
+// Follow the cursor across monitors. When it enters another output, that
+// output becomes the active one: the window moves onto it, the renderer
+// switches to its ring, and the capturing side loads its duplication session
+// the next time it looks at g_ActiveOutput.
+void UpdateActiveOutput()
+{
+    if (g_Outputs.size() < 2)
+        return;
+    POINT cursor;
+    if (!GetCursorPos(&cursor))
+        return;
+    int index = FindOutputSession(MonitorFromPoint(cursor, MONITOR_DEFAULTTONULL));
+    if (index < 0 || index == g_ActiveOutput.load(std::memory_order_relaxed))
+        return;
+
+    OutputSession& session = *g_Outputs[index];
+    if (session.refreshRate > 0.0)
+        g_RefreshRate = session.refreshRate;
+    g_ActiveOutput.store(index, std::memory_order_release);
+    MoveWindowToOutput(session);
+    if (g_Options.threadedCapture)
+    {
+        // Show what the ring last held until the capture thread publishes
+        // a fresh frame of this output.
+        g_RenderRing = &session.ring;
+        if (g_RenderRing->hasFrame)
+        {
+            BindFrontSlot(*g_RenderRing);
+        }
+        else
+        {
+            g_FrameShaderResourceView = nullptr;
+            BindFrameView(g_FrameShaderResourceView.Get());
+        }
+    }
+    g_NeedsRedraw = true;
+}
+
+POINT g_LensPosition = { LONG_MIN, LONG_MIN };  // Screen position of the lens window
+
+// Lens mode: keep the lens window centred on the cursor and inside the
+// active output, and magnify what lies under its centre. The window is only
+// moved, without activation; its size, and so the swap chain's, stays the
+// lens size.
+void UpdateLens()
+{
+    if (!g_Options.lensWidth || !g_WindowVisible || g_Outputs.empty())
+        return;
+    POINT cursor;
+    MONITORINFO info = { sizeof(info) };
+    if (!GetCursorPos(&cursor) || !GetMonitorInfo(g_Outputs[g_ActiveOutput]->monitor, &info))
+        return;
+    const RECT& bounds = info.rcMonitor;
+    LONG monitorWidth = bounds.right - bounds.left;
+    LONG monitorHeight = bounds.bottom - bounds.top;
+    LONG width = std::min(static_cast<LONG>(g_Options.lensWidth), monitorWidth);
+    LONG height = std::min(static_cast<LONG>(g_Options.lensHeight), monitorHeight);
+    LONG x = std::clamp(cursor.x - width / 2, bounds.left, bounds.right - width);
+    LONG y = std::clamp(cursor.y - height / 2, bounds.top, bounds.bottom - height);
+    if (x != g_LensPosition.x || y != g_LensPosition.y)
+    {
+        SetWindowPos(glfwGetWin32Window(g_Window), HWND_TOPMOST, x, y, 0, 0, SWP_NOSIZE | SWP_NOACTIVATE);
+        g_LensPosition = { x, y };
+    }
+
+    float center[2] = {
+        (x - bounds.left + 0.5f * width) / monitorWidth,
+        (y - bounds.top + 0.5f * height) / monitorHeight };
+    float extent[2] = {
+        static_cast<float>(width) / monitorWidth,
+        static_cast<float>(height) / monitorHeight };
+    if (memcmp(center, g_View.center, sizeof(center)) != 0 || memcmp(extent, g_View.extent, sizeof(extent)) != 0)
+    {
+        memcpy(g_View.center, center, sizeof(center));
+        memcpy(g_View.extent, extent, sizeof(extent));
+        g_SharedCenter[0].store(center[0], std::memory_order_relaxed);
+        g_SharedCenter[1].store(center[1], std::memory_order_relaxed);
+        g_ConstantsDirty = true;
+        g_NeedsRedraw = true;
+    }
+}
+
+// Apply filter changes requested from the keyboard hook. Filters the device
+// cannot run are skipped with a note.
+void ApplyFilterRequests()
+{
+    if (g_FilterCycleRequest)
+    {
+        g_FilterCycleRequest = false;
+        g_Filter = static_cast<MagnifyFilter>((static_cast<int>(g_Filter) + 1) % static_cast<int>(MagnifyFilter::Count));
+        if (g_Filter != MagnifyFilter::Bilinear && !g_BackBufferUAV && !g_CpuRender)
+        {
+            std::cout << "The " << kFilterNames[static_cast<int>(g_Filter)] << " filter is not available on this device." << std::endl;
+            g_Filter = MagnifyFilter::Bilinear;
+        }
+        std::cout << "Filter: " << kFilterNames[static_cast<int>(g_Filter)] << std::endl;
+        SelectShaderPermutation();
+        g_NeedsRedraw = true;
+    }
+    if (g_SharpenToggleRequest)
+    {
+        g_SharpenToggleRequest = false;
+        g_Sharpen = !g_Sharpen && g_BackBufferUAV != nullptr && !g_CpuRender;
+        std::cout << "Sharpening " << (g_Sharpen ? "on" : "off") << std::endl;
+        if (!g_Sharpen)
+        {
+            // The intermediate is only needed while sharpening.
+            g_FilterTextureUAV.Reset();
+            g_FilterTextureView.Reset();
+            g_FilterTexture.Reset();
+        }
+        g_NeedsRedraw = true;
+    }
+    if (g_InvertToggleRequest || g_ColorFilterCycleRequest)
+    {
+        if (g_InvertToggleRequest)
+        {
+            g_Invert = !g_Invert;
+            std::cout << "Inversion " << (g_Invert ? "on" : "off") << std::endl;
+        }
+        if (g_ColorFilterCycleRequest)
+        {
+            g_ColorFilter = static_cast<ColorFilter>((static_cast<int>(g_ColorFilter) + 1) % static_cast<int>(ColorFilter::Count));
+            std::cout << "Colour filter: " << kColorFilterNames[static_cast<int>(g_ColorFilter)] << std::endl;
+        }
+        g_InvertToggleRequest = false;
+        g_ColorFilterCycleRequest = false;
+        SelectShaderPermutation();
+        g_ConstantsDirty = true;
+        g_NeedsRedraw = true;
+    }
+}
+
+// True when nothing needs to be captured or drawn: the window is hidden, the
+// zoom is settled at 1.0 and no input is waiting to be handled.
+bool IsIdle()
+{
+    return !g_WindowVisible && !g_WindowToggleRequest && !g_RightButtonDown && !g_ResizeRequest &&
+        !g_FilterCycleRequest && !g_SharpenToggleRequest && !g_InvertToggleRequest && !g_ColorFilterCycleRequest &&
+        g_InputQueue.Empty() &&
+        g_CurrentZoom == 1.0f && g_TargetZoom == 1.0f;
+}
+
+// Park the render loop and the capture thread until the input hooks signal
+// that the magnifier is needed again. Any held frame is released first.
+void WaitInStandby()
+{
+    if (g_FrameAcquired)
+    {
+        g_CaptureSource->ReleaseFrame();
+        g_FrameAcquired = false;
+    }
+    ResetEvent(g_ResumeEvent);
+    g_Standby = true;
+    SetFineTimerResolution(false);
+    while (g_Running && !glfwWindowShouldClose(g_Window) && IsIdle())
+    {
+        MsgWaitForMultipleObjects(1, &g_WakeEvent, FALSE, INFINITE, QS_ALLINPUT);
+        glfwPollEvents();
+        // The zoom is settled while idle, so advancing it across standby
+        // changes nothing and the press that woke the loop starts the
+        // animation from its own timestamp.
+        DrainInputEvents();
+    }
+    g_Standby = false;
+    SetEvent(g_ResumeEvent);
+}
+
+// Render paths measured by --bench. A ROI path copies the magnified crop
+// into a small texture every frame and samples that, as --roi does. Paths
+// with another filter than bilinear, or with sharpening, run the compute
+// magnifier.
+struct BenchPath {
+    const char* name;
+    bool regionOfInterest;
+    MagnifyFilter filter;
+    bool sharpen;
+    BorderMode border;
+};
+const BenchPath kBenchPaths[] = {
+    { "quad", false, MagnifyFilter::Bilinear, false, BorderMode::Clamp },
+    { "quad-roi", true, MagnifyFilter::Bilinear, false, BorderMode::Clamp },
+    { "quad-border", false, MagnifyFilter::Bilinear, false, BorderMode::Black },
+    { "cs-bicubic", false, MagnifyFilter::Bicubic, false, BorderMode::Clamp },
+    { "cs-lanczos", false, MagnifyFilter::Lanczos, false, BorderMode::Clamp },
+    { "cs-lanczos-sharpen", false, MagnifyFilter::Lanczos, true, BorderMode::Clamp },
+};
+
+// Synthetic BGRA texels for the benchmark: a fine checkerboard over a
+// colour gradient, so the sampler sees detail at every zoom.
+std::vector<uint32_t> MakeBenchPattern(UINT width, UINT height)
+{
+    std::vector<uint32_t> pixels(static_cast<size_t>(width) * height);
+    for (UINT y = 0; y < height; y++)
+    {
+        for (UINT x = 0; x < width; x++)
+        {
+            uint32_t checker = ((x >> 2) ^ (y >> 2)) & 1 ? 0x404040u : 0u;
+            uint32_t gradient = ((x * 191 / width) << 16) | ((y * 191 / height) << 8) | 0x40;
+            pixels[static_cast<size_t>(y) * width + x] = 0xFF000000u | (gradient + checker);
+        }
+    }
+    return pixels;
+}
+
+// Create a texture holding MakeBenchPattern().
+bool CreateBenchSource(UINT width, UINT height, ComPtr<ID3D11Texture2D>& texture, ComPtr<ID3D11ShaderResourceView>& view)
+{
+    std::vector<uint32_t> pixels = MakeBenchPattern(width, height);
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    D3D11_SUBRESOURCE_DATA data = { pixels.data(), width * 4, 0 };
+    HRESULT hr = g_D3DDevice->CreateTexture2D(&desc, &data, &texture);
+    if (SUCCEEDED(hr))
+        hr = g_D3DDevice->CreateShaderResourceView(texture.Get(), nullptr, &view);
+    if (FAILED(hr))
+    {
+        std::cerr << "Failed to create " << width << "x" << height << " benchmark source: " << HrToString(hr) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Draw one benchmark point: warm up, then time kFrames draws (and crop
+// copies for ROI paths) with a pair of GPU timestamps. Returns the GPU time
+// per frame in milliseconds, or a negative value if the timing was disjoint.
+double RunBenchPoint(const BenchPath& path, ID3D11Texture2D* source, ID3D11ShaderResourceView* sourceView,
+    ID3D11RenderTargetView* target, ID3D11UnorderedAccessView* targetUAV, UINT width, UINT height, float zoom)
+{
+    const int kWarmupFrames = 16;
+    const int kFrames = 200;
+
+    ComPtr<ID3D11Texture2D> crop;
+    ComPtr<ID3D11ShaderResourceView> cropView;
+    FrameRing::SlotLayout layout = { { 0, 0, static_cast<LONG>(width), static_cast<LONG>(height) }, width, height, width, height };
+    D3D11_BOX box = {};
+    if (path.regionOfInterest)
+    {
+        layout.crop = GetRegionOfInterest(width, height, zoom);
+        D3D11_TEXTURE2D_DESC desc = {};
+        source->GetDesc(&desc);
+        desc.Width = layout.textureWidth = static_cast<UINT>(layout.crop.right - layout.crop.left);
+        desc.Height = layout.textureHeight = static_cast<UINT>(layout.crop.bottom - layout.crop.top);
+        if (FAILED(g_D3DDevice->CreateTexture2D(&desc, nullptr, &crop)) ||
+            FAILED(g_D3DDevice->CreateShaderResourceView(crop.Get(), nullptr, &cropView)))
+            return -1.0;
+        box = { static_cast<UINT>(layout.crop.left), static_cast<UINT>(layout.crop.top), 0,
+            static_cast<UINT>(layout.crop.right), static_cast<UINT>(layout.crop.bottom), 1 };
+    }
+    SetSourceTransform(layout);
+    g_View.magnificationFactor = zoom;
+    g_ConstantsDirty = true;
+    ID3D11ShaderResourceView* view = path.regionOfInterest ? cropView.Get() : sourceView;
+    g_Filter = path.filter;
+    g_Sharpen = path.sharpen;
+    SelectShaderPermutation(path.border);
+    bool compute = ComputeFilterSelected();
+
+    D3D11_QUERY_DESC disjointDesc = { D3D11_QUERY_TIMESTAMP_DISJOINT, 0 };
+    D3D11_QUERY_DESC timestampDesc = { D3D11_QUERY_TIMESTAMP, 0 };
+    ComPtr<ID3D11Query> disjoint, begin, end;
+    if (FAILED(g_D3DDevice->CreateQuery(&disjointDesc, &disjoint)) ||
+        FAILED(g_D3DDevice->CreateQuery(&timestampDesc, &begin)) ||
+        FAILED(g_D3DDevice->CreateQuery(&timestampDesc, &end)))
+        return -1.0;
+
+    for (int i = 0; i < kWarmupFrames + kFrames; i++)
+    {
+        if (i == kWarmupFrames)
+        {
+            g_D3DContext->Begin(disjoint.Get());
+            g_D3DContext->End(begin.Get());
+        }
+        if (path.regionOfInterest)
+        {
+            // Unbind the crop before writing it.
+            BindFrameView(nullptr);
+            g_D3DContext->CopySubresourceRegion(crop.Get(), 0, 0, 0, 0, source, 0, &box);
+        }
+        if (compute)
+        {
+            DispatchMagnifier(targetUAV, view, width, height);
+        }
+        else
+        {
+            BindFrameView(view);
+            DrawMagnifier(target, width, height);
+        }
+    }
+    g_D3DContext->End(end.Get());
+    g_D3DContext->End(disjoint.Get());
+
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjointData;
+    while (g_D3DContext->GetData(disjoint.Get(), &disjointData, sizeof(disjointData), 0) == S_FALSE)
+        std::this_thread::yield();
+    UINT64 beginTime = 0, endTime = 0;
+    while (g_D3DContext->GetData(begin.Get(), &beginTime, sizeof(beginTime), 0) == S_FALSE)
+        std::this_thread::yield();
+    while (g_D3DContext->GetData(end.Get(), &endTime, sizeof(endTime), 0) == S_FALSE)
+        std::this_thread::yield();
+    if (disjointData.Disjoint || disjointData.Frequency == 0)
+        return -1.0;
+    return static_cast<double>(endTime - beginTime) * 1000.0 / disjointData.Frequency / kFrames;
+}
+
+// --bench: time every render path over synthetic sources at common display
+// resolutions and a sweep of zoom factors, without a window or desktop
+// capture, and write the results as CSV.
+bool RunBenchmark()
+{
+    const UINT kResolutions[][2] = { { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 }, { 7680, 4320 } };
+    const float kZooms[] = { 1.0f, 1.5f, 2.0f, 3.0f, 4.0f, 6.0f, 8.0f };
+
+    if (!CreateDevice() || !CreateSamplerState() || !CreateShaders())
+        return false;
+    CreateComputeMagnifier();
+
+    std::string adapterName = "unknown";
+    ComPtr<IDXGIDevice> dxgiDevice;
+    ComPtr<IDXGIAdapter> adapter;
+    DXGI_ADAPTER_DESC adapterDesc = {};
+    if (SUCCEEDED(g_D3DDevice.As(&dxgiDevice)) && SUCCEEDED(dxgiDevice->GetAdapter(&adapter)) && SUCCEEDED(adapter->GetDesc(&adapterDesc)))
+    {
+        char name[128];
+        WideCharToMultiByte(CP_UTF8, 0, adapterDesc.Description, -1, name, sizeof(name), nullptr, nullptr);
+        adapterName = name;
+        std::replace(adapterName.begin(), adapterName.end(), ',', ' ');
+    }
+
+    std::ofstream report(g_Options.benchOutputPath);
+    if (!report)
+    {
+        std::cerr << "Failed to open benchmark report " << g_Options.benchOutputPath << std::endl;
+        return false;
+    }
+    report << "adapter,path,width,height,zoom,gpu_ms,fps,ns_per_pixel\n";
+    std::cout << "Benchmarking on " << adapterName << std::endl;
+
+    for (const auto& resolution : kResolutions)
+    {
+        UINT width = resolution[0];
+        UINT height = resolution[1];
+        ComPtr<ID3D11Texture2D> source;
+        ComPtr<ID3D11ShaderResourceView> sourceView;
+        if (!CreateBenchSource(width, height, source, sourceView))
+            continue;
+
+        D3D11_TEXTURE2D_DESC targetDesc = {};
+        source->GetDesc(&targetDesc);
+        targetDesc.BindFlags = D3D11_BIND_RENDER_TARGET;
+        if (g_ComputeSupported)
+            targetDesc.BindFlags |= D3D11_BIND_UNORDERED_ACCESS;
+        ComPtr<ID3D11Texture2D> targetTexture;
+        ComPtr<ID3D11RenderTargetView> target;
+        ComPtr<ID3D11UnorderedAccessView> targetUAV;
+        HRESULT hr = g_D3DDevice->CreateTexture2D(&targetDesc, nullptr, &targetTexture);
+        if (SUCCEEDED(hr))
+            hr = g_D3DDevice->CreateRenderTargetView(targetTexture.Get(), nullptr, &target);
+        if (SUCCEEDED(hr) && g_ComputeSupported)
+            hr = g_D3DDevice->CreateUnorderedAccessView(targetTexture.Get(), nullptr, &targetUAV);
+        if (FAILED(hr))
+        {
+            std::cerr << "Failed to create " << width << "x" << height << " benchmark target: " << HrToString(hr) << std::endl;
+            continue;
+        }
+
+        for (const BenchPath& path : kBenchPaths)
+        {
+            if ((path.filter != MagnifyFilter::Bilinear || path.sharpen) && !g_ComputeSupported)
+            {
+                std::cout << path.name << ": compute filters unavailable, skipped" << std::endl;
+                continue;
+            }
+            for (float zoom : kZooms)
+            {
+                double gpuMs = RunBenchPoint(path, source.Get(), sourceView.Get(), target.Get(), targetUAV.Get(), width, height, zoom);
+                if (gpuMs <= 0.0)
+                {
+                    std::cout << path.name << " " << width << "x" << height << " @" << zoom << "x: timing unavailable" << std::endl;
+                    continue;
+                }
+                double fps = 1000.0 / gpuMs;
+                double nsPerPixel = gpuMs * 1e6 / (static_cast<double>(width) * height);
+                report << adapterName << ',' << path.name << ',' << width << ',' << height << ',' << zoom << ','
+                    << gpuMs << ',' << fps << ',' << nsPerPixel << '\n';
+                std::cout << path.name << " " << width << "x" << height << " @" << zoom << "x: "
+                    << gpuMs << " ms, " << fps << " fps, " << nsPerPixel << " ns/pixel" << std::endl;
+            }
+        }
+        g_D3DContext->ClearState();
+        InvalidateBoundState();
+    }
+    std::cout << "Benchmark report written to " << g_Options.benchOutputPath << std::endl;
+
+    g_D3DContext->ClearState();
+    InvalidateBoundState();
+    g_VertexShader.Reset();
+    g_PixelShader.Reset();
+    g_ConstantBuffer.Reset();
+    g_SamplerState.Reset();
+    g_ResampleShader.Reset();
+    ResetShaderPermutations();
+    g_SharpenShader.Reset();
+    g_FilterConstantBuffer.Reset();
+    g_FilterTextureUAV.Reset();
+    g_FilterTextureView.Reset();
+    g_FilterTexture.Reset();
+    g_D3DContext.Reset();
+    g_D3DDevice.Reset();
+    return true;
+}
+
+// Time the device magnifying a width x height benchmark pattern at 2x into
+// an offscreen target with the bilinear quad. Returns milliseconds per
+// frame by the wall clock, which is what WARP costs the render thread, or a
+// negative value on failure.
+double MeasureGpuMagnify(UINT width, UINT height)
+{
+    const int kWarmupFrames = 2;
+    const int kFrames = 8;
+    ComPtr<ID3D11Texture2D> source;
+    ComPtr<ID3D11ShaderResourceView> sourceView;
+    if (!CreateBenchSource(width, height, source, sourceView))
+        return -1.0;
+    D3D11_TEXTURE2D_DESC desc = {};
+    source->GetDesc(&desc);
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+    ComPtr<ID3D11Texture2D> targetTexture;
+    ComPtr<ID3D11RenderTargetView> target;
+    D3D11_QUERY_DESC queryDesc = { D3D11_QUERY_EVENT, 0 };
+    ComPtr<ID3D11Query> finished;
+    if (FAILED(g_D3DDevice->CreateTexture2D(&desc, nullptr, &targetTexture)) ||
+        FAILED(g_D3DDevice->CreateRenderTargetView(targetTexture.Get(), nullptr, &target)) ||
+        FAILED(g_D3DDevice->CreateQuery(&queryDesc, &finished)))
+        return -1.0;
+
+    MagnificationView savedView = g_View;
+    FrameRing::SlotLayout layout = { { 0, 0, static_cast<LONG>(width), static_cast<LONG>(height) }, width, height, width, height };
+    SetSourceTransform(layout);
+    g_View.magnificationFactor = 2.0f;
+    g_ConstantsDirty = true;
+    SelectShaderPermutation(BorderMode::Clamp);
+    BindFrameView(sourceView.Get());
+    LONGLONG start = 0;
+    for (int i = 0; i < kWarmupFrames + kFrames; i++)
+    {
+        DrawMagnifier(target.Get(), width, height);
+        if (i == kWarmupFrames - 1 || i == kWarmupFrames + kFrames - 1)
+        {
+            g_D3DContext->End(finished.Get());
+            BOOL done = FALSE;
+            while (g_D3DContext->GetData(finished.Get(), &done, sizeof(done), 0) == S_FALSE)
+                std::this_thread::yield();
+            if (i == kWarmupFrames - 1)
+                start = QpcNow();
+        }
+    }
+    double elapsedMs = QpcToMicroseconds(QpcNow() - start) / 1000.0;
+
+    g_D3DContext->ClearState();
+    InvalidateBoundState();
+    g_View = savedView;
+    g_ConstantsDirty = true;
+    return elapsedMs / kFrames;
+}
+
+// Time the CPU magnifier on the same pattern and zoom, without the upload.
+double MeasureCpuMagnify(UINT width, UINT height)
+{
+    const int kWarmupFrames = 1;
+    const int kFrames = 4;
+    MagnificationView savedView = g_View;
+    g_CpuDesktop.pixels = MakeBenchPattern(width, height);
+    g_CpuDesktop.width = width;
+    g_CpuDesktop.height = height;
+    g_View.magnificationFactor = 2.0f;
+    SetSourceSize(width, height);
+    LONGLONG start = 0;
+    for (int i = 0; i < kWarmupFrames + kFrames; i++)
+    {
+        if (i == kWarmupFrames)
+            start = QpcNow();
+        MagnifyOnCpu(width, height);
+    }
+    double elapsedMs = QpcToMicroseconds(QpcNow() - start) / 1000.0;
+
+    g_CpuDesktop = {};
+    g_CpuOutput = {};
+    g_View = savedView;
+    g_ConstantsDirty = true;
+    return elapsedMs / kFrames;
+}
+
+// True for the Microsoft Basic Render Driver (WARP), which D3D11CreateDevice
+// falls back to without a usable GPU.
+bool IsSoftwareAdapter()
+{
+    ComPtr<IDXGIDevice> dxgiDevice;
+    ComPtr<IDXGIAdapter> adapter;
+    ComPtr<IDXGIAdapter1> adapter1;
+    DXGI_ADAPTER_DESC1 desc = {};
+    if (FAILED(g_D3DDevice.As(&dxgiDevice)) || FAILED(dxgiDevice->GetAdapter(&adapter)) ||
+        FAILED(adapter.As(&adapter1)) || FAILED(adapter1->GetDesc1(&desc)))
+        return false;
+    return (desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) != 0 || (desc.VendorId == 0x1414 && desc.DeviceId == 0x8C);
+}
+
+// Decide once, on the first device, whether to magnify on the CPU: with
+// --cpu-render on, or in auto mode on a software adapter when the CPU
+// kernels measure faster than the device at the primary monitor's size.
+// The CPU path reads 8-bit frames on the render thread, so it turns off HDR
+// capture, the capture thread and ROI cropping.
+void ChooseRenderPath()
+{
+    static bool chosen = false;
+    if (chosen)
+        return;
+    chosen = true;
+
+    const char* kernel = "scalar";
+    if (IsProcessorFeaturePresent(PF_SSE4_1_INSTRUCTIONS_AVAILABLE))
+    {
+        g_CpuBilinearRow = BilinearRowSse41;
+        g_CpuBicubicRow = BicubicRowSse41;
+        kernel = "SSE4.1";
+    }
+    if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE))
+    {
+        g_CpuBilinearRow = BilinearRowAvx2;
+        kernel = "AVX2";
+    }
+
+    if (g_Options.cpuRender == CpuRenderMode::Off || (g_Options.cpuRender == CpuRenderMode::Auto && !IsSoftwareAdapter()))
+        return;
+    g_RowPool = std::make_unique<RowPool>();
+    g_RowPool->Start();
+    if (g_Options.cpuRender == CpuRenderMode::Auto)
+    {
+        UINT width = static_cast<UINT>(std::max(GetSystemMetrics(SM_CXSCREEN), 1));
+        UINT height = static_cast<UINT>(std::max(GetSystemMetrics(SM_CYSCREEN), 1));
+        double gpuMs = MeasureGpuMagnify(width, height);
+        double cpuMs = MeasureCpuMagnify(width, height);
+        std::cout << "Software adapter: " << gpuMs << " ms per frame on the device, " << cpuMs << " ms on the CPU." << std::endl;
+        if (gpuMs >= 0.0 && gpuMs <= cpuMs)
+        {
+            g_RowPool.reset();
+            return;
+        }
+    }
+    g_CpuRender = true;
+    g_Options.forceSdr = true;
+    g_Options.threadedCapture = false;
+    g_Options.regionOfInterest = false;
+    std::cout << "Magnifying on the CPU with " << kernel << " kernels on " << g_RowPool->WorkerCount() << " threads." << std::endl;
+}
+
+// Parse command line options into g_Options.
+//   --no-incremental   sample every acquired frame instead of applying dirty rects
+//   --single-thread    capture on the render thread instead of a capture thread
+//   --pacing <mode>    frame pacing: low-latency, vsync (default) or capped
+//   --fps <n>          frame rate for --pacing capped
+//   --capture <mode>   capture backend: auto (default), duplication or wgc
+//   --present <mode>   presentation: composition (default) or hwnd
+//   --capture-window <title>    capture a single window through Windows.Graphics.Capture
+//   --capture-region <x,y,w,h>  capture only this part of the monitor
+//   --roi              keep only the magnified crop in the frame ring (threaded capture)
+//   --lens <w>x<h>     magnify in a lens of this size that follows the cursor (implies --roi)
+//   --filter <name>    resampling filter: bilinear (default), bicubic or lanczos
+//   --sharpen          sharpen after resampling (contrast adaptive)
+//   --sharpness <n>    sharpening strength from 0 to 1 (default 0.5)
+//   --invert           invert colours
+//   --contrast <n>     contrast around mid-grey, from 0 to 4 (default 1, unchanged)
+//   --color-filter <name> none (default), grayscale, protanopia, deuteranopia or tritanopia
+//   --sdr              capture 8-bit even from HDR and 10-bit desktops
+//   --no-realtime      keep default scheduling: no MMCSS, GPU priority or timer resolution changes
+//   --cores <r>[,<c>]  pin the render thread, and the capture thread, to these cores
+//   --zoom <a,b,...>   zoom levels for right-click, stepped with Numpad +/- (default 1.4)
+//   --zoom-curve <name> zoom animation: spring, exponential (default) or instant
+//   --zoom-time <ms>   time constant of the zoom animation (default 100)
+//   --record <path>    record the presented image to a fragmented MP4 on the GPU encoder
+//   --record-codec <name> h264 (default) or hevc
+//   --record-bitrate <Mbps> encoder bitrate (default from the size and frame rate)
+//   --vram-budget <MB> degrade as if the adapter's video memory budget were at most this
+//   --cpu-render <mode> magnify on the CPU: auto (default, on slow software adapters), on or off
+//   --renderer <name>  d3d11 (default) or d3d12, which draws on its own high-priority queue
+//   --stats            record frame timings and show a p50/p99 overlay
+//   --stats-csv <path> record frame timings and append per-second summaries to a CSV file
+//   --bench            benchmark the render paths on synthetic sources and exit
+//   --bench-out <path> benchmark report file (default zoomin-bench.csv)
+//   --trace-record <path> record captured frames, pointer and input to a capture trace
+//   --trace-replay <path> replay a capture trace as fast as possible, report and exit
+//   --replay-out <path> per-frame replay report file (default zoomin-replay.csv)
+void ParseCommandLine(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--no-incremental")
+            g_Options.incrementalCapture = false;
+        else if (arg == "--single-thread")
+            g_Options.threadedCapture = false;
+        else if (arg == "--roi")
+            g_Options.regionOfInterest = true;
+        else if (arg == "--lens" && i + 1 < argc)
+        {
+            int w = 0, h = 0;
+            if (sscanf_s(argv[++i], "%dx%d", &w, &h) == 2 && w > 0 && h > 0)
+            {
+                g_Options.lensWidth = w;
+                g_Options.lensHeight = h;
+            }
+            else
+            {
+                std::cout << "Invalid lens size: " << argv[i] << std::endl;
+            }
+        }
+        else if (arg == "--filter" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            bool found = false;
+            for (int filter = 0; filter < static_cast<int>(MagnifyFilter::Count); filter++)
+            {
+                if (name == kFilterNames[filter])
+                {
+                    g_Options.filter = static_cast<MagnifyFilter>(filter);
+                    found = true;
+                }
+            }
+            if (!found)
+                std::cout << "Unknown filter: " << name << std::endl;
+        }
+        else if (arg == "--sharpen")
+            g_Options.sharpen = true;
+        else if (arg == "--sdr")
+            g_Options.forceSdr = true;
+        else if (arg == "--no-realtime")
+            g_Options.realtime = false;
+        else if (arg == "--cores" && i + 1 < argc)
+        {
+            int render = -1, capture = -1;
+            int count = sscanf_s(argv[++i], "%d,%d", &render, &capture);
+            if (count >= 1 && render >= 0 && render < kMaxAffinityCores && capture < kMaxAffinityCores)
+            {
+                g_Options.renderCore = render;
+                g_Options.captureCore = count == 2 ? capture : -1;
+            }
+            else
+            {
+                std::cout << "Invalid cores: " << argv[i] << std::endl;
+            }
+        }
+        else if (arg == "--sharpness" && i + 1 < argc)
+            g_Options.sharpness = static_cast<float>(atof(argv[++i]));
+        else if (arg == "--invert")
+            g_Options.invert = true;
+        else if (arg == "--contrast" && i + 1 < argc)
+            g_Options.contrast = std::min(std::max(static_cast<float>(atof(argv[++i])), 0.0f), 4.0f);
+        else if (arg == "--color-filter" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            bool found = false;
+            for (int filter = 0; filter < static_cast<int>(ColorFilter::Count); filter++)
+            {
+                if (name == kColorFilterNames[filter])
+                {
+                    g_Options.colorFilter = static_cast<ColorFilter>(filter);
+                    found = true;
+                }
+            }
+            if (!found)
+                std::cout << "Unknown colour filter: " << name << std::endl;
+        }
+        else if (arg == "--zoom" && i + 1 < argc)
+        {
+            std::vector<float> levels;
+            std::string list = argv[++i];
+            for (size_t start = 0; start <= list.size();)
+            {
+                size_t end = std::min(list.find(',', start), list.size());
+                float level = static_cast<float>(atof(list.substr(start, end - start).c_str()));
+                if (level >= 1.0f)
+                    levels.push_back(level);
+                start = end + 1;
+            }
+            if (!levels.empty())
+                g_Options.zoomLevels = levels;
+            else
+                std::cout << "Invalid zoom levels: " << list << std::endl;
+        }
+        else if (arg == "--zoom-curve" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            bool found = false;
+            for (int curve = 0; curve < static_cast<int>(ZoomCurve::Count); curve++)
+            {
+                if (name == kZoomCurveNames[curve])
+                {
+                    g_Options.zoomCurve = static_cast<ZoomCurve>(curve);
+                    found = true;
+                }
+            }
+            if (!found)
+                std::cout << "Unknown zoom curve: " << name << std::endl;
+        }
+        else if (arg == "--zoom-time" && i + 1 < argc)
+            g_Options.zoomTimeMs = std::max(0.0f, static_cast<float>(atof(argv[++i])));
+        else if (arg == "--stats")
         {
-            DXGI_OUTPUT_DESC outputDesc;
-            dxgiOutput->GetDesc(&outputDesc);
-            std::wcout << L"  Trying output: " << outputDesc.DeviceName << std::endl;
-            hr = dxgiOutput.As(&dxgiOutput6);
-            if (FAILED(hr))
+            g_Options.collectStats = true;
+            g_Options.statsOverlay = true;
+        }
+        else if (arg == "--bench")
+            g_Options.bench = true;
+        else if (arg == "--bench-out" && i + 1 < argc)
+            g_Options.benchOutputPath = argv[++i];
+        else if (arg == "--trace-record" && i + 1 < argc)
+            g_Options.traceRecordPath = argv[++i];
+        else if (arg == "--trace-replay" && i + 1 < argc)
+            g_Options.traceReplayPath = argv[++i];
+        else if (arg == "--replay-out" && i + 1 < argc)
+            g_Options.replayReportPath = argv[++i];
+        else if (arg == "--stats-csv" && i + 1 < argc)
+        {
+            g_Options.collectStats = true;
+            g_Options.statsCsvPath = argv[++i];
+        }
+        else if (arg == "--pacing" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "low-latency")
+                g_Options.pacing = PacingPolicy::LowLatency;
+            else if (mode == "vsync")
+                g_Options.pacing = PacingPolicy::VSync;
+            else if (mode == "capped")
+                g_Options.pacing = PacingPolicy::CappedFps;
+            else
+                std::cout << "Unknown pacing mode: " << mode << std::endl;
+        }
+        else if (arg == "--fps" && i + 1 < argc)
+        {
+            double fps = atof(argv[++i]);
+            if (fps > 0.0)
+                g_Options.cappedFps = fps;
+        }
+        else if (arg == "--capture" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "auto")
+                g_Options.captureBackend = CaptureBackend::Auto;
+            else if (mode == "duplication")
+                g_Options.captureBackend = CaptureBackend::Duplication;
+            else if (mode == "wgc")
+                g_Options.captureBackend = CaptureBackend::GraphicsCapture;
+            else
+                std::cout << "Unknown capture backend: " << mode << std::endl;
+        }
+        else if (arg == "--present" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "composition")
+                g_Options.presentBackend = PresentBackend::Composition;
+            else if (mode == "hwnd")
+                g_Options.presentBackend = PresentBackend::Hwnd;
+            else
+                std::cout << "Unknown presentation backend: " << mode << std::endl;
+        }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            std::string path = argv[++i];
+            int length = MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, nullptr, 0);
+            if (length > 0)
             {
-                std::cout << "    Query IDXGIOutput6 failed: " << HrToString(hr) << std::endl;
-                continue;
+                std::wstring widePath(length, L'\0');
+                MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, &widePath[0], length);
+                widePath.resize(length - 1);
+                g_Options.recordPath = widePath;
             }
-            hr = dxgiOutput6->DuplicateOutput(g_D3DDevice.Get(), &g_OutputDuplication);
-            if (SUCCEEDED(hr))
+        }
+        else if (arg == "--record-codec" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            bool found = false;
+            for (int codec = 0; codec < static_cast<int>(VideoCodec::Count); codec++)
             {
-                std::cout << "    Successfully created output duplication!" << std::endl;
-                break;
+                if (name == kVideoCodecNames[codec])
+                {
+                    g_Options.recordCodec = static_cast<VideoCodec>(codec);
+                    found = true;
+                }
             }
-            else {
-                const DXGI_FORMAT formats[] = { DXGI_FORMAT_R8G8B8A8_UNORM, DXGI_FORMAT_B8G8R8A8_UNORM };
-                hr = dxgiOutput6->DuplicateOutput1(g_D3DDevice.Get(), 0, ARRAYSIZE(formats), formats, &g_OutputDuplication);
-                if (SUCCEEDED(hr))
+            if (!found)
+                std::cout << "Unknown codec: " << name << std::endl;
+        }
+        else if (arg == "--renderer" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            bool found = false;
+            for (int backend = 0; backend < static_cast<int>(RendererBackend::Count); backend++)
+            {
+                if (name == kRendererBackendNames[backend])
                 {
-                    std::cout << "    Successfully created output duplication with DuplicateOutput1!" << std::endl;
-                    break;
+                    g_Options.renderer = static_cast<RendererBackend>(backend);
+                    found = true;
                 }
-                std::cout << "    DuplicateOutput failed: " << HrToString(hr) << std::endl;
             }
-            dxgiOutput = nullptr;
-            dxgiOutput6 = nullptr;
+            if (!found)
+                std::cout << "Unknown renderer: " << name << std::endl;
         }
-        if (g_OutputDuplication)
-            break;
-    }
-    if (!g_OutputDuplication)
-    {
-        std::cerr << "Failed to create output duplication on any adapter/output combination." << std::endl;
-        std::cerr << "This could be due to UAC elevation requirements or protected content." << std::endl;
-        CoUninitialize();
-        return false;
+        else if (arg == "--cpu-render" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "auto")
+                g_Options.cpuRender = CpuRenderMode::Auto;
+            else if (mode == "on")
+                g_Options.cpuRender = CpuRenderMode::On;
+            else if (mode == "off")
+                g_Options.cpuRender = CpuRenderMode::Off;
+            else
+                std::cout << "Unknown CPU render mode: " << mode << std::endl;
+        }
+        else if (arg == "--vram-budget" && i + 1 < argc)
+        {
+            int megabytes = atoi(argv[++i]);
+            if (megabytes > 0)
+                g_Options.vramBudgetMB = static_cast<UINT>(megabytes);
+            else
+                std::cout << "Invalid video memory budget: " << argv[i] << std::endl;
+        }
+        else if (arg == "--record-bitrate" && i + 1 < argc)
+        {
+            int mbps = atoi(argv[++i]);
+            if (mbps > 0 && mbps <= 1000)
+                g_Options.recordBitrateMbps = static_cast<UINT>(mbps);
+            else
+                std::cout << "Invalid bitrate: " << argv[i] << std::endl;
+        }
+        else if (arg == "--capture-window" && i + 1 < argc)
+        {
+            std::string title = argv[++i];
+            int length = MultiByteToWideChar(CP_ACP, 0, title.c_str(), -1, nullptr, 0);
+            if (length > 0)
+            {
+                std::wstring wideTitle(length, L'\0');
+                MultiByteToWideChar(CP_ACP, 0, title.c_str(), -1, &wideTitle[0], length);
+                wideTitle.resize(length - 1);
+                g_Options.captureWindowTitle = wideTitle;
+                g_Options.captureBackend = CaptureBackend::GraphicsCapture;
+            }
+        }
+        else if (arg == "--capture-region" && i + 1 < argc)
+        {
+            int x = 0, y = 0, w = 0, h = 0;
+            if (sscanf_s(argv[++i], "%d,%d,%d,%d", &x, &y, &w, &h) == 4 && w > 0 && h > 0)
+            {
+                g_Options.captureRegion = { x, y, x + w, y + h };
+                g_Options.hasCaptureRegion = true;
+            }
+            else
+            {
+                std::cout << "Invalid capture region: " << argv[i] << std::endl;
+            }
+        }
+        else
+            std::cout << "Ignoring unknown option: " << arg << std::endl;
     }
 
-    DXGI_OUTDUPL_DESC outputDuplDesc;
-    g_OutputDuplication->GetDesc(&outputDuplDesc);
-    std::cout << "Capturing at: " << outputDuplDesc.ModeDesc.Width << "x"
-        << outputDuplDesc.ModeDesc.Height << " @ "
-        << (outputDuplDesc.ModeDesc.RefreshRate.Numerator / outputDuplDesc.ModeDesc.RefreshRate.Denominator)
-        << " Hz" << std::endl;
-
-    D3D11_TEXTURE2D_DESC rtDesc = {};
-    rtDesc.Width = g_ScreenWidth;
-    rtDesc.Height = g_ScreenHeight;
-    rtDesc.MipLevels = 1;
-    rtDesc.ArraySize = 1;
-    rtDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    rtDesc.SampleDesc.Count = 1;
-    rtDesc.Usage = D3D11_USAGE_DEFAULT;
-    rtDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
-    rtDesc.CPUAccessFlags = 0;
-    rtDesc.MiscFlags = 0;
-
-    hr = g_D3DDevice->CreateTexture2D(&rtDesc, nullptr, &g_RenderTarget);
-    if (FAILED(hr))
+    // The lens maps the cursor onto a whole monitor, and captures only what
+    // it shows.
+    if (g_Options.lensWidth && (!g_Options.captureWindowTitle.empty() || g_Options.hasCaptureRegion))
     {
-        std::cerr << "Create render target texture failed: " << HrToString(hr) << std::endl;
-        return false;
+        std::cout << "--lens needs a monitor capture; ignored with --capture-window and --capture-region." << std::endl;
+        g_Options.lensWidth = 0;
+        g_Options.lensHeight = 0;
     }
+    if (g_Options.lensWidth)
+        g_Options.regionOfInterest = true;
 
-    D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = {};
-    rtvDesc.Format = rtDesc.Format;
-    rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
-    rtvDesc.Texture2D.MipSlice = 0;
-    hr = g_D3DDevice->CreateRenderTargetView(g_RenderTarget.Get(), &rtvDesc, &g_RenderTargetView);
-    if (FAILED(hr))
+    // A replay stands in for the capture on the render thread and runs
+    // unpaced. The zoom jumps to each target, so every frame shows the same
+    // view however fast the replay runs, and the whole traced image is shown.
+    if (!g_Options.traceReplayPath.empty())
     {
-        std::cerr << "Create render target view failed: " << HrToString(hr) << std::endl;
-        return false;
+        if (!g_Options.traceRecordPath.empty())
+            std::cout << "--trace-record is ignored while replaying." << std::endl;
+        g_Options.traceRecordPath.clear();
+        g_Options.threadedCapture = false;
+        g_Options.regionOfInterest = false;
+        g_Options.pacing = PacingPolicy::LowLatency;
+        g_Options.zoomCurve = ZoomCurve::Instant;
+        g_Options.lensWidth = 0;
+        g_Options.lensHeight = 0;
+        g_Options.hasCaptureRegion = false;
+        g_Options.captureWindowTitle.clear();
     }
+}
 
-    D3D11_TEXTURE2D_DESC stagingDesc = {};
-    stagingDesc.Width = outputDuplDesc.ModeDesc.Width;
-    stagingDesc.Height = outputDuplDesc.ModeDesc.Height;
-    stagingDesc.MipLevels = 1;
-    stagingDesc.ArraySize = 1;
-    stagingDesc.Format = outputDuplDesc.ModeDesc.Format;
-    stagingDesc.SampleDesc.Count = 1;
-    stagingDesc.Usage = D3D11_USAGE_STAGING;
-    stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    stagingDesc.BindFlags = 0;
-    hr = g_D3DDevice->CreateTexture2D(&stagingDesc, nullptr, &g_StagingTexture);
-    if (FAILED(hr))
-    {
-        std::cerr << "Failed to create staging texture: " << HrToString(hr) << std::endl;
-        return false;
-    }
+HANDLE g_CaptureThread = nullptr;
 
-    D3D11_SAMPLER_DESC sampDesc = {};
-    sampDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
-    sampDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
-    sampDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
-    sampDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
-    sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
-    sampDesc.MinLOD = 0;
-    sampDesc.MaxLOD = D3D11_FLOAT32_MAX;
-    hr = g_D3DDevice->CreateSamplerState(&sampDesc, &g_SamplerState);
-    if (FAILED(hr))
+// Start the capture thread that feeds the frame rings.
+bool StartCaptureThread()
+{
+    g_CaptureThread = CreateThread(nullptr, 0, CaptureThread, nullptr, 0, nullptr);
+    if (!g_CaptureThread)
     {
-        std::cerr << "Create sampler state failed: " << HrToString(hr) << std::endl;
+        std::cerr << "Failed to create capture thread." << std::endl;
         return false;
     }
-
-    if (!CreateSwapChain())
-        return false;
-
     return true;
 }
 
-// Create shaders and initialize the constant buffer with a 1.0x zoom.
-bool CreateShaders() {
-    HRESULT hr = S_OK;
-    const char* vsCode = R"(
-        struct VS_INPUT {
-            float3 position : POSITION;
-            float2 texCoord : TEXCOORD0;
-        };
-        struct VS_OUTPUT {
-            float4 position : SV_POSITION;
-            float2 texCoord : TEXCOORD0;
-        };
-        VS_OUTPUT main(VS_INPUT input) {
-            VS_OUTPUT output;
-            output.position = float4(input.position, 1.0f);
-            output.texCoord = input.texCoord;
-            return output;
-        }
-    )";
-    const char* psCode = R"(
-        Texture2D frameTexture : register(t0);
-        SamplerState frameSampler : register(s0);
-        cbuffer MagnificationBuffer : register(b0) {
-            float magnificationFactor;
-            float3 padding;
-        }
-        struct PS_INPUT {
-            float4 position : SV_POSITION;
-            float2 texCoord : TEXCOORD0;
-        };
-        float4 main(PS_INPUT input) : SV_TARGET {
-            float2 center = float2(0.5, 0.5);
-            float2 dir = input.texCoord - center;
-            dir = dir / magnificationFactor;
-            float2 zoomedCoord = center + dir;
-            if (zoomedCoord.x >= 0.0 && zoomedCoord.x <= 1.0 &&
-                zoomedCoord.y >= 0.0 && zoomedCoord.y <= 1.0) {
-                return frameTexture.Sample(frameSampler, zoomedCoord);
-            }
-            else {
-                return float4(0.0, 0.0, 0.0, 0.0);
-            }
-        }
-    )";
-
-    ComPtr<ID3DBlob> vsBlob;
-    ComPtr<ID3DBlob> errorBlob;
-    hr = D3DCompile(vsCode, strlen(vsCode), "VertexShader", nullptr, nullptr, "main", "vs_4_0",
-        D3DCOMPILE_ENABLE_STRICTNESS, 0, &vsBlob, &errorBlob);
-    if (FAILED(hr))
-    {
-        if (errorBlob)
-            std::cerr << "Vertex shader compilation failed: " << static_cast<char*>(errorBlob->GetBufferPointer()) << std::endl;
-        return false;
-    }
-    hr = g_D3DDevice->CreateVertexShader(vsBlob->GetBufferPointer(), vsBlob->GetBufferSize(), nullptr, &g_VertexShader);
-    if (FAILED(hr))
-    {
-        std::cerr << "Create vertex shader failed: " << HrToString(hr) << std::endl;
-        return false;
-    }
+// Wait for the capture thread to leave its loop, after g_Running was cleared
+// or g_DeviceLost or g_CaptureReconfigure set.
+void StopCaptureThread()
+{
+    if (!g_CaptureThread)
+        return;
+    WaitForSingleObject(g_CaptureThread, INFINITE);
+    CloseHandle(g_CaptureThread);
+    g_CaptureThread = nullptr;
+}
 
-    D3D11_INPUT_ELEMENT_DESC layout[] = {
-        { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,                      D3D11_INPUT_PER_VERTEX_DATA, 0 },
-        { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 12,                     D3D11_INPUT_PER_VERTEX_DATA, 0 }
-    };
-    UINT numElements = ARRAYSIZE(layout);
-    hr = g_D3DDevice->CreateInputLayout(layout, numElements, vsBlob->GetBufferPointer(), vsBlob->GetBufferSize(), &g_InputLayout);
-    if (FAILED(hr))
+// Return a ring to the state it was created in, without textures. The next
+// frame captured for it recreates them. Only while no thread captures.
+void ResetFrameRing(FrameRing& ring)
+{
+    for (int i = 0; i < FrameRing::kSlotCount; i++)
     {
-        std::cerr << "Create input layout failed: " << HrToString(hr) << std::endl;
-        return false;
+        ring.views[i].Reset();
+        ring.textures[i].Reset();
+        ring.pendingRects[i].clear();
+        ring.needsFullCopy[i] = true;
+        ring.layouts[i] = {};
+        ring.captureTimes[i] = 0;
     }
+    ring.publishedCrop = {};
+    ring.lastCaptureTime = 0;
+    ring.backSlot = 2;
+    ring.readyState.store(1);
+    ring.frontSlot = 0;
+    ring.hasFrame = false;
+}
 
-    ComPtr<ID3DBlob> psBlob;
-    hr = D3DCompile(psCode, strlen(psCode), "PixelShader", nullptr, nullptr, "main", "ps_4_0",
-        D3DCOMPILE_ENABLE_STRICTNESS, 0, &psBlob, &errorBlob);
-    if (FAILED(hr))
+// Give up memory for one more level. Each level keeps the ones before it:
+//   trimmed        drop the staging and unused filter textures, the rings and
+//                  desktop copies of outputs not being shown, and the
+//                  driver's cached allocations (IDXGIDevice3::Trim)
+//   cropped-ring   ring slots hold only the magnified crop (as --roi)
+//   single-thread  no ring at all: capture on the render thread
+// The capture thread is stopped while the rings change. The texture on
+// screen is kept until the next frame replaces it.
+void ApplyMemoryLevel(MemoryLevel level)
+{
+    g_CaptureReconfigure = true;
+    StopCaptureThread();
+    g_CaptureReconfigure = false;
+
+    if (level == MemoryLevel::Trimmed)
     {
-        if (errorBlob)
-            std::cerr << "Pixel shader compilation failed: " << static_cast<char*>(errorBlob->GetBufferPointer()) << std::endl;
-        return false;
+        g_StagingTexture.Reset();
+        if (!g_Sharpen)
+        {
+            g_FilterTextureUAV.Reset();
+            g_FilterTextureView.Reset();
+            g_FilterTexture.Reset();
+        }
+        for (int i = 0; i < static_cast<int>(g_Outputs.size()); i++)
+        {
+            if (i == g_CaptureOutput)
+                continue;
+            OutputSession& session = *g_Outputs[i];
+            ResetFrameRing(session.ring);
+            session.desktopTextureView.Reset();
+            session.desktopTexture.Reset();
+            session.desktopTextureValid = false;
+        }
+        ComPtr<IDXGIDevice3> dxgiDevice3;
+        if (SUCCEEDED(g_D3DDevice.As(&dxgiDevice3)))
+        {
+            g_D3DContext->ClearState();
+            InvalidateBoundState();
+            dxgiDevice3->Trim();
+        }
     }
-    hr = g_D3DDevice->CreatePixelShader(psBlob->GetBufferPointer(), psBlob->GetBufferSize(), nullptr, &g_PixelShader);
-    if (FAILED(hr))
+    else if (level == MemoryLevel::CroppedRing && g_Options.threadedCapture && !g_Options.regionOfInterest)
     {
-        std::cerr << "Create pixel shader failed: " << HrToString(hr) << std::endl;
-        return false;
+        g_Options.regionOfInterest = true;
+        for (auto& session : g_Outputs)
+            ResetFrameRing(session->ring);
     }
-
-    Vertex vertices[6] = {
-        { {-1.0f,  1.0f, 0.0f}, {0.0f, 0.0f} },
-        { { 1.0f, -1.0f, 0.0f}, {1.0f, 1.0f} },
-        { {-1.0f, -1.0f, 0.0f}, {0.0f, 1.0f} },
-        { {-1.0f,  1.0f, 0.0f}, {0.0f, 0.0f} },
-        { { 1.0f,  1.0f, 0.0f}, {1.0f, 0.0f} },
-        { { 1.0f, -1.0f, 0.0f}, {1.0f, 1.0f} }
-    };
-
-    D3D11_BUFFER_DESC vbDesc = {};
-    vbDesc.Usage = D3D11_USAGE_DEFAULT;
-    vbDesc.ByteWidth = sizeof(vertices);
-    vbDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-    vbDesc.CPUAccessFlags = 0;
-    D3D11_SUBRESOURCE_DATA vbData = {};
-    vbData.pSysMem = vertices;
-    hr = g_D3DDevice->CreateBuffer(&vbDesc, &vbData, &g_VertexBuffer);
-    if (FAILED(hr))
+    else if (level == MemoryLevel::SingleThread && g_Options.threadedCapture)
     {
-        std::cerr << "Create vertex buffer failed: " << HrToString(hr) << std::endl;
-        return false;
+        g_Options.threadedCapture = false;
+        for (auto& session : g_Outputs)
+            ResetFrameRing(session->ring);
     }
+    g_MemoryLevel = level;
+    g_NeedsRedraw = true;
+    std::cout << "Over the video memory budget (" << (g_VideoMemory.CurrentUsage >> 20) << " of "
+        << (MemoryBudget() >> 20) << " MB); memory level " << kMemoryLevelNames[static_cast<int>(level)] << "." << std::endl;
+    TraceLoggingWrite(g_TraceProvider, "MemoryLevel",
+        TraceLoggingString(kMemoryLevelNames[static_cast<int>(level)], "Level"),
+        TraceLoggingUInt64(g_VideoMemory.CurrentUsage, "UsageBytes"),
+        TraceLoggingUInt64(MemoryBudget(), "BudgetBytes"));
 
-    D3D11_BUFFER_DESC constantBufferDesc = {};
-    constantBufferDesc.ByteWidth = sizeof(MagnificationConstantBuffer);
-    constantBufferDesc.Usage = D3D11_USAGE_DEFAULT;
-    constantBufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    constantBufferDesc.CPUAccessFlags = 0;
-    MagnificationConstantBuffer initialData = { 1.0f, {0.0f, 0.0f, 0.0f} };
-    D3D11_SUBRESOURCE_DATA constantBufferData = {};
-    constantBufferData.pSysMem = &initialData;
-    hr = g_D3DDevice->CreateBuffer(&constantBufferDesc, &constantBufferData, &g_ConstantBuffer);
-    if (FAILED(hr))
-    {
-        std::cerr << "Create constant buffer failed: " << HrToString(hr) << std::endl;
-        return false;
-    }
-    return true;
+    if (g_Options.threadedCapture && !StartCaptureThread())
+        g_Running = false;
 }
 
-// Render the current frame by setting the viewport, clearing the render target,
-// setting up the pipeline, drawing the quad, and presenting the frame.
-void RenderCurrentFrame() {
-    HWND hwnd = glfwGetWin32Window(g_Window);
-    RECT rect;
-    GetClientRect(hwnd, &rect);
-    unsigned int width = rect.right - rect.left;
-    unsigned int height = rect.bottom - rect.top;
-    D3D11_VIEWPORT viewport = {};
-    viewport.Width = static_cast<float>(width);
-    viewport.Height = static_cast<float>(height);
-    viewport.MinDepth = 0.0f;
-    viewport.MaxDepth = 1.0f;
-    viewport.TopLeftX = 0.0f;
-    viewport.TopLeftY = 0.0f;
-    g_D3DContext->RSSetViewports(1, &viewport);
-
-    g_D3DContext->OMSetRenderTargets(1, g_RenderTargetView.GetAddressOf(), nullptr);
-    float clearColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
-    g_D3DContext->ClearRenderTargetView(g_RenderTargetView.Get(), clearColor);
-
-    g_D3DContext->IASetInputLayout(g_InputLayout.Get());
-    g_D3DContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    UINT stride = sizeof(Vertex);
-    UINT offset = 0;
-    g_D3DContext->IASetVertexBuffers(0, 1, g_VertexBuffer.GetAddressOf(), &stride, &offset);
-    g_D3DContext->VSSetShader(g_VertexShader.Get(), nullptr, 0);
-    g_D3DContext->PSSetShader(g_PixelShader.Get(), nullptr, 0);
-    g_D3DContext->PSSetSamplers(0, 1, g_SamplerState.GetAddressOf());
-    g_D3DContext->PSSetConstantBuffers(0, 1, g_ConstantBuffer.GetAddressOf());
-    g_D3DContext->Draw(6, 0);
+// Query the adapter's memory once a second, or at once when the budget
+// changes, and step down a level while usage is over budget. One level per
+// query, so the memory a level frees shows in the usage before the next.
+void UpdateMemoryBudget()
+{
+    if (!g_MemoryAdapter)
+        return;
+    static LONGLONG lastQuery = 0;
+    LONGLONG now = QpcNow();
+    bool budgetChanged = g_BudgetEvent && WaitForSingleObject(g_BudgetEvent, 0) == WAIT_OBJECT_0;
+    if (!budgetChanged && lastQuery && QpcToMicroseconds(now - lastQuery) < 1e6)
+        return;
+    lastQuery = now;
+    if (FAILED(g_MemoryAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &g_VideoMemory)))
+        return;
+    int next = static_cast<int>(g_MemoryLevel) + 1;
+    if (g_VideoMemory.CurrentUsage > MemoryBudget() && next < static_cast<int>(MemoryLevel::Count))
+        ApplyMemoryLevel(static_cast<MemoryLevel>(next));
+}
 
-    ComPtr<ID3D11Texture2D> backBuffer;
-    HRESULT hr = g_SwapChain->GetBuffer(0, IID_PPV_ARGS(&backBuffer));
-    if (SUCCEEDED(hr))
+// Release everything created from the device, at shutdown or before the
+// device is rebuilt. The capture thread must not be running.
+void ReleaseDeviceResources()
+{
+    if (g_FrameAcquired)
+        g_CaptureSource->ReleaseFrame();
+    g_FrameAcquired = false;
+    g_CaptureSource.reset();
+    g_Recorder.reset();
+    if (g_D3DContext)
+        g_D3DContext->ClearState();
+    InvalidateBoundState();
+    ResetFrameSurfaceViews();
+    g_CaptureRing = nullptr;
+    g_RenderRing = nullptr;
+    g_Outputs.clear();
+    g_DesktopTextureView.Reset();
+    g_DesktopTexture.Reset();
+    g_DesktopTextureValid = false;
+    g_CpuDesktop.valid = false;
+    g_VertexShader.Reset();
+    g_PixelShader.Reset();
+    g_ConstantBuffer.Reset();
+    g_SamplerState.Reset();
+    g_FrameShaderResourceView.Reset();
+    g_RenderTargetView.Reset();
+    g_BackBufferUAV.Reset();
+    g_ResampleShader.Reset();
+    ResetShaderPermutations();
+    g_SharpenShader.Reset();
+    g_FilterConstantBuffer.Reset();
+    g_FilterConstants = {};
+    g_FilterTextureUAV.Reset();
+    g_FilterTextureView.Reset();
+    g_FilterTexture.Reset();
+    ReleaseOverlayTarget();
+    g_OverlayTextBrush.Reset();
+    g_OverlayBackgroundBrush.Reset();
+    g_D2DContext.Reset();
+    g_D2DFactory.Reset();
+    for (GpuFrameQueries& queries : g_GpuQueries)
     {
-        g_D3DContext->CopyResource(backBuffer.Get(), g_RenderTarget.Get());
-        g_SwapChain->Present(0, DXGI_PRESENT_DO_NOT_WAIT);
+        queries.disjoint.Reset();
+        for (auto& timestamp : queries.timestamps)
+            timestamp.Reset();
+        queries.open = false;
+        queries.pending = false;
     }
-    else
+    g_PendingLatency.clear();
+    g_StagingTexture.Reset();
+    g_Cursor = {};
+    g_CursorInView = false;
+    g_CursorShape.store(nullptr);
+    g_CursorShapeCache.clear();
+    g_Renderer.reset();  // Before the swap chain, which the D3D12 queue presents
+    ReleaseCompositionTree();
+    g_SwapChain.Reset();
+    g_GpuMemory[static_cast<int>(GpuMemoryUse::SwapChain)] = 0;
+    UnregisterMemoryBudget();
+    if (g_FrameLatencyWaitable)
     {
-        std::cout << "Failed to get back buffer from swap chain: " << HrToString(hr) << std::endl;
+        CloseHandle(g_FrameLatencyWaitable);
+        g_FrameLatencyWaitable = nullptr;
     }
+    // Destruction is deferred until the context is flushed, and the window
+    // can only take a new flip-model swap chain once the old one is gone.
+    if (g_D3DContext)
+        g_D3DContext->Flush();
+    g_D3DContext.Reset();
+    g_D3DDevice.Reset();
 }
 
-// Process the frame: update the zoom based on the right mouse button,
-// capture the desktop frame, update the shader resource, and render.
-bool ProcessFrame() {
-    HRESULT hr = S_OK;
-    static auto lastTime = std::chrono::steady_clock::now();
-    auto now = std::chrono::steady_clock::now();
-    float dt_ms = std::chrono::duration<float, std::milli>(now - lastTime).count();
-    lastTime = now;
-
-    bool isRMB = (GetAsyncKeyState(VK_RBUTTON) & 0x8000) != 0;
-    float targetZoom = isRMB ? 1.4f : 1.0f;
-    const float smoothingTime = 100.0f;
-    float t = dt_ms / smoothingTime;
-    if (t > 1.0f) t = 1.0f;
-    g_CurrentZoom = g_CurrentZoom + (targetZoom - g_CurrentZoom) * t;
-
-    MagnificationConstantBuffer cbData = { g_CurrentZoom, {0.0f, 0.0f, 0.0f} };
-    g_D3DContext->UpdateSubresource(g_ConstantBuffer.Get(), 0, nullptr, &cbData, 0, 0);
-
-    ComPtr<IDXGIResource> desktopResource;
-    DXGI_OUTDUPL_FRAME_INFO frameInfo = {};
-    hr = g_OutputDuplication->AcquireNextFrame(25, &frameInfo, &desktopResource);
-    if (hr == DXGI_ERROR_WAIT_TIMEOUT)
-    {
-        RenderCurrentFrame();
-        return true;
-    }
-    else if (FAILED(hr))
+// Create g_Renderer for the device. The D3D12 renderer draws the fragment
+// magnifier into 8-bit buffers from the desktop texture, so it captures in
+// SDR on the render thread and copies every frame; the stats overlay and the
+// recorder draw through D3D11 and are left off. Falls back to D3D11 if the
+// adapter has no D3D12 support.
+void CreateRenderer()
+{
+    if (g_Options.renderer == RendererBackend::D3D12 && !g_CpuRender)
     {
-        if (hr == DXGI_ERROR_ACCESS_LOST)
-        {
-            g_OutputDuplication.Reset();
-            std::cout << "Access lost to desktop duplication, attempting to continue..." << std::endl;
-            return true;
-        }
-        else
+        auto renderer = std::make_unique<D3D12Renderer>();
+        if (renderer->Initialize())
         {
-            std::cout << "AcquireNextFrame failed: " << HrToString(hr) << std::endl;
-            return true;
+            g_Renderer = std::move(renderer);
+            if (!g_Options.forceSdr)
+                std::cout << "The Direct3D 12 renderer draws 8-bit, so HDR and 10-bit desktops are captured in SDR." << std::endl;
+            if (g_Options.threadedCapture)
+                std::cout << "The Direct3D 12 renderer captures on the render thread, not a capture thread." << std::endl;
+            if (g_Options.regionOfInterest)
+                std::cout << "The Direct3D 12 renderer captures the whole frame; --roi is ignored." << std::endl;
+            if (!g_Options.incrementalCapture)
+                std::cout << "The Direct3D 12 renderer draws from the desktop copy; --no-incremental is ignored." << std::endl;
+            g_Options.forceSdr = true;
+            g_Options.threadedCapture = false;
+            g_Options.regionOfInterest = false;
+            g_Options.incrementalCapture = true;
+            if (g_Options.statsOverlay)
+                std::cout << "The stats overlay is not drawn by the Direct3D 12 renderer." << std::endl;
+            if (!g_Options.recordPath.empty())
+                std::cout << "Recording is not supported by the Direct3D 12 renderer." << std::endl;
+            g_Options.statsOverlay = false;
+            g_Options.recordPath.clear();
+            return;
         }
+        std::cout << "Direct3D 12 renderer unavailable, drawing with Direct3D 11." << std::endl;
+        g_Options.renderer = RendererBackend::D3D11;
     }
+    g_Renderer = std::make_unique<D3D11Renderer>();
+}
 
-    ComPtr<ID3D11Texture2D> desktopTexture;
-    hr = desktopResource.As(&desktopTexture);
-    if (FAILED(hr))
-    {
-        std::cout << "Failed to QI for ID3D11Texture2D: " << HrToString(hr) << std::endl;
-        g_OutputDuplication->ReleaseFrame();
-        return true;
-    }
+// Create the device, pipeline and capture sources. Needs no window, so main()
+// runs it on a worker thread while GLFW creates the window.
+bool InitializeDirectX() {
+    if (!CreateDevice() || !CreateShaders() || !CreateSamplerState())
+        return false;
+    // Without the compute path, drawing falls back to bilinear.
+    CreateComputeMagnifier();
+    // Before the sessions, since the CPU path and the D3D12 renderer change
+    // how they capture.
+    ChooseRenderPath();
+    CreateRenderer();
+    return CreateOutputSessions();
+}
 
-    D3D11_TEXTURE2D_DESC textureDesc = {};
-    desktopTexture->GetDesc(&textureDesc);
+// Worker thread for InitializeDirectX(); the result is the thread exit code.
+DWORD WINAPI InitializationThread(LPVOID lpParam)
+{
+    // The Windows.Graphics.Capture fallback is created on this thread.
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    bool succeeded = InitializeDirectX();
+    CoUninitialize();
+    return succeeded ? 0 : 1;
+}
 
-    if (g_FrameShaderResourceView == nullptr)
+// Rebuild the device and everything created from it after the GPU was removed
+// or reset. The pipeline comes back from the embedded shader bytecode and the
+// CPU-side state it was created from (g_View, the buffer and sampler
+// descriptions), so nothing is compiled or read from disk; the window,
+// options and stats stay as they are.
+bool RecoverDevice()
+{
+    LONGLONG lostTime = QpcNow();
+    std::cout << "Device lost: " << HrToString(g_D3DDevice ? g_D3DDevice->GetDeviceRemovedReason() : E_FAIL)
+        << ", rebuilding..." << std::endl;
+    if (g_Recorder)
+        std::cout << "The recording ends with the lost device." << std::endl;
+    if (g_TraceReplay)
     {
-        D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
-        srvDesc.Format = textureDesc.Format;
-        srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-        srvDesc.Texture2D.MostDetailedMip = 0;
-        srvDesc.Texture2D.MipLevels = 1;
-        hr = g_D3DDevice->CreateShaderResourceView(desktopTexture.Get(), &srvDesc, &g_FrameShaderResourceView);
-        if (FAILED(hr))
-        {
-            std::cout << "Create shader resource view failed: " << HrToString(hr) << std::endl;
-            g_OutputDuplication->ReleaseFrame();
-            return true;
-        }
+        // The replayed image cannot be rebuilt from the middle of the trace.
+        std::cout << "The replay ends with the lost device." << std::endl;
+        return false;
     }
-    else
+    StopCaptureThread();
+    ReleaseDeviceResources();
+
+    if (!InitializeDirectX() || !CreateSwapChain())
+        return false;
+    SelectShaderPermutation();
+    if (g_Outputs.size() > 1)
+        MoveWindowToOutput(*g_Outputs[g_ActiveOutput]);
+    if (g_Options.collectStats)
     {
-        g_D3DContext->CopyResource(g_StagingTexture.Get(), desktopTexture.Get());
+        CreateGpuQueries();
+        if (g_Options.statsOverlay && !CreateStatsOverlay())
+            g_Options.statsOverlay = false;
     }
-
-    g_D3DContext->PSSetShaderResources(0, 1, g_FrameShaderResourceView.GetAddressOf());
-    RenderCurrentFrame();
-
-    hr = g_OutputDuplication->ReleaseFrame();
-    if (FAILED(hr))
-        std::cout << "ReleaseFrame failed: " << HrToString(hr) << std::endl;
-
+    g_DeviceLost = false;
+    if (g_Options.threadedCapture && !StartCaptureThread())
+        return false;
+    g_NeedsRedraw = true;
+    ReportRecovery("Device", lostTime);
     return true;
 }
 
 // Main function: initializes GLFW, DirectX, shaders, and enters the frame loop.
 // The window remains hidden until toggled with Numpad 8.
-int main() {
+int main(int argc, char** argv) {
+    ParseCommandLine(argc, argv);
+    if (g_Options.bench)
+        return RunBenchmark() ? 0 : -1;
+    if (!g_Options.traceReplayPath.empty())
+    {
+        g_TraceReplay = std::make_unique<TraceReplay>();
+        if (!g_TraceReplay->Open(g_Options.traceReplayPath))
+            return -1;
+        g_WindowToggleRequest = true;  // Show the window from the first frame
+    }
+    else if (!g_Options.traceRecordPath.empty())
+    {
+        g_TraceWriter = std::make_unique<TraceWriter>();
+        if (!g_TraceWriter->Open(g_Options.traceRecordPath))
+            g_TraceWriter.reset();
+    }
+
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    // Device, pipeline and capture setup need no window, so they run while
+    // GLFW creates it; the swap chain is created once both are done.
+    HANDLE hInitThread = CreateThread(nullptr, 0, InitializationThread, nullptr, 0, nullptr);
+    if (!hInitThread)
+    {
+        std::cerr << "Failed to create initialization thread." << std::endl;
+        return -1;
+    }
     if (!InitializeGLFW())
+    {
+        g_Running = false;
+        WaitForSingleObject(hInitThread, INFINITE);
+        return -1;
+    }
+
+    g_WakeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    g_ResumeEvent = CreateEvent(nullptr, TRUE, TRUE, nullptr);
+    if (!g_WakeEvent || !g_ResumeEvent)
+    {
+        std::cerr << "Failed to create standby events." << std::endl;
         return -1;
+    }
 
-    // Start the keyboard hook thread to detect Shift+Esc and Numpad 8.
+    // Start the hook thread to detect Shift+Esc, Numpad 8 and the right button.
     DWORD threadId;
     HANDLE hHookThread = CreateThread(nullptr, 0, KeyboardHookThread, nullptr, 0, &threadId);
     if (!hHookThread)
@@ -719,32 +8036,123 @@ int main() {
         return -1;
     }
 
-    if (!InitializeDirectX())
+    DWORD initResult = 1;
+    WaitForSingleObject(hInitThread, INFINITE);
+    GetExitCodeThread(hInitThread, &initResult);
+    CloseHandle(hInitThread);
+    if (initResult != 0 || !CreateSwapChain())
     {
         glfwTerminate();
         return -1;
     }
-    if (!CreateShaders())
+    if (g_Outputs.size() > 1)
+        MoveWindowToOutput(*g_Outputs[g_ActiveOutput]);
+    g_Filter = g_Options.filter;
+    g_Sharpen = g_Options.sharpen;
+    g_Invert = g_Options.invert;
+    g_ColorFilter = g_Options.colorFilter;
+    if (g_CpuRender && g_Sharpen)
     {
-        glfwTerminate();
-        return -1;
+        std::cout << "Sharpening is not available on the CPU magnifier." << std::endl;
+        g_Sharpen = false;
     }
-    std::cout << "Screen Magnifier initialized. Hold right-click to zoom; press Shift+ESC to exit. Toggle window visibility with Numpad 8." << std::endl;
-
-    using clock = std::chrono::high_resolution_clock;
-    auto lastFrameTime = clock::now();
-    const auto targetFrameTime = std::chrono::microseconds(8333);
+    else if (!g_CpuRender && ComputeFilterSelected() && !g_BackBufferUAV)
+    {
+        std::cout << "Compute filters unavailable, using bilinear." << std::endl;
+        g_Filter = MagnifyFilter::Bilinear;
+        g_Sharpen = false;
+    }
+    SelectShaderPermutation();
+    if (!g_Options.recordPath.empty())
+    {
+        g_Recorder = std::make_unique<Recorder>();
+        if (!g_Recorder->Start(g_Options.recordPath))
+            g_Recorder.reset();
+    }
+    if (g_Options.collectStats)
+    {
+        TraceLoggingRegister(g_TraceProvider);
+        CreateGpuQueries();
+        if (g_Options.statsOverlay && !CreateStatsOverlay())
+            g_Options.statsOverlay = false;
+        if (!g_Options.statsCsvPath.empty())
+        {
+            g_StatsCsv.open(g_Options.statsCsvPath, std::ios::app);
+            if (!g_StatsCsv)
+                std::cerr << "Failed to open stats file " << g_Options.statsCsvPath << std::endl;
+            else if (g_StatsCsv.tellp() == 0)
+                g_StatsCsv << "time_s,metric,count,p50_us,p99_us\n";
+        }
+    }
+    if (g_Options.threadedCapture)
+    {
+        g_FrameReadyEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!StartCaptureThread())
+        {
+            g_Running = false;
+            glfwTerminate();
+            return -1;
+        }
+    }
+    std::cout << "Screen Magnifier initialized. Hold right-click to zoom; press Shift+ESC to exit. Toggle window visibility with Numpad 8; Numpad 9 cycles the filter and Numpad 7 toggles sharpening; Numpad 6 inverts colours and Numpad 4 cycles the colour filter; Numpad +/- change the zoom level." << std::endl;
 
+    // Frames that are drawn wait on the swap chain in RenderCurrentFrame();
+    // idle iterations block on capture, so the loop never spins.
+    HANDLE mmcssTask = EnterMmcssTask(L"Games");
+    PinThreadToCore(g_Options.renderCore);
     int errors = 0;
     while (g_Running && !glfwWindowShouldClose(g_Window))
     {
-        auto frameStart = clock::now();
+        if (g_DeviceLost)
+        {
+            if (!RecoverDevice())
+                break;
+            continue;
+        }
+        DrainInputEvents();
+        if (IsIdle())
+        {
+            WaitInStandby();
+            continue;
+        }
+        SetFineTimerResolution(g_RightButtonDown || g_CurrentZoom != 1.0f);
+        ApplyFilterRequests();
+        UpdateMemoryBudget();
+        UpdateActiveOutput();
+        UpdateLens();
 
-        if (!ProcessFrame())
+        if (g_Options.threadedCapture)
+        {
+            // While the zoom is settled, sleep until the capture thread
+            // publishes a frame, the input hooks queue an event or a window
+            // message arrives. Queued input is applied before drawing.
+            if (g_CurrentZoom == g_TargetZoom && !g_NeedsRedraw)
+            {
+                DWORD waitMs = static_cast<DWORD>(std::max<long long>(1,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(GetFramePeriod()).count()));
+                HANDLE events[] = { g_FrameReadyEvent, g_WakeEvent };
+                MsgWaitForMultipleObjects(2, events, FALSE, waitMs, QS_ALLINPUT);
+                DrainInputEvents();
+            }
+            if (!RenderLatestFrame())
+                std::cout << "Error processing frame x" << ++errors << std::endl;
+        }
+        else if (!ProcessFrame())
+        {
             std::cout << "Error processing frame x" << ++errors << std::endl;
+        }
+        EndGpuFrame();
+        UpdateStatsReport();
 
         glfwPollEvents();
 
+        if (g_ResizeRequest)
+        {
+            g_ResizeRequest = false;
+            ResizeSwapChain(g_PendingWidth, g_PendingHeight);
+            g_NeedsRedraw = true;
+        }
+
         // Check for a toggle request and update window visibility accordingly.
         if (g_WindowToggleRequest)
         {
@@ -755,44 +8163,41 @@ int main() {
             }
             else
             {
-                glfwShowWindow(g_Window);
                 g_WindowVisible = true;
+                UpdateLens();  // Place a lens before it appears
+                glfwShowWindow(g_Window);
+                g_NeedsRedraw = true;
             }
             g_WindowToggleRequest = false;
         }
-
-        auto frameEnd = clock::now();
-        auto frameDuration = frameEnd - frameStart;
-        if (frameDuration < targetFrameTime)
-        {
-            auto sleepTime = std::min(
-                std::chrono::duration_cast<std::chrono::nanoseconds>(targetFrameTime - frameDuration),
-                std::chrono::nanoseconds(1)
-            );
-            std::this_thread::sleep_for(sleepTime);
-        }
     }
 
-    g_D3DContext->ClearState();
-    g_VertexShader.Reset();
-    g_PixelShader.Reset();
-    g_InputLayout.Reset();
-    g_VertexBuffer.Reset();
-    g_ConstantBuffer.Reset();
-    g_SamplerState.Reset();
-    g_FrameShaderResourceView.Reset();
-    g_RenderTargetView.Reset();
-    g_RenderTarget.Reset();
-    g_OutputDuplication.Reset();
-    g_StagingTexture.Reset();
-    g_D3DContext.Reset();
-    g_D3DDevice.Reset();
-    g_SwapChain.Reset();
+    g_Running = false;
+    SetEvent(g_ResumeEvent);
+    SetFineTimerResolution(false);
+    LeaveMmcssTask(mmcssTask);
+    StopCaptureThread();
+    if (g_FrameReadyEvent)
+        CloseHandle(g_FrameReadyEvent);
+    if (g_TraceWriter)
+        g_TraceWriter->Close();
+    if (g_TraceReplay)
+        g_TraceReplay->Finish(g_Options.replayReportPath);
+
+    ReleaseDeviceResources();
+    if (g_PacingTimer)
+        CloseHandle(g_PacingTimer);
 
     glfwDestroyWindow(g_Window);
     glfwTerminate();
     WaitForSingleObject(hHookThread, INFINITE);
     CloseHandle(hHookThread);
+    CloseHandle(g_WakeEvent);
+    CloseHandle(g_ResumeEvent);
+    if (g_BudgetEvent)
+        CloseHandle(g_BudgetEvent);
+    if (g_Options.collectStats)
+        TraceLoggingUnregister(g_TraceProvider);
     CoUninitialize();
     return 0;
 }
\ No newline at end of file